@@ -182,6 +182,47 @@ int get_math_cpu_count() {
     return get_num_physical_cores();
 }
 
+bool parse_cpu_mask(const std::string & mask, bool (&cpumask)[GGML_MAX_N_THREADS]) {
+    // the mask is a hex number, the least significant bit is CPU 0
+    size_t start = 0;
+    if (mask.length() > 2 && mask[0] == '0' && (mask[1] == 'x' || mask[1] == 'X')) {
+        start = 2;
+    }
+
+    if (mask.length() <= start) {
+        return false;
+    }
+
+    for (int i = 0; i < GGML_MAX_N_THREADS; ++i) {
+        cpumask[i] = false;
+    }
+
+    const size_t n_digits = mask.length() - start;
+    for (size_t i = 0; i < n_digits; ++i) {
+        const char c = mask[mask.length() - 1 - i];
+
+        int id;
+        if (c >= '0' && c <= '9') {
+            id = c - '0';
+        } else if (c >= 'a' && c <= 'f') {
+            id = c - 'a' + 10;
+        } else if (c >= 'A' && c <= 'F') {
+            id = c - 'A' + 10;
+        } else {
+            return false;
+        }
+
+        for (int b = 0; b < 4; ++b) {
+            const size_t cpu = 4*i + b;
+            if ((id & (1 << b)) && cpu < GGML_MAX_N_THREADS) {
+                cpumask[cpu] = true;
+            }
+        }
+    }
+
+    return true;
+}
+
 void process_escapes(std::string & input) {
     std::size_t input_len = input.length();
     std::size_t output_idx = 0;
@@ -219,9 +260,73 @@ void process_escapes(std::string & input) {
     input.resize(output_idx);
 }
 
+static void gpt_params_read_args_file(const std::string & fname, std::vector<std::string> & args, int depth) {
+    if (depth > 8) {
+        throw std::invalid_argument("error: --args-file nested too deeply in " + fname);
+    }
+    std::ifstream file(fname);
+    if (!file) {
+        throw std::invalid_argument("error: failed to open args file " + fname);
+    }
+    const std::string content((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+    std::vector<std::string> file_args;
+    size_t pos = 0;
+    while (pos < content.size()) {
+        const char c = content[pos];
+        if (std::isspace((unsigned char) c)) {
+            pos++;
+        } else if (c == '#') {
+            pos = content.find('\n', pos);
+        } else if (c == '"') {
+            const size_t end = content.find('"', pos + 1);
+            if (end == std::string::npos) {
+                throw std::invalid_argument("error: unterminated quote in args file " + fname);
+            }
+            file_args.push_back(content.substr(pos + 1, end - pos - 1));
+            pos = end + 1;
+        } else {
+            size_t end = pos;
+            while (end < content.size() && !std::isspace((unsigned char) content[end])) {
+                end++;
+            }
+            file_args.push_back(content.substr(pos, end - pos));
+            pos = end;
+        }
+    }
+
+    for (size_t i = 0; i < file_args.size(); i++) {
+        if (file_args[i] == "--args-file" && i + 1 < file_args.size()) {
+            gpt_params_read_args_file(file_args[++i], args, depth + 1);
+        } else {
+            args.push_back(file_args[i]);
+        }
+    }
+}
+
+std::vector<std::string> gpt_params_expand_args_file(int argc, char ** argv) {
+    std::vector<std::string> args;
+    for (int i = 0; i < argc; i++) {
+        if (i > 0 && std::string(argv[i]) == "--args-file" && i + 1 < argc) {
+            gpt_params_read_args_file(argv[++i], args, 0);
+        } else {
+            args.push_back(argv[i]);
+        }
+    }
+    return args;
+}
+
 bool gpt_params_parse(int argc, char ** argv, gpt_params & params) {
     bool result = true;
     try {
+        std::vector<std::string> args = gpt_params_expand_args_file(argc, argv);
+        std::vector<char *> args_ptr;
+        for (auto & arg : args) {
+            args_ptr.push_back(&arg[0]);
+        }
+        argc = (int) args_ptr.size();
+        argv = args_ptr.data();
+
         if (!gpt_params_parse_ex(argc, argv, params)) {
             gpt_print_usage(argc, argv, gpt_params());
             exit(0);
@@ -338,6 +443,30 @@ bool gpt_params_find_arg(int argc, char ** argv, const std::string & arg, gpt_pa
         }
         return true;
     }
+    if (arg == "--poll") {
+        if (++i >= argc) {
+            invalid_param = true;
+            return true;
+        }
+        params.poll = std::stoi(argv[i]);
+        return true;
+    }
+    if (arg == "-C" || arg == "--cpu-mask") {
+        if (++i >= argc) {
+            invalid_param = true;
+            return true;
+        }
+        if (!parse_cpu_mask(argv[i], params.cpumask)) {
+            invalid_param = true;
+            return true;
+        }
+        params.cpumask_set = true;
+        return true;
+    }
+    if (arg == "--cpu-strict") {
+        params.cpu_strict = true;
+        return true;
+    }
     if (arg == "-p" || arg == "--prompt") {
         if (++i >= argc) {
             invalid_param = true;
@@ -937,6 +1066,14 @@ bool gpt_params_find_arg(int argc, char ** argv, const std::string & arg, gpt_pa
         params.no_kv_offload = true;
         return true;
     }
+    if (arg == "--kv-block") {
+        if (++i >= argc) {
+            invalid_param = true;
+            return true;
+        }
+        params.n_kv_block = std::stoi(argv[i]);
+        return true;
+    }
     if (arg == "-ctk" || arg == "--cache-type-k") {
         params.cache_type_k = argv[++i];
         return true;
@@ -1060,6 +1197,17 @@ bool gpt_params_find_arg(int argc, char ** argv, const std::string & arg, gpt_pa
 #endif // GGML_USE_CUDA_SYCL_VULKAN
         return true;
     }
+    if (arg == "--rpc") {
+        if (++i >= argc) {
+            invalid_param = true;
+            return true;
+        }
+        params.rpc_servers = argv[i];
+#ifndef GGML_USE_RPC
+        fprintf(stderr, "warning: llama.cpp was compiled without RPC support. Setting the RPC servers has no effect.\n");
+#endif // GGML_USE_RPC
+        return true;
+    }
     if (arg == "--no-mmap") {
         params.use_mmap = false;
         return true;
@@ -1076,6 +1224,14 @@ bool gpt_params_find_arg(int argc, char ** argv, const std::string & arg, gpt_pa
         else { invalid_param = true; }
         return true;
     }
+    if (arg == "--cpu-stages") {
+        if (++i >= argc) {
+            invalid_param = true;
+            return true;
+        }
+        params.n_cpu_stages = std::stoi(argv[i]);
+        return true;
+    }
     if (arg == "--verbose-prompt") {
         params.verbose_prompt = true;
         return true;
@@ -1152,6 +1308,10 @@ bool gpt_params_find_arg(int argc, char ** argv, const std::string & arg, gpt_pa
         params.check_tensors = true;
         return true;
     }
+    if (arg == "--repack") {
+        params.repack_tensors = true;
+        return true;
+    }
     if (arg == "--ppl-output-type") {
         if (++i >= argc) {
             invalid_param = true;
@@ -1423,6 +1583,7 @@ void gpt_print_usage(int /*argc*/, char ** argv, const gpt_params & params) {
     printf("options:\n");
     printf("  -h, --help            show this help message and exit\n");
     printf("  --version             show version and build info\n");
+    printf("  --args-file FNAME     read more arguments from FNAME, e.g. a configuration written by llama-bench --autotune\n");
     printf("  -i, --interactive     run in interactive mode\n");
     printf("  --interactive-specials allow special tokens in user text, in interactive mode\n");
     printf("  --interactive-first   run in interactive mode and wait for input right away\n");
@@ -1442,6 +1603,9 @@ void gpt_print_usage(int /*argc*/, char ** argv, const gpt_params & params) {
     printf("                        number of threads to use during generation (default: same as --threads)\n");
     printf("  -tbd N, --threads-batch-draft N\n");
     printf("                        number of threads to use during batch and prompt processing (default: same as --threads-draft)\n");
+    printf("  --poll N              busy-wait level of idle worker threads before they sleep, 0-100 (default: %d, -1 = no thread pool)\n", params.poll);
+    printf("  -C M, --cpu-mask M    hex mask of the CPUs the worker threads may run on, e.g. 0xff (default: no mask)\n");
+    printf("  --cpu-strict          pin each worker thread to a single CPU of the --cpu-mask\n");
     printf("  -p PROMPT, --prompt PROMPT\n");
     printf("                        prompt to start generation with (default: empty)\n");
     printf("  -e, --escape          process prompt escapes sequences (\\n, \\r, \\t, \\', \\\", \\\\)\n");
@@ -1537,11 +1701,13 @@ void gpt_print_usage(int /*argc*/, char ** argv, const gpt_params & params) {
         printf("  --no-mmap             do not memory-map model (slower load but may reduce pageouts if not using mlock)\n");
     }
     printf("  --numa TYPE           attempt optimizations that help on some NUMA systems\n");
-    printf("                          - distribute: spread execution evenly over all nodes\n");
+    printf("                          - distribute: spread execution evenly over all nodes and split CPU weight matrices across them\n");
     printf("                          - isolate: only spawn threads on CPUs on the node that execution started on\n");
     printf("                          - numactl: use the CPU map provided by numactl\n");
     printf("                        if run without this previously, it is recommended to drop the system page cache before using this\n");
     printf("                        see https://github.com/ggerganov/llama.cpp/issues/1437\n");
+    printf("  --cpu-stages N        split the layers kept on the CPU across N CPU backends with their own threads,\n");
+    printf("                        e.g. one per NUMA node, and run them as a pipeline over the ubatches (default: %d)\n", params.n_cpu_stages);
     if (llama_supports_gpu_offload()) {
         printf("  -ngl N, --n-gpu-layers N\n");
         printf("                        number of layers to store in VRAM\n");
@@ -1556,6 +1722,7 @@ void gpt_print_usage(int /*argc*/, char ** argv, const gpt_params & params) {
         printf("                        fraction of the model to offload to each GPU, comma-separated list of proportions, e.g. 3,1\n");
         printf("  -mg i, --main-gpu i   the GPU to use for the model (with split-mode = none),\n");
         printf("                        or for intermediate results and KV (with split-mode = row) (default: %d)\n", params.main_gpu);
+        printf("  --rpc SERVERS         comma separated list of RPC servers (host:port) to offload layers to\n");
     }
     printf("  --verbose-prompt      print a verbose prompt before generation (default: %s)\n", params.verbose_prompt ? "true" : "false");
     printf("  --no-display-prompt   don't print prompt at generation (default: %s)\n", !params.display_prompt ? "true" : "false");
@@ -1567,6 +1734,7 @@ void gpt_print_usage(int /*argc*/, char ** argv, const gpt_params & params) {
     printf("                        verbose print of the KV cache\n");
     printf("  -nkvo, --no-kv-offload\n");
     printf("                        disable KV offload\n");
+    printf("  --kv-block N          number of KV cells per block of the paged KV cache (default: %d, 0 = contiguous, requires -fa)\n", params.n_kv_block);
     printf("  -ctk TYPE, --cache-type-k TYPE\n");
     printf("                        KV cache data type for K (default: %s)\n", params.cache_type_k.c_str());
     printf("  -ctv TYPE, --cache-type-v TYPE\n");
@@ -1603,6 +1771,7 @@ void gpt_print_usage(int /*argc*/, char ** argv, const gpt_params & params) {
     printf("  -ptc N, --print-token-count N\n");
     printf("                        print token count every N tokens (default: %d)\n", params.n_print);
     printf("  --check-tensors       check model tensor data for invalid values\n");
+    printf("  --repack              repack the Q4_0/Q8_0 weights of the CPU layers into an interleaved layout for faster matmul\n");
     printf("\n");
 #ifndef LOG_DISABLE_LOGS
     log_print_usage();
@@ -1833,9 +2002,14 @@ struct llama_model_params llama_model_params_from_gpt_params(const gpt_params &
     mparams.main_gpu        = params.main_gpu;
     mparams.split_mode      = params.split_mode;
     mparams.tensor_split    = params.tensor_split;
+    mparams.n_cpu_stages    = params.n_cpu_stages;
+    if (!params.rpc_servers.empty()) {
+        mparams.rpc_servers = params.rpc_servers.c_str();
+    }
     mparams.use_mmap        = params.use_mmap;
     mparams.use_mlock       = params.use_mlock;
     mparams.check_tensors   = params.check_tensors;
+    mparams.repack_tensors  = params.repack_tensors;
     if (params.kv_overrides.empty()) {
         mparams.kv_overrides = NULL;
     } else {
@@ -1880,10 +2054,14 @@ struct llama_context_params llama_context_params_from_gpt_params(const gpt_param
 
     cparams.n_ctx             = params.n_ctx;
     cparams.n_seq_max         = params.n_parallel;
+    cparams.n_kv_block        = params.n_kv_block;
     cparams.n_batch           = params.n_batch;
     cparams.n_ubatch          = params.n_ubatch;
     cparams.n_threads         = params.n_threads;
     cparams.n_threads_batch   = params.n_threads_batch == -1 ? params.n_threads : params.n_threads_batch;
+    cparams.poll              = params.poll;
+    cparams.cpumask           = params.cpumask_set ? params.cpumask : nullptr;
+    cparams.cpu_strict        = params.cpu_strict;
     cparams.seed              = params.seed;
     cparams.logits_all        = params.logits_all;
     cparams.embeddings        = params.embedding;
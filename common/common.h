@@ -44,6 +44,9 @@ struct llama_control_vector_load_info;
 int get_math_cpu_count();
 int32_t get_num_physical_cores();
 
+// parse a hex CPU mask such as "0xff00" into a per-CPU array
+bool parse_cpu_mask(const std::string & mask, bool (&cpumask)[GGML_MAX_N_THREADS]);
+
 //
 // CLI argument parsing
 //
@@ -55,6 +58,7 @@ struct gpt_params {
     int32_t n_threads_draft       = -1;
     int32_t n_threads_batch       = -1;    // number of threads to use for batch processing (-1 = use n_threads)
     int32_t n_threads_batch_draft = -1;
+    int32_t poll                  = 50;    // thread pool busy-wait level (0 = sleep immediately, 100 = spin aggressively, -1 = no thread pool)
     int32_t n_predict             = -1;    // new tokens to predict
     int32_t n_ctx                 = 512;   // context size
     int32_t n_batch               = 2048;  // logical batch size for prompt processing (must be >=32 to use BLAS)
@@ -64,12 +68,14 @@ struct gpt_params {
     int32_t n_chunks              = -1;    // max number of chunks to process (-1 = unlimited)
     int32_t n_parallel            = 1;     // number of parallel sequences to decode
     int32_t n_sequences           = 1;     // number of sequences to decode
+    int32_t n_kv_block            = 0;     // KV cells per block of the paged KV cache (0 = contiguous)
     float   p_split               = 0.1f;  // speculative decoding split probability
     int32_t n_gpu_layers          = -1;    // number of layers to store in VRAM (-1 - use default)
     int32_t n_gpu_layers_draft    = -1;    // number of layers to store in VRAM for the draft model (-1 - use default)
     llama_split_mode split_mode   = LLAMA_SPLIT_MODE_LAYER; // how to split the model across GPUs
     int32_t main_gpu              = 0;     // the GPU that is used for scratch and small tensors
     float   tensor_split[128]     = {0};   // how split tensors should be distributed across GPUs
+    int32_t n_cpu_stages          = 1;     // number of CPU backends the CPU layers are pipelined across
     int32_t n_beams               = 0;     // if non-zero then use beam search of given width.
     int32_t grp_attn_n            = 1;     // group-attention factor
     int32_t grp_attn_w            = 512;   // group-attention width
@@ -88,6 +94,10 @@ struct gpt_params {
 
     ggml_numa_strategy numa = GGML_NUMA_STRATEGY_DISABLED;
 
+    bool cpumask[GGML_MAX_N_THREADS] = {false}; // CPU affinity mask for the worker threads
+    bool cpumask_set                 = false;   // use cpumask
+    bool cpu_strict                  = false;   // pin each worker thread to a single CPU of cpumask
+
     enum llama_rope_scaling_type rope_scaling_type = LLAMA_ROPE_SCALING_TYPE_UNSPECIFIED;
     enum llama_pooling_type      pooling_type      = LLAMA_POOLING_TYPE_UNSPECIFIED; // pooling type for embeddings
 
@@ -110,6 +120,7 @@ struct gpt_params {
     std::string lookup_cache_static  = ""; // path of static ngram cache file for lookup decoding
     std::string lookup_cache_dynamic = ""; // path of dynamic ngram cache file for lookup decoding
     std::string logits_file          = "";  // file for saving *all* logits
+    std::string rpc_servers          = "";  // comma separated list of RPC servers
 
     std::vector<llama_model_kv_override> kv_overrides;
 
@@ -167,6 +178,7 @@ struct gpt_params {
     bool no_kv_offload     = false; // disable KV offloading
     bool warmup            = true;  // warmup run
     bool check_tensors     = false; // validate tensor data
+    bool repack_tensors    = false; // interleave the rows of the Q4_0/Q8_0 matrices of the CPU layers
 
     std::string cache_type_k = "f16"; // KV cache data type for the K
     std::string cache_type_v = "f16"; // KV cache data type for the V
@@ -184,6 +196,10 @@ bool gpt_params_parse_ex(int argc, char ** argv, gpt_params & params);
 
 bool gpt_params_parse(int argc, char ** argv, gpt_params & params);
 
+// argv with every "--args-file FNAME" replaced by the arguments read from FNAME
+// the arguments are separated by whitespace, may be "quoted", and # starts a comment until the end of the line
+std::vector<std::string> gpt_params_expand_args_file(int argc, char ** argv);
+
 void gpt_print_usage(int argc, char ** argv, const gpt_params & params);
 
 bool gpt_params_find_arg(int argc, char ** argv, const std::string & arg, gpt_params & params, int & i, bool & invalid_param);
@@ -1,7 +1,18 @@
 #define LLAMA_API_INTERNAL
 #include "sampling.h"
+
+#include <algorithm>
+#include <cmath>
 #include <random>
 
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
 struct llama_sampling_context * llama_sampling_init(const struct llama_sampling_params & params) {
     struct llama_sampling_context * result = new llama_sampling_context();
 
@@ -174,6 +185,47 @@ static void sampler_queue(
     }
 }
 
+static llama_token_data_array llama_sampling_prepare_impl(
+                  struct llama_sampling_context * ctx_sampling,
+                  struct llama_context * ctx_main,
+                  struct llama_context * ctx_cfg,
+                  const int idx,
+                  bool apply_grammar,
+                  std::vector<float> * original_logits,
+                  size_t n_select);
+
+// the number of candidates to select from the logits instead of using the whole vocab, or 0 if the
+// result of the samplers could depend on the tokens outside of the top-k
+static size_t llama_sampling_n_select(const llama_sampling_context * ctx_sampling, int n_vocab) {
+    const llama_sampling_params & params = ctx_sampling->params;
+
+    if (ctx_sampling->grammar != NULL) {
+        return 0;
+    }
+
+    // greedy sampling only needs the max, otherwise the first sampler must be top-k
+    const bool greedy = params.temp == 0.0f;
+    if (!greedy && (params.temp < 0.0f || params.mirostat != 0 || params.top_k <= 0 ||
+        params.samplers_sequence.empty() || params.samplers_sequence[0] != llama_sampler_type::TOP_K)) {
+        return 0;
+    }
+
+    // some callers look past the sampled candidates in ctx_sampling->cur, keep a few more for them
+    size_t n_select = 64;
+    n_select = std::max(n_select, (size_t) params.n_probs);
+    if (!greedy) {
+        n_select = std::max(n_select, (size_t) params.top_k);
+        n_select = std::max(n_select, (size_t) params.min_keep);
+    }
+
+    // not worth it if a large part of the vocab is kept anyway
+    if (4*n_select > (size_t) n_vocab) {
+        return 0;
+    }
+
+    return n_select;
+}
+
 static llama_token llama_sampling_sample_impl(
                   struct llama_sampling_context * ctx_sampling,
                   struct llama_context * ctx_main,
@@ -187,9 +239,15 @@ static llama_token llama_sampling_sample_impl(
     const float   mirostat_tau    = params.mirostat_tau;
     const float   mirostat_eta    = params.mirostat_eta;
 
-    std::vector<float> original_logits;
-    auto cur_p = llama_sampling_prepare(ctx_sampling, ctx_main, ctx_cfg, idx, !is_resampling, &original_logits);
-    if (!is_resampling) {
+    // the original logits are only needed to resample with the grammar
+    std::vector<float> & original_logits = ctx_sampling->original_logits;
+    original_logits.clear();
+
+    const size_t n_select = llama_sampling_n_select(ctx_sampling, llama_n_vocab(llama_get_model(ctx_main)));
+
+    auto cur_p = llama_sampling_prepare_impl(ctx_sampling, ctx_main, ctx_cfg, idx, !is_resampling,
+            ctx_sampling->grammar != NULL ? &original_logits : nullptr, n_select);
+    if (!is_resampling && ctx_sampling->grammar != NULL) {
         GGML_ASSERT(!original_logits.empty());
     }
     llama_token id = 0;
@@ -261,13 +319,103 @@ static llama_token llama_sampling_sample_impl(
     return id;
 }
 
-static llama_token_data_array llama_sampling_prepare_impl(
+// index of the first element of x[0..n) that is greater than thr, or n if there is none
+static int llama_sampling_find_gt(const float * x, int n, float thr) {
+    int i = 0;
+
+#if defined(__AVX__)
+    const __m256 vthr = _mm256_set1_ps(thr);
+    for (; i + 16 <= n; i += 16) {
+        const __m256 c0 = _mm256_cmp_ps(_mm256_loadu_ps(x + i + 0), vthr, _CMP_GT_OQ);
+        const __m256 c1 = _mm256_cmp_ps(_mm256_loadu_ps(x + i + 8), vthr, _CMP_GT_OQ);
+        if (_mm256_movemask_ps(_mm256_or_ps(c0, c1))) {
+            break;
+        }
+    }
+#elif defined(__SSE2__) || defined(_M_X64)
+    const __m128 vthr = _mm_set1_ps(thr);
+    for (; i + 16 <= n; i += 16) {
+        const __m128 c0 = _mm_cmpgt_ps(_mm_loadu_ps(x + i +  0), vthr);
+        const __m128 c1 = _mm_cmpgt_ps(_mm_loadu_ps(x + i +  4), vthr);
+        const __m128 c2 = _mm_cmpgt_ps(_mm_loadu_ps(x + i +  8), vthr);
+        const __m128 c3 = _mm_cmpgt_ps(_mm_loadu_ps(x + i + 12), vthr);
+        if (_mm_movemask_ps(_mm_or_ps(_mm_or_ps(c0, c1), _mm_or_ps(c2, c3)))) {
+            break;
+        }
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    const float32x4_t vthr = vdupq_n_f32(thr);
+    for (; i + 16 <= n; i += 16) {
+        const uint32x4_t c0 = vcgtq_f32(vld1q_f32(x + i +  0), vthr);
+        const uint32x4_t c1 = vcgtq_f32(vld1q_f32(x + i +  4), vthr);
+        const uint32x4_t c2 = vcgtq_f32(vld1q_f32(x + i +  8), vthr);
+        const uint32x4_t c3 = vcgtq_f32(vld1q_f32(x + i + 12), vthr);
+        if (vmaxvq_u32(vorrq_u32(vorrq_u32(c0, c1), vorrq_u32(c2, c3)))) {
+            break;
+        }
+    }
+#endif
+
+    for (; i < n; ++i) {
+        if (x[i] > thr) {
+            return i;
+        }
+    }
+
+    return n;
+}
+
+// select into cur a superset of the n_select largest logits, ordered by token id
+// the buffer is compacted to the n_select largest candidates whenever it fills up, which raises the threshold
+// that a logit must exceed to be considered, so that most of the vocab is skipped by the vectorized scan
+// returns false if there are less than n_select finite logits
+static bool llama_sampling_select(std::vector<llama_token_data> & cur, const float * logits, int n_vocab, size_t n_select) {
+    const size_t n_buf = std::max((size_t) 1024, 4*n_select);
+
+    cur.resize(n_buf);
+
+    const auto comp = [](const llama_token_data & a, const llama_token_data & b) {
+        return a.logit > b.logit;
+    };
+
+    size_t n   = 0;
+    float  thr = -INFINITY;
+
+    for (int i = 0; i < n_vocab; ++i) {
+        i += llama_sampling_find_gt(logits + i, n_vocab - i, thr);
+        if (i >= n_vocab) {
+            break;
+        }
+
+        if (n == n_buf) {
+            std::nth_element(cur.begin(), cur.begin() + n_select - 1, cur.begin() + n, comp);
+            thr = cur[n_select - 1].logit;
+            n   = n_select;
+
+            if (!(logits[i] > thr)) {
+                continue;
+            }
+        }
+
+        cur[n++] = llama_token_data{i, logits[i], 0.0f};
+    }
+
+    cur.resize(n);
+
+    // same relative order as in the full array, so that the samplers see the candidates as they would otherwise
+    std::sort(cur.begin(), cur.end(), [](const llama_token_data & a, const llama_token_data & b) {
+        return a.id < b.id;
+    });
+
+    return n >= n_select;
+}
+
+// compute the repetition penalties into ctx_sampling->penalties, with the penalized logit in .logit and the original one in .p
+// this is equivalent to llama_sample_repetition_penalties, but it only visits the tokens in the penalty window
+static void llama_sampling_compute_penalties(
                   struct llama_sampling_context * ctx_sampling,
                   struct llama_context * ctx_main,
-                  struct llama_context * ctx_cfg,
-                  const int idx,
-                  bool apply_grammar,
-                  std::vector<float> * original_logits) {
+                  const float * logits) {
     const llama_sampling_params & params = ctx_sampling->params;
 
     const int n_vocab = llama_n_vocab(llama_get_model(ctx_main));
@@ -277,17 +425,71 @@ static llama_token_data_array llama_sampling_prepare_impl(
     const float   penalty_freq    = params.penalty_freq;
     const float   penalty_present = params.penalty_present;
 
-    const bool    penalize_nl     = params.penalize_nl;
+    auto & penalties = ctx_sampling->penalties;
+    penalties.clear();
+
+    const auto & prev = params.use_penalty_prompt_tokens ? params.penalty_prompt_tokens : ctx_sampling->prev;
+    const int n_used = std::min((int) prev.size(), penalty_last_n);
+
+    if (n_used <= 0 || (penalty_repeat == 1.0f && penalty_freq == 0.0f && penalty_present == 0.0f)) {
+        return;
+    }
+
+    // the newline keeps its logit unless it is penalized explicitly
+    const llama_token nl = params.penalize_nl ? -1 : llama_token_nl(llama_get_model(ctx_main));
+
+    auto & tokens = ctx_sampling->penalty_tokens;
+    tokens.assign(prev.end() - n_used, prev.end());
+    std::sort(tokens.begin(), tokens.end());
+
+    for (size_t i = 0; i < tokens.size(); ) {
+        const llama_token id = tokens[i];
+
+        size_t j = i;
+        while (j < tokens.size() && tokens[j] == id) {
+            j++;
+        }
+        const int count = j - i;
+        i = j;
+
+        if (id < 0 || id >= n_vocab || id == nl) {
+            continue;
+        }
+
+        float logit = logits[id];
+
+        if (logit <= 0) {
+            logit *= penalty_repeat;
+        } else {
+            logit /= penalty_repeat;
+        }
+
+        logit -= float(count) * penalty_freq + float(count > 0) * penalty_present;
+
+        penalties.push_back(llama_token_data{id, logit, logits[id]});
+    }
+}
+
+static llama_token_data_array llama_sampling_prepare_impl(
+                  struct llama_sampling_context * ctx_sampling,
+                  struct llama_context * ctx_main,
+                  struct llama_context * ctx_cfg,
+                  const int idx,
+                  bool apply_grammar,
+                  std::vector<float> * original_logits,
+                  size_t n_select) {
+    const llama_sampling_params & params = ctx_sampling->params;
+
+    const int n_vocab = llama_n_vocab(llama_get_model(ctx_main));
 
-    auto & prev = ctx_sampling->prev;
-    auto & cur  = ctx_sampling->cur;
+    auto & cur = ctx_sampling->cur;
 
     // Get a pointer to the logits
     float * logits = llama_get_logits_ith(ctx_main, idx);
 
     if (apply_grammar && original_logits != NULL) {
         // Only make a copy of the original logits if we are not applying grammar checks, not sure if I actually have to do this.
-        *original_logits = {logits, logits + llama_n_vocab(llama_get_model(ctx_main))};
+        original_logits->assign(logits, logits + n_vocab);
     }
 
     // apply params.logit_bias map
@@ -300,34 +502,40 @@ static llama_token_data_array llama_sampling_prepare_impl(
         llama_sample_apply_guidance(ctx_main, logits, logits_guidance, params.cfg_scale);
     }
 
-    cur.clear();
+    llama_sampling_compute_penalties(ctx_sampling, ctx_main, logits);
 
-    for (llama_token token_id = 0; token_id < n_vocab; token_id++) {
-        cur.emplace_back(llama_token_data{token_id, logits[token_id], 0.0f});
+    const auto & penalties = ctx_sampling->penalties;
+
+    // select the top candidates directly from the logits, with the penalties written in place for the duration of the scan
+    if (n_select > 0 && !(apply_grammar && ctx_sampling->grammar != NULL)) {
+        for (const auto & penalty : penalties) {
+            logits[penalty.id] = penalty.logit;
+        }
+
+        const bool ok = llama_sampling_select(cur, logits, n_vocab, n_select);
+
+        for (const auto & penalty : penalties) {
+            logits[penalty.id] = penalty.p;
+        }
+
+        if (ok) {
+            return { cur.data(), cur.size(), false };
+        }
     }
 
-    llama_token_data_array cur_p = { cur.data(), cur.size(), false };
+    cur.resize(n_vocab);
+
+    for (llama_token token_id = 0; token_id < n_vocab; token_id++) {
+        cur[token_id] = llama_token_data{token_id, logits[token_id], 0.0f};
+    }
 
     // apply penalties
-    const auto& penalty_tokens = params.use_penalty_prompt_tokens ? params.penalty_prompt_tokens : prev;
-    const int penalty_tokens_used_size = std::min((int)penalty_tokens.size(), penalty_last_n);
-    if (penalty_tokens_used_size) {
-        const float nl_logit = logits[llama_token_nl(llama_get_model(ctx_main))];
-
-        llama_sample_repetition_penalties(ctx_main, &cur_p,
-                penalty_tokens.data() + penalty_tokens.size() - penalty_tokens_used_size,
-                penalty_tokens_used_size, penalty_repeat, penalty_freq, penalty_present);
-
-        if (!penalize_nl) {
-            for (size_t idx = 0; idx < cur_p.size; idx++) {
-                if (cur_p.data[idx].id == llama_token_nl(llama_get_model(ctx_main))) {
-                    cur_p.data[idx].logit = nl_logit;
-                    break;
-                }
-            }
-        }
+    for (const auto & penalty : penalties) {
+        cur[penalty.id].logit = penalty.logit;
     }
 
+    llama_token_data_array cur_p = { cur.data(), cur.size(), false };
+
     // apply grammar checks before sampling logic
     if (apply_grammar && ctx_sampling->grammar != NULL) {
         llama_sample_grammar(ctx_main, &cur_p, ctx_sampling->grammar);
@@ -352,7 +560,7 @@ llama_token_data_array llama_sampling_prepare(
                   const int idx,
                   bool apply_grammar,
                   std::vector<float> * original_logits) {
-    return llama_sampling_prepare_impl(ctx_sampling,ctx_main, ctx_cfg, idx, apply_grammar, original_logits);
+    return llama_sampling_prepare_impl(ctx_sampling,ctx_main, ctx_cfg, idx, apply_grammar, original_logits, 0);
 }
 
 void llama_sampling_accept(
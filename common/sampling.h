@@ -83,6 +83,11 @@ struct llama_sampling_context {
     std::vector<llama_token_data> cur;
     size_t n_valid; // Number of correct top tokens with correct probabilities.
 
+    // scratch buffers, reused so that sampling a token does not allocate
+    std::vector<float>            original_logits;
+    std::vector<llama_token>      penalty_tokens;
+    std::vector<llama_token_data> penalties; // penalized logits of the tokens in the penalty window, original logits in .p
+
     std::mt19937 rng;
 };
 
@@ -2,10 +2,13 @@
 #include "common.h"
 
 #include <algorithm>
+#include <atomic>
 #include <cmath>
 #include <cstdlib>
-#include <fstream>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include <stdio.h>
@@ -14,11 +17,23 @@
 #include <stdexcept>
 
 #if defined(_WIN32)
+    #ifndef NOMINMAX
+        #define NOMINMAX
+    #endif
     #include <windows.h>
     #ifndef PATH_MAX
         #define PATH_MAX MAX_PATH
     #endif
     #include <io.h>
+#else
+    #include <errno.h>
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+    #if defined(__linux__) && defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27))
+        #define GGUF_SPLIT_USE_COPY_FILE_RANGE
+    #endif
 #endif
 
 enum split_operation : uint8_t {
@@ -34,6 +49,8 @@ struct split_params {
     std::string output;
     bool no_tensor_first_split = false;
     bool dry_run = false;
+    bool verify = false;
+    int n_threads = std::max(1u, std::thread::hardware_concurrency());
 };
 
 static void split_print_usage(const char * executable) {
@@ -52,6 +69,8 @@ static void split_print_usage(const char * executable) {
     printf("  --split-max-size N(M|G) max size per split\n");
     printf("  --no-tensor-first-split do not add tensors to the first split (disabled by default)\n");
     printf("  --dry-run               only print out a split plan and exit, without writing any new files\n");
+    printf("  --verify                compare the checksums of the tensors written with the ones of the input\n");
+    printf("  --threads N             number of tensors copied concurrently (default: %d)\n", default_params.n_threads);
     printf("\n");
 }
 
@@ -106,6 +125,18 @@ static void split_params_parse_ex(int argc, const char ** argv, split_params & p
             arg_found = true;
             params.no_tensor_first_split = true;
         }
+        if (arg == "--verify") {
+            arg_found = true;
+            params.verify = true;
+        }
+        if (arg == "--threads") {
+            if (++arg_idx >= argc) {
+                invalid_param = true;
+                break;
+            }
+            arg_found = true;
+            params.n_threads = std::max(1, atoi(argv[arg_idx]));
+        }
 
         if (is_op_set) {
             throw std::invalid_argument("error: either --split or --merge can be specified, but not both");
@@ -173,16 +204,285 @@ static bool split_params_parse(int argc, const char ** argv, split_params & para
     return result;
 }
 
-static void zeros(std::ofstream & file, size_t n) {
-    char zero = 0;
-    for (size_t i = 0; i < n; ++i) {
-        file.write(&zero, 1);
+// a file accessed at explicit offsets, so that several threads can copy tensors to and from it
+// input files are memory-mapped, output files are extended to their final size before the copies
+struct split_file {
+    std::string path;
+#if defined(_WIN32)
+    HANDLE handle = INVALID_HANDLE_VALUE;
+#else
+    int fd = -1;
+#endif
+    const uint8_t * addr = nullptr; // read-only mapping of an input file
+    size_t size = 0;
+
+    split_file(const std::string & path, bool write) : path(path) {
+#if defined(_WIN32)
+        handle = CreateFileA(path.c_str(), write ? GENERIC_READ | GENERIC_WRITE : GENERIC_READ, FILE_SHARE_READ, NULL,
+                write ? CREATE_ALWAYS : OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (handle == INVALID_HANDLE_VALUE) {
+            throw std::runtime_error("failed to open " + path);
+        }
+        if (!write) {
+            LARGE_INTEGER file_size;
+            GetFileSizeEx(handle, &file_size);
+            size = file_size.QuadPart;
+            if (size > 0) {
+                HANDLE mapping = CreateFileMappingA(handle, NULL, PAGE_READONLY, 0, 0, NULL);
+                if (mapping != NULL) {
+                    addr = (const uint8_t *) MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+                    CloseHandle(mapping);
+                }
+                if (addr == nullptr) {
+                    throw std::runtime_error("failed to mmap " + path);
+                }
+            }
+        }
+#else
+        fd = open(path.c_str(), write ? O_RDWR | O_CREAT | O_TRUNC : O_RDONLY, 0644);
+        if (fd < 0) {
+            throw std::runtime_error("failed to open " + path + ": " + strerror(errno));
+        }
+        if (!write) {
+            struct stat st;
+            if (fstat(fd, &st) != 0) {
+                throw std::runtime_error("failed to stat " + path + ": " + strerror(errno));
+            }
+            size = st.st_size;
+            if (size > 0) {
+                void * mapped = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+                if (mapped == MAP_FAILED) {
+                    throw std::runtime_error("failed to mmap " + path + ": " + strerror(errno));
+                }
+                posix_madvise(mapped, size, POSIX_MADV_SEQUENTIAL);
+                addr = (const uint8_t *) mapped;
+            }
+        }
+#endif
+    }
+
+    ~split_file() {
+#if defined(_WIN32)
+        if (addr != nullptr) {
+            UnmapViewOfFile(addr);
+        }
+        if (handle != INVALID_HANDLE_VALUE) {
+            CloseHandle(handle);
+        }
+#else
+        if (addr != nullptr) {
+            munmap(const_cast<uint8_t *>(addr), size);
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+#endif
+    }
+
+    split_file(const split_file &) = delete;
+    split_file & operator=(const split_file &) = delete;
+
+    void write(const void * data, size_t len, size_t offset) const {
+        const uint8_t * ptr = (const uint8_t *) data;
+        while (len > 0) {
+#if defined(_WIN32)
+            OVERLAPPED ov = {};
+            ov.Offset     = (DWORD) offset;
+            ov.OffsetHigh = (DWORD) (offset >> 32);
+            DWORD n = 0;
+            if (!WriteFile(handle, ptr, (DWORD) std::min(len, (size_t) 1 << 30), &n, &ov) || n == 0) {
+                throw std::runtime_error("failed to write " + path);
+            }
+#else
+            ssize_t n = pwrite(fd, ptr, len, offset);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                throw std::runtime_error("failed to write " + path + ": " + strerror(errno));
+            }
+#endif
+            ptr    += n;
+            offset += n;
+            len    -= n;
+        }
+    }
+
+    void read(void * data, size_t len, size_t offset) const {
+        uint8_t * ptr = (uint8_t *) data;
+        while (len > 0) {
+#if defined(_WIN32)
+            OVERLAPPED ov = {};
+            ov.Offset     = (DWORD) offset;
+            ov.OffsetHigh = (DWORD) (offset >> 32);
+            DWORD n = 0;
+            if (!ReadFile(handle, ptr, (DWORD) std::min(len, (size_t) 1 << 30), &n, &ov) || n == 0) {
+                throw std::runtime_error("failed to read " + path);
+            }
+#else
+            ssize_t n = pread(fd, ptr, len, offset);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                throw std::runtime_error("failed to read " + path + ": " + (n == 0 ? "unexpected end of file" : strerror(errno)));
+            }
+#endif
+            ptr    += n;
+            offset += n;
+            len    -= n;
+        }
+    }
+
+    // the bytes that are never written read back as zeros, this takes care of the padding between the tensors
+    void resize(size_t new_size) {
+#if defined(_WIN32)
+        LARGE_INTEGER pos;
+        pos.QuadPart = new_size;
+        if (!SetFilePointerEx(handle, pos, NULL, FILE_BEGIN) || !SetEndOfFile(handle)) {
+            throw std::runtime_error("failed to resize " + path);
+        }
+#else
+        if (ftruncate(fd, new_size) != 0) {
+            throw std::runtime_error("failed to resize " + path + ": " + strerror(errno));
+        }
+#endif
+        size = new_size;
+    }
+};
+
+// copy len bytes at in_offset of in to out_offset of out
+// the data stays in the kernel with copy_file_range() (and reflinks on filesystems that support it),
+// otherwise it is written in large chunks straight from the mapping of the input
+static void split_copy_range(const split_file & in, size_t in_offset, const split_file & out, size_t out_offset, size_t len) {
+    if (in_offset + len > in.size) {
+        throw std::runtime_error("tensor data is out of the bounds of " + in.path);
+    }
+#if defined(GGUF_SPLIT_USE_COPY_FILE_RANGE)
+    static std::atomic<bool> has_copy_file_range(true);
+    while (len > 0 && has_copy_file_range) {
+        loff_t off_in  = in_offset;
+        loff_t off_out = out_offset;
+        ssize_t n = copy_file_range(in.fd, &off_in, out.fd, &off_out, len, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP || errno == EPERM)) {
+            // not supported by the kernel or between these filesystems
+            has_copy_file_range = false;
+            break;
+        }
+        if (n <= 0) {
+            throw std::runtime_error("failed to copy " + in.path + " to " + out.path + ": " + (n == 0 ? "unexpected end of file" : strerror(errno)));
+        }
+        in_offset  += n;
+        out_offset += n;
+        len        -= n;
+    }
+#endif
+    const size_t chunk_size = 64*1024*1024;
+    while (len > 0) {
+        const size_t n = std::min(len, chunk_size);
+        out.write(in.addr + in_offset, n, out_offset);
+        in_offset  += n;
+        out_offset += n;
+        len        -= n;
+    }
+}
+
+// FNV-1a over 64-bit words, the data must be hashed in chunks that are a multiple of 8 bytes except for the last one
+struct split_checksum {
+    uint64_t hash = 14695981039346656037ULL;
+
+    void update(const uint8_t * data, size_t len) {
+        size_t i = 0;
+        for (; i + 8 <= len; i += 8) {
+            uint64_t word;
+            memcpy(&word, data + i, sizeof(word));
+            hash = (hash ^ word) * 1099511628211ULL;
+        }
+        for (; i < len; ++i) {
+            hash = (hash ^ data[i]) * 1099511628211ULL;
+        }
+    }
+};
+
+// copy of the data of one tensor from an input file to an output file
+struct split_tensor_copy {
+    const char * name;
+    int    i_in;
+    size_t in_offset;
+    int    i_out;
+    size_t out_offset;
+    size_t n_bytes;
+};
+
+// copy the tensors with params.n_threads threads, then optionally compare their checksums in the input and in the output
+static void split_copy_tensors(
+        const std::vector<std::unique_ptr<split_file>> & ins,
+        const std::vector<std::unique_ptr<split_file>> & outs,
+        const std::vector<split_tensor_copy> & copies,
+        const split_params & params) {
+    std::atomic<size_t> i_next(0);
+    std::mutex mutex;
+    std::string error;
+
+    auto worker = [&]() {
+        std::vector<uint8_t> buf;
+        for (size_t i = i_next++; i < copies.size(); i = i_next++) {
+            const auto & c = copies[i];
+            try {
+                split_copy_range(*ins[c.i_in], c.in_offset, *outs[c.i_out], c.out_offset, c.n_bytes);
+
+                if (params.verify) {
+                    split_checksum expected;
+                    expected.update(ins[c.i_in]->addr + c.in_offset, c.n_bytes);
+
+                    split_checksum actual;
+                    buf.resize(std::min(c.n_bytes, (size_t) 16*1024*1024));
+                    for (size_t off = 0; off < c.n_bytes; off += buf.size()) {
+                        const size_t n = std::min(buf.size(), c.n_bytes - off);
+                        outs[c.i_out]->read(buf.data(), n, c.out_offset + off);
+                        actual.update(buf.data(), n);
+                    }
+
+                    if (actual.hash != expected.hash) {
+                        char msg[256];
+                        snprintf(msg, sizeof(msg), "checksum mismatch for tensor %s: %016llx != %016llx",
+                                c.name, (unsigned long long) actual.hash, (unsigned long long) expected.hash);
+                        throw std::runtime_error(msg);
+                    }
+                }
+            } catch (const std::exception & e) {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (error.empty()) {
+                    error = e.what();
+                }
+                i_next = copies.size();
+            }
+        }
+    };
+
+    const int n_threads = (int) std::min((size_t) params.n_threads, copies.size());
+    std::vector<std::thread> workers;
+    for (int i = 1; i < n_threads; ++i) {
+        workers.emplace_back(worker);
+    }
+    worker();
+    for (auto & w : workers) {
+        w.join();
+    }
+
+    if (!error.empty()) {
+        throw std::runtime_error(error);
+    }
+    if (params.verify) {
+        fprintf(stderr, "%s: verified the checksums of %zu tensors\n", __func__, copies.size());
     }
 }
 
 struct split_strategy {
     const split_params params;
-    std::ifstream & f_input;
     struct gguf_context * ctx_gguf;
     struct ggml_context * ctx_meta = NULL;
     const int n_tensors;
@@ -190,15 +490,10 @@ struct split_strategy {
     // one ctx_out per one output file
     std::vector<struct gguf_context *> ctx_outs;
 
-    // temporary buffer for reading in tensor data
-    std::vector<uint8_t> read_buf;
-
     split_strategy(const split_params & params,
-            std::ifstream & f_input,
             struct gguf_context * ctx_gguf,
             struct ggml_context * ctx_meta) :
         params(params),
-        f_input(f_input),
         ctx_gguf(ctx_gguf),
         ctx_meta(ctx_meta),
         n_tensors(gguf_get_n_tensors(ctx_gguf)) {
@@ -291,56 +586,48 @@ struct split_strategy {
     }
 
     void write() {
-        int i_split = 0;
+        std::vector<std::unique_ptr<split_file>> ins;
+        std::vector<std::unique_ptr<split_file>> outs;
+        std::vector<split_tensor_copy> copies;
+
+        ins.emplace_back(new split_file(params.input, false));
+
         int n_split = ctx_outs.size();
-        for (auto & ctx_out : ctx_outs) {
+        for (int i_split = 0; i_split < n_split; ++i_split) {
+            auto * ctx_out = ctx_outs[i_split];
+
             // construct file path
             char split_path[PATH_MAX] = {0};
             llama_split_path(split_path, sizeof(split_path), params.output.c_str(), i_split, n_split);
 
             // open the output file
-            printf("Writing file %s ... ", split_path);
-            fflush(stdout);
-            std::ofstream fout = std::ofstream(split_path, std::ios::binary);
-            fout.exceptions(std::ofstream::failbit); // fail fast on write errors
+            printf("Writing file %s\n", split_path);
+            outs.emplace_back(new split_file(split_path, true));
 
-            // write metadata
-            std::vector<uint8_t> data(gguf_get_meta_size(ctx_out));
+            // write metadata, the offsets of the tensors follow from it
+            const size_t meta_size = gguf_get_meta_size(ctx_out);
+            std::vector<uint8_t> data(meta_size);
             gguf_get_meta_data(ctx_out, data.data());
-            fout.write((const char *)data.data(), data.size());
+            outs.back()->write(data.data(), data.size(), 0);
 
-            // write tensors
+            size_t file_size = meta_size;
             for (int i = 0; i < gguf_get_n_tensors(ctx_out); ++i) {
-                // read tensor meta and prepare buffer
                 const char * t_name = gguf_get_tensor_name(ctx_out, i);
                 struct ggml_tensor * t = ggml_get_tensor(ctx_meta, t_name);
                 auto n_bytes = ggml_nbytes(t);
-                read_buf.resize(n_bytes);
 
-                // calculate offset
                 auto i_tensor_in = gguf_find_tensor(ctx_gguf, t_name); // idx of tensor in the input file
-                auto offset = gguf_get_data_offset(ctx_gguf) + gguf_get_tensor_offset(ctx_gguf, i_tensor_in);
+                auto in_offset   = gguf_get_data_offset(ctx_gguf) + gguf_get_tensor_offset(ctx_gguf, i_tensor_in);
+                auto out_offset  = meta_size + gguf_get_tensor_offset(ctx_out, i);
 
-                // copy tensor from input to output file
-                copy_file_to_file(f_input, fout, offset, n_bytes);
-                zeros(fout, GGML_PAD(n_bytes, GGUF_DEFAULT_ALIGNMENT) - n_bytes);
+                copies.push_back({ t_name, 0, in_offset, i_split, out_offset, n_bytes });
+                file_size = out_offset + GGML_PAD(n_bytes, GGUF_DEFAULT_ALIGNMENT);
             }
-
-            printf("done\n");
-            // close the file
-            fout.close();
-            i_split++;
+            outs.back()->resize(file_size);
         }
-    }
 
-    void copy_file_to_file(std::ifstream & f_in, std::ofstream & f_out, const size_t in_offset, const size_t len) {
-        // TODO: detect OS and use copy_file_range() here for better performance
-        if (read_buf.size() < len) {
-            read_buf.resize(len);
-        }
-        f_in.seekg(in_offset);
-        f_in.read((char *)read_buf.data(), len);
-        f_out.write((const char *)read_buf.data(), len);
+        // copy the tensors of all the splits concurrently
+        split_copy_tensors(ins, outs, copies, params);
     }
 };
 
@@ -352,12 +639,6 @@ static void gguf_split(const split_params & split_params) {
         /*.ctx      = */ &ctx_meta,
     };
 
-    std::ifstream f_input(split_params.input.c_str(), std::ios::binary);
-    if (!f_input.is_open()) {
-        fprintf(stderr, "%s:  failed to open input GGUF from %s\n", __func__, split_params.input.c_str());
-        exit(EXIT_FAILURE);
-    }
-
     auto * ctx_gguf = gguf_init_from_file(split_params.input.c_str(), params);
     if (!ctx_gguf) {
         fprintf(stderr, "%s:  failed to load input GGUF from %s\n", __func__, split_params.input.c_str());
@@ -365,18 +646,22 @@ static void gguf_split(const split_params & split_params) {
     }
 
     // prepare the strategy
-    split_strategy strategy(split_params, f_input, ctx_gguf, ctx_meta);
+    split_strategy strategy(split_params, ctx_gguf, ctx_meta);
     int n_split = strategy.ctx_outs.size();
     strategy.print_info();
 
     if (!split_params.dry_run) {
         // write all output splits
-        strategy.write();
+        try {
+            strategy.write();
+        } catch (const std::exception & e) {
+            fprintf(stderr, "%s: %s\n", __func__, e.what());
+            exit(EXIT_FAILURE);
+        }
     }
 
     // done, clean up
     gguf_free(ctx_gguf);
-    f_input.close();
 
     fprintf(stderr, "%s: %d gguf split written with a total of %d tensors.\n",
             __func__, n_split, strategy.n_tensors);
@@ -390,10 +675,7 @@ static void gguf_merge(const split_params & split_params) {
     int total_tensors = 0;
 
     auto * ctx_out = gguf_init_empty();
-    std::ofstream fout(split_params.output.c_str(), std::ios::binary);
-    fout.exceptions(std::ofstream::failbit); // fail fast on write errors
 
-    std::vector<uint8_t> read_data;
     std::vector<ggml_context *> ctx_metas;
     std::vector<gguf_context *> ctx_ggufs;
 
@@ -433,7 +715,6 @@ static void gguf_merge(const split_params & split_params) {
                 gguf_free(ctx_gguf);
                 ggml_free(ctx_meta);
                 gguf_free(ctx_out);
-                fout.close();
                 exit(EXIT_FAILURE);
             }
 
@@ -446,7 +727,6 @@ static void gguf_merge(const split_params & split_params) {
                 gguf_free(ctx_gguf);
                 ggml_free(ctx_meta);
                 gguf_free(ctx_out);
-                fout.close();
                 exit(EXIT_FAILURE);
             }
 
@@ -459,7 +739,6 @@ static void gguf_merge(const split_params & split_params) {
                 gguf_free(ctx_gguf);
                 ggml_free(ctx_meta);
                 gguf_free(ctx_out);
-                fout.close();
                 exit(EXIT_FAILURE);
             }
 
@@ -481,67 +760,60 @@ static void gguf_merge(const split_params & split_params) {
         fprintf(stderr, "\033[3Ddone\n");
     }
 
-    // placeholder for the meta data
-    {
-        auto meta_size = gguf_get_meta_size(ctx_out);
-        ::zeros(fout, meta_size);
-    }
+    // open the splits and the output, then copy all the tensors concurrently at the offsets of the merged metadata
+    try {
+        std::vector<std::unique_ptr<split_file>> ins;
+        std::vector<std::unique_ptr<split_file>> outs;
+        std::vector<split_tensor_copy> copies;
 
-    // Write tensors data
-    for (int i_split = 0; i_split < n_split; i_split++) {
-        llama_split_path(split_path, sizeof(split_path), split_prefix, i_split, n_split);
-        std::ifstream f_input(split_path, std::ios::binary);
-        if (!f_input.is_open()) {
-            fprintf(stderr, "%s:  failed to open input GGUF from %s\n", __func__, split_path);
-            for (uint32_t i = 0; i < ctx_ggufs.size(); i++) {
-                gguf_free(ctx_ggufs[i]);
-                ggml_free(ctx_metas[i]);
-            }
-            gguf_free(ctx_out);
-            fout.close();
-            exit(EXIT_FAILURE);
-        }
-        fprintf(stderr, "%s: writing tensors %s ...", __func__, split_path);
+        outs.emplace_back(new split_file(split_params.output, true));
 
-        auto * ctx_gguf = ctx_ggufs[i_split];
-        auto * ctx_meta = ctx_metas[i_split];
+        const size_t meta_size = gguf_get_meta_size(ctx_out);
+        std::vector<uint8_t> data(meta_size);
+        gguf_get_meta_data(ctx_out, data.data());
+        outs.back()->write(data.data(), data.size(), 0);
 
-        auto n_tensors = gguf_get_n_tensors(ctx_gguf);
-        for (int i_tensor = 0; i_tensor < n_tensors; i_tensor++) {
-            const char * t_name = gguf_get_tensor_name(ctx_gguf, i_tensor);
-            struct ggml_tensor * t = ggml_get_tensor(ctx_meta, t_name);
+        size_t file_size = meta_size;
+        int i_tensor_out = 0;
+        for (int i_split = 0; i_split < n_split; i_split++) {
+            llama_split_path(split_path, sizeof(split_path), split_prefix, i_split, n_split);
+            ins.emplace_back(new split_file(split_path, false));
 
-            auto n_bytes = ggml_nbytes(t);
+            auto * ctx_gguf = ctx_ggufs[i_split];
+            auto * ctx_meta = ctx_metas[i_split];
 
-            if (read_data.size() < n_bytes) {
-                read_data.resize(n_bytes);
-            }
+            auto n_tensors = gguf_get_n_tensors(ctx_gguf);
+            for (int i_tensor = 0; i_tensor < n_tensors; i_tensor++, i_tensor_out++) {
+                const char * t_name = gguf_get_tensor_name(ctx_gguf, i_tensor);
+                struct ggml_tensor * t = ggml_get_tensor(ctx_meta, t_name);
+                auto n_bytes = ggml_nbytes(t);
 
-            auto offset = gguf_get_data_offset(ctx_gguf) + gguf_get_tensor_offset(ctx_gguf, i_tensor);
-            f_input.seekg(offset);
-            f_input.read((char *)read_data.data(), n_bytes);
+                auto in_offset  = gguf_get_data_offset(ctx_gguf) + gguf_get_tensor_offset(ctx_gguf, i_tensor);
+                auto out_offset = meta_size + gguf_get_tensor_offset(ctx_out, i_tensor_out);
 
-            // write tensor data + padding
-            fout.write((const char *)read_data.data(), n_bytes);
-            zeros(fout, GGML_PAD(n_bytes, GGUF_DEFAULT_ALIGNMENT) - n_bytes);
+                copies.push_back({ t_name, i_split, in_offset, 0, out_offset, n_bytes });
+                file_size = out_offset + GGML_PAD(n_bytes, GGUF_DEFAULT_ALIGNMENT);
+            }
         }
-
-        gguf_free(ctx_gguf);
-        ggml_free(ctx_meta);
-        f_input.close();
-        fprintf(stderr, "\033[3Ddone\n");
+        outs.back()->resize(file_size);
+
+        fprintf(stderr, "%s: writing %zu tensors to %s ...\n", __func__, copies.size(), split_params.output.c_str());
+        split_copy_tensors(ins, outs, copies, split_params);
+    } catch (const std::exception & e) {
+        fprintf(stderr, "%s: %s\n", __func__, e.what());
+        for (uint32_t i = 0; i < ctx_ggufs.size(); i++) {
+            gguf_free(ctx_ggufs[i]);
+            ggml_free(ctx_metas[i]);
+        }
+        gguf_free(ctx_out);
+        exit(EXIT_FAILURE);
     }
 
-    {
-        // go back to beginning of file and write the updated metadata
-        fout.seekp(0);
-        std::vector<uint8_t> data(gguf_get_meta_size(ctx_out));
-        gguf_get_meta_data(ctx_out, data.data());
-        fout.write((const char *)data.data(), data.size());
-
-        fout.close();
-        gguf_free(ctx_out);
+    for (uint32_t i = 0; i < ctx_ggufs.size(); i++) {
+        gguf_free(ctx_ggufs[i]);
+        ggml_free(ctx_metas[i]);
     }
+    gguf_free(ctx_out);
 
     fprintf(stderr, "%s: %s merged from %d split with %d tensors.\n",
             __func__, split_params.output.c_str(), n_split, total_tensors);
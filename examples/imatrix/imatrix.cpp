@@ -8,6 +8,8 @@
 #include <sstream>
 #include <thread>
 #include <mutex>
+#include <condition_variable>
+#include <deque>
 #include <vector>
 #include <fstream>
 #include <unordered_map>
@@ -19,10 +21,25 @@
 
 struct Stats {
     std::vector<float> values;
-    std::vector<int> counts;
+    std::vector<int64_t> counts;
     int ncall = 0;
 };
 
+// the activations of one matrix multiplication, copied out of the graph by the eval callback
+// and accumulated by the worker thread while the computation goes on
+struct IMatrixJob {
+    std::string        wname;
+    ggml_op            op;
+    ggml_type          type;              // src1
+    int64_t            ne[GGML_MAX_DIMS]; // src1
+    size_t             nb[GGML_MAX_DIMS];
+    int                n_as = 0;          // number of experts of GGML_OP_MUL_MAT_ID
+    int                n_ids = 0;
+    size_t             ids_nb[2] = {0, 0};
+    std::vector<float> data;
+    std::vector<char>  ids;               // the expert ids from ggml_mul_mat_id
+};
+
 struct StatParams {
     std::string dataset;
     std::string ofile = "imatrix.dat";
@@ -35,23 +52,38 @@ struct StatParams {
 class IMatrixCollector {
 public:
     IMatrixCollector() = default;
+    ~IMatrixCollector() { finish(); }
     void set_parameters(StatParams&& params) { m_params = std::move(params); }
     bool collect_imatrix(struct ggml_tensor * t, bool ask, void * user_data);
+    // wait for the pending activations to be accumulated and stop the worker thread
+    void finish();
     void save_imatrix() const;
     bool load_imatrix(const char * file_name, bool add);
-    static bool load_imatrix(const char * file_name, std::unordered_map<std::string, Stats>& imatrix);
+    static bool load_imatrix(const char * file_name, std::unordered_map<std::string, Stats>& imatrix, int * n_chunks = nullptr);
 private:
     std::unordered_map<std::string, Stats> m_stats;
     StatParams                             m_params;
-    std::mutex                             m_mutex;
     int                                    m_last_call = 0;
-    std::vector<float>                     m_src1_data;
-    std::vector<char>                      m_ids; // the expert ids from ggml_mul_mat_id
-                                                  //
+
+    // the queue of the worker thread, m_stats and m_last_call are only updated by the worker while it runs
+    std::thread                            m_worker;
+    std::mutex                             m_mutex;
+    std::condition_variable                m_cv_push;
+    std::condition_variable                m_cv_pop;
+    std::deque<IMatrixJob>                 m_queue;
+    std::vector<std::vector<float>>        m_free_data;
+    size_t                                 m_pending_bytes = 0;
+    bool                                   m_stop = false;
+
+    void process_jobs();
+    void accumulate(const IMatrixJob & job);
     void save_imatrix(const char * file_name, const char * dataset) const;
     void keep_imatrix(int ncall) const;
 };
 
+// the eval callback blocks when more activations than this are waiting to be accumulated
+static const size_t IMATRIX_MAX_PENDING_BYTES = 512u*1024*1024;
+
 // remove any prefix and suffixes from the name
 // CUDA0#blk.0.attn_k.weight#0 => blk.0.attn_k.weight
 static std::string filter_tensor_name(const char * name) {
@@ -89,68 +121,137 @@ bool IMatrixCollector::collect_imatrix(struct ggml_tensor * t, bool ask, void *
         return true;
     }
 
-    std::lock_guard<std::mutex> lock(m_mutex);
+    std::unique_lock<std::mutex> lock(m_mutex);
+    if (!m_worker.joinable()) {
+        m_stop   = false;
+        m_worker = std::thread(&IMatrixCollector::process_jobs, this);
+    }
 
-    // copy the data from the GPU memory if needed
-    const bool is_host = ggml_backend_buffer_is_host(src1->buffer);
+    // bound the memory used by the activations that have not been accumulated yet
+    m_cv_pop.wait(lock, [&]() { return m_pending_bytes < IMATRIX_MAX_PENDING_BYTES || m_queue.empty(); });
 
-    if (!is_host) {
-        m_src1_data.resize(ggml_nelements(src1));
-        ggml_backend_tensor_get(src1, m_src1_data.data(), 0, ggml_nbytes(src1));
+    IMatrixJob job;
+    if (!m_free_data.empty()) {
+        job.data = std::move(m_free_data.back());
+        m_free_data.pop_back();
     }
+    lock.unlock();
 
-    const float * data = is_host ? (const float *) src1->data : m_src1_data.data();
+    // copy the data out of the graph (and from the GPU memory if needed), the tensor can be reused by the next nodes
+    job.wname = std::move(wname);
+    job.op    = t->op;
+    job.type  = src1->type;
+    for (int i = 0; i < GGML_MAX_DIMS; ++i) {
+        job.ne[i] = src1->ne[i];
+        job.nb[i] = src1->nb[i];
+    }
+    job.data.resize(ggml_nbytes(src1)/sizeof(float));
+    ggml_backend_tensor_get(src1, job.data.data(), 0, ggml_nbytes(src1));
 
-    // this has been adapted to the new format of storing merged experts in a single 3d tensor
-    // ref: https://github.com/ggerganov/llama.cpp/pull/6387
     if (t->op == GGML_OP_MUL_MAT_ID) {
-        //   ids  -> [n_experts_used, n_tokens]
-        //   src1 -> [cols, n_expert_used, n_tokens]
-        const ggml_tensor * ids = t->src[2];
-        const int n_as = src0->ne[2];
-        const int n_ids = ids->ne[0];
-
         // the top-k selected expert ids are stored in the ids tensor
         // for simplicity, always copy ids to host, because it is small
         // take into account that ids is not contiguous!
+        const ggml_tensor * ids = t->src[2];
 
         GGML_ASSERT(ids->ne[1] == src1->ne[2]);
 
-        m_ids.resize(ggml_nbytes(ids));
-        ggml_backend_tensor_get(ids, m_ids.data(), 0, ggml_nbytes(ids));
+        job.n_as      = src0->ne[2];
+        job.n_ids     = ids->ne[0];
+        job.ids_nb[0] = ids->nb[0];
+        job.ids_nb[1] = ids->nb[1];
+        job.ids.resize(ggml_nbytes(ids));
+        ggml_backend_tensor_get(ids, job.ids.data(), 0, ggml_nbytes(ids));
+    }
+
+    lock.lock();
+    m_pending_bytes += ggml_nbytes(src1);
+    m_queue.push_back(std::move(job));
+    m_cv_push.notify_one();
+
+    return true;
+}
+
+void IMatrixCollector::finish() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (!m_worker.joinable()) {
+            return;
+        }
+        m_stop = true;
+    }
+    m_cv_push.notify_one();
+    m_worker.join();
+}
+
+void IMatrixCollector::process_jobs() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (true) {
+        m_cv_push.wait(lock, [&]() { return !m_queue.empty() || m_stop; });
+        if (m_queue.empty()) {
+            break;
+        }
+        IMatrixJob job = std::move(m_queue.front());
+        m_queue.pop_front();
+        lock.unlock();
+
+        accumulate(job);
+
+        lock.lock();
+        m_pending_bytes -= job.data.size()*sizeof(float);
+        if (m_free_data.size() < 16) {
+            m_free_data.push_back(std::move(job.data));
+        }
+        m_cv_pop.notify_all();
+    }
+}
+
+void IMatrixCollector::accumulate(const IMatrixJob & job) {
+    const std::string & wname = job.wname;
+    const int64_t * ne = job.ne;
+    const size_t  * nb = job.nb;
+    const float * data = job.data.data();
+
+    // this has been adapted to the new format of storing merged experts in a single 3d tensor
+    // ref: https://github.com/ggerganov/llama.cpp/pull/6387
+    if (job.op == GGML_OP_MUL_MAT_ID) {
+        //   ids  -> [n_experts_used, n_tokens]
+        //   src1 -> [cols, n_expert_used, n_tokens]
+        const int n_as = job.n_as;
+        const int n_ids = job.n_ids;
 
         auto & e = m_stats[wname];
 
         ++e.ncall;
 
         if (e.values.empty()) {
-            e.values.resize(src1->ne[0]*n_as, 0);
-            e.counts.resize(src1->ne[0]*n_as, 0);
+            e.values.resize(ne[0]*n_as, 0);
+            e.counts.resize(ne[0]*n_as, 0);
         }
-        else if (e.values.size() != (size_t)src1->ne[0]*n_as) {
-            fprintf(stderr, "Oops: inconsistent size for %s (%d vs %d)\n", wname.c_str(), (int)e.values.size(), (int)src1->ne[0]*n_as);
+        else if (e.values.size() != (size_t)ne[0]*n_as) {
+            fprintf(stderr, "Oops: inconsistent size for %s (%d vs %d)\n", wname.c_str(), (int)e.values.size(), (int)ne[0]*n_as);
             exit(1); //GGML_ASSERT(false);
         }
         if (m_params.verbosity > 1) {
-            printf("%s[%d]: %32s, %s, %5d x %5d, %d\n", __func__, m_last_call, wname.c_str(), ggml_op_name(t->op), (int)src1->ne[0], (int)src1->ne[2], (int)src1->type);
+            printf("%s[%d]: %32s, %s, %5d x %5d, %d\n", __func__, m_last_call, wname.c_str(), ggml_op_name(job.op), (int)ne[0], (int)ne[2], (int)job.type);
         }
         // loop over all possible experts, regardless if they are used or not in the batch
         for (int ex = 0; ex < n_as; ++ex) {
-            size_t e_start = ex*src1->ne[0];
+            size_t e_start = ex*ne[0];
 
             for (int idx = 0; idx < n_ids; ++idx) {
-                for (int row = 0; row < (int)src1->ne[2]; ++row) {
-                    const int excur = *(const int32_t *) (m_ids.data() + row*ids->nb[1] + idx*ids->nb[0]);
+                for (int row = 0; row < (int)ne[2]; ++row) {
+                    const int excur = *(const int32_t *) (job.ids.data() + row*job.ids_nb[1] + idx*job.ids_nb[0]);
 
                     GGML_ASSERT(excur >= 0 && excur < n_as); // sanity check
 
                     if (excur != ex) continue;
 
-                    const int64_t i11 = idx % src1->ne[1];
+                    const int64_t i11 = idx % ne[1];
                     const int64_t i12 = row;
-                    const float * x = (const float *)((const char *)data + i11*src1->nb[1] + i12*src1->nb[2]);
+                    const float * x = (const float *)((const char *)data + i11*nb[1] + i12*nb[2]);
 
-                    for (int j = 0; j < (int)src1->ne[0]; ++j) {
+                    for (int j = 0; j < (int)ne[0]; ++j) {
                         e.values[e_start + j] += x[j]*x[j];
                         e.counts[e_start + j]++;
                     }
@@ -169,20 +270,20 @@ bool IMatrixCollector::collect_imatrix(struct ggml_tensor * t, bool ask, void *
     } else {
         auto& e = m_stats[wname];
         if (e.values.empty()) {
-            e.values.resize(src1->ne[0], 0);
-            e.counts.resize(src1->ne[0], 0);
+            e.values.resize(ne[0], 0);
+            e.counts.resize(ne[0], 0);
         }
-        else if (e.values.size() != (size_t)src1->ne[0]) {
-            fprintf(stderr, "Oops: inconsistent size for %s (%d vs %d)\n", wname.c_str(), (int)e.values.size(), (int)src1->ne[0]);
+        else if (e.values.size() != (size_t)ne[0]) {
+            fprintf(stderr, "Oops: inconsistent size for %s (%d vs %d)\n", wname.c_str(), (int)e.values.size(), (int)ne[0]);
             exit(1); //GGML_ASSERT(false);
         }
         ++e.ncall;
         if (m_params.verbosity > 1) {
-            printf("%s[%d]: %32s, %s, %5d x %5d, %d\n", __func__, m_last_call, wname.c_str(), ggml_op_name(t->op), (int)src1->ne[0], (int)src1->ne[1], (int)src1->type);
+            printf("%s[%d]: %32s, %s, %5d x %5d, %d\n", __func__, m_last_call, wname.c_str(), ggml_op_name(job.op), (int)ne[0], (int)ne[1], (int)job.type);
         }
-        for (int row = 0; row < (int)src1->ne[1]; ++row) {
-            const float * x = data + row * src1->ne[0];
-            for (int j = 0; j < (int)src1->ne[0]; ++j) {
+        for (int row = 0; row < (int)ne[1]; ++row) {
+            const float * x = data + row * ne[0];
+            for (int j = 0; j < (int)ne[0]; ++j) {
                 e.values[j] += x[j]*x[j];
                 e.counts[j]++;
             }
@@ -197,8 +298,6 @@ bool IMatrixCollector::collect_imatrix(struct ggml_tensor * t, bool ask, void *
             }
         }
     }
-
-    return true;
 }
 
 void IMatrixCollector::save_imatrix() const {
@@ -241,12 +340,26 @@ void IMatrixCollector::save_imatrix(const char * fname, const char * dataset) co
     out.write((const char *) &n_dataset, sizeof(n_dataset));
     out.write(dataset, n_dataset);
 
+    // Write the raw sums and counts, so that partial results can be merged exactly with --combine
+    // this is ignored by quantize, which stops reading after the dataset name
+    out.write("_counts_", 8);
+    out.write((const char *) &n_entries, sizeof(n_entries));
+    for (const auto & p : m_stats) {
+        int len = p.first.size();
+        out.write((const char *) &len, sizeof(len));
+        out.write(p.first.c_str(), len);
+        int nval = p.second.values.size();
+        out.write((const char *) &nval, sizeof(nval));
+        out.write((const char *) p.second.counts.data(), nval*sizeof(int64_t));
+        out.write((const char *) p.second.values.data(), nval*sizeof(float));
+    }
+
     if (m_params.verbosity > 0) {
         fprintf(stderr, "\n%s: stored collected data after %d chunks in %s\n", __func__, m_last_call, fname);
     }
 }
 
-bool IMatrixCollector::load_imatrix(const char * imatrix_file, std::unordered_map<std::string, Stats>& imatrix_data) {
+bool IMatrixCollector::load_imatrix(const char * imatrix_file, std::unordered_map<std::string, Stats>& imatrix_data, int * n_chunks) {
     std::ifstream in(imatrix_file, std::ios::binary);
     if (!in) {
         printf("%s: failed to open %s\n",__func__,imatrix_file);
@@ -258,6 +371,9 @@ bool IMatrixCollector::load_imatrix(const char * imatrix_file, std::unordered_ma
         printf("%s: no data in file %s\n", __func__, imatrix_file);
         return false;
     }
+
+    // the entries of this file, merged into imatrix_data once the file has been read completely
+    std::unordered_map<std::string, Stats> file_data;
     for (int i = 0; i < n_entries; ++i) {
         int len; in.read((char *)&len, sizeof(len));
         std::vector<char> name_as_vec(len+1);
@@ -268,38 +384,81 @@ bool IMatrixCollector::load_imatrix(const char * imatrix_file, std::unordered_ma
         }
         name_as_vec[len] = 0;
         std::string name{name_as_vec.data()};
-        auto& e = imatrix_data[std::move(name)];
+        auto& e = file_data[std::move(name)];
         int ncall;
         in.read((char*)&ncall, sizeof(ncall));
         int nval;
         in.read((char *)&nval, sizeof(nval));
         if (in.fail() || nval < 1) {
             printf("%s: failed reading number of values for entry %d\n",__func__,i);
-            imatrix_data = {};
             return false;
         }
 
-        // When re-called from load_imatrix() with add set, this will already be created.
-        if (e.values.empty()) {
-            e.values.resize(nval, 0);
-            e.counts.resize(nval, 0);
-        }
-
-        std::vector<float> tmp(nval);
-        in.read((char*)tmp.data(), nval*sizeof(float));
+        e.values.resize(nval);
+        in.read((char*)e.values.data(), nval*sizeof(float));
         if (in.fail()) {
             printf("%s: failed reading data for entry %d\n",__func__,i);
-            imatrix_data = {};
             return false;
         }
 
-        // Recreate the state as expected by save_imatrix(), and corerct for weighted sum.
-        for (int i = 0; i < nval; i++) {
-            e.values[i] += tmp[i];
-            e.counts[i] += ncall;
+        // Without the raw counts, recreate the state as expected by save_imatrix(), and correct for weighted sum.
+        e.counts.assign(nval, ncall);
+        e.ncall = ncall;
+    }
+
+    // the number of chunks and the dataset name
+    int last_call = 0;
+    if (in.peek() != EOF) {
+        in.read((char *)&last_call, sizeof(last_call));
+        int n_dataset = 0;
+        in.read((char *)&n_dataset, sizeof(n_dataset));
+        in.ignore(n_dataset);
+    }
+
+    // the raw sums and counts, if the file has them
+    char magic[8];
+    if (in.peek() != EOF && in.read(magic, sizeof(magic)) && memcmp(magic, "_counts_", sizeof(magic)) == 0) {
+        int n_counts = 0;
+        in.read((char *)&n_counts, sizeof(n_counts));
+        for (int i = 0; i < n_counts; ++i) {
+            int len; in.read((char *)&len, sizeof(len));
+            std::string name(std::max(len, 0), '\0');
+            in.read(&name[0], len);
+            int nval = 0;
+            in.read((char *)&nval, sizeof(nval));
+            auto it = file_data.find(name);
+            if (in.fail() || it == file_data.end() || nval != (int) it->second.values.size()) {
+                printf("%s: failed reading counts for entry %d from %s\n",__func__,i,imatrix_file);
+                return false;
+            }
+            in.read((char *)it->second.counts.data(), nval*sizeof(int64_t));
+            in.read((char *)it->second.values.data(), nval*sizeof(float));
+            if (in.fail()) {
+                printf("%s: failed reading counts for entry %d from %s\n",__func__,i,imatrix_file);
+                return false;
+            }
         }
-        e.ncall += ncall;
+    }
 
+    for (auto & p : file_data) {
+        auto & e = imatrix_data[p.first];
+        // When re-called from load_imatrix() with add set, this will already be created.
+        if (e.values.empty()) {
+            e.values.resize(p.second.values.size(), 0);
+            e.counts.resize(p.second.counts.size(), 0);
+        } else if (e.values.size() != p.second.values.size()) {
+            printf("%s: inconsistent size for %s (%d vs %d)\n",__func__,p.first.c_str(),(int)e.values.size(),(int)p.second.values.size());
+            imatrix_data = {};
+            return false;
+        }
+        for (size_t i = 0; i < e.values.size(); i++) {
+            e.values[i] += p.second.values[i];
+            e.counts[i] += p.second.counts[i];
+        }
+        e.ncall += p.second.ncall;
+    }
+    if (n_chunks) {
+        *n_chunks += last_call;
     }
     return true;
 }
@@ -307,8 +466,9 @@ bool IMatrixCollector::load_imatrix(const char * imatrix_file, std::unordered_ma
 bool IMatrixCollector::load_imatrix(const char * file_name, bool add) {
     if (!add) {
         m_stats.clear();
+        m_last_call = 0;
     }
-    return load_imatrix(file_name, m_stats);
+    return load_imatrix(file_name, m_stats, &m_last_call);
 }
 
 static IMatrixCollector g_collector;
@@ -671,6 +831,7 @@ int main(int argc, char ** argv) {
     }
 
     bool OK = compute_imatrix(ctx, params, compute_ppl, from_chunk);
+    g_collector.finish();
     if (!OK) {
         return 1;
     }
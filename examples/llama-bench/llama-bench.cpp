@@ -11,6 +11,7 @@
 #include <cstdlib>
 #include <iterator>
 #include <map>
+#include <memory>
 #include <numeric>
 #include <regex>
 #include <sstream>
@@ -172,11 +173,13 @@ struct cmd_params {
     std::vector<int> n_prompt;
     std::vector<int> n_gen;
     std::vector<std::pair<int, int>> n_pg;
+    std::vector<int> n_depth;
     std::vector<int> n_batch;
     std::vector<int> n_ubatch;
     std::vector<ggml_type> type_k;
     std::vector<ggml_type> type_v;
     std::vector<int> n_threads;
+    std::vector<int> poll;
     std::vector<int> n_gpu_layers;
     std::vector<llama_split_mode> split_mode;
     std::vector<int> main_gpu;
@@ -189,6 +192,8 @@ struct cmd_params {
     int reps;
     bool verbose;
     output_formats output_format;
+    std::string autotune;     // test to optimize (pp, tg or pg), empty = run every combination
+    std::string autotune_out; // file the best configuration is written to
 };
 
 static const cmd_params cmd_params_defaults = {
@@ -196,11 +201,13 @@ static const cmd_params cmd_params_defaults = {
     /* n_prompt      */ {512},
     /* n_gen         */ {128},
     /* n_pg          */ {{512, 128}},
+    /* n_depth       */ {0},
     /* n_batch       */ {2048},
     /* n_ubatch      */ {512},
     /* type_k        */ {GGML_TYPE_F16},
     /* type_v        */ {GGML_TYPE_F16},
     /* n_threads     */ {get_math_cpu_count()},
+    /* poll          */ {50},
     /* n_gpu_layers  */ {99},
     /* split_mode    */ {LLAMA_SPLIT_MODE_LAYER},
     /* main_gpu      */ {0},
@@ -212,7 +219,9 @@ static const cmd_params cmd_params_defaults = {
     /* numa          */ GGML_NUMA_STRATEGY_DISABLED,
     /* reps          */ 5,
     /* verbose       */ false,
-    /* output_format */ MARKDOWN
+    /* output_format */ MARKDOWN,
+    /* autotune      */ "",
+    /* autotune_out  */ "autotune.txt",
 };
 
 static void print_usage(int /* argc */, char ** argv) {
@@ -224,11 +233,13 @@ static void print_usage(int /* argc */, char ** argv) {
     printf("  -p, --n-prompt <n>                  (default: %s)\n", join(cmd_params_defaults.n_prompt, ",").c_str());
     printf("  -n, --n-gen <n>                     (default: %s)\n", join(cmd_params_defaults.n_gen, ",").c_str());
     printf("  -pg <pp,tg>                         (default: %s)\n", join(transform_to_str(cmd_params_defaults.n_pg, pair_str), ",").c_str());
+    printf("  -d, --depth <n>                     (default: %s)\n", join(cmd_params_defaults.n_depth, ",").c_str());
     printf("  -b, --batch-size <n>                (default: %s)\n", join(cmd_params_defaults.n_batch, ",").c_str());
     printf("  -ub, --ubatch-size <n>              (default: %s)\n", join(cmd_params_defaults.n_ubatch, ",").c_str());
     printf("  -ctk, --cache-type-k <t>            (default: %s)\n", join(transform_to_str(cmd_params_defaults.type_k, ggml_type_name), ",").c_str());
     printf("  -ctv, --cache-type-v <t>            (default: %s)\n", join(transform_to_str(cmd_params_defaults.type_v, ggml_type_name), ",").c_str());
     printf("  -t, --threads <n>                   (default: %s)\n", join(cmd_params_defaults.n_threads, ",").c_str());
+    printf("  --poll <0...100>                    (default: %s, -1 = no thread pool)\n", join(cmd_params_defaults.poll, ",").c_str());
     printf("  -ngl, --n-gpu-layers <n>            (default: %s)\n", join(cmd_params_defaults.n_gpu_layers, ",").c_str());
     printf("  -sm, --split-mode <none|layer|row>  (default: %s)\n", join(transform_to_str(cmd_params_defaults.split_mode, split_mode_str), ",").c_str());
     printf("  -mg, --main-gpu <i>                 (default: %s)\n", join(cmd_params_defaults.main_gpu, ",").c_str());
@@ -241,8 +252,12 @@ static void print_usage(int /* argc */, char ** argv) {
     printf("  -r, --repetitions <n>               (default: %d)\n", cmd_params_defaults.reps);
     printf("  -o, --output <csv|json|md|sql>      (default: %s)\n", output_format_str(cmd_params_defaults.output_format));
     printf("  -v, --verbose                       (default: %s)\n", cmd_params_defaults.verbose ? "1" : "0");
+    printf("  --autotune <pp|tg|pg>               (default: disabled)\n");
+    printf("  --autotune-out <filename>           (default: %s)\n", cmd_params_defaults.autotune_out.c_str());
     printf("\n");
     printf("Multiple values can be given for each parameter by separating them with ',' or by specifying the parameter multiple times.\n");
+    printf("With --autotune, the values are searched for the fastest configuration of the first pp, tg or pg test (at the first depth) instead of being\n");
+    printf("run in every combination, and the best one is written to the --autotune-out file for main and server --args-file.\n");
 }
 
 static ggml_type ggml_type_from_name(const std::string & s) {
@@ -282,6 +297,8 @@ static cmd_params parse_cmd_params(int argc, char ** argv) {
     params.verbose = cmd_params_defaults.verbose;
     params.output_format = cmd_params_defaults.output_format;
     params.reps = cmd_params_defaults.reps;
+    params.autotune = cmd_params_defaults.autotune;
+    params.autotune_out = cmd_params_defaults.autotune_out;
 
     for (int i = 1; i < argc; i++) {
         arg = argv[i];
@@ -324,6 +341,13 @@ static cmd_params parse_cmd_params(int argc, char ** argv) {
                 break;
             }
             params.n_pg.push_back({std::stoi(p[0]), std::stoi(p[1])});
+        } else if (arg == "-d" || arg == "--depth") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            auto p = split<int>(argv[i], split_delim);
+            params.n_depth.insert(params.n_depth.end(), p.begin(), p.end());
         } else if (arg == "-b" || arg == "--batch-size") {
             if (++i >= argc) {
                 invalid_param = true;
@@ -377,6 +401,13 @@ static cmd_params parse_cmd_params(int argc, char ** argv) {
             }
             auto p = split<int>(argv[i], split_delim);
             params.n_threads.insert(params.n_threads.end(), p.begin(), p.end());
+        } else if (arg == "--poll") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            auto p = split<int>(argv[i], split_delim);
+            params.poll.insert(params.poll.end(), p.begin(), p.end());
         } else if (arg == "-ngl" || arg == "--n-gpu-layers") {
             if (++i >= argc) {
                 invalid_param = true;
@@ -498,6 +529,22 @@ static cmd_params parse_cmd_params(int argc, char ** argv) {
             }
         } else if (arg == "-v" || arg == "--verbose") {
             params.verbose = true;
+        } else if (arg == "--autotune") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            params.autotune = argv[i];
+            if (params.autotune != "pp" && params.autotune != "tg" && params.autotune != "pg") {
+                invalid_param = true;
+                break;
+            }
+        } else if (arg == "--autotune-out") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            params.autotune_out = argv[i];
         } else {
             invalid_param = true;
             break;
@@ -514,6 +561,7 @@ static cmd_params parse_cmd_params(int argc, char ** argv) {
     if (params.n_prompt.empty())     { params.n_prompt = cmd_params_defaults.n_prompt; }
     if (params.n_gen.empty())        { params.n_gen = cmd_params_defaults.n_gen; }
     if (params.n_pg.empty())         { params.n_pg = cmd_params_defaults.n_pg; }
+    if (params.n_depth.empty())      { params.n_depth = cmd_params_defaults.n_depth; }
     if (params.n_batch.empty())      { params.n_batch = cmd_params_defaults.n_batch; }
     if (params.n_ubatch.empty())     { params.n_ubatch = cmd_params_defaults.n_ubatch; }
     if (params.type_k.empty())       { params.type_k = cmd_params_defaults.type_k; }
@@ -527,6 +575,7 @@ static cmd_params parse_cmd_params(int argc, char ** argv) {
     if (params.use_mmap.empty())     { params.use_mmap = cmd_params_defaults.use_mmap; }
     if (params.embeddings.empty())   { params.embeddings = cmd_params_defaults.embeddings; }
     if (params.n_threads.empty())    { params.n_threads = cmd_params_defaults.n_threads; }
+    if (params.poll.empty())         { params.poll = cmd_params_defaults.poll; }
 
     return params;
 }
@@ -535,11 +584,13 @@ struct cmd_params_instance {
     std::string model;
     int n_prompt;
     int n_gen;
+    int n_depth;
     int n_batch;
     int n_ubatch;
     ggml_type type_k;
     ggml_type type_v;
     int n_threads;
+    int poll;
     int n_gpu_layers;
     llama_split_mode split_mode;
     int main_gpu;
@@ -573,7 +624,7 @@ struct cmd_params_instance {
     llama_context_params to_llama_cparams() const {
         llama_context_params cparams = llama_context_default_params();
 
-        cparams.n_ctx = n_prompt + n_gen;
+        cparams.n_ctx = n_depth + n_prompt + n_gen;
         cparams.n_batch = n_batch;
         cparams.n_ubatch = n_ubatch;
         cparams.type_k = type_k;
@@ -581,6 +632,9 @@ struct cmd_params_instance {
         cparams.offload_kqv = !no_kv_offload;
         cparams.flash_attn = flash_attn;
         cparams.embeddings = embeddings;
+        cparams.n_threads = n_threads;
+        cparams.n_threads_batch = n_threads;
+        cparams.poll = poll;
 
         return cparams;
     }
@@ -603,7 +657,9 @@ static std::vector<cmd_params_instance> get_cmd_params_instances(const cmd_param
     for (const auto & tv : params.type_v)
     for (const auto & nkvo : params.no_kv_offload)
     for (const auto & fa : params.flash_attn)
-    for (const auto & nt : params.n_threads) {
+    for (const auto & nt : params.n_threads)
+    for (const auto & pl : params.poll)
+    for (const auto & nd : params.n_depth) {
         for (const auto & n_prompt : params.n_prompt) {
             if (n_prompt == 0) {
                 continue;
@@ -612,11 +668,13 @@ static std::vector<cmd_params_instance> get_cmd_params_instances(const cmd_param
                 /* .model        = */ m,
                 /* .n_prompt     = */ n_prompt,
                 /* .n_gen        = */ 0,
+                /* .n_depth      = */ nd,
                 /* .n_batch      = */ nb,
                 /* .n_ubatch     = */ nub,
                 /* .type_k       = */ tk,
                 /* .type_v       = */ tv,
                 /* .n_threads    = */ nt,
+                /* .poll         = */ pl,
                 /* .n_gpu_layers = */ nl,
                 /* .split_mode   = */ sm,
                 /* .main_gpu     = */ mg,
@@ -637,11 +695,13 @@ static std::vector<cmd_params_instance> get_cmd_params_instances(const cmd_param
                 /* .model        = */ m,
                 /* .n_prompt     = */ 0,
                 /* .n_gen        = */ n_gen,
+                /* .n_depth      = */ nd,
                 /* .n_batch      = */ nb,
                 /* .n_ubatch     = */ nub,
                 /* .type_k       = */ tk,
                 /* .type_v       = */ tv,
                 /* .n_threads    = */ nt,
+                /* .poll         = */ pl,
                 /* .n_gpu_layers = */ nl,
                 /* .split_mode   = */ sm,
                 /* .main_gpu     = */ mg,
@@ -662,11 +722,13 @@ static std::vector<cmd_params_instance> get_cmd_params_instances(const cmd_param
                 /* .model        = */ m,
                 /* .n_prompt     = */ n_pg.first,
                 /* .n_gen        = */ n_pg.second,
+                /* .n_depth      = */ nd,
                 /* .n_batch      = */ nb,
                 /* .n_ubatch     = */ nub,
                 /* .type_k       = */ tk,
                 /* .type_v       = */ tv,
                 /* .n_threads    = */ nt,
+                /* .poll         = */ pl,
                 /* .n_gpu_layers = */ nl,
                 /* .split_mode   = */ sm,
                 /* .main_gpu     = */ mg,
@@ -703,6 +765,7 @@ struct test {
     int n_batch;
     int n_ubatch;
     int n_threads;
+    int poll;
     ggml_type type_k;
     ggml_type type_v;
     int n_gpu_layers;
@@ -715,6 +778,7 @@ struct test {
     bool embeddings;
     int n_prompt;
     int n_gen;
+    int n_depth;
     std::string test_time;
     std::vector<uint64_t> samples_ns;
 
@@ -728,6 +792,7 @@ struct test {
         n_batch = inst.n_batch;
         n_ubatch = inst.n_ubatch;
         n_threads = inst.n_threads;
+        poll = inst.poll;
         type_k = inst.type_k;
         type_v = inst.type_v;
         n_gpu_layers = inst.n_gpu_layers;
@@ -740,6 +805,7 @@ struct test {
         embeddings = inst.embeddings;
         n_prompt = inst.n_prompt;
         n_gen = inst.n_gen;
+        n_depth = inst.n_depth;
         // RFC 3339 date-time format
         time_t t = time(NULL);
         std::strftime(buf, sizeof(buf), "%FT%TZ", gmtime(&t));
@@ -807,11 +873,11 @@ struct test {
             "cpu_info", "gpu_info",
             "model_filename", "model_type", "model_size", "model_n_params",
             "n_batch", "n_ubatch",
-            "n_threads", "type_k", "type_v",
+            "n_threads", "poll", "type_k", "type_v",
             "n_gpu_layers", "split_mode",
             "main_gpu", "no_kv_offload", "flash_attn",
             "tensor_split", "use_mmap", "embeddings",
-            "n_prompt", "n_gen", "test_time",
+            "n_prompt", "n_gen", "n_depth", "test_time",
             "avg_ns", "stddev_ns",
             "avg_ts", "stddev_ts"
         };
@@ -822,10 +888,10 @@ struct test {
 
     static field_type get_field_type(const std::string & field) {
         if (field == "build_number" || field == "n_batch" || field == "n_ubatch" ||
-            field == "n_threads" ||
+            field == "n_threads" || field == "poll" ||
             field == "model_size" || field == "model_n_params" ||
             field == "n_gpu_layers" || field == "main_gpu" ||
-            field == "n_prompt" || field == "n_gen" ||
+            field == "n_prompt" || field == "n_gen" || field == "n_depth" ||
             field == "avg_ns" || field == "stddev_ns") {
             return INT;
         }
@@ -863,11 +929,11 @@ struct test {
             cpu_info, gpu_info,
             model_filename, model_type, std::to_string(model_size), std::to_string(model_n_params),
             std::to_string(n_batch), std::to_string(n_ubatch),
-            std::to_string(n_threads), ggml_type_name(type_k), ggml_type_name(type_v),
+            std::to_string(n_threads), std::to_string(poll), ggml_type_name(type_k), ggml_type_name(type_v),
             std::to_string(n_gpu_layers), split_mode_str(split_mode),
             std::to_string(main_gpu), std::to_string(no_kv_offload), std::to_string(flash_attn),
             tensor_split_str, std::to_string(use_mmap), std::to_string(embeddings),
-            std::to_string(n_prompt), std::to_string(n_gen), test_time,
+            std::to_string(n_prompt), std::to_string(n_gen), std::to_string(n_depth), test_time,
             std::to_string(avg_ns()), std::to_string(stdev_ns()),
             std::to_string(avg_ts()), std::to_string(stdev_ts())
         };
@@ -997,8 +1063,9 @@ struct json_printer : public printer {
 
 struct markdown_printer : public printer {
     std::vector<std::string> fields;
+    bool depth = false; // the test names have a depth label
 
-    static int get_field_width(const std::string & field) {
+    int get_field_width(const std::string & field) const {
         if (field == "model") {
             return -30;
         }
@@ -1012,7 +1079,7 @@ struct markdown_printer : public printer {
             return 3;
         }
         if (field == "test") {
-            return 13;
+            return depth ? 20 : 13;
         }
 
         int width = std::max((int)field.length(), 10);
@@ -1064,6 +1131,9 @@ struct markdown_printer : public printer {
         if (params.n_threads.size() > 1 || params.n_threads != cmd_params_defaults.n_threads || is_cpu_backend) {
             fields.emplace_back("n_threads");
         }
+        if (params.poll.size() > 1 || params.poll != cmd_params_defaults.poll) {
+            fields.emplace_back("poll");
+        }
         if (params.n_batch.size() > 1 || params.n_batch != cmd_params_defaults.n_batch) {
             fields.emplace_back("n_batch");
         }
@@ -1100,6 +1170,8 @@ struct markdown_printer : public printer {
         fields.emplace_back("test");
         fields.emplace_back("t/s");
 
+        depth = std::any_of(params.n_depth.begin(), params.n_depth.end(), [](int nd) { return nd > 0; });
+
         fprintf(fout, "|");
         for (const auto & field : fields) {
             fprintf(fout, " %*s |", get_field_width(field), get_field_display_name(field).c_str());
@@ -1147,6 +1219,10 @@ struct markdown_printer : public printer {
                     snprintf(buf, sizeof(buf), "pp%d+tg%d", t.n_prompt, t.n_gen);
                 }
                 value = buf;
+                if (t.n_depth > 0) {
+                    snprintf(buf, sizeof(buf), " @ d%d", t.n_depth);
+                    value += buf;
+                }
             } else if (field == "t/s") {
                 snprintf(buf, sizeof(buf), "%.2f ± %.2f", t.avg_ts(), t.stdev_ts());
                 value = buf;
@@ -1222,7 +1298,7 @@ static void test_prompt(llama_context * ctx, int n_prompt, int n_past, int n_bat
 
     while (n_processed < n_prompt) {
         int n_tokens = std::min(n_prompt - n_processed, n_batch);
-        tokens[0] = n_processed == 0 && llama_add_bos_token(model) ? llama_token_bos(model) : std::rand() % n_vocab;
+        tokens[0] = n_past + n_processed == 0 && llama_add_bos_token(model) ? llama_token_bos(model) : std::rand() % n_vocab;
         for (int i = 1; i < n_tokens; i++) {
             tokens[i] = std::rand() % n_vocab;
         }
@@ -1248,6 +1324,215 @@ static void test_gen(llama_context * ctx, int n_gen, int n_past, int n_threads)
     }
 }
 
+// adds reps samples to t, after a warmup run
+static void run_test(llama_context * ctx, test & t, int reps) {
+    llama_kv_cache_clear(ctx);
+
+    // fill the KV cache up to the depth once, and restore it before every run instead of processing it again
+    std::vector<uint8_t> depth_state;
+    if (t.n_depth > 0) {
+        test_prompt(ctx, t.n_depth, 0, t.n_batch, t.n_threads);
+        depth_state.resize(llama_state_seq_get_size(ctx, 0));
+        depth_state.resize(llama_state_seq_get_data(ctx, depth_state.data(), 0));
+    }
+    auto reset_kv = [&]() {
+        llama_kv_cache_clear(ctx);
+        if (t.n_depth > 0 && llama_state_seq_set_data(ctx, depth_state.data(), 0) == 0) {
+            // the state could not be restored, process the depth again
+            llama_kv_cache_clear(ctx);
+            test_prompt(ctx, t.n_depth, 0, t.n_batch, t.n_threads);
+        }
+    };
+
+    // warmup run
+    if (t.n_prompt > 0) {
+        //test_prompt(ctx, std::min(t.n_batch, std::min(t.n_prompt, 32)), 0, t.n_batch, t.n_threads);
+        reset_kv();
+        test_prompt(ctx, t.n_prompt, t.n_depth, t.n_batch, t.n_threads);
+    }
+    if (t.n_gen > 0) {
+        reset_kv();
+        test_gen(ctx, 1, t.n_depth, t.n_threads);
+    }
+
+    for (int i = 0; i < reps; i++) {
+        reset_kv();
+
+        uint64_t t_start = get_time_ns();
+
+        if (t.n_prompt > 0) {
+            test_prompt(ctx, t.n_prompt, t.n_depth, t.n_batch, t.n_threads);
+        }
+        if (t.n_gen > 0) {
+            test_gen(ctx, t.n_gen, t.n_depth + t.n_prompt, t.n_threads);
+        }
+
+        uint64_t t_ns = get_time_ns() - t_start;
+        t.samples_ns.push_back(t_ns);
+    }
+}
+
+// the configuration of t as the options of main and server, with their value if any
+static std::vector<std::pair<std::string, std::string>> autotune_args(const test & t) {
+    std::vector<std::pair<std::string, std::string>> args = {
+        { "-m",     t.model_filename },
+        { "-t",     std::to_string(t.n_threads) },
+        { "-tb",    std::to_string(t.n_threads) },
+        { "--poll", std::to_string(t.poll) },
+        { "-b",     std::to_string(t.n_batch) },
+        { "-ub",    std::to_string(t.n_ubatch) },
+        { "-ctk",   ggml_type_name(t.type_k) },
+        { "-ctv",   ggml_type_name(t.type_v) },
+    };
+    if (llama_supports_gpu_offload()) {
+        args.push_back({ "-ngl", std::to_string(t.n_gpu_layers) });
+        args.push_back({ "-sm",  split_mode_str(t.split_mode) });
+        args.push_back({ "-mg",  std::to_string(t.main_gpu) });
+        if (std::any_of(t.tensor_split.begin(), t.tensor_split.end(), [](float ts) { return ts > 0.0f; })) {
+            args.push_back({ "-ts", join(t.tensor_split, ",") });
+        }
+    }
+    if (t.flash_attn) {
+        args.push_back({ "-fa", "" });
+    }
+    if (t.no_kv_offload) {
+        args.push_back({ "-nkvo", "" });
+    }
+    if (!t.use_mmap) {
+        args.push_back({ "--no-mmap", "" });
+    }
+    return args;
+}
+
+// search the values of params for the fastest configuration of the target test by successive halving:
+// each round runs the remaining candidates with twice the repetitions of the previous one and keeps the faster half
+static int autotune(const cmd_params & params, printer & p) {
+    if (params.model.size() > 1) {
+        fprintf(stderr, "%s: error: only one model can be tuned at a time\n", __func__);
+        return 1;
+    }
+
+    cmd_params tune_params = params;
+    tune_params.n_prompt = {0};
+    tune_params.n_gen    = {0};
+    tune_params.n_pg     = {{0, 0}};
+    tune_params.n_depth  = {params.n_depth[0]};
+    if (params.autotune == "pp") {
+        tune_params.n_prompt = {params.n_prompt[0]};
+    } else if (params.autotune == "tg") {
+        tune_params.n_gen = {params.n_gen[0]};
+    } else {
+        tune_params.n_pg = {params.n_pg[0]};
+    }
+
+    const std::vector<cmd_params_instance> candidates = get_cmd_params_instances(tune_params);
+    if (candidates.empty()) {
+        fprintf(stderr, "%s: error: the %s test to tune has no tokens\n", __func__, params.autotune.c_str());
+        return 1;
+    }
+
+    std::vector<std::unique_ptr<test>> results(candidates.size());
+    std::vector<int> rounds(candidates.size(), 0); // number of rounds each candidate took part in
+
+    llama_model * lmodel = nullptr;
+    const cmd_params_instance * prev_inst = nullptr;
+
+    auto run = [&](size_t c, int reps) {
+        const cmd_params_instance & inst = candidates[c];
+        // keep the same model between tests when possible
+        if (!lmodel || !prev_inst || !inst.equal_mparams(*prev_inst)) {
+            if (lmodel) {
+                llama_free_model(lmodel);
+            }
+
+            lmodel = llama_load_model_from_file(inst.model.c_str(), inst.to_llama_mparams());
+            if (lmodel == NULL) {
+                fprintf(stderr, "%s: error: failed to load model '%s'\n", __func__, inst.model.c_str());
+                return false;
+            }
+            prev_inst = &inst;
+        }
+
+        llama_context * ctx = llama_new_context_with_model(lmodel, inst.to_llama_cparams());
+        if (ctx == NULL) {
+            fprintf(stderr, "%s: error: failed to create context with model '%s'\n", __func__, inst.model.c_str());
+            return false;
+        }
+        if (!results[c]) {
+            results[c].reset(new test(inst, lmodel, ctx));
+        }
+        run_test(ctx, *results[c], reps);
+        rounds[c]++;
+
+        llama_free(ctx);
+        return true;
+    };
+
+    std::vector<size_t> alive(candidates.size());
+    std::iota(alive.begin(), alive.end(), 0);
+
+    auto faster = [&](size_t a, size_t b) { return results[a]->avg_ts() > results[b]->avg_ts(); };
+
+    int reps = 1;
+    for (int round = 1; alive.size() > 1; round++, reps *= 2) {
+        fprintf(stderr, "%s: round %d: %zu candidates, %d repetitions each\n", __func__, round, alive.size(), reps);
+        for (size_t c : alive) {
+            if (!run(c, reps)) {
+                llama_free_model(lmodel);
+                return 1;
+            }
+        }
+
+        // keep the faster half, in the original order to reload the models as little as possible
+        std::stable_sort(alive.begin(), alive.end(), faster);
+        alive.resize((alive.size() + 1)/2);
+        std::sort(alive.begin(), alive.end());
+    }
+
+    // measure the best candidate with at least the requested repetitions
+    const size_t best = alive[0];
+    const int n_done = results[best] ? (int) results[best]->samples_ns.size() : 0;
+    if (n_done < params.reps && !run(best, params.reps - n_done)) {
+        llama_free_model(lmodel);
+        return 1;
+    }
+    llama_free_model(lmodel);
+
+    // the candidates from the best, those that lasted more rounds first
+    std::vector<size_t> order(candidates.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        return rounds[a] != rounds[b] ? rounds[a] > rounds[b] : faster(a, b);
+    });
+    std::stable_partition(order.begin(), order.end(), [best](size_t c) { return c == best; });
+    for (size_t c : order) {
+        p.print_test(*results[c]);
+    }
+
+    const test & t = *results[best];
+    FILE * f = fopen(params.autotune_out.c_str(), "w");
+    if (f == NULL) {
+        fprintf(stderr, "%s: error: failed to open '%s'\n", __func__, params.autotune_out.c_str());
+        return 1;
+    }
+    fprintf(f, "# llama-bench --autotune %s -d %d: %.2f t/s, build %s (%d)\n", params.autotune.c_str(), t.n_depth, t.avg_ts(), test::build_commit.c_str(), test::build_number);
+    fprintf(f, "# %s, %s%s%s\n", t.model_type.c_str(), test::cpu_info.c_str(), test::gpu_info.empty() ? "" : ", ", test::gpu_info.c_str());
+    for (const auto & arg : autotune_args(t)) {
+        if (arg.second.empty()) {
+            fprintf(f, "%s\n", arg.first.c_str());
+        } else if (arg.second.find_first_of(" \t#") != std::string::npos) {
+            fprintf(f, "%s \"%s\"\n", arg.first.c_str(), arg.second.c_str());
+        } else {
+            fprintf(f, "%s %s\n", arg.first.c_str(), arg.second.c_str());
+        }
+    }
+    fclose(f);
+
+    fprintf(stderr, "%s: best configuration: %.2f t/s, written to %s\n", __func__, t.avg_ts(), params.autotune_out.c_str());
+
+    return 0;
+}
+
 static void llama_null_log_callback(enum ggml_log_level level, const char * text, void * user_data) {
     (void) level;
     (void) text;
@@ -1301,6 +1586,13 @@ int main(int argc, char ** argv) {
     p->fout = stdout;
     p->print_header(params);
 
+    if (!params.autotune.empty()) {
+        const int ret = autotune(params, *p);
+        p->print_footer();
+        llama_backend_free();
+        return ret;
+    }
+
     std::vector<cmd_params_instance> params_instances = get_cmd_params_instances(params);
 
     llama_model * lmodel = nullptr;
@@ -1330,32 +1622,7 @@ int main(int argc, char ** argv) {
 
         test t(inst, lmodel, ctx);
 
-        llama_kv_cache_clear(ctx);
-
-        // warmup run
-        if (t.n_prompt > 0) {
-            //test_prompt(ctx, std::min(t.n_batch, std::min(t.n_prompt, 32)), 0, t.n_batch, t.n_threads);
-            test_prompt(ctx, t.n_prompt, 0, t.n_batch, t.n_threads);
-        }
-        if (t.n_gen > 0) {
-            test_gen(ctx, 1, 0, t.n_threads);
-        }
-
-        for (int i = 0; i < params.reps; i++) {
-            llama_kv_cache_clear(ctx);
-
-            uint64_t t_start = get_time_ns();
-
-            if (t.n_prompt > 0) {
-                test_prompt(ctx, t.n_prompt, 0, t.n_batch, t.n_threads);
-            }
-            if (t.n_gen > 0) {
-                test_gen(ctx, t.n_gen, t.n_prompt, t.n_threads);
-            }
-
-            uint64_t t_ns = get_time_ns() - t_start;
-            t.samples_ns.push_back(t_ns);
-        }
+        run_test(ctx, t, params.reps);
 
         p->print_test(t);
 
@@ -12,6 +12,7 @@
 #include <vector>
 #include <array>
 #include <fstream>
+#include <future>
 #include <sstream>
 
 #if defined(_MSC_VER)
@@ -543,6 +544,10 @@ static results_perplexity perplexity(llama_context * ctx, const gpt_params & par
 
     std::vector<std::thread> workers(std::thread::hardware_concurrency() - 1);
 
+    // the logits of a chunk are processed in the background while the next chunk is decoded
+    std::future<void> job;
+    std::vector<float> chunk_logits;
+
     std::vector<uint16_t> log_probs;
     if (!params.logits_file.empty()) {
         logits_stream.write((const char *)&n_vocab, sizeof(n_vocab));
@@ -613,6 +618,9 @@ static results_perplexity perplexity(llama_context * ctx, const gpt_params & par
 
             if (llama_decode(ctx, batch)) {
                 fprintf(stderr, "%s : failed to eval\n", __func__);
+                if (job.valid()) {
+                    job.wait();
+                }
                 return {tokens, -1, logit_history, prob_history};
             }
 
@@ -636,37 +644,52 @@ static results_perplexity perplexity(llama_context * ctx, const gpt_params & par
             fprintf(stderr, "%.2f minutes\n", total_seconds / 60.0);
         }
 
-        for (int seq = 0; seq < n_seq_batch; seq++) {
-            const float * all_logits = num_batches > 1 ? logits.data() : llama_get_logits_ith(ctx, seq*n_ctx + first);
-
-            llama_token * tokens_data = tokens.data() + start + seq*n_ctx + first;
-            if (!params.logits_file.empty()) {
-                process_logits(logits_stream, n_vocab, all_logits,
-                        tokens_data, n_ctx - 1 - first,
-                        workers, log_probs, nll, nll2);
-            } else {
-                process_logits(n_vocab, all_logits,
-                        tokens_data, n_ctx - 1 - first,
-                        workers, nll, nll2,
-                        logit_history.data() + start + seq*n_ctx + first,
-                        prob_history.data()  + start + seq*n_ctx + first);
-            }
-            count += n_ctx - first - 1;
-
-            // perplexity is e^(average negative log-likelihood)
-            if (params.ppl_output_type == 0) {
-                printf("[%d]%.4lf,", i + seq + 1, std::exp(nll / count));
-            } else {
-                double av = nll/count;
-                double av2 = nll2/count - av*av;
-                if (av2 > 0) av2 = sqrt(av2/(count-1));
-                printf("%8d  %.4lf  %4lf  %4lf\n", i*n_ctx, std::exp(nll / count), av, av2);
-            }
+        // wait for the previous chunk before taking over its buffer
+        if (job.valid()) {
+            job.get();
         }
-        fflush(stdout);
+
+        // the outputs of each sequence are the n_ctx - first last positions of its chunk
+        const size_t n_seq_logits = size_t(n_ctx - first) * n_vocab;
+        const float * all_logits = num_batches > 1 ? logits.data() : llama_get_logits_ith(ctx, first);
+        chunk_logits.assign(all_logits, all_logits + n_seq_batch*n_seq_logits);
+
+        job = std::async(std::launch::async, [&, i, start, n_seq_batch, n_seq_logits]() {
+            for (int seq = 0; seq < n_seq_batch; seq++) {
+                const float * seq_logits = chunk_logits.data() + seq*n_seq_logits;
+
+                llama_token * tokens_data = tokens.data() + start + seq*n_ctx + first;
+                if (!params.logits_file.empty()) {
+                    process_logits(logits_stream, n_vocab, seq_logits,
+                            tokens_data, n_ctx - 1 - first,
+                            workers, log_probs, nll, nll2);
+                } else {
+                    process_logits(n_vocab, seq_logits,
+                            tokens_data, n_ctx - 1 - first,
+                            workers, nll, nll2,
+                            logit_history.data() + start + seq*n_ctx + first,
+                            prob_history.data()  + start + seq*n_ctx + first);
+                }
+                count += n_ctx - first - 1;
+
+                // perplexity is e^(average negative log-likelihood)
+                if (params.ppl_output_type == 0) {
+                    printf("[%d]%.4lf,", i + seq + 1, std::exp(nll / count));
+                } else {
+                    double av = nll/count;
+                    double av2 = nll2/count - av*av;
+                    if (av2 > 0) av2 = sqrt(av2/(count-1));
+                    printf("%8d  %.4lf  %4lf  %4lf\n", i*n_ctx, std::exp(nll / count), av, av2);
+                }
+            }
+            fflush(stdout);
+        });
 
         logits.clear();
     }
+    if (job.valid()) {
+        job.get();
+    }
     printf("\n");
 
     nll2 /= count;
@@ -1736,7 +1759,13 @@ static void kl_divergence(llama_context * ctx, const gpt_params & params) {
     const bool add_bos = llama_should_add_bos_token(llama_get_model(ctx));
     GGML_ASSERT(llama_add_eos_token(llama_get_model(ctx)) != 1);
 
-    std::vector<uint16_t> log_probs_uint16(size_t(n_ctx - 1 - n_ctx/2) * nv);
+    // the log-probs of the base model are read one chunk ahead into one of two buffers
+    std::vector<uint16_t> log_probs_uint16[2];
+    log_probs_uint16[0].resize(size_t(n_ctx - 1 - n_ctx/2) * nv);
+    log_probs_uint16[1].resize(size_t(n_ctx - 1 - n_ctx/2) * nv);
+    auto read_log_probs = [&in](std::vector<uint16_t> & buf) {
+        return !in.read((char *)buf.data(), buf.size()*sizeof(uint16_t)).fail();
+    };
     std::vector<float>    kld_values(size_t(n_ctx - 1 - n_ctx/2)*n_chunk);
     std::vector<float> p_diff_values(size_t(n_ctx - 1 - n_ctx/2)*n_chunk);
     std::vector<float> logits;
@@ -1768,17 +1797,26 @@ static void kl_divergence(llama_context * ctx, const gpt_params & params) {
     auto    kld_ptr =    kld_values.data();
     auto p_diff_ptr = p_diff_values.data();
 
+    // the logits of a chunk are processed in the background while the next chunk is decoded
+    std::future<bool> read_job = std::async(std::launch::async, read_log_probs, std::ref(log_probs_uint16[0]));
+    std::future<void> job;
+    std::vector<float> chunk_logits;
+
+    auto wait_jobs = [&]() {
+        if (read_job.valid()) {
+            read_job.wait();
+        }
+        if (job.valid()) {
+            job.wait();
+        }
+    };
+
     for (int i = 0; i < n_chunk; ++i) {
         const int start =     i * n_ctx;
         const int end   = start + n_ctx;
 
         const auto t_start = std::chrono::high_resolution_clock::now();
 
-        if (in.read((char *)log_probs_uint16.data(), log_probs_uint16.size()*sizeof(uint16_t)).fail()) {
-            fprintf(stderr, "%s: failed reading log-probs for chunk %d\n", __func__, i);
-            return;
-        }
-
         // clear the KV cache
         llama_kv_cache_clear(ctx);
 
@@ -1797,6 +1835,7 @@ static void kl_divergence(llama_context * ctx, const gpt_params & params) {
             // TODO: use llama_batch.logits instead of relying on logits_all == true
             if (llama_decode(ctx, llama_batch_get_one(tokens.data() + batch_start, batch_size, j * n_batch, 0))) {
                 fprintf(stderr, "%s : failed to eval\n", __func__);
+                wait_jobs();
                 return;
             }
 
@@ -1824,44 +1863,61 @@ static void kl_divergence(llama_context * ctx, const gpt_params & params) {
             printf("\nchunk             PPL               ln(PPL(Q)/PPL(base))          KL Divergence              Δp RMS            Same top p\n");
         }
 
+        // wait for the previous chunk before taking over its buffers
+        if (job.valid()) {
+            job.get();
+        }
+        if (!read_job.get()) {
+            fprintf(stderr, "%s: failed reading log-probs for chunk %d\n", __func__, i);
+            return;
+        }
+        if (i + 1 < n_chunk) {
+            read_job = std::async(std::launch::async, read_log_probs, std::ref(log_probs_uint16[(i + 1) % 2]));
+        }
+
         const int first = n_ctx/2;
         const float * all_logits = num_batches > 1 ? logits.data() : llama_get_logits(ctx);
-        process_logits(n_vocab, all_logits + first*n_vocab, tokens.data() + start + first, n_ctx - 1 - first,
-                workers, log_probs_uint16, kld, kld_ptr, p_diff_ptr);
-        p_diff_ptr += n_ctx - 1 - first;
-        kld_ptr    += n_ctx - 1 - first;
+        chunk_logits.assign(all_logits + first*n_vocab, all_logits + (n_ctx - 1)*n_vocab);
 
-        printf("%4d", i+1);
+        job = std::async(std::launch::async, [&, i, start, first]() {
+            process_logits(n_vocab, chunk_logits.data(), tokens.data() + start + first, n_ctx - 1 - first,
+                    workers, log_probs_uint16[i % 2], kld, kld_ptr, p_diff_ptr);
+            p_diff_ptr += n_ctx - 1 - first;
+            kld_ptr    += n_ctx - 1 - first;
 
-        auto log_ppl = mean_and_uncertainty(kld.sum_nll, kld.sum_nll2, kld.count);
-        const double ppl_val = exp(log_ppl.first);
-        const double ppl_unc = ppl_val * log_ppl.second; // ppl_unc = sqrt( (dexp(x) / dx) ** 2 * log_ppl.second ** 2 )
-        printf("    %9.4lf ± %9.4lf", ppl_val, ppl_unc);
+            printf("%4d", i+1);
 
-        auto log_ppl_base = mean_and_uncertainty(kld.sum_nll_base, kld.sum_nll_base2, kld.count);
-        const double log_ppl_cov = covariance(kld.sum_nll, kld.sum_nll_base, kld.sum_nll_nll_base, kld.count);
-        const double log_ppl_ratio_val = log_ppl.first - log_ppl_base.first;
-        const double log_ppl_ratio_unc = sqrt(log_ppl.second*log_ppl.second + log_ppl_base.second*log_ppl_base.second - 2.0*log_ppl_cov);
-        printf("    %10.5lf ± %10.5lf", log_ppl_ratio_val, log_ppl_ratio_unc);
+            auto log_ppl = mean_and_uncertainty(kld.sum_nll, kld.sum_nll2, kld.count);
+            const double ppl_val = exp(log_ppl.first);
+            const double ppl_unc = ppl_val * log_ppl.second; // ppl_unc = sqrt( (dexp(x) / dx) ** 2 * log_ppl.second ** 2 )
+            printf("    %9.4lf ± %9.4lf", ppl_val, ppl_unc);
 
-        auto kl_div = mean_and_uncertainty(kld.sum_kld, kld.sum_kld2, kld.count);
-        printf("    %10.5lf ± %10.5lf", kl_div.first, kl_div.second);
+            auto log_ppl_base = mean_and_uncertainty(kld.sum_nll_base, kld.sum_nll_base2, kld.count);
+            const double log_ppl_cov = covariance(kld.sum_nll, kld.sum_nll_base, kld.sum_nll_nll_base, kld.count);
+            const double log_ppl_ratio_val = log_ppl.first - log_ppl_base.first;
+            const double log_ppl_ratio_unc = sqrt(log_ppl.second*log_ppl.second + log_ppl_base.second*log_ppl_base.second - 2.0*log_ppl_cov);
+            printf("    %10.5lf ± %10.5lf", log_ppl_ratio_val, log_ppl_ratio_unc);
 
-        auto p_diff_mse   = mean_and_uncertainty(kld.sum_p_diff2, kld.sum_p_diff4, kld.count);
-        const double p_diff_rms_val = sqrt(p_diff_mse.first);
-        const double p_diff_rms_unc = 0.5/p_diff_rms_val * p_diff_mse.second;
-        printf("    %6.3lf ± %6.3lf %%", 100.0*p_diff_rms_val, 100.0*p_diff_rms_unc);
+            auto kl_div = mean_and_uncertainty(kld.sum_kld, kld.sum_kld2, kld.count);
+            printf("    %10.5lf ± %10.5lf", kl_div.first, kl_div.second);
 
-        double p_top_val = 1.*kld.n_same_top/kld.count;
-        double p_top_unc = sqrt(p_top_val*(1 - p_top_val)/(kld.count - 1));
-        printf("    %6.3lf ± %6.3lf %%", 100.0*p_top_val, 100.0*p_top_unc);
+            auto p_diff_mse   = mean_and_uncertainty(kld.sum_p_diff2, kld.sum_p_diff4, kld.count);
+            const double p_diff_rms_val = sqrt(p_diff_mse.first);
+            const double p_diff_rms_unc = 0.5/p_diff_rms_val * p_diff_mse.second;
+            printf("    %6.3lf ± %6.3lf %%", 100.0*p_diff_rms_val, 100.0*p_diff_rms_unc);
 
-        printf("\n");
+            double p_top_val = 1.*kld.n_same_top/kld.count;
+            double p_top_unc = sqrt(p_top_val*(1 - p_top_val)/(kld.count - 1));
+            printf("    %6.3lf ± %6.3lf %%", 100.0*p_top_val, 100.0*p_top_unc);
 
-        fflush(stdout);
+            printf("\n");
+
+            fflush(stdout);
+        });
 
         logits.clear();
     }
+    wait_jobs();
     printf("\n");
 
     if (kld.count < 100) return; // we do not wish to do statistics on so few values
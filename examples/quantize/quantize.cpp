@@ -92,7 +92,7 @@ static bool try_parse_ftype(const std::string & ftype_str_in, llama_ftype & ftyp
 //
 [[noreturn]]
 static void usage(const char * executable) {
-    printf("usage: %s [--help] [--allow-requantize] [--leave-output-tensor] [--pure] [--imatrix] [--include-weights] [--exclude-weights] [--output-tensor-type] [--token-embedding-type] [--override-kv] model-f32.gguf [model-quant.gguf] type [nthreads]\n\n", executable);
+    printf("usage: %s [--help] [--allow-requantize] [--leave-output-tensor] [--pure] [--imatrix] [--include-weights] [--exclude-weights] [--output-tensor-type] [--token-embedding-type] [--keep-split] [--split-max-size] [--resume] [--override-kv] model-f32.gguf [model-quant.gguf] type [nthreads]\n\n", executable);
     printf("  --allow-requantize: Allows requantizing tensors that have already been quantized. Warning: This can severely reduce quality compared to quantizing from 16bit or 32bit\n");
     printf("  --leave-output-tensor: Will leave output.weight un(re)quantized. Increases model size but may also increase quality, especially when requantizing\n");
     printf("  --pure: Disable k-quant mixtures and quantize all tensors to the same type\n");
@@ -101,7 +101,9 @@ static void usage(const char * executable) {
     printf("  --exclude-weights tensor_name: use importance matrix for this/these tensor(s)\n");
     printf("  --output-tensor-type ggml_type: use this ggml_type for the output.weight tensor\n");
     printf("  --token-embedding-type ggml_type: use this ggml_type for the token embeddings tensor\n");
-    printf("  --keep-split: will generate quatized model in the same shards as input");
+    printf("  --keep-split: will generate quatized model in the same shards as input\n");
+    printf("  --split-max-size N(M|G): write the quantized model in shards of at most N megabytes or gigabytes of tensor data\n");
+    printf("  --resume: continue an interrupted run from the checkpoint next to the output\n");
     printf("  --override-kv KEY=TYPE:VALUE\n");
     printf("      Advanced option to override model metadata by key in the quantized model. May be specified multiple times.\n");
     printf("Note: --include-weights and --exclude-weights cannot be used together\n");
@@ -231,6 +233,22 @@ static ggml_type parse_ggml_type(const char * arg) {
     return result;
 }
 
+// N followed by M (megabytes) or G (gigabytes), 0 if invalid
+static size_t parse_split_max_size(const char * arg) {
+    char * end = nullptr;
+    const long n = std::strtol(arg, &end, 10);
+    if (n <= 0 || end == arg) {
+        return 0;
+    }
+    if (strcmp(end, "M") == 0) {
+        return (size_t) n * 1024 * 1024;
+    }
+    if (strcmp(end, "G") == 0) {
+        return (size_t) n * 1024 * 1024 * 1024;
+    }
+    return 0;
+}
+
 int main(int argc, char ** argv) {
     if (argc < 3) {
         usage(argv[0]);
@@ -284,8 +302,14 @@ int main(int argc, char ** argv) {
             } else {
                 usage(argv[0]);
             }
-        } else if (strcmp(argv[arg_idx], "--keep-split")) {
+        } else if (strcmp(argv[arg_idx], "--keep-split") == 0) {
             params.keep_split = true;
+        } else if (strcmp(argv[arg_idx], "--split-max-size") == 0) {
+            if (arg_idx == argc-1 || (params.split_max_size = parse_split_max_size(argv[++arg_idx])) == 0) {
+                usage(argv[0]);
+            }
+        } else if (strcmp(argv[arg_idx], "--resume") == 0) {
+            params.resume = true;
         } else {
             usage(argv[0]);
         }
@@ -361,7 +385,7 @@ int main(int argc, char ** argv) {
 
         // export as [inp path]/ggml-model-[ftype]. Only add extension if there is no splitting
         fname_out = fpath + "ggml-model-" + ftype_str;
-        if (!params.keep_split) {
+        if (!params.keep_split && params.split_max_size == 0) {
             fname_out += suffix;
         }
         arg_idx++;
@@ -370,7 +394,7 @@ int main(int argc, char ** argv) {
         }
     } else {
         fname_out = argv[arg_idx];
-        if (params.keep_split && fname_out.find(suffix) != std::string::npos) {
+        if ((params.keep_split || params.split_max_size > 0) && fname_out.find(suffix) != std::string::npos) {
             fname_out = fname_out.substr(0, fname_out.length() - suffix.length());
         }
         arg_idx++;
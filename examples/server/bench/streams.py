@@ -0,0 +1,120 @@
+#!/usr/bin/env python3
+# Load test of many concurrent streaming completions.
+#
+# Every stream sends one streaming /completion request, all the streams start at the same time.
+# The time between two consecutive tokens of a stream (inter-token latency) and the time to the first token
+# are measured on the client side, which includes the delivery of the results to the HTTP threads of the server.
+#
+# Example:
+#   server -m model.gguf --parallel 256 --ctx-size 32768
+#   python3 streams.py --streams 256 --n-predict 64
+#
+# Only the Python standard library is needed.
+
+import argparse
+import http.client
+import json
+import sys
+import threading
+import time
+import urllib.parse
+
+
+def percentile(values, p):
+    if not values:
+        return float('nan')
+    values = sorted(values)
+    return values[min(len(values) - 1, int(p / 100.0 * len(values)))]
+
+
+class Stream:
+    def __init__(self, index):
+        self.index      = index
+        self.t_start    = 0.0
+        self.t_tokens   = []
+        self.error      = None
+
+
+def run_stream(args, url, stream, barrier):
+    body = json.dumps({
+        'prompt':       args.prompt,
+        'n_predict':    args.n_predict,
+        'seed':         args.seed + stream.index,
+        'cache_prompt': False,
+        'stream':       True,
+    })
+
+    try:
+        conn = http.client.HTTPConnection(url.hostname, url.port or 80, timeout=args.timeout)
+        barrier.wait()
+
+        stream.t_start = time.perf_counter()
+        conn.request('POST', '/completion', body=body, headers={'Content-Type': 'application/json'})
+        res = conn.getresponse()
+        if res.status != 200:
+            raise RuntimeError(f'HTTP {res.status}: {res.read()[:200]}')
+
+        while True:
+            line = res.readline()
+            if not line:
+                break
+            if line.startswith(b'error:'):
+                raise RuntimeError(line.decode('utf-8', errors='replace').strip())
+            if not line.startswith(b'data: '):
+                continue
+
+            t = time.perf_counter()
+            data = json.loads(line[6:])
+            if data.get('content') or not data.get('stop'):
+                stream.t_tokens.append(t)
+            if data.get('stop'):
+                break
+
+        conn.close()
+    except Exception as e:  # noqa: BLE001
+        stream.error = str(e)
+
+
+def main():
+    parser = argparse.ArgumentParser(description='inter-token latency of concurrent streaming completions')
+    parser.add_argument('--url',       type=str,   default='http://localhost:8080', help='server url')
+    parser.add_argument('--streams',   type=int,   default=256, help='number of concurrent streams')
+    parser.add_argument('--n-predict', type=int,   default=64,  help='tokens to predict per stream')
+    parser.add_argument('--prompt',    type=str,   default='Once upon a time', help='prompt of every stream')
+    parser.add_argument('--seed',      type=int,   default=42,  help='seed of the first stream, the next streams use the following seeds')
+    parser.add_argument('--timeout',   type=float, default=600, help='timeout of a request in seconds')
+    args = parser.parse_args()
+
+    url = urllib.parse.urlparse(args.url)
+
+    streams = [Stream(i) for i in range(args.streams)]
+    barrier = threading.Barrier(args.streams + 1)
+    threads = [threading.Thread(target=run_stream, args=(args, url, stream, barrier), daemon=True) for stream in streams]
+    for thread in threads:
+        thread.start()
+
+    barrier.wait()
+    t_start = time.perf_counter()
+    for thread in threads:
+        thread.join()
+    t_total = time.perf_counter() - t_start
+
+    errors = [s for s in streams if s.error is not None]
+    for s in errors[:8]:
+        print(f'stream {s.index}: error: {s.error}', file=sys.stderr)
+
+    ttft = [s.t_tokens[0] - s.t_start for s in streams if s.error is None and s.t_tokens]
+    itl  = [b - a for s in streams if s.error is None for a, b in zip(s.t_tokens, s.t_tokens[1:])]
+    n_tokens = sum(len(s.t_tokens) for s in streams if s.error is None)
+
+    print(f'streams:              {args.streams} ({len(errors)} failed)')
+    print(f'tokens:               {n_tokens} in {t_total:.2f} s, {n_tokens / t_total:.1f} tokens/s')
+    print(f'time to first token:  p50 {1e3*percentile(ttft, 50):8.2f} ms, p99 {1e3*percentile(ttft, 99):8.2f} ms')
+    print(f'inter-token latency:  p50 {1e3*percentile(itl, 50):8.2f} ms, p90 {1e3*percentile(itl, 90):8.2f} ms, '
+          f'p99 {1e3*percentile(itl, 99):8.2f} ms, max {1e3*max(itl, default=float("nan")):8.2f} ms')
+
+    return 1 if errors else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
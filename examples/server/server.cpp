@@ -1,6 +1,7 @@
 #include "utils.hpp"
 
 #include "common.h"
+#include "ngram-cache.h"
 #include "json-schema-to-grammar.h"
 #include "llama.h"
 #include "grammar-parser.h"
@@ -26,11 +27,16 @@
 #include <chrono>
 #include <condition_variable>
 #include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <map>
 #include <set>
 #include <mutex>
 #include <thread>
 #include <signal.h>
 #include <memory>
+#include <unordered_map>
 
 using json = nlohmann::ordered_json;
 
@@ -79,6 +85,8 @@ struct server_task {
 
     bool infill    = false;
     bool embedding = false;
+
+    int64_t t_queued = 0; // us, time at which the task was posted
 };
 
 struct server_task_result {
@@ -133,6 +141,9 @@ struct server_params {
 
     bool slots_endpoint   = true;
     bool metrics_endpoint = false;
+    bool draft_lookup     = false;
+    int32_t n_prefill_budget = 0;
+    int32_t n_threads_sampling = -1;
     std::string slot_save_path;
 };
 
@@ -169,6 +180,19 @@ struct server_slot {
     std::vector<llama_token> cache_tokens;
     std::vector<completion_token_output> generated_token_probs;
 
+    int32_t n_shared = 0; // number of leading cached tokens whose KV cells can be shared with other slots
+
+    // speculative decoding
+    std::vector<llama_token> drafted;          // draft tokens following the sampled token in the current batch
+    std::vector<llama_token> cache_tokens_dft; // tokens in the KV cache of the draft model (including the system prompt)
+
+    llama_ngram_cache ngram_cache;    // n-grams of the cached tokens, used for lookup decoding
+    size_t            n_ngram_cached = 0; // number of cached tokens added to ngram_cache
+
+    int32_t i_batch_dft        = -1;
+    int32_t n_drafted          = 0;
+    int32_t n_drafted_accepted = 0;
+
     bool infill         = false;
     bool embedding      = false;
     bool has_next_token = true;
@@ -188,6 +212,8 @@ struct server_slot {
     llama_sampling_context * ctx_sampling = nullptr;
     json json_schema;
 
+    std::vector<completion_token_output> outputs; // tokens sampled from the current view of the batch, not yet processed
+
     int32_t ga_i = 0;   // group-attention state
     int32_t ga_n = 1;   // group-attention factor
     int32_t ga_w = 512; // group-attention width
@@ -198,8 +224,10 @@ struct server_slot {
     size_t n_sent_text = 0; // number of sent text character
     size_t n_sent_token_probs = 0;
 
+    int64_t t_queued; // us, time at which the task of the slot was posted
     int64_t t_start_process_prompt;
     int64_t t_start_generation;
+    int64_t t_last_token; // us, time at which the last token was sampled
 
     double t_prompt_processing; // ms
     double t_token_generation; // ms
@@ -218,8 +246,14 @@ struct server_slot {
         infill             = false;
         ga_i               = 0;
         n_past_se          = 0;
+        n_drafted          = 0;
+        n_drafted_accepted = 0;
 
         generated_token_probs.clear();
+        drafted.clear();
+
+        ngram_cache.clear();
+        n_ngram_cached = 0;
     }
 
     bool has_budget(gpt_params &global_params) {
@@ -271,6 +305,9 @@ struct server_slot {
             {"predicted_ms",           t_token_generation},
             {"predicted_per_token_ms", t_token_generation / n_decoded},
             {"predicted_per_second",   1e3 / t_token_generation * n_decoded},
+
+            {"drafted_n",              n_drafted},
+            {"drafted_accepted_n",     n_drafted_accepted},
         };
     }
 
@@ -349,6 +386,239 @@ struct server_slot {
     }
 };
 
+// radix tree of the tokens cached in the KV cache of each slot
+// used to find the longest prefix of a new prompt that is already computed by any slot
+struct server_prefix_cache {
+    struct node {
+        std::vector<llama_token> tokens; // tokens on the edge leading to this node
+
+        std::map<llama_token, std::unique_ptr<node>> children;
+
+        std::set<int> slots; // slots that have the full path up to the end of this node in their KV cache
+    };
+
+    node root;
+
+    // tokens currently registered for each slot
+    std::vector<std::vector<llama_token>> slot_tokens;
+
+    void init(int n_slots) {
+        clear();
+        slot_tokens.resize(n_slots);
+    }
+
+    void clear() {
+        root.children.clear();
+        for (auto & tokens : slot_tokens) {
+            tokens.clear();
+        }
+    }
+
+    // make the registered tokens of a slot equal to the given tokens
+    void update(int id_slot, const std::vector<llama_token> & tokens) {
+        std::vector<llama_token> & cur = slot_tokens[id_slot];
+
+        const size_t n_common = common_part(cur, tokens);
+        if (n_common == cur.size() && n_common == tokens.size()) {
+            return;
+        }
+
+        if (n_common < cur.size()) {
+            remove(&root, 0, id_slot, cur, n_common);
+        }
+
+        insert(id_slot, tokens, n_common);
+
+        cur = tokens;
+    }
+
+    // register the tokens added after the registered tokens of a slot, which must still be a prefix of the given
+    // tokens - unlike update(), the cost does not depend on the number of tokens already registered
+    void append(int id_slot, const std::vector<llama_token> & tokens) {
+        std::vector<llama_token> & cur = slot_tokens[id_slot];
+
+        if (tokens.size() < cur.size() || (!cur.empty() && tokens[cur.size() - 1] != cur.back())) {
+            // the tokens have been truncated or replaced
+            update(id_slot, tokens);
+            return;
+        }
+
+        if (tokens.size() == cur.size()) {
+            return;
+        }
+
+        insert(id_slot, tokens, cur.size());
+
+        cur.insert(cur.end(), tokens.begin() + cur.size(), tokens.end());
+    }
+
+    // returns the length of the longest cached prefix of the tokens and a slot that holds it
+    std::pair<size_t, int> find(const std::vector<llama_token> & tokens) const {
+        std::pair<size_t, int> best = { 0, -1 };
+
+        const node * cur = &root;
+        size_t n = 0;
+
+        while (n < tokens.size()) {
+            const auto it = cur->children.find(tokens[n]);
+            if (it == cur->children.end()) {
+                break;
+            }
+
+            const node * child = it->second.get();
+
+            size_t i = 0;
+            while (i < child->tokens.size() && n + i < tokens.size() && child->tokens[i] == tokens[n + i]) {
+                i++;
+            }
+
+            best = { n + i, *child->slots.begin() };
+
+            if (i < child->tokens.size()) {
+                break;
+            }
+
+            n  += i;
+            cur = child;
+        }
+
+        return best;
+    }
+
+private:
+    // split the edge of a node after the first n tokens, the node keeps the first part
+    static void split(node * nd, size_t n) {
+        std::unique_ptr<node> tail(new node);
+
+        tail->tokens.assign(nd->tokens.begin() + n, nd->tokens.end());
+        tail->children = std::move(nd->children);
+        tail->slots    = nd->slots;
+
+        nd->tokens.resize(n);
+        nd->children.clear();
+        nd->children[tail->tokens[0]] = std::move(tail);
+    }
+
+    // remove the slot from the nodes of its path that are past the first n_keep tokens
+    static void remove(node * cur, size_t depth, int id_slot, const std::vector<llama_token> & path, size_t n_keep) {
+        if (depth >= path.size()) {
+            return;
+        }
+
+        auto it = cur->children.find(path[depth]);
+        GGML_ASSERT(it != cur->children.end());
+
+        node * child = it->second.get();
+
+        const size_t depth_end = depth + child->tokens.size();
+
+        if (depth < n_keep && n_keep < depth_end) {
+            split(child, n_keep - depth);
+        }
+
+        remove(child, depth + child->tokens.size(), id_slot, path, n_keep);
+
+        if (depth >= n_keep) {
+            child->slots.erase(id_slot);
+            if (child->slots.empty()) {
+                // no other slot goes through this node, so none goes through its children either
+                cur->children.erase(it);
+            }
+        }
+    }
+
+    // add the slot to the path of the tokens, the first n_past tokens are already registered
+    // the edges within the registered tokens are skipped without comparing their tokens
+    void insert(int id_slot, const std::vector<llama_token> & tokens, size_t n_past) {
+        node * cur = &root;
+        size_t n = 0;
+
+        while (n < tokens.size()) {
+            auto it = cur->children.find(tokens[n]);
+            if (it == cur->children.end()) {
+                if (cur != &root && cur->children.empty() && cur->slots.size() == 1) {
+                    // this slot is the only one using this leaf - extend it in place
+                    cur->tokens.insert(cur->tokens.end(), tokens.begin() + n, tokens.end());
+                } else {
+                    std::unique_ptr<node> leaf(new node);
+
+                    leaf->tokens.assign(tokens.begin() + n, tokens.end());
+                    leaf->slots.insert(id_slot);
+
+                    cur->children[tokens[n]] = std::move(leaf);
+                }
+                break;
+            }
+
+            node * child = it->second.get();
+
+            size_t i = n < n_past ? std::min(child->tokens.size(), n_past - n) : 0;
+            while (i < child->tokens.size() && n + i < tokens.size() && child->tokens[i] == tokens[n + i]) {
+                i++;
+            }
+
+            if (i < child->tokens.size()) {
+                split(child, i);
+            }
+
+            if (n + i > n_past) {
+                child->slots.insert(id_slot);
+            }
+
+            n  += i;
+            cur = child;
+        }
+    }
+};
+
+// distribution of the values of a metric over fixed buckets, exposed as a prometheus histogram
+// only the thread of update_slots observes values, the HTTP threads can read the histogram at any time without locking
+struct server_metrics_histogram {
+    std::vector<double> bounds; // upper bounds of the buckets, the last bucket (+Inf) is implicit
+
+    std::vector<std::atomic<uint64_t>> counts; // number of values in each bucket (not cumulative)
+    std::atomic<double> sum;
+
+    explicit server_metrics_histogram(std::vector<double> bounds_) : bounds(std::move(bounds_)), counts(bounds.size() + 1), sum(0.0) {
+        GGML_ASSERT(std::is_sorted(bounds.begin(), bounds.end()));
+    }
+
+    void observe(double value) {
+        const size_t i = std::lower_bound(bounds.begin(), bounds.end(), value) - bounds.begin();
+
+        counts[i].fetch_add(1, std::memory_order_relaxed);
+        sum.store(sum.load(std::memory_order_relaxed) + value, std::memory_order_relaxed); // single writer
+    }
+
+    // the buckets are cumulative, the count is the number of values in all the buckets
+    json to_json() const {
+        json buckets = json::array();
+
+        uint64_t count = 0;
+        for (size_t i = 0; i < counts.size(); ++i) {
+            count += counts[i].load(std::memory_order_relaxed);
+
+            std::ostringstream le;
+            if (i < bounds.size()) {
+                le << bounds[i];
+            } else {
+                le << "+Inf";
+            }
+
+            buckets.push_back({
+                {"le",    le.str()},
+                {"count", count},
+            });
+        }
+
+        return json {
+            {"buckets", buckets},
+            {"sum",     sum.load(std::memory_order_relaxed)},
+            {"count",   count},
+        };
+    }
+};
+
 struct server_metrics {
     int64_t t_start = 0;
 
@@ -356,6 +626,8 @@ struct server_metrics {
     uint64_t t_prompt_processing_total       = 0;
     uint64_t n_tokens_predicted_total        = 0;
     uint64_t t_tokens_generation_total       = 0;
+    uint64_t n_tokens_drafted_total          = 0;
+    uint64_t n_tokens_drafted_accepted_total = 0;
 
     uint64_t n_prompt_tokens_processed = 0;
     uint64_t t_prompt_processing       = 0;
@@ -363,6 +635,17 @@ struct server_metrics {
     uint64_t n_tokens_predicted  = 0;
     uint64_t t_tokens_generation = 0;
 
+    // distributions, per request unless noted otherwise
+    server_metrics_histogram queue_wait          {{0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30, 60}}; // seconds
+    server_metrics_histogram time_to_first_token {{0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30, 60}}; // seconds
+    server_metrics_histogram inter_token_latency {{0.005, 0.01, 0.02, 0.03, 0.05, 0.075, 0.1, 0.15, 0.2, 0.3, 0.5, 1, 2.5}}; // seconds, per token
+    server_metrics_histogram prompt_throughput   {{10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000}}; // tokens/s
+    server_metrics_histogram batch_fill_ratio    {{0.05, 0.1, 0.2, 0.3, 0.4, 0.5, 0.6, 0.7, 0.8, 0.9, 1}}; // per batch
+
+    // state after the last step of update_slots
+    std::atomic<int32_t> kv_cache_used_cells{0};
+    std::atomic<double>  t_kv_cache_update{0.0}; // seconds, defragmentation and shifts applied before the batches of the step
+
     void init() {
         t_start = ggml_time_us();
     }
@@ -372,6 +655,26 @@ struct server_metrics {
         n_prompt_tokens_processed       += slot.n_prompt_tokens_processed;
         t_prompt_processing             += slot.t_prompt_processing;
         t_prompt_processing_total       += slot.t_prompt_processing;
+
+        queue_wait         .observe((slot.t_start_process_prompt - slot.t_queued) / 1e6);
+        time_to_first_token.observe((slot.t_start_generation     - slot.t_queued) / 1e6);
+
+        if (slot.n_prompt_tokens_processed > 0 && slot.t_prompt_processing > 0) {
+            prompt_throughput.observe(1e3 / slot.t_prompt_processing * slot.n_prompt_tokens_processed);
+        }
+    }
+
+    void on_token(int64_t t_us) {
+        inter_token_latency.observe(t_us / 1e6);
+    }
+
+    void on_batch(int32_t n_tokens, int32_t n_batch) {
+        batch_fill_ratio.observe((double) n_tokens / n_batch);
+    }
+
+    void on_step(int32_t n_cells_used, int64_t t_update_us) {
+        kv_cache_used_cells.store(n_cells_used,     std::memory_order_relaxed);
+        t_kv_cache_update  .store(t_update_us / 1e6, std::memory_order_relaxed);
     }
 
     void on_prediction(const server_slot & slot) {
@@ -379,6 +682,9 @@ struct server_metrics {
         n_tokens_predicted         += slot.n_decoded;
         t_tokens_generation        += slot.t_token_generation;
         t_tokens_generation_total  += slot.t_token_generation;
+
+        n_tokens_drafted_total          += slot.n_drafted;
+        n_tokens_drafted_accepted_total += slot.n_drafted_accepted;
     }
 
     void reset_bucket() {
@@ -414,6 +720,7 @@ struct server_queue {
             task.id = id++;
             LOG_VERBOSE("new task id", {{"new_id", task.id}});
         }
+        task.t_queued = ggml_time_us();
         queue_tasks.push_back(std::move(task));
         condition_tasks.notify_one();
         return task.id;
@@ -553,54 +860,58 @@ struct server_queue {
     }
 };
 
+// the results of a task, in the order they were sent
+// only the thread that waits for the task is woken up when a result arrives
+struct server_task_channel {
+    std::mutex mutex;
+    std::condition_variable condition;
+    std::deque<server_task_result> results;
+};
+
 struct server_response {
     typedef std::function<void(int, int, server_task_result &)> callback_multitask_t;
     callback_multitask_t callback_update_multitask;
 
-    // for keeping track of all tasks waiting for the result
-    std::set<int> waiting_task_ids;
-
-    // the main result queue
-    std::vector<server_task_result> queue_results;
+    // the channels of all tasks waiting for results, by task id
+    std::unordered_map<int, std::shared_ptr<server_task_channel>> channels;
 
     std::mutex mutex_results;
-    std::condition_variable condition_results;
 
     // add the id_task to the list of tasks waiting for response
     void add_waiting_task_id(int id_task) {
         LOG_VERBOSE("waiting for task id", {{"id_task", id_task}});
 
         std::unique_lock<std::mutex> lock(mutex_results);
-        waiting_task_ids.insert(id_task);
+        get_channel(id_task);
     }
 
     // when the request is finished, we can remove task associated with it
+    // the results that were not received are dropped
     void remove_waiting_task_id(int id_task) {
         LOG_VERBOSE("remove waiting for task id", {{"id_task", id_task}});
 
         std::unique_lock<std::mutex> lock(mutex_results);
-        waiting_task_ids.erase(id_task);
+        channels.erase(id_task);
     }
 
     // This function blocks the thread until there is a response for this id_task
     server_task_result recv(int id_task) {
-        while (true) {
+        std::shared_ptr<server_task_channel> channel;
+        {
             std::unique_lock<std::mutex> lock(mutex_results);
-            condition_results.wait(lock, [&]{
-                return !queue_results.empty();
-            });
-
-            for (int i = 0; i < (int) queue_results.size(); i++) {
-                if (queue_results[i].id == id_task) {
-                    assert(queue_results[i].id_multi == -1);
-                    server_task_result res = queue_results[i];
-                    queue_results.erase(queue_results.begin() + i);
-                    return res;
-                }
-            }
+            channel = get_channel(id_task);
         }
 
-        // should never reach here
+        std::unique_lock<std::mutex> lock(channel->mutex);
+        channel->condition.wait(lock, [&]{
+            return !channel->results.empty();
+        });
+
+        server_task_result res = std::move(channel->results.front());
+        channel->results.pop_front();
+        assert(res.id_multi == -1);
+
+        return res;
     }
 
     // Register the function to update multitask
@@ -612,22 +923,127 @@ struct server_response {
     void send(server_task_result result) {
         LOG_VERBOSE("send new result", {{"id_task", result.id}});
 
-        std::unique_lock<std::mutex> lock(mutex_results);
-        for (const auto & id_task : waiting_task_ids) {
-            // LOG_TEE("waiting task id %i \n", id_task);
+        std::shared_ptr<server_task_channel> channel;
+        {
+            std::unique_lock<std::mutex> lock(mutex_results);
+
             // for now, tasks that have associated parent multitasks just get erased once multitask picks up the result
-            if (result.id_multi == id_task) {
-                LOG_VERBOSE("callback_update_multitask", {{"id_task", id_task}});
-                callback_update_multitask(id_task, result.id, result);
-                continue;
+            if (result.id_multi != -1 && channels.find(result.id_multi) != channels.end()) {
+                LOG_VERBOSE("callback_update_multitask", {{"id_task", result.id_multi}});
+                callback_update_multitask(result.id_multi, result.id, result);
+                return;
+            }
+
+            const auto it = channels.find(result.id);
+            if (it == channels.end()) {
+                return; // nobody is waiting for this task anymore
             }
+            channel = it->second;
+        }
+
+        LOG_VERBOSE("queue_results.push_back", {{"id_task", result.id}});
+
+        {
+            std::unique_lock<std::mutex> lock(channel->mutex);
+            channel->results.push_back(std::move(result));
+        }
+        channel->condition.notify_one();
+    }
+
+private:
+    // mutex_results must be held
+    std::shared_ptr<server_task_channel> & get_channel(int id_task) {
+        std::shared_ptr<server_task_channel> & channel = channels[id_task];
+        if (!channel) {
+            channel = std::make_shared<server_task_channel>();
+        }
+        return channel;
+    }
+};
+
+// a fixed set of threads that run a job for each index in [0, n)
+// the calling thread takes part in the work, so a pool of 1 thread runs the jobs in order on the caller
+struct server_thread_pool {
+    std::vector<std::thread> workers;
+
+    std::mutex mutex;
+    std::condition_variable condition_jobs;
+    std::condition_variable condition_done;
+
+    const std::function<void(int)> * job = nullptr;
+
+    int n_jobs = 0; // number of jobs of the current run
+    int i_next = 0; // next job to start
+    int n_done = 0; // number of finished jobs
+
+    bool stop = false;
+
+    ~server_thread_pool() {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            stop = true;
+        }
+        condition_jobs.notify_all();
+
+        for (auto & worker : workers) {
+            worker.join();
+        }
+    }
+
+    void start(int n_threads) {
+        for (int i = 1; i < n_threads; ++i) {
+            workers.emplace_back(&server_thread_pool::worker, this);
+        }
+    }
+
+    int n_threads() const {
+        return (int) workers.size() + 1;
+    }
+
+    // returns when all the jobs are done
+    void run(int n, const std::function<void(int)> & fn) {
+        if (workers.empty() || n < 2) {
+            for (int i = 0; i < n; ++i) {
+                fn(i);
+            }
+            return;
+        }
+
+        std::unique_lock<std::mutex> lock(mutex);
+        job    = &fn;
+        n_jobs = n;
+        i_next = 0;
+        n_done = 0;
+        condition_jobs.notify_all();
+
+        while (i_next < n_jobs) {
+            process_next(lock);
+        }
+
+        condition_done.wait(lock, [&]{ return n_done == n_jobs; });
+        job = nullptr;
+    }
+
+private:
+    void process_next(std::unique_lock<std::mutex> & lock) {
+        const int i = i_next++;
+        lock.unlock();
+        (*job)(i);
+        lock.lock();
 
-            if (result.id == id_task) {
-                LOG_VERBOSE("queue_results.push_back", {{"id_task", id_task}});
-                queue_results.push_back(result);
-                condition_results.notify_all();
+        if (++n_done == n_jobs) {
+            condition_done.notify_one();
+        }
+    }
+
+    void worker() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            condition_jobs.wait(lock, [&]{ return stop || i_next < n_jobs; });
+            if (stop) {
                 return;
             }
+            process_next(lock);
         }
     }
 };
@@ -660,6 +1076,24 @@ struct server_context {
 
     server_metrics metrics;
 
+    server_prefix_cache prefix_cache;
+
+    bool prefix_cache_enabled = false;
+
+    // speculative decoding
+    llama_model   * model_dft = nullptr;
+    llama_context * ctx_dft   = nullptr;
+
+    llama_batch batch_dft = {};
+
+    bool draft_lookup = false; // draft tokens with n-gram lookup in the cached tokens of the slot
+
+    int32_t n_prefill_budget = 0; // max prompt tokens per batch while other slots are generating (0 = n_batch)
+
+    int32_t n_threads_sampling = 1; // number of threads that sample the slots after each decode
+
+    server_thread_pool pool_sampling;
+
     ~server_context() {
         if (ctx) {
             llama_free(ctx);
@@ -671,7 +1105,18 @@ struct server_context {
             model = nullptr;
         }
 
+        if (ctx_dft) {
+            llama_free(ctx_dft);
+            ctx_dft = nullptr;
+        }
+
+        if (model_dft) {
+            llama_free_model(model_dft);
+            model_dft = nullptr;
+        }
+
         llama_batch_free(batch);
+        llama_batch_free(batch_dft);
     }
 
     bool load_model(const gpt_params & params_) {
@@ -692,6 +1137,54 @@ struct server_context {
         add_bos_token = llama_should_add_bos_token(model);
         GGML_ASSERT(llama_add_eos_token(model) != 1);
 
+        if (!params.model_draft.empty()) {
+            gpt_params params_dft = params;
+
+            params_dft.model        = params.model_draft;
+            params_dft.n_gpu_layers = params.n_gpu_layers_draft;
+            params_dft.n_ctx        = n_ctx;
+            params_dft.lora_adapter.clear();
+            params_dft.lora_base.clear();
+            params_dft.control_vectors.clear();
+
+            std::tie(model_dft, ctx_dft) = llama_init_from_gpt_params(params_dft);
+            if (model_dft == nullptr) {
+                LOG_ERROR("unable to load draft model", {{"model", params_dft.model}});
+                return false;
+            }
+
+            if (!validate_draft_model()) {
+                LOG_ERROR("the draft model vocabulary does not match the target model", {{"model", params_dft.model}});
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    bool validate_draft_model() const {
+        if (llama_vocab_type(model) != llama_vocab_type(model_dft) ||
+            llama_add_bos_token(model) != llama_add_bos_token(model_dft) ||
+            llama_token_bos(model) != llama_token_bos(model_dft) ||
+            llama_token_eos(model) != llama_token_eos(model_dft)) {
+            return false;
+        }
+
+        const int n_vocab     = llama_n_vocab(model);
+        const int n_vocab_dft = llama_n_vocab(model_dft);
+
+        // allow a few extra tokens at the end of one of the vocabularies
+        if (std::abs(n_vocab - n_vocab_dft) > 100) {
+            return false;
+        }
+
+        // the first tokens are control tokens that are allowed to differ
+        for (int i = 5; i < std::min(n_vocab, n_vocab_dft); ++i) {
+            if (std::strcmp(llama_token_get_text(model, i), llama_token_get_text(model_dft, i)) != 0) {
+                return false;
+            }
+        }
+
         return true;
     }
 
@@ -757,6 +1250,24 @@ struct server_context {
             batch = llama_batch_init(n_batch, 0, 1);
         }
 
+        prefix_cache.init(params.n_parallel);
+
+        // the prefix is shared by copying the KV cells of a range of positions to the other slot - a recurrent model
+        // has a single state per sequence instead, so the copy would be the whole state of the donor
+        prefix_cache_enabled = !llama_model_is_recurrent(model);
+        if (!prefix_cache_enabled) {
+            LOG_INFO("prefix cache disabled for the recurrent model", {});
+        }
+
+        // there is never more than one slot to sample per thread
+        pool_sampling.start(std::max(1, std::min(n_threads_sampling, params.n_parallel)));
+
+        LOG_INFO("sampling threads", {{"n_threads", pool_sampling.n_threads()}});
+
+        if (ctx_dft) {
+            batch_dft = llama_batch_init(llama_n_batch(ctx_dft), 0, 1);
+        }
+
         metrics.init();
     }
 
@@ -826,6 +1337,8 @@ struct server_context {
         llama_sampling_params default_sparams;
         auto & data = task.data;
 
+        slot.t_queued = task.t_queued;
+
         if (data.count("__oaicompat") != 0) {
             slot.oaicompat = true;
             slot.oaicompat_model = json_value(data, "model", std::string(DEFAULT_OAICOMPAT_MODEL));
@@ -1048,6 +1561,39 @@ struct server_context {
         // clear the entire KV cache
         llama_kv_cache_clear(ctx);
         clean_kv_cache = false;
+
+        for (server_slot & slot : slots) {
+            slot.cache_tokens.clear();
+            slot.n_shared = 0;
+        }
+        prefix_cache.clear();
+
+        if (ctx_dft) {
+            llama_kv_cache_clear(ctx_dft);
+            for (server_slot & slot : slots) {
+                slot.cache_tokens_dft.clear();
+            }
+        }
+    }
+
+    // register the tokens that are currently in the KV cache of the slot
+    // when the prefix cache is disabled, nothing is registered and no prefix is ever found
+    void prefix_cache_update(const server_slot & slot) {
+        if (!prefix_cache_enabled || slot.ga_n != 1) {
+            // with self-extend, the positions of the cached tokens are compressed
+            return;
+        }
+
+        prefix_cache.update(slot.id, slot.cache_tokens);
+    }
+
+    // register the tokens added to the KV cache of the slot since the last update
+    void prefix_cache_append(const server_slot & slot) {
+        if (!prefix_cache_enabled || slot.ga_n != 1) {
+            return;
+        }
+
+        prefix_cache.append(slot.id, slot.cache_tokens);
     }
 
     void system_prompt_update() {
@@ -1113,6 +1659,66 @@ struct server_context {
         return true;
     }
 
+    // sample the next token of the slot from the view [i_view, i_view + n_view) of the batch
+    // the sampled token is followed by the drafted tokens (if any), each accepted draft token provides the logits to sample the next one
+    // this runs on the sampling pool, in parallel with the other slots: only the slot and its sampling context are modified
+    void sample_slot(server_slot & slot, int32_t i_view, int32_t n_view) {
+        slot.outputs.clear();
+
+        for (size_t i_dft = 0; i_dft <= slot.drafted.size(); ++i_dft) {
+            const int32_t i_logits = i_dft == 0 ? slot.i_batch : slot.i_batch_dft + (int32_t) i_dft - 1;
+            if (i_logits < i_view || i_logits >= i_view + n_view) {
+                break; // not in this view of the batch
+            }
+
+            completion_token_output result;
+            const llama_token id = llama_sampling_sample(slot.ctx_sampling, ctx, NULL, i_logits - i_view);
+
+            llama_sampling_accept(slot.ctx_sampling, ctx, id, true);
+
+            if (slot.ctx_sampling->params.use_penalty_prompt_tokens && id != -1) {
+                // we can change penalty_prompt_tokens because it is always created from scratch each request
+                slot.ctx_sampling->params.penalty_prompt_tokens.push_back(id);
+            }
+
+            llama_token_data_array cur_p = { slot.ctx_sampling->cur.data(), slot.ctx_sampling->cur.size(), false };
+            result.tok = id;
+
+            const size_t n_probs = std::min(cur_p.size, (size_t) slot.sparams.n_probs);
+            if (n_probs > 0) {
+                const size_t n_valid = slot.ctx_sampling->n_valid;
+
+                // Make sure at least n_probs top tokens are at the front of the vector:
+                if (slot.sparams.temp == 0.0f && n_probs > n_valid) {
+                    llama_sample_top_k(ctx, &cur_p, n_probs, 0);
+                }
+
+                if (slot.sparams.temp == 0.0f) {
+                    // With greedy sampling the probabilities have possibly not been calculated.
+                    for (size_t i = 0; i < n_probs; ++i) {
+                        result.probs.push_back({
+                            cur_p.data[i].id,
+                            i == 0 ? 1.0f : 0.0f
+                        });
+                    }
+                } else {
+                    for (size_t i = 0; i < n_probs; ++i) {
+                        result.probs.push_back({
+                            cur_p.data[i].id,
+                            i >= n_valid ? 0.0f : cur_p.data[i].p // Tokens filtered out due to e.g. top_k have 0 probability.
+                        });
+                    }
+                }
+            }
+
+            slot.outputs.push_back(std::move(result));
+
+            if (i_dft == slot.drafted.size() || id != slot.drafted[i_dft]) {
+                break;
+            }
+        }
+    }
+
     bool process_token(completion_token_output & result, server_slot & slot) {
         // remember which tokens were sampled - used for repetition penalties during sampling
         const std::string token_str = llama_token_to_piece(ctx, result.tok, false);
@@ -1122,11 +1728,6 @@ struct server_context {
         slot.generated_text += token_str;
         slot.has_next_token = true;
 
-        if (slot.ctx_sampling->params.use_penalty_prompt_tokens && result.tok != -1) {
-            // we can change penalty_prompt_tokens because it is always created from scratch each request
-            slot.ctx_sampling->params.penalty_prompt_tokens.push_back(result.tok);
-        }
-
         // check if there is incomplete UTF-8 character at the end
         bool incomplete = false;
         for (unsigned i = 1; i < 5 && i <= slot.generated_text.size(); ++i) {
@@ -1624,6 +2225,8 @@ struct server_context {
                         { "t_tokens_generation_total",       metrics.t_tokens_generation_total},
                         { "n_tokens_predicted_total",        metrics.n_tokens_predicted_total},
                         { "t_prompt_processing_total",       metrics.t_prompt_processing_total},
+                        { "n_tokens_drafted_total",          metrics.n_tokens_drafted_total},
+                        { "n_tokens_drafted_accepted_total", metrics.n_tokens_drafted_accepted_total},
 
                         { "n_prompt_tokens_processed",       metrics.n_prompt_tokens_processed},
                         { "t_prompt_processing",             metrics.t_prompt_processing},
@@ -1693,12 +2296,15 @@ struct server_context {
                     slot->cache_tokens.resize(slot->n_ctx);
                     size_t token_count = 0;
                     size_t nread = llama_state_seq_load_file(ctx, filepath.c_str(), slot->id + 1, slot->cache_tokens.data(), slot->cache_tokens.size(), &token_count);
+                    slot->n_shared = 0;
                     if (nread == 0) {
                         slot->cache_tokens.resize(0);
+                        prefix_cache_update(*slot);
                         send_error(task, "Unable to restore slot, no available space in KV cache or invalid slot save file", ERROR_TYPE_INVALID_REQUEST);
                         break;
                     }
                     slot->cache_tokens.resize(token_count);
+                    prefix_cache_update(*slot);
 
                     const int64_t t_end = ggml_time_us();
                     const double t_restore_ms = (t_end - t_start) / 1000.0;
@@ -1731,6 +2337,8 @@ struct server_context {
                     const size_t n_erased = slot->cache_tokens.size();
                     llama_kv_cache_seq_rm(ctx, slot->id + 1, -1, -1);
                     slot->cache_tokens.clear();
+                    slot->n_shared = 0;
+                    prefix_cache_update(*slot);
 
                     server_task_result result;
                     result.id = task.id;
@@ -1765,6 +2373,175 @@ struct server_context {
         queue_results.send(result);
     }
 
+    // draft the tokens that follow the sampled token of each generating slot
+    // the drafts are verified by the target model in the next batch, together with the other slots
+    void speculative_draft(int32_t n_free) {
+        std::vector<server_slot *> slots_dft;
+        std::vector<int32_t>       n_max; // max number of tokens to draft for each slot in slots_dft
+
+        for (server_slot & slot : slots) {
+            slot.drafted.clear();
+
+            if (slot.state != SLOT_STATE_PROCESSING || slot.ga_n != 1) {
+                continue;
+            }
+
+            // the accepted tokens must fit in the context of the slot and in the prediction budget
+            int32_t n_draft = std::min(params.n_draft, slot.n_ctx - 1 - (int32_t) system_tokens.size() - slot.n_past);
+            if (slot.n_remaining >= 0) {
+                n_draft = std::min(n_draft, slot.n_remaining - 1);
+            }
+            n_draft = std::min(n_draft, n_free);
+
+            if (n_draft <= 0) {
+                continue;
+            }
+
+            if (ctx_dft) {
+                slots_dft.push_back(&slot);
+                n_max.push_back(n_draft);
+
+                n_free -= n_draft;
+            } else {
+                // the cached tokens end with the sampled token
+                std::vector<llama_token> & inp = slot.cache_tokens;
+
+                if (slot.n_ngram_cached > inp.size()) {
+                    slot.ngram_cache.clear();
+                    slot.n_ngram_cached = 0;
+                }
+
+                llama_ngram_cache_update(slot.ngram_cache, LLAMA_NGRAM_MIN, LLAMA_NGRAM_MAX, inp, inp.size() - slot.n_ngram_cached, false);
+                slot.n_ngram_cached = inp.size();
+
+                llama_ngram_cache empty;
+
+                std::vector<llama_token> draft = { inp.back() };
+                llama_ngram_cache_draft(inp, draft, n_draft, LLAMA_NGRAM_MIN, LLAMA_NGRAM_MAX, slot.ngram_cache, empty, empty);
+
+                slot.drafted.assign(draft.begin() + 1, draft.end());
+
+                n_free -= slot.drafted.size();
+            }
+        }
+
+        if (slots_dft.empty()) {
+            return;
+        }
+
+        const int32_t n_batch_dft = llama_n_batch(ctx_dft);
+        const int32_t n_vocab     = llama_n_vocab(model);
+        const int32_t n_vocab_dft = llama_n_vocab(model_dft);
+
+        const auto decode_dft = [&]() {
+            const bool ok = batch_dft.n_tokens == 0 || llama_decode(ctx_dft, batch_dft) == 0;
+            if (!ok) {
+                LOG_WARNING("failed to decode the draft batch - dropping the draft KV cache", {
+                    {"n_tokens", batch_dft.n_tokens},
+                });
+
+                llama_kv_cache_clear(ctx_dft);
+                for (server_slot & slot : slots) {
+                    slot.cache_tokens_dft.clear();
+                    slot.drafted.clear();
+                }
+            }
+
+            llama_batch_clear(batch_dft);
+
+            return ok;
+        };
+
+        // bring the draft KV cache of each slot up to date with the target, except for the sampled token
+        llama_batch_clear(batch_dft);
+
+        std::vector<std::vector<llama_token>> prompts(slots_dft.size());
+
+        for (size_t k = 0; k < slots_dft.size(); ++k) {
+            server_slot & slot = *slots_dft[k];
+
+            std::vector<llama_token> & prompt = prompts[k];
+
+            prompt = system_tokens;
+            prompt.insert(prompt.end(), slot.cache_tokens.begin(), slot.cache_tokens.end());
+
+            const size_t n_common = std::min(common_part(slot.cache_tokens_dft, prompt), prompt.size() - 1);
+
+            llama_kv_cache_seq_rm(ctx_dft, slot.id, n_common, -1);
+            slot.cache_tokens_dft.resize(n_common);
+
+            for (size_t i = n_common; i < prompt.size() - 1; ++i) {
+                if (batch_dft.n_tokens == n_batch_dft && !decode_dft()) {
+                    return;
+                }
+
+                llama_batch_add(batch_dft, prompt[i], i, { slot.id }, false);
+                slot.cache_tokens_dft.push_back(prompt[i]);
+            }
+        }
+
+        if (batch_dft.n_tokens + (int32_t) slots_dft.size() > n_batch_dft && !decode_dft()) {
+            return;
+        }
+
+        // draft greedily with all slots in the same batch
+        std::vector<llama_token> last(slots_dft.size());
+
+        for (size_t k = 0; k < slots_dft.size(); ++k) {
+            last[k] = prompts[k].back();
+        }
+
+        while (true) {
+            std::vector<int32_t> i_logits(slots_dft.size(), -1);
+
+            for (size_t k = 0; k < slots_dft.size(); ++k) {
+                server_slot & slot = *slots_dft[k];
+
+                if (last[k] < 0 || (int32_t) slot.drafted.size() >= n_max[k]) {
+                    continue;
+                }
+
+                i_logits[k] = batch_dft.n_tokens;
+
+                llama_batch_add(batch_dft, last[k], slot.cache_tokens_dft.size(), { slot.id }, true);
+                slot.cache_tokens_dft.push_back(last[k]);
+            }
+
+            if (batch_dft.n_tokens == 0) {
+                break;
+            }
+
+            if (!decode_dft()) {
+                return;
+            }
+
+            for (size_t k = 0; k < slots_dft.size(); ++k) {
+                if (i_logits[k] < 0) {
+                    continue;
+                }
+
+                const float * logits = llama_get_logits_ith(ctx_dft, i_logits[k]);
+
+                llama_token id = 0;
+                for (llama_token i = 1; i < n_vocab_dft; ++i) {
+                    if (logits[i] > logits[id]) {
+                        id = i;
+                    }
+                }
+
+                if (id >= n_vocab) {
+                    // not a token of the target model
+                    last[k] = -1;
+                    continue;
+                }
+
+                slots_dft[k]->drafted.push_back(id);
+
+                last[k] = llama_token_is_eog(model, id) ? -1 : id;
+            }
+        }
+    }
+
     void update_slots() {
         if (system_need_update) {
             system_prompt_update();
@@ -1830,7 +2607,13 @@ struct server_context {
                     // Shift context
                     const int n_keep    = slot.params.n_keep + add_bos_token;
                     const int n_left    = (int) system_tokens.size() + slot.n_past - n_keep;
-                    const int n_discard = slot.params.n_discard ? slot.params.n_discard : (n_left / 2);
+                          int n_discard = slot.params.n_discard ? slot.params.n_discard : (n_left / 2);
+
+                    // the KV cells shared with other slots cannot be shifted - discard at least up to their end
+                    const int n_shared_end = (int) system_tokens.size() + slot.n_shared;
+                    if (n_keep + n_discard < n_shared_end) {
+                        n_discard = std::min(n_left, n_shared_end - n_keep);
+                    }
 
                     LOG_INFO("slot context shift", {
                         {"id_slot",         slot.id},
@@ -1847,15 +2630,20 @@ struct server_context {
                     llama_kv_cache_seq_rm (ctx, slot.id + 1, n_keep            , n_keep + n_discard);
                     llama_kv_cache_seq_add(ctx, slot.id + 1, n_keep + n_discard, system_tokens.size() + slot.n_past, -n_discard);
 
-                    if (slot.params.cache_prompt) {
-                        for (size_t i = n_keep + n_discard; i < slot.cache_tokens.size(); i++) {
-                            slot.cache_tokens[i - n_discard] = slot.cache_tokens[i];
-                        }
-
-                        slot.cache_tokens.resize(slot.cache_tokens.size() - n_discard);
+                    for (size_t i = n_keep + n_discard; i < slot.cache_tokens.size(); i++) {
+                        slot.cache_tokens[i - n_discard] = slot.cache_tokens[i];
                     }
 
+                    slot.cache_tokens.resize(slot.cache_tokens.size() - n_discard);
+
                     slot.n_past -= n_discard;
+                    slot.n_shared = std::min(slot.n_shared, std::max(0, n_keep - (int) system_tokens.size()));
+
+                    // the n-grams of the discarded tokens are not valid anymore
+                    slot.ngram_cache.clear();
+                    slot.n_ngram_cached = 0;
+
+                    prefix_cache_update(slot);
 
                     slot.truncated = true;
                 }
@@ -1881,9 +2669,7 @@ struct server_context {
 
             slot.n_past += 1;
 
-            if (slot.params.cache_prompt) {
-                slot.cache_tokens.push_back(slot.sampled);
-            }
+            slot.cache_tokens.push_back(slot.sampled);
 
             LOG_VERBOSE("slot decode token", {
                 {"id_slot",         slot.id},
@@ -1900,7 +2686,32 @@ struct server_context {
         int32_t n_batch  = llama_n_batch(ctx);
         int32_t n_ubatch = llama_n_ubatch(ctx);
 
-        // next, batch any pending prompts without exceeding n_batch
+        // speculative decoding: add the drafted tokens after the sampled ones
+        if (ctx_dft || draft_lookup) {
+            speculative_draft(n_batch - batch.n_tokens);
+
+            for (auto & slot : slots) {
+                if (slot.drafted.empty()) {
+                    continue;
+                }
+
+                slot.i_batch_dft = batch.n_tokens;
+
+                for (size_t i = 0; i < slot.drafted.size(); ++i) {
+                    llama_batch_add(batch, slot.drafted[i], system_tokens.size() + slot.n_past + i, { slot.id + 1 }, true);
+                }
+
+                slot.n_drafted += slot.drafted.size();
+            }
+        }
+
+        // limit the prompt tokens added to a batch that has generating slots, so that a long prompt does not stall them
+        int32_t n_batch_prompt = n_batch;
+        if (n_prefill_budget > 0 && batch.n_tokens > 0) {
+            n_batch_prompt = std::min(n_batch, batch.n_tokens + n_prefill_budget);
+        }
+
+        // next, batch any pending prompts without exceeding n_batch_prompt
         if (params.cont_batching || batch.n_tokens == 0) {
             for (auto & slot : slots) {
                 // this slot still has a prompt to be processed
@@ -2030,6 +2841,32 @@ struct server_context {
                                 // reuse any previously computed tokens that are common with the new prompt
                                 slot.n_past = common_part(slot.cache_tokens, prompt_tokens);
 
+                                // a longer prefix might be cached by another slot - share its KV cells
+                                const auto prefix = prefix_cache.find(prompt_tokens);
+                                if ((int) prefix.first > slot.n_past && prefix.second != slot.id) {
+                                    server_slot & donor = slots[prefix.second];
+
+                                    const int n_prefix = prefix.first;
+                                    const int p0 = (int) system_tokens.size();
+
+                                    LOG_INFO("sharing cached prefix from another slot", {
+                                        {"id_slot",   slot.id},
+                                        {"id_task",   slot.id_task},
+                                        {"id_donor",  donor.id},
+                                        {"n_prefix",  n_prefix},
+                                        {"n_past",    slot.n_past},
+                                    });
+
+                                    llama_kv_cache_seq_rm(ctx, slot.id + 1, p0, -1);
+                                    llama_kv_cache_seq_cp(ctx, donor.id + 1, slot.id + 1, p0, p0 + n_prefix);
+
+                                    slot.cache_tokens.assign(prompt_tokens.begin(), prompt_tokens.begin() + n_prefix);
+                                    slot.n_past   = n_prefix;
+                                    slot.n_shared = n_prefix;
+
+                                    donor.n_shared = std::max(donor.n_shared, n_prefix);
+                                }
+
                                 // push the prompt into the sampling context (do not apply grammar)
                                 for (int i = 0; i < slot.n_past; ++i) {
                                     llama_sampling_accept(slot.ctx_sampling, ctx, slot.cache_tokens[i], false);
@@ -2082,6 +2919,9 @@ struct server_context {
 
                     // remove the non-common part from the cache
                     slot.cache_tokens.resize(slot.n_past);
+                    slot.n_shared = std::min(slot.n_shared, slot.n_past);
+
+                    prefix_cache_update(slot);
 
                     LOG_INFO("kv cache rm [p0, end)", {
                         { "id_slot", slot.id },
@@ -2095,9 +2935,12 @@ struct server_context {
                     int32_t ga_n = slot.ga_n;
                     int32_t ga_w = slot.ga_w;
 
+                    // an embedding is pooled from a single batch, so its prompt is not limited by the prefill budget
+                    const int32_t n_batch_slot = slot.embedding ? n_batch : n_batch_prompt;
+
                     // add prompt tokens for processing in the current batch
                     // TODO: the self-extend stuff here is a mess - simplify and/or abstract it somehow
-                    for (; slot.n_past < slot.n_prompt_tokens && batch.n_tokens < n_batch; ++slot.n_past) {
+                    for (; slot.n_past < slot.n_prompt_tokens && batch.n_tokens < n_batch_slot; ++slot.n_past) {
                         if (slot.ga_n != 1) {
                             while (slot_npast >= ga_i + ga_w) {
                                 const int bd = (ga_w/ga_n)*(ga_n - 1);
@@ -2108,9 +2951,7 @@ struct server_context {
 
                         llama_batch_add(batch, prompt_tokens[slot.n_past], system_tokens.size() + slot_npast, { slot.id + 1 }, false);
 
-                        if (slot.params.cache_prompt) {
-                            slot.cache_tokens.push_back(prompt_tokens[slot.n_past]);
-                        }
+                        slot.cache_tokens.push_back(prompt_tokens[slot.n_past]);
 
                         slot.n_prompt_tokens_processed++;
                         slot_npast++;
@@ -2146,7 +2987,7 @@ struct server_context {
                     }
                 }
 
-                if (batch.n_tokens >= n_batch) {
+                if (batch.n_tokens >= n_batch_prompt) {
                     break;
                 }
             }
@@ -2161,6 +3002,9 @@ struct server_context {
             {"n_tokens", batch.n_tokens},
         });
 
+        // time spent to apply the pending updates of the KV cache (defragmentation and shifts) in this step
+        int64_t t_kv_cache_update_us = 0;
+
         // process the created batch of tokens
         for (int32_t i = 0; i < batch.n_tokens; i += n_batch) {
             const int32_t n_tokens = std::min(n_batch, batch.n_tokens - i);
@@ -2205,6 +3049,13 @@ struct server_context {
                 0, 0, 0, // unused
             };
 
+            // llama_decode would apply the pending updates itself, but then they could not be timed separately
+            {
+                const int64_t t_start_update = ggml_time_us();
+                llama_kv_cache_update(ctx);
+                t_kv_cache_update_us += ggml_time_us() - t_start_update;
+            }
+
             const int ret = llama_decode(ctx, batch_view);
 
             if (ret != 0) {
@@ -2220,6 +3071,9 @@ struct server_context {
                         slot.command = SLOT_COMMAND_NONE;
                         slot.release();
                         send_error(slot, "Input prompt is too big compared to KV size. Please try increasing KV size.");
+
+                        // the batch was not fully decoded, so the cached tokens do not match the KV cache anymore
+                        slot.cache_tokens.clear();
                     }
                     break; // break loop of n_batch
                 }
@@ -2237,6 +3091,11 @@ struct server_context {
                 continue; // continue loop of n_batch
             }
 
+            metrics.on_batch(n_tokens, llama_n_batch(ctx));
+
+            // the slots that sample from this view of the batch
+            std::vector<server_slot *> slots_sampling;
+
             for (auto & slot : slots) {
                 if (slot.state != SLOT_STATE_PROCESSING || slot.i_batch < (int) i || slot.i_batch >= (int) (i + n_tokens)) {
                     continue; // continue loop of slots
@@ -2250,59 +3109,82 @@ struct server_context {
                     continue; // continue loop of slots
                 }
 
-                completion_token_output result;
-                const llama_token id = llama_sampling_sample(slot.ctx_sampling, ctx, NULL, slot.i_batch - i);
+                slots_sampling.push_back(&slot);
+            }
 
-                llama_sampling_accept(slot.ctx_sampling, ctx, id, true);
+            // each slot has its own sampling context and RNG, so the slots can be sampled in any order
+            // the outputs are then processed in the order of the slots, on this thread
+            llama_synchronize(ctx);
 
-                slot.n_decoded += 1;
-                if (slot.n_decoded == 1) {
-                    slot.t_start_generation = ggml_time_us();
-                    slot.t_prompt_processing = (slot.t_start_generation - slot.t_start_process_prompt) / 1e3;
-                    metrics.on_prompt_eval(slot);
-                }
+            const std::function<void(int)> sample = [&](int k) {
+                sample_slot(*slots_sampling[k], i, n_tokens);
+            };
+            pool_sampling.run(slots_sampling.size(), sample);
 
-                llama_token_data_array cur_p = { slot.ctx_sampling->cur.data(), slot.ctx_sampling->cur.size(), false };
-                result.tok = id;
+            for (server_slot * slot_ptr : slots_sampling) {
+                server_slot & slot = *slot_ptr;
 
-                const size_t n_probs = std::min(cur_p.size, (size_t) slot.sparams.n_probs);
-                if (n_probs > 0) {
-                    const size_t n_valid = slot.ctx_sampling->n_valid;
+                for (size_t i_dft = 0; i_dft < slot.outputs.size(); ++i_dft) {
+                    completion_token_output & result = slot.outputs[i_dft];
 
-                    // Make sure at least n_probs top tokens are at the front of the vector:
-                    if (slot.sparams.temp == 0.0f && n_probs > n_valid) {
-                        llama_sample_top_k(ctx, &cur_p, n_probs, 0);
+                    const int64_t t_current = ggml_time_us();
+
+                    slot.n_decoded += 1;
+                    if (slot.n_decoded == 1) {
+                        slot.t_start_generation = t_current;
+                        slot.t_prompt_processing = (slot.t_start_generation - slot.t_start_process_prompt) / 1e3;
+                        metrics.on_prompt_eval(slot);
+                    } else if (i_dft == 0) {
+                        // the accepted draft tokens arrive together with the sampled token, they are not separate latencies
+                        metrics.on_token(t_current - slot.t_last_token);
                     }
+                    slot.t_last_token = t_current;
 
-                    if (slot.sparams.temp == 0.0f) {
-                        // With greedy sampling the probabilities have possibly not been calculated.
-                        for (size_t i = 0; i < n_probs; ++i) {
-                            result.probs.push_back({
-                                cur_p.data[i].id,
-                                i == 0 ? 1.0f : 0.0f
-                            });
-                        }
-                    } else {
-                        for (size_t i = 0; i < n_probs; ++i) {
-                            result.probs.push_back({
-                                cur_p.data[i].id,
-                                i >= n_valid ? 0.0f : cur_p.data[i].p // Tokens filtered out due to e.g. top_k have 0 probability.
-                            });
-                        }
+                    if (!process_token(result, slot)) {
+                        slot.release();
+                        slot.print_timings();
+                        send_final_response(slot);
+                        metrics.on_prediction(slot);
+                        break;
                     }
-                }
 
-                if (!process_token(result, slot)) {
-                    slot.release();
-                    slot.print_timings();
-                    send_final_response(slot);
-                    metrics.on_prediction(slot);
+                    if (i_dft == slot.drafted.size() || result.tok != slot.drafted[i_dft]) {
+                        break;
+                    }
+
+                    if (i_dft + 1 == slot.outputs.size()) {
+                        // the logits of this draft token are in a later view of the batch, which does not sample the slot:
+                        // the token becomes the sampled token of the next batch, its KV cell and those of the drafts
+                        // after it are removed with the rejected drafts below
+                        break;
+                    }
+
+                    // the draft token is accepted - keep it in the KV cache
+                    slot.n_drafted_accepted += 1;
+                    slot.n_past += 1;
+                    slot.cache_tokens.push_back(result.tok);
                 }
 
+                slot.outputs.clear();
                 slot.i_batch = -1;
             }
         }
 
+        // remove the rejected draft tokens from the KV cache
+        for (auto & slot : slots) {
+            if (!slot.drafted.empty()) {
+                llama_kv_cache_seq_rm(ctx, slot.id + 1, system_tokens.size() + slot.n_past, -1);
+                slot.drafted.clear();
+            }
+        }
+
+        // the tokens of the batch are now in the KV cache and can be reused by other slots
+        for (const server_slot & slot : slots) {
+            prefix_cache_append(slot);
+        }
+
+        metrics.on_step(llama_get_kv_cache_used_cells(ctx), t_kv_cache_update_us);
+
         LOG_VERBOSE("run slots completed", {});
     }
 
@@ -2323,10 +3205,13 @@ static void server_print_usage(const char * argv0, const gpt_params & params, co
     printf("\n");
     printf("options:\n");
     printf("  -h, --help                show this help message and exit\n");
+    printf("  --args-file FNAME         read more arguments from FNAME, e.g. a configuration written by llama-bench --autotune\n");
     printf("  -v, --verbose             verbose output (default: %s)\n", server_verbose ? "enabled" : "disabled");
     printf("  -t N, --threads N         number of threads to use during computation (default: %d)\n", params.n_threads);
     printf("  -tb N, --threads-batch N  number of threads to use during batch and prompt processing (default: same as --threads)\n");
+    printf("  --poll N                  busy-wait level of idle worker threads before they sleep, 0-100 (default: %d, -1 = no thread pool)\n", params.poll);
     printf("  --threads-http N          number of threads in the http server pool to process requests (default: max(hardware concurrency - 1, --parallel N + 2))\n");
+    printf("  --threads-sampling N      number of threads that sample the tokens of the slots after each batch (default: min(--threads N, --parallel N))\n");
     printf("  -c N, --ctx-size N        size of the prompt context (default: %d)\n", params.n_ctx);
     printf("  --rope-scaling {none,linear,yarn}\n");
     printf("                            RoPE frequency scaling method, defaults to linear unless specified by the model\n");
@@ -2351,6 +3236,8 @@ static void server_print_usage(const char * argv0, const gpt_params & params, co
     printf("                              - distribute: spread execution evenly over all nodes\n");
     printf("                              - isolate: only spawn threads on CPUs on the node that execution started on\n");
     printf("                              - numactl: use the CPU map provided my numactl\n");
+    printf("  --cpu-stages N            split the layers kept on the CPU across N CPU backends with their own threads,\n");
+    printf("                            e.g. one per NUMA node, and run them as a pipeline over the ubatches (default: %d)\n", params.n_cpu_stages);
     if (llama_supports_gpu_offload()) {
         printf("  -ngl N, --n-gpu-layers N\n");
         printf("                            number of layers to store in VRAM\n");
@@ -2363,6 +3250,7 @@ static void server_print_usage(const char * argv0, const gpt_params & params, co
         printf("                            fraction of the model to offload to each GPU, comma-separated list of proportions, e.g. 3,1\n");
         printf("  -mg i, --main-gpu i       the GPU to use for the model (with split-mode = none),\n");
         printf("                            or for intermediate results and KV (with split-mode = row)\n");
+        printf("  --rpc SERVERS             comma separated list of RPC servers (host:port) to offload layers to\n");
         printf("  -nkvo, --no-kv-offload\n");
         printf("                            disable KV offload\n");
     }
@@ -2376,6 +3264,14 @@ static void server_print_usage(const char * argv0, const gpt_params & params, co
     printf("                            Hugging Face model file (default: unused)\n");
     printf("  -a ALIAS, --alias ALIAS\n");
     printf("                            set an alias for the model, will be added as `model` field in completion response\n");
+    printf("  -md FNAME, --model-draft FNAME\n");
+    printf("                            draft model for speculative decoding (default: unused)\n");
+    if (llama_supports_gpu_offload()) {
+        printf("  -ngld N, --n-gpu-layers-draft N\n");
+        printf("                            number of layers of the draft model to store in VRAM\n");
+    }
+    printf("  --draft-lookup            draft tokens for speculative decoding with n-gram lookup in the slot context (default: %s)\n", sparams.draft_lookup ? "enabled" : "disabled");
+    printf("  --draft N                 max number of tokens to draft per slot for speculative decoding (default: %d)\n", params.n_draft);
     printf("  --lora FNAME              apply LoRA adapter (implies --no-mmap)\n");
     printf("  --lora-base FNAME         optional model to use as a base for the layers modified by the LoRA adapter\n");
     printf("  --host                    ip address to listen (default  (default: %s)\n", sparams.hostname.c_str());
@@ -2391,6 +3287,7 @@ static void server_print_usage(const char * argv0, const gpt_params & params, co
     printf("  --embeddings              enable embedding vector output (default: %s)\n", params.embedding ? "enabled" : "disabled");
     printf("  -np N, --parallel N       number of slots for process requests (default: %d)\n", params.n_parallel);
     printf("  -cb, --cont-batching      enable continuous batching (a.k.a dynamic batching) (default: enabled)\n");
+    printf("  -pb N, --prefill-budget N max number of prompt tokens per batch while other slots are generating, 0 = n_batch (default: %d)\n", sparams.n_prefill_budget);
     printf("  -fa, --flash-attn         enable Flash Attention (default: %s)\n", params.flash_attn ? "enabled" : "disabled");
     printf("  -spf FNAME, --system-prompt-file FNAME\n");
     printf("                            set a file to load a system prompt (initial prompt of all slots), this is useful for chat applications.\n");
@@ -2498,6 +3395,20 @@ static void server_params_parse(int argc, char ** argv, server_params & sparams,
                 break;
             }
             params.model = argv[i];
+        } else if (arg == "-md" || arg == "--model-draft") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            params.model_draft = argv[i];
+        } else if (arg == "--draft-lookup") {
+            sparams.draft_lookup = true;
+        } else if (arg == "--draft") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            params.n_draft = std::stoi(argv[i]);
         } else if (arg == "-mu" || arg == "--model-url") {
             if (++i >= argc) {
                 invalid_param = true;
@@ -2621,12 +3532,24 @@ static void server_params_parse(int argc, char ** argv, server_params & sparams,
                 break;
             }
             params.n_threads_batch = std::stoi(argv[i]);
+        } else if (arg == "--poll") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            params.poll = std::stoi(argv[i]);
         } else if (arg == "--threads-http") {
             if (++i >= argc) {
                 invalid_param = true;
                 break;
             }
             sparams.n_threads_http = std::stoi(argv[i]);
+        } else if (arg == "--threads-sampling") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            sparams.n_threads_sampling = std::stoi(argv[i]);
         } else if (arg == "-b" || arg == "--batch-size") {
             if (++i >= argc) {
                 invalid_param = true;
@@ -2652,6 +3575,19 @@ static void server_params_parse(int argc, char ** argv, server_params & sparams,
                     "See main README.md for information on enabling GPU BLAS support",
                     {{"n_gpu_layers", params.n_gpu_layers}});
             }
+        } else if (arg == "--gpu-layers-draft" || arg == "-ngld" || arg == "--n-gpu-layers-draft") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            if (llama_supports_gpu_offload()) {
+                params.n_gpu_layers_draft = std::stoi(argv[i]);
+            } else {
+                LOG_WARNING(
+                    "Not compiled with GPU offload support, --n-gpu-layers-draft option will be ignored. "
+                    "See main README.md for information on enabling GPU BLAS support",
+                    {{"n_gpu_layers_draft", params.n_gpu_layers_draft}});
+            }
         } else if (arg == "-nkvo" || arg == "--no-kv-offload") {
             params.no_kv_offload = true;
         } else if (arg == "--split-mode" || arg == "-sm") {
@@ -2707,6 +3643,12 @@ static void server_params_parse(int argc, char ** argv, server_params & sparams,
 #else
             LOG_WARNING("llama.cpp was compiled without CUDA. It is not possible to set a main GPU.", {});
 #endif
+        } else if (arg == "--rpc") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            params.rpc_servers = argv[i];
         } else if (arg == "--lora") {
             if (++i >= argc) {
                 invalid_param = true;
@@ -2753,10 +3695,22 @@ static void server_params_parse(int argc, char ** argv, server_params & sparams,
                 else if (value == "numactl")                    { params.numa = GGML_NUMA_STRATEGY_NUMACTL; }
                 else { invalid_param = true; break; }
             }
+        } else if (arg == "--cpu-stages") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            params.n_cpu_stages = std::stoi(argv[i]);
         } else if (arg == "--embedding" || arg == "--embeddings") {
             params.embedding = true;
         } else if (arg == "-cb" || arg == "--cont-batching") {
             params.cont_batching = true;
+        } else if (arg == "-pb" || arg == "--prefill-budget") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            sparams.n_prefill_budget = std::stoi(argv[i]);
         } else if (arg == "-fa" || arg == "--flash-attn") {
             params.flash_attn = true;
         } else if (arg == "-np" || arg == "--parallel") {
@@ -2912,7 +3866,18 @@ int main(int argc, char ** argv) {
     // struct that contains llama context and inference
     server_context ctx_server;
 
-    server_params_parse(argc, argv, sparams, params);
+    std::vector<std::string> args;
+    try {
+        args = gpt_params_expand_args_file(argc, argv);
+    } catch (const std::invalid_argument & ex) {
+        fprintf(stderr, "%s\n", ex.what());
+        return 1;
+    }
+    std::vector<char *> args_ptr;
+    for (auto & arg : args) {
+        args_ptr.push_back(&arg[0]);
+    }
+    server_params_parse((int) args_ptr.size(), args_ptr.data(), sparams, params);
 
     if (!sparams.system_prompt.empty()) {
         ctx_server.system_prompt_set(sparams.system_prompt);
@@ -3017,6 +3982,12 @@ int main(int argc, char ** argv) {
     }
 
     // load the model
+    ctx_server.draft_lookup     = sparams.draft_lookup;
+    ctx_server.n_prefill_budget = sparams.n_prefill_budget;
+
+    // the threads of the computation are idle while the slots are sampled
+    ctx_server.n_threads_sampling = sparams.n_threads_sampling > 0 ? sparams.n_threads_sampling : std::min(params.n_threads, params.n_parallel);
+
     if (!ctx_server.load_model(params)) {
         state.store(SERVER_STATE_ERROR);
         return 1;
@@ -3225,6 +4196,9 @@ int main(int argc, char ** argv) {
 
         const int32_t kv_cache_used_cells = data.at("kv_cache_used_cells");
 
+        // the histograms and the state after the last step are read directly, the main loop updates them without locking
+        const server_metrics & metrics = ctx_server.metrics;
+
         // metrics definition: https://prometheus.io/docs/practices/naming/#metric-names
         json all_metrics_def = json {
             {"counter", {{
@@ -3243,6 +4217,14 @@ int main(int argc, char ** argv) {
                     {"name",  "tokens_predicted_seconds_total"},
                     {"help",  "Predict process time"},
                     {"value",  (uint64_t) data.at("t_tokens_generation_total") / 1.e3}
+            }, {
+                    {"name",  "tokens_drafted_total"},
+                    {"help",  "Number of speculative decoding tokens drafted."},
+                    {"value",  (uint64_t) data.at("n_tokens_drafted_total")}
+            }, {
+                    {"name",  "tokens_drafted_accepted_total"},
+                    {"help",  "Number of speculative decoding drafted tokens accepted by the target model."},
+                    {"value",  (uint64_t) data.at("n_tokens_drafted_accepted_total")}
             }}},
             {"gauge", {{
                     {"name",  "prompt_tokens_seconds"},
@@ -3268,6 +4250,35 @@ int main(int argc, char ** argv) {
                     {"name",  "requests_deferred"},
                     {"help",  "Number of request deferred."},
                     {"value",  (uint64_t) data.at("deferred")}
+            },{
+                    {"name",  "kv_cache_used_cells"},
+                    {"help",  "KV-cache cells used after the last batch."},
+                    {"value",  metrics.kv_cache_used_cells.load(std::memory_order_relaxed)}
+            },{
+                    {"name",  "kv_cache_update_seconds"},
+                    {"help",  "Time spent to defragment and shift the KV-cache before the last batch."},
+                    {"value",  metrics.t_kv_cache_update.load(std::memory_order_relaxed)}
+            }}},
+            {"histogram", {{
+                    {"name",  "queue_wait_seconds"},
+                    {"help",  "Time from the arrival of a request to the start of its prompt processing."},
+                    {"value",  metrics.queue_wait.to_json()}
+            },{
+                    {"name",  "time_to_first_token_seconds"},
+                    {"help",  "Time from the arrival of a request to its first generated token."},
+                    {"value",  metrics.time_to_first_token.to_json()}
+            },{
+                    {"name",  "inter_token_latency_seconds"},
+                    {"help",  "Latency between consecutive generated tokens."},
+                    {"value",  metrics.inter_token_latency.to_json()}
+            },{
+                    {"name",  "prompt_tokens_per_second"},
+                    {"help",  "Prompt processing throughput of a request in tokens/s."},
+                    {"value",  metrics.prompt_throughput.to_json()}
+            },{
+                    {"name",  "batch_fill_ratio"},
+                    {"help",  "Number of tokens of a batch relative to the batch size."},
+                    {"value",  metrics.batch_fill_ratio.to_json()}
             }}}
         };
 
@@ -3281,10 +4292,21 @@ int main(int argc, char ** argv) {
                 const std::string name = metric_def.at("name");
                 const std::string help = metric_def.at("help");
 
-                auto value = json_value(metric_def, "value", 0.);
                 prometheus << "# HELP llamacpp:" << name << " " << help  << "\n"
-                            << "# TYPE llamacpp:" << name << " " << type  << "\n"
-                            << "llamacpp:"        << name << " " << value << "\n";
+                            << "# TYPE llamacpp:" << name << " " << type  << "\n";
+
+                if (type == "histogram") {
+                    const json & histogram = metric_def.at("value");
+                    for (const auto & bucket : histogram.at("buckets")) {
+                        prometheus << "llamacpp:" << name << "_bucket{le=\"" << bucket.at("le").get<std::string>() << "\"} " << bucket.at("count") << "\n";
+                    }
+                    prometheus << "llamacpp:" << name << "_sum "   << histogram.at("sum")   << "\n"
+                               << "llamacpp:" << name << "_count " << histogram.at("count") << "\n";
+                    continue;
+                }
+
+                auto value = json_value(metric_def, "value", 0.);
+                prometheus << "llamacpp:" << name << " " << value << "\n";
             }
         }
 
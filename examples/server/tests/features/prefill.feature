@@ -0,0 +1,56 @@
+@llama.cpp
+@prefill
+Feature: llama.cpp server chunked prefill
+
+  Background: Server startup
+    Given a server listening on localhost:8080
+    And   a model file tinyllamas/stories260K.gguf from HF repo ggml-org/models
+    And   42 as server seed
+    And   2 slots
+    And   128 as batch size
+    And   512 KV cache size
+    And   16 as prefill budget
+    And   continuous batching
+    And   embeddings extraction
+    And   prometheus compatible metrics exposed
+    Then  the server is starting
+    Then  the server is healthy
+
+  Scenario: Long prompt processed in chunks while another slot is generating
+    Given a prompt:
+      """
+      Once upon a time
+      """
+    And a prompt:
+      """
+      Once upon a time, there was a little girl named Lily. She loved to play outside in the park with her friends.
+      One day, she saw a big tree with a swing. She ran to the swing and started to play. Her mom was watching her.
+      """
+    And   64 max tokens to predict
+    Given concurrent completion requests
+    Then  the server is busy
+    Then  the server is idle
+    And   all slots are idle
+    Then  all prompts are predicted with 64 tokens
+    And   prometheus metrics are exposed
+    And   metric llamacpp:queue_wait_seconds has 2 observations
+    And   metric llamacpp:time_to_first_token_seconds has 2 observations
+    And   metric llamacpp:inter_token_latency_seconds has 126 observations
+
+  Scenario: Embedding computed in a single batch while another slot is generating
+    Given a prompt:
+      """
+      Once upon a time
+      """
+    And   64 max tokens to predict
+    Given concurrent completion requests
+    Then  the server is busy
+    When  embeddings are computed for:
+      """
+      Once upon a time, there was a little girl named Lily. She loved to play outside in the park with her friends.
+      One day, she saw a big tree with a swing. She ran to the swing and started to play. Her mom was watching her.
+      """
+    Then  embeddings are generated
+    Then  the server is idle
+    And   all prompts are predicted with 64 tokens
+    And   the embeddings are the same when computed alone
@@ -28,6 +28,24 @@ Feature: Results
       | 1       |
       | 2       |
 
+  Scenario Outline: consistent results with same seed and parallel sampling
+    Given 4 slots
+    And   <n_threads> sampling threads
+    Then  the server is starting
+    Then  the server is healthy
+
+    Given 4 prompts "Title: Little Red Riding Hood But In Space\n\nSummary:" with seed 42
+
+    Given concurrent completion requests
+    Then the server is busy
+    Then the server is idle
+    And  all slots are idle
+    Then all predictions are equal
+    Examples:
+      | n_threads |
+      | 1         |
+      | 4         |
+
   Scenario Outline: different results with different seed
     Given <n_slots> slots
     Then  the server is starting
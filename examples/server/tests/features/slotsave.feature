@@ -56,3 +56,16 @@ Feature: llama.cpp server slot management
     And   a completion request with no api error
     Then  24 tokens are predicted matching (Lily|cake)
     And   22 prompt tokens are processed
+
+  Scenario: Share Cached Prefix Across Slots
+    Given a user prompt "What is the capital of France?"
+    And   using slot id 1
+    And   a completion request with no api error
+    Then  24 tokens are predicted matching (Lily|cake)
+    And   22 prompt tokens are processed
+    # Slot 0 is empty, the common prefix is reused from the cache of slot 1
+    Given a user prompt "What is the capital of Germany?"
+    And   using slot id 0
+    And   a completion request with no api error
+    Then  24 tokens are predicted matching (Thank|special)
+    And   7 prompt tokens are processed
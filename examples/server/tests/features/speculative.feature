@@ -0,0 +1,25 @@
+@llama.cpp
+@speculative
+Feature: llama.cpp server speculative decoding
+
+  Background: Server startup
+    Given a server listening on localhost:8080
+    And   a model file tinyllamas/stories260K.gguf from HF repo ggml-org/models
+    And   42 as server seed
+    And   2 slots
+    And   4 as draft
+    And   speculative decoding with n-gram lookup
+    And   prometheus compatible metrics exposed
+    Then  the server is starting
+    Then  the server is healthy
+
+  Scenario: Completion with n-gram lookup drafting
+    Given a prompt:
+    """
+    Once upon a time, there was a little girl named Lily. She loved to play outside.
+    Once upon a time, there was a little girl named Lily. She loved to
+    """
+    And   64 max tokens to predict
+    And   a completion request with no api error
+    Then  64 tokens are predicted
+    And   prometheus metrics are exposed
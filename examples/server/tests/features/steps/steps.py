@@ -62,6 +62,9 @@ def step_server_config(context, server_fqdn, server_port):
     context.server_process = None
     context.seed = None
     context.draft = None
+    context.draft_lookup = False
+    context.n_prefill_budget = None
+    context.n_threads_sampling = None
     context.server_seed = None
     context.user_api_key = None
     context.response_format = None
@@ -114,6 +117,11 @@ def step_draft(context, draft):
     context.draft = draft
 
 
+@step('speculative decoding with n-gram lookup')
+def step_draft_lookup(context):
+    context.draft_lookup = True
+
+
 @step('{n_ctx:d} KV cache size')
 def step_n_ctx(context, n_ctx):
     context.n_ctx = n_ctx
@@ -368,6 +376,16 @@ def step_n_ubatch(context, n_ubatch):
     context.n_ubatch = n_ubatch
 
 
+@step('{n_prefill_budget:d} as prefill budget')
+def step_n_prefill_budget(context, n_prefill_budget):
+    context.n_prefill_budget = n_prefill_budget
+
+
+@step('{n_threads_sampling:d} sampling threads')
+def step_n_threads_sampling(context, n_threads_sampling):
+    context.n_threads_sampling = n_threads_sampling
+
+
 @step('{seed:d} as seed')
 def step_seed(context, seed):
     if context.seed is None:
@@ -575,7 +593,18 @@ async def all_prompts_are_predicted(context, expected_predicted_n=None):
 @async_run_until_complete
 async def step_compute_embedding(context):
     context.n_prompts = 1
-    context.embeddings = await request_embedding(context_text(context), None, base_url=context.base_url)
+    context.embeddings_content = context_text(context)
+    context.embeddings = await request_embedding(context.embeddings_content, None, base_url=context.base_url)
+
+
+@step('the embeddings are the same when computed alone')
+@async_run_until_complete
+async def step_embeddings_same_alone(context):
+    embeddings = await request_embedding(context.embeddings_content, None, base_url=context.base_url)
+    embedding1 = np.array(context.embeddings[0])
+    embedding2 = np.array(embeddings[0])
+    similarity = np.dot(embedding1, embedding2) / (np.linalg.norm(embedding1) * np.linalg.norm(embedding2))
+    assert np.isclose(similarity, 1.0, rtol=1e-05, atol=1e-08, equal_nan=False), f"similarity: {similarity:.10f}"
 
 
 @step('all embeddings are the same')
@@ -758,6 +787,14 @@ def step_assert_metric_value(context, metric_name, metric_value):
     assert context.metrics[metric_name].samples[0].value == metric_value, f"metric: {context.metrics[metric_name]}"
 
 
+@step('metric {metric_name} has {n_observations:d} observations')
+def step_assert_metric_observations(context, metric_name, n_observations):
+    if metric_name not in context.metrics:
+        assert False, f"no metric {metric_name} in {context.metrics.keys()}"
+    count = [sample.value for sample in context.metrics[metric_name].samples if sample.name.endswith('_count')]
+    assert count == [n_observations], f"metric: {context.metrics[metric_name]}"
+
+
 @step('available models')
 def step_available_models(context):
     # openai client always expects an api_key
@@ -1261,10 +1298,16 @@ def start_server_background(context):
         server_args.extend(['--batch-size', context.n_batch])
     if context.n_ubatch:
         server_args.extend(['--ubatch-size', context.n_ubatch])
+    if context.n_prefill_budget:
+        server_args.extend(['--prefill-budget', context.n_prefill_budget])
+    if context.n_threads_sampling:
+        server_args.extend(['--threads-sampling', context.n_threads_sampling])
     if context.n_gpu_layer:
         server_args.extend(['--n-gpu-layers', context.n_gpu_layer])
     if context.draft is not None:
         server_args.extend(['--draft', context.draft])
+    if context.draft_lookup:
+        server_args.append('--draft-lookup')
     if context.server_continuous_batching:
         server_args.append('--cont-batching')
     if context.server_embeddings:
@@ -1,6 +1,7 @@
 #include "ggml-backend-impl.h"
 #include "ggml-alloc.h"
 #include "ggml-impl.h"
+#include "ggml-quants.h"
 
 #include <assert.h>
 #include <limits.h>
@@ -9,6 +10,15 @@
 #include <stdlib.h>
 #include <string.h>
 
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#ifndef NOMINMAX
+#   define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
 
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
 
@@ -725,13 +735,207 @@ ggml_backend_buffer_type_t ggml_backend_cpu_hbm_buffer_type(void) {
 }
 #endif
 
+// buffer type CPU_REPACK
+// 2D Q4_0/Q8_0 tensors are stored with their rows interleaved in groups of GGML_REPACK_NROWS (see ggml-quants.h),
+// which lets the matrix multiplication compute several rows per pass over the data
+// set_tensor/get_tensor convert from/to the usual layout
+
+GGML_CALL static const char * ggml_backend_cpu_repack_buffer_type_get_name(ggml_backend_buffer_type_t buft) {
+    return "CPU_REPACK";
+
+    GGML_UNUSED(buft);
+}
+
+GGML_CALL static const char * ggml_backend_cpu_repack_buffer_get_name(ggml_backend_buffer_t buf) {
+    return "CPU_REPACK";
+
+    GGML_UNUSED(buf);
+}
+
+GGML_CALL static void ggml_backend_cpu_repack_buffer_init_tensor(ggml_backend_buffer_t buffer, struct ggml_tensor * tensor) {
+    if (ggml_repack_supported(tensor)) {
+        tensor->extra = &ggml_repack_tag;
+    }
+
+    GGML_UNUSED(buffer);
+}
+
+GGML_CALL static void ggml_backend_cpu_repack_buffer_set_tensor(ggml_backend_buffer_t buffer, struct ggml_tensor * tensor, const void * data, size_t offset, size_t size) {
+    if (tensor->extra != &ggml_repack_tag) {
+        memcpy((char *)tensor->data + offset, data, size);
+        return;
+    }
+
+    const int64_t nrows = ggml_nrows(tensor);
+
+    if (offset == 0 && size == ggml_nbytes(tensor)) {
+        ggml_repack_rows(tensor->type, tensor->data, data, nrows, tensor->ne[0]);
+        return;
+    }
+
+    // partial update: unpack, update and repack the whole tensor
+    void * tmp = malloc(ggml_nbytes(tensor));
+    GGML_ASSERT(tmp != NULL);
+    ggml_unpack_rows(tensor->type, tmp, tensor->data, nrows, tensor->ne[0]);
+    memcpy((char *)tmp + offset, data, size);
+    ggml_repack_rows(tensor->type, tensor->data, tmp, nrows, tensor->ne[0]);
+    free(tmp);
+
+    GGML_UNUSED(buffer);
+}
+
+GGML_CALL static void ggml_backend_cpu_repack_buffer_get_tensor(ggml_backend_buffer_t buffer, const struct ggml_tensor * tensor, void * data, size_t offset, size_t size) {
+    if (tensor->extra != &ggml_repack_tag) {
+        memcpy(data, (const char *)tensor->data + offset, size);
+        return;
+    }
+
+    const int64_t nrows = ggml_nrows(tensor);
+
+    if (offset == 0 && size == ggml_nbytes(tensor)) {
+        ggml_unpack_rows(tensor->type, data, tensor->data, nrows, tensor->ne[0]);
+        return;
+    }
+
+    void * tmp = malloc(ggml_nbytes(tensor));
+    GGML_ASSERT(tmp != NULL);
+    ggml_unpack_rows(tensor->type, tmp, tensor->data, nrows, tensor->ne[0]);
+    memcpy(data, (const char *)tmp + offset, size);
+    free(tmp);
+
+    GGML_UNUSED(buffer);
+}
+
+GGML_CALL static bool ggml_backend_cpu_repack_buffer_cpy_tensor(ggml_backend_buffer_t buffer, const struct ggml_tensor * src, struct ggml_tensor * dst) {
+    if (ggml_backend_buffer_is_host(src->buffer)) {
+        ggml_backend_cpu_repack_buffer_set_tensor(buffer, dst, src->data, 0, ggml_nbytes(src));
+        return true;
+    }
+    return false;
+}
+
+GGML_CALL static ggml_backend_buffer_t ggml_backend_cpu_repack_buffer_type_alloc_buffer(ggml_backend_buffer_type_t buft, size_t size) {
+    ggml_backend_buffer_t buffer = ggml_backend_buft_alloc_buffer(ggml_backend_cpu_buffer_type(), size);
+    if (buffer == NULL) {
+        return NULL;
+    }
+
+    buffer->buft = buft;
+    buffer->iface.get_name    = ggml_backend_cpu_repack_buffer_get_name;
+    buffer->iface.init_tensor = ggml_backend_cpu_repack_buffer_init_tensor;
+    buffer->iface.set_tensor  = ggml_backend_cpu_repack_buffer_set_tensor;
+    buffer->iface.get_tensor  = ggml_backend_cpu_repack_buffer_get_tensor;
+    buffer->iface.cpy_tensor  = ggml_backend_cpu_repack_buffer_cpy_tensor;
+
+    return buffer;
+}
+
+GGML_CALL static bool ggml_backend_cpu_repack_buffer_type_is_host(ggml_backend_buffer_type_t buft) {
+    return false; // the data of the repacked tensors is not in the usual layout
+
+    GGML_UNUSED(buft);
+}
+
+GGML_CALL ggml_backend_buffer_type_t ggml_backend_cpu_repack_buffer_type(void) {
+    static struct ggml_backend_buffer_type ggml_backend_cpu_buffer_type_repack = {
+        /* .iface    = */ {
+            /* .get_name         = */ ggml_backend_cpu_repack_buffer_type_get_name,
+            /* .alloc_buffer     = */ ggml_backend_cpu_repack_buffer_type_alloc_buffer,
+            /* .get_alignment    = */ ggml_backend_cpu_buffer_type_get_alignment,
+            /* .get_max_size     = */ NULL, // defaults to SIZE_MAX
+            /* .get_alloc_size   = */ NULL, // defaults to ggml_nbytes
+            /* .supports_backend = */ ggml_backend_cpu_buffer_type_supports_backend,
+            /* .is_host          = */ ggml_backend_cpu_repack_buffer_type_is_host,
+        },
+        /* .context  = */ NULL,
+    };
+
+    return &ggml_backend_cpu_buffer_type_repack;
+}
+
+// buffer type CPU_NUMA
+// the rows of the matrices are split in one shard per NUMA node, and the pages of each shard are bound to its node
+// before the data is copied, so that with GGML_NUMA_STRATEGY_DISTRIBUTE each node reads its weights from local memory
+
+GGML_CALL static const char * ggml_backend_cpu_numa_buffer_type_get_name(ggml_backend_buffer_type_t buft) {
+    return "CPU_NUMA";
+
+    GGML_UNUSED(buft);
+}
+
+GGML_CALL static const char * ggml_backend_cpu_numa_buffer_get_name(ggml_backend_buffer_t buf) {
+    return "CPU_NUMA";
+
+    GGML_UNUSED(buf);
+}
+
+GGML_CALL static void ggml_backend_cpu_numa_buffer_init_tensor(ggml_backend_buffer_t buffer, struct ggml_tensor * tensor) {
+    const int n_nodes = ggml_numa_shard_count();
+
+    if (n_nodes < 2 || tensor->view_src != NULL || !ggml_is_contiguous(tensor) ||
+        tensor->ne[2] != 1 || tensor->ne[3] != 1 || tensor->ne[1] < n_nodes) {
+        return;
+    }
+
+    for (int node = 0; node < n_nodes; ++node) {
+        int64_t ir0, ir1;
+        ggml_numa_shard_rows(tensor->ne[1], n_nodes, node, &ir0, &ir1);
+        // placement is only a hint, the shards are computed by their node either way
+        ggml_numa_bind((char *) tensor->data + ir0*tensor->nb[1], (ir1 - ir0)*tensor->nb[1], node);
+    }
+
+    tensor->extra = &ggml_numa_shard_tag;
+
+    GGML_UNUSED(buffer);
+}
+
+GGML_CALL static ggml_backend_buffer_t ggml_backend_cpu_numa_buffer_type_alloc_buffer(ggml_backend_buffer_type_t buft, size_t size) {
+    ggml_backend_buffer_t buffer = ggml_backend_buft_alloc_buffer(ggml_backend_cpu_buffer_type(), size);
+    if (buffer == NULL) {
+        return NULL;
+    }
+
+    buffer->buft = buft;
+    buffer->iface.get_name    = ggml_backend_cpu_numa_buffer_get_name;
+    buffer->iface.init_tensor = ggml_backend_cpu_numa_buffer_init_tensor;
+
+    return buffer;
+}
+
+GGML_CALL ggml_backend_buffer_type_t ggml_backend_cpu_numa_buffer_type(void) {
+    static struct ggml_backend_buffer_type ggml_backend_cpu_buffer_type_numa = {
+        /* .iface    = */ {
+            /* .get_name         = */ ggml_backend_cpu_numa_buffer_type_get_name,
+            /* .alloc_buffer     = */ ggml_backend_cpu_numa_buffer_type_alloc_buffer,
+            /* .get_alignment    = */ ggml_backend_cpu_buffer_type_get_alignment,
+            /* .get_max_size     = */ NULL, // defaults to SIZE_MAX
+            /* .get_alloc_size   = */ NULL, // defaults to ggml_nbytes
+            /* .supports_backend = */ ggml_backend_cpu_buffer_type_supports_backend,
+            /* .is_host          = */ ggml_backend_cpu_buffer_type_is_host,
+        },
+        /* .context  = */ NULL,
+    };
+
+    if (ggml_numa_shard_count() < 2) {
+        return NULL;
+    }
+
+    return &ggml_backend_cpu_buffer_type_numa;
+}
+
+struct ggml_cpu_stage;
+
 struct ggml_backend_cpu_context {
     int n_threads;
     void * work_data;
     size_t work_size;
 
+    struct ggml_threadpool * threadpool; // not owned
+
     ggml_abort_callback abort_callback;
     void *              abort_callback_data;
+
+    struct ggml_cpu_stage * stage; // NULL if the graphs are computed synchronously
 };
 
 GGML_CALL static const char * ggml_backend_cpu_name(ggml_backend_t backend) {
@@ -774,6 +978,7 @@ GGML_CALL static ggml_backend_graph_plan_t ggml_backend_cpu_graph_plan_create(gg
         }
     }
 
+    cpu_plan->cplan.threadpool          = cpu_ctx->threadpool;
     cpu_plan->cplan.abort_callback      = cpu_ctx->abort_callback;
     cpu_plan->cplan.abort_callback_data = cpu_ctx->abort_callback_data;
 
@@ -812,6 +1017,7 @@ GGML_CALL static enum ggml_status ggml_backend_cpu_graph_compute(ggml_backend_t
         cpu_ctx->work_size = cplan.work_size;
     }
     cplan.work_data = cpu_ctx->work_data;
+    cplan.threadpool = cpu_ctx->threadpool;
 
     cplan.abort_callback      = cpu_ctx->abort_callback;
     cplan.abort_callback_data = cpu_ctx->abort_callback_data;
@@ -829,6 +1035,10 @@ GGML_CALL static bool ggml_backend_cpu_supports_op(ggml_backend_t backend, const
                 op->type != GGML_TYPE_IQ1_M; // missing type_traits.from_float
         case GGML_OP_MUL_MAT:
             return op->src[1]->type == GGML_TYPE_F32 || op->src[1]->type == ggml_internal_get_type_traits(op->src[0]->type).vec_dot_type;
+        case GGML_OP_FLASH_ATTN_EXT:
+            return
+                ggml_internal_get_type_traits(ggml_internal_get_type_traits(op->src[1]->type).vec_dot_type).from_float != NULL &&
+                ggml_internal_get_type_traits(op->src[2]->type).to_float != NULL;
         default:
             return true;
     }
@@ -871,8 +1081,10 @@ ggml_backend_t ggml_backend_cpu_init(void) {
     ctx->n_threads           = GGML_DEFAULT_N_THREADS;
     ctx->work_data           = NULL;
     ctx->work_size           = 0;
+    ctx->threadpool          = NULL;
     ctx->abort_callback      = NULL;
     ctx->abort_callback_data = NULL;
+    ctx->stage               = NULL;
 
     ggml_backend_t cpu_backend = malloc(sizeof(struct ggml_backend));
     if (cpu_backend == NULL) {
@@ -899,6 +1111,13 @@ void ggml_backend_cpu_set_n_threads(ggml_backend_t backend_cpu, int n_threads) {
     ctx->n_threads = n_threads;
 }
 
+void ggml_backend_cpu_set_threadpool(ggml_backend_t backend_cpu, struct ggml_threadpool * threadpool) {
+    GGML_ASSERT(ggml_backend_is_cpu(backend_cpu));
+
+    struct ggml_backend_cpu_context * ctx = (struct ggml_backend_cpu_context *)backend_cpu->context;
+    ctx->threadpool = threadpool;
+}
+
 void ggml_backend_cpu_set_abort_callback(ggml_backend_t backend_cpu, ggml_abort_callback abort_callback, void * abort_callback_data) {
     GGML_ASSERT(ggml_backend_is_cpu(backend_cpu));
 
@@ -919,6 +1138,590 @@ GGML_CALL static ggml_backend_t ggml_backend_reg_cpu_init(const char * params, v
     GGML_UNUSED(user_data);
 }
 
+// CPU pipeline stages
+// a stage is a CPU backend that computes its graphs on its own worker thread, so that the splits of consecutive graphs
+// (e.g. the ubatches of a batch) run on several stages at the same time, like a pipeline
+// the tasks queued on a stage run in order, and the dependencies between the stages are expressed with the number of
+// tasks that a stage has completed
+
+#if defined(_WIN32)
+typedef HANDLE             ggml_cpu_stage_thread_t;
+typedef SRWLOCK            ggml_cpu_stage_mutex_t;
+typedef CONDITION_VARIABLE ggml_cpu_stage_cond_t;
+
+static void ggml_cpu_stage_mutex_init   (ggml_cpu_stage_mutex_t * m) { InitializeSRWLock(m); }
+static void ggml_cpu_stage_mutex_destroy(ggml_cpu_stage_mutex_t * m) { GGML_UNUSED(m); }
+static void ggml_cpu_stage_mutex_lock   (ggml_cpu_stage_mutex_t * m) { AcquireSRWLockExclusive(m); }
+static void ggml_cpu_stage_mutex_unlock (ggml_cpu_stage_mutex_t * m) { ReleaseSRWLockExclusive(m); }
+
+static void ggml_cpu_stage_cond_init     (ggml_cpu_stage_cond_t * c) { InitializeConditionVariable(c); }
+static void ggml_cpu_stage_cond_destroy  (ggml_cpu_stage_cond_t * c) { GGML_UNUSED(c); }
+static void ggml_cpu_stage_cond_wait     (ggml_cpu_stage_cond_t * c, ggml_cpu_stage_mutex_t * m) { SleepConditionVariableSRW(c, m, INFINITE, 0); }
+static void ggml_cpu_stage_cond_broadcast(ggml_cpu_stage_cond_t * c) { WakeAllConditionVariable(c); }
+#else
+typedef pthread_t       ggml_cpu_stage_thread_t;
+typedef pthread_mutex_t ggml_cpu_stage_mutex_t;
+typedef pthread_cond_t  ggml_cpu_stage_cond_t;
+
+static void ggml_cpu_stage_mutex_init   (ggml_cpu_stage_mutex_t * m) { pthread_mutex_init(m, NULL); }
+static void ggml_cpu_stage_mutex_destroy(ggml_cpu_stage_mutex_t * m) { pthread_mutex_destroy(m); }
+static void ggml_cpu_stage_mutex_lock   (ggml_cpu_stage_mutex_t * m) { pthread_mutex_lock(m); }
+static void ggml_cpu_stage_mutex_unlock (ggml_cpu_stage_mutex_t * m) { pthread_mutex_unlock(m); }
+
+static void ggml_cpu_stage_cond_init     (ggml_cpu_stage_cond_t * c) { pthread_cond_init(c, NULL); }
+static void ggml_cpu_stage_cond_destroy  (ggml_cpu_stage_cond_t * c) { pthread_cond_destroy(c); }
+static void ggml_cpu_stage_cond_wait     (ggml_cpu_stage_cond_t * c, ggml_cpu_stage_mutex_t * m) { pthread_cond_wait(c, m); }
+static void ggml_cpu_stage_cond_broadcast(ggml_cpu_stage_cond_t * c) { pthread_cond_broadcast(c); }
+#endif
+
+enum ggml_cpu_stage_op {
+    GGML_CPU_STAGE_OP_NONE,   // only wait
+    GGML_CPU_STAGE_OP_GRAPH,  // compute a graph
+    GGML_CPU_STAGE_OP_MEMCPY, // copy tensor data
+};
+
+struct ggml_cpu_stage_task {
+    enum ggml_cpu_stage_op op;
+
+    // wait until wait_stage has completed wait_n tasks before running the task
+    struct ggml_cpu_stage * wait_stage;
+    uint64_t                wait_n;
+
+    // GGML_CPU_STAGE_OP_GRAPH
+    struct ggml_cgraph *     graph; // private copy, see ggml_cpu_stage_graph_dup
+    int                      n_threads;
+    struct ggml_threadpool * threadpool;
+    ggml_abort_callback      abort_callback;
+    void *                   abort_callback_data;
+
+    // GGML_CPU_STAGE_OP_MEMCPY
+    void *       dst;
+    const void * src;
+    size_t       size;
+
+    struct ggml_cpu_stage_task * next;
+};
+
+struct ggml_cpu_stage {
+    int id;
+
+    struct ggml_backend_cpu_context * ctx; // the work buffer is only used by the worker
+
+    ggml_cpu_stage_thread_t thread;
+    ggml_cpu_stage_mutex_t  mutex;
+    ggml_cpu_stage_cond_t   cond_task; // a task was queued or the worker has to stop
+    ggml_cpu_stage_cond_t   cond_done; // a task was completed
+
+    struct ggml_cpu_stage_task * head;
+    struct ggml_cpu_stage_task * tail;
+
+    uint64_t n_queued; // tasks queued since the stage was created (only modified by the thread that queues the tasks)
+    uint64_t n_done;   // tasks completed
+    uint64_t n_wait;   // tasks that must be completed before another stage may overwrite the inputs of this stage
+    bool     stop;
+
+    enum ggml_status status; // first error of the graphs computed since it was last reported
+};
+
+static void ggml_cpu_stage_wait(struct ggml_cpu_stage * stage, uint64_t n) {
+    ggml_cpu_stage_mutex_lock(&stage->mutex);
+    while (stage->n_done < n) {
+        ggml_cpu_stage_cond_wait(&stage->cond_done, &stage->mutex);
+    }
+    ggml_cpu_stage_mutex_unlock(&stage->mutex);
+}
+
+static void ggml_cpu_stage_push(struct ggml_cpu_stage * stage, struct ggml_cpu_stage_task task) {
+    struct ggml_cpu_stage_task * t = malloc(sizeof(struct ggml_cpu_stage_task));
+    GGML_ASSERT(t != NULL);
+    *t = task;
+    t->next = NULL;
+
+    ggml_cpu_stage_mutex_lock(&stage->mutex);
+    if (stage->tail != NULL) {
+        stage->tail->next = t;
+    } else {
+        stage->head = t;
+    }
+    stage->tail = t;
+    stage->n_queued++;
+    ggml_cpu_stage_cond_broadcast(&stage->cond_task);
+    ggml_cpu_stage_mutex_unlock(&stage->mutex);
+}
+
+static void ggml_cpu_stage_run(struct ggml_cpu_stage * stage, struct ggml_cpu_stage_task * task) {
+    if (task->wait_stage != NULL) {
+        ggml_cpu_stage_wait(task->wait_stage, task->wait_n);
+    }
+
+    switch (task->op) {
+        case GGML_CPU_STAGE_OP_NONE:
+            break;
+        case GGML_CPU_STAGE_OP_GRAPH:
+            {
+                struct ggml_backend_cpu_context * ctx = stage->ctx;
+
+                struct ggml_cplan cplan = ggml_graph_plan(task->graph, task->n_threads);
+
+                enum ggml_status status = GGML_STATUS_SUCCESS;
+                if (ctx->work_size < cplan.work_size) {
+                    free(ctx->work_data);
+                    ctx->work_data = malloc(cplan.work_size);
+                    ctx->work_size = ctx->work_data != NULL ? cplan.work_size : 0;
+                    if (ctx->work_data == NULL) {
+                        status = GGML_STATUS_ALLOC_FAILED;
+                    }
+                }
+                if (status == GGML_STATUS_SUCCESS) {
+                    cplan.work_data           = ctx->work_data;
+                    cplan.threadpool          = task->threadpool;
+                    cplan.abort_callback      = task->abort_callback;
+                    cplan.abort_callback_data = task->abort_callback_data;
+
+                    status = ggml_graph_compute(task->graph, &cplan);
+                }
+                free(task->graph);
+
+                if (status != GGML_STATUS_SUCCESS) {
+                    ggml_cpu_stage_mutex_lock(&stage->mutex);
+                    if (stage->status == GGML_STATUS_SUCCESS) {
+                        stage->status = status;
+                    }
+                    ggml_cpu_stage_mutex_unlock(&stage->mutex);
+                }
+            } break;
+        case GGML_CPU_STAGE_OP_MEMCPY:
+            memcpy(task->dst, task->src, task->size);
+            break;
+    }
+}
+
+#if defined(_WIN32)
+static DWORD WINAPI ggml_cpu_stage_main(LPVOID data) {
+#else
+static void * ggml_cpu_stage_main(void * data) {
+#endif
+    struct ggml_cpu_stage * stage = data;
+
+    for (;;) {
+        ggml_cpu_stage_mutex_lock(&stage->mutex);
+        while (stage->head == NULL && !stage->stop) {
+            ggml_cpu_stage_cond_wait(&stage->cond_task, &stage->mutex);
+        }
+        struct ggml_cpu_stage_task * task = stage->head;
+        if (task != NULL) {
+            stage->head = task->next;
+            if (stage->head == NULL) {
+                stage->tail = NULL;
+            }
+        }
+        ggml_cpu_stage_mutex_unlock(&stage->mutex);
+
+        if (task == NULL) {
+            break;
+        }
+
+        ggml_cpu_stage_run(stage, task);
+        free(task);
+
+        ggml_cpu_stage_mutex_lock(&stage->mutex);
+        stage->n_done++;
+        ggml_cpu_stage_cond_broadcast(&stage->cond_done);
+        ggml_cpu_stage_mutex_unlock(&stage->mutex);
+    }
+
+    return 0;
+}
+
+// the sched reuses the nodes of a split and its input copies for the next graph while the worker may still be computing
+// the split, so the worker computes a copy of the nodes and of their sources, allocated in a single block
+static struct ggml_cgraph * ggml_cpu_stage_graph_dup(struct ggml_cgraph * graph) {
+    const int n_nodes = graph->n_nodes;
+
+    struct ggml_hash_set hash_set = ggml_hash_set_new((size_t) n_nodes*(GGML_MAX_SRC + 1));
+
+    size_t n_tensors = 0;
+    for (int i = 0; i < n_nodes; i++) {
+        struct ggml_tensor * node = graph->nodes[i];
+        if (ggml_hash_insert(hash_set, node) != GGML_HASHTABLE_ALREADY_EXISTS) {
+            n_tensors++;
+        }
+        for (int j = 0; j < GGML_MAX_SRC; j++) {
+            if (node->src[j] != NULL && ggml_hash_insert(hash_set, node->src[j]) != GGML_HASHTABLE_ALREADY_EXISTS) {
+                n_tensors++;
+            }
+        }
+    }
+
+    const size_t size = sizeof(struct ggml_cgraph) + n_nodes*sizeof(struct ggml_tensor *) + n_tensors*sizeof(struct ggml_tensor);
+    char * data = malloc(size);
+    struct ggml_tensor ** copies = calloc(hash_set.size, sizeof(struct ggml_tensor *));
+    GGML_ASSERT(data != NULL && copies != NULL);
+
+    struct ggml_cgraph  * cgraph  = (struct ggml_cgraph *) data;
+    struct ggml_tensor ** nodes   = (struct ggml_tensor **) (cgraph + 1);
+    struct ggml_tensor  * tensors = (struct ggml_tensor *) (nodes + n_nodes);
+
+    size_t n_copied = 0;
+    for (int i = 0; i < n_nodes; i++) {
+        for (int j = -1; j < GGML_MAX_SRC; j++) {
+            struct ggml_tensor * t = j < 0 ? graph->nodes[i] : graph->nodes[i]->src[j];
+            if (t == NULL) {
+                continue;
+            }
+            const size_t id = ggml_hash_find(hash_set, t);
+            if (copies[id] == NULL) {
+                // the sources of a node are earlier nodes or leafs, only the data of the leafs is needed
+                struct ggml_tensor * copy = &tensors[n_copied++];
+                *copy = *t;
+                memset(copy->src, 0, sizeof(copy->src));
+                copy->view_src = NULL;
+                copies[id] = copy;
+            }
+            if (j < 0) {
+                nodes[i] = copies[id];
+            } else {
+                nodes[i]->src[j] = copies[id];
+            }
+        }
+    }
+    GGML_ASSERT(n_copied == n_tensors);
+
+    *cgraph = ggml_graph_view(graph, 0, n_nodes);
+    cgraph->nodes = nodes;
+    cgraph->grads = NULL;
+
+    free(copies);
+    free(hash_set.keys);
+
+    return cgraph;
+}
+
+// buffer type CPU_STAGE<i>
+// the tensors in these buffers are computed by stage i, and with several NUMA nodes the pages are bound to node i % n_nodes
+
+static char ggml_backend_cpu_stage_names[GGML_CPU_MAX_STAGES][16];
+
+GGML_CALL static const char * ggml_backend_cpu_stage_buffer_type_get_name(ggml_backend_buffer_type_t buft) {
+    return ggml_backend_cpu_stage_names[(intptr_t) buft->context];
+}
+
+GGML_CALL static const char * ggml_backend_cpu_stage_buffer_get_name(ggml_backend_buffer_t buf) {
+    return ggml_backend_cpu_stage_names[(intptr_t) buf->buft->context];
+}
+
+GGML_CALL static ggml_backend_buffer_t ggml_backend_cpu_stage_buffer_type_alloc_buffer(ggml_backend_buffer_type_t buft, size_t size) {
+    ggml_backend_buffer_t buffer = ggml_backend_buft_alloc_buffer(ggml_backend_cpu_buffer_type(), size);
+    if (buffer == NULL) {
+        return NULL;
+    }
+
+    buffer->buft = buft;
+    buffer->iface.get_name = ggml_backend_cpu_stage_buffer_get_name;
+
+    if (ggml_is_numa()) {
+        // the buffer is not touched yet, its pages are allocated on the node when they are first written
+        ggml_numa_bind(ggml_backend_buffer_get_base(buffer), size, (int) ((intptr_t) buft->context % ggml_numa_n_nodes()));
+    }
+
+    return buffer;
+}
+
+GGML_CALL static bool ggml_backend_cpu_stage_buffer_type_supports_backend(ggml_backend_buffer_type_t buft, ggml_backend_t backend) {
+    if (!ggml_backend_is_cpu(backend)) {
+        return false;
+    }
+
+    const struct ggml_backend_cpu_context * ctx = (const struct ggml_backend_cpu_context *) backend->context;
+    return ctx->stage != NULL && ctx->stage->id == (intptr_t) buft->context;
+}
+
+GGML_CALL ggml_backend_buffer_type_t ggml_backend_cpu_stage_buffer_type(int stage) {
+    static struct ggml_backend_buffer_type ggml_backend_cpu_buffer_type_stage[GGML_CPU_MAX_STAGES];
+    static bool initialized = false;
+
+    GGML_ASSERT(stage >= 0 && stage < GGML_CPU_MAX_STAGES);
+
+    if (!initialized) {
+        for (int i = 0; i < GGML_CPU_MAX_STAGES; i++) {
+            snprintf(ggml_backend_cpu_stage_names[i], sizeof(ggml_backend_cpu_stage_names[i]), "CPU_STAGE%d", i);
+            ggml_backend_cpu_buffer_type_stage[i] = (struct ggml_backend_buffer_type) {
+                /* .iface    = */ {
+                    /* .get_name         = */ ggml_backend_cpu_stage_buffer_type_get_name,
+                    /* .alloc_buffer     = */ ggml_backend_cpu_stage_buffer_type_alloc_buffer,
+                    /* .get_alignment    = */ ggml_backend_cpu_buffer_type_get_alignment,
+                    /* .get_max_size     = */ NULL, // defaults to SIZE_MAX
+                    /* .get_alloc_size   = */ NULL, // defaults to ggml_nbytes
+                    /* .supports_backend = */ ggml_backend_cpu_stage_buffer_type_supports_backend,
+                    /* .is_host          = */ ggml_backend_cpu_buffer_type_is_host,
+                },
+                /* .context  = */ (void *) (intptr_t) i,
+            };
+        }
+        initialized = true;
+    }
+
+    return &ggml_backend_cpu_buffer_type_stage[stage];
+}
+
+static bool ggml_backend_buft_is_cpu_stage(ggml_backend_buffer_type_t buft) {
+    return buft->iface.get_name == ggml_backend_cpu_stage_buffer_type_get_name;
+}
+
+static bool ggml_backend_is_cpu_stage(ggml_backend_t backend) {
+    return ggml_backend_is_cpu(backend) && ((struct ggml_backend_cpu_context *) backend->context)->stage != NULL;
+}
+
+// backend
+
+GGML_CALL static const char * ggml_backend_cpu_stage_name(ggml_backend_t backend) {
+    struct ggml_backend_cpu_context * cpu_ctx = (struct ggml_backend_cpu_context *)backend->context;
+    return ggml_backend_cpu_stage_names[cpu_ctx->stage->id];
+}
+
+GGML_CALL static void ggml_backend_cpu_stage_synchronize(ggml_backend_t backend) {
+    struct ggml_backend_cpu_context * cpu_ctx = (struct ggml_backend_cpu_context *)backend->context;
+    ggml_cpu_stage_wait(cpu_ctx->stage, cpu_ctx->stage->n_queued);
+}
+
+GGML_CALL static void ggml_backend_cpu_stage_free(ggml_backend_t backend) {
+    struct ggml_backend_cpu_context * cpu_ctx = (struct ggml_backend_cpu_context *)backend->context;
+    struct ggml_cpu_stage * stage = cpu_ctx->stage;
+
+    ggml_backend_cpu_stage_synchronize(backend);
+
+    ggml_cpu_stage_mutex_lock(&stage->mutex);
+    stage->stop = true;
+    ggml_cpu_stage_cond_broadcast(&stage->cond_task);
+    ggml_cpu_stage_mutex_unlock(&stage->mutex);
+
+#if defined(_WIN32)
+    WaitForSingleObject(stage->thread, INFINITE);
+    CloseHandle(stage->thread);
+#else
+    pthread_join(stage->thread, NULL);
+#endif
+
+    ggml_cpu_stage_cond_destroy(&stage->cond_done);
+    ggml_cpu_stage_cond_destroy(&stage->cond_task);
+    ggml_cpu_stage_mutex_destroy(&stage->mutex);
+    free(stage);
+
+    free(cpu_ctx->work_data);
+    free(cpu_ctx);
+    free(backend);
+}
+
+GGML_CALL static ggml_backend_buffer_type_t ggml_backend_cpu_stage_get_default_buffer_type(ggml_backend_t backend) {
+    struct ggml_backend_cpu_context * cpu_ctx = (struct ggml_backend_cpu_context *)backend->context;
+    return ggml_backend_cpu_stage_buffer_type(cpu_ctx->stage->id);
+}
+
+GGML_CALL static void ggml_backend_cpu_stage_set_tensor_async(ggml_backend_t backend, struct ggml_tensor * tensor, const void * data, size_t offset, size_t size) {
+    struct ggml_backend_cpu_context * cpu_ctx = (struct ggml_backend_cpu_context *)backend->context;
+    GGML_ASSERT(ggml_backend_buffer_is_host(tensor->buffer));
+
+    ggml_cpu_stage_push(cpu_ctx->stage, (struct ggml_cpu_stage_task) {
+        .op   = GGML_CPU_STAGE_OP_MEMCPY,
+        .dst  = (char *) tensor->data + offset,
+        .src  = data,
+        .size = size,
+    });
+}
+
+GGML_CALL static void ggml_backend_cpu_stage_get_tensor_async(ggml_backend_t backend, const struct ggml_tensor * tensor, void * data, size_t offset, size_t size) {
+    struct ggml_backend_cpu_context * cpu_ctx = (struct ggml_backend_cpu_context *)backend->context;
+    GGML_ASSERT(ggml_backend_buffer_is_host(tensor->buffer));
+
+    ggml_cpu_stage_push(cpu_ctx->stage, (struct ggml_cpu_stage_task) {
+        .op   = GGML_CPU_STAGE_OP_MEMCPY,
+        .dst  = data,
+        .src  = (const char *) tensor->data + offset,
+        .size = size,
+    });
+}
+
+GGML_CALL static bool ggml_backend_cpu_stage_cpy_tensor_async(ggml_backend_t backend_src, ggml_backend_t backend_dst, const struct ggml_tensor * src, struct ggml_tensor * dst) {
+    if (!ggml_backend_is_cpu(backend_src) || !ggml_backend_buffer_is_host(src->buffer) || !ggml_backend_buffer_is_host(dst->buffer)) {
+        return false;
+    }
+
+    struct ggml_cpu_stage * stage_src = ((struct ggml_backend_cpu_context *)backend_src->context)->stage;
+    struct ggml_cpu_stage * stage_dst = ((struct ggml_backend_cpu_context *)backend_dst->context)->stage;
+
+    if (stage_src == NULL) {
+        // the synchronous CPU backend has already computed src
+        ggml_cpu_stage_wait(stage_dst, stage_dst->n_wait);
+        memcpy(dst->data, src->data, ggml_nbytes(src));
+        return true;
+    }
+
+    // copy on the source stage before it can overwrite src with its next graph, once the destination stage is done
+    // with the previous data of dst, and make the destination stage wait for the copy
+    ggml_cpu_stage_push(stage_src, (struct ggml_cpu_stage_task) {
+        .op         = GGML_CPU_STAGE_OP_MEMCPY,
+        .wait_stage = stage_dst,
+        .wait_n     = stage_dst->n_wait,
+        .dst        = dst->data,
+        .src        = src->data,
+        .size       = ggml_nbytes(src),
+    });
+    ggml_cpu_stage_push(stage_dst, (struct ggml_cpu_stage_task) {
+        .op         = GGML_CPU_STAGE_OP_NONE,
+        .wait_stage = stage_src,
+        .wait_n     = stage_src->n_queued,
+    });
+
+    return true;
+}
+
+GGML_CALL static enum ggml_status ggml_backend_cpu_stage_graph_compute(ggml_backend_t backend, struct ggml_cgraph * cgraph) {
+    struct ggml_backend_cpu_context * cpu_ctx = (struct ggml_backend_cpu_context *)backend->context;
+    struct ggml_cpu_stage * stage = cpu_ctx->stage;
+
+    // report the errors of the previous graphs
+    ggml_cpu_stage_mutex_lock(&stage->mutex);
+    enum ggml_status status = stage->status;
+    stage->status = GGML_STATUS_SUCCESS;
+    ggml_cpu_stage_mutex_unlock(&stage->mutex);
+    if (status != GGML_STATUS_SUCCESS) {
+        return status;
+    }
+
+    if (cgraph->n_nodes == 0) {
+        return GGML_STATUS_SUCCESS;
+    }
+
+    ggml_cpu_stage_push(stage, (struct ggml_cpu_stage_task) {
+        .op                  = GGML_CPU_STAGE_OP_GRAPH,
+        .wait_stage          = NULL,
+        .wait_n              = 0,
+        .graph               = ggml_cpu_stage_graph_dup(cgraph),
+        .n_threads           = cpu_ctx->n_threads,
+        .threadpool          = cpu_ctx->threadpool,
+        .abort_callback      = cpu_ctx->abort_callback,
+        .abort_callback_data = cpu_ctx->abort_callback_data,
+    });
+
+    return GGML_STATUS_SUCCESS;
+}
+
+// events
+// an event is the number of tasks queued on its stage when it was recorded
+
+GGML_CALL static ggml_backend_event_t ggml_backend_cpu_stage_event_new(ggml_backend_t backend) {
+    struct ggml_backend_event * event = malloc(sizeof(struct ggml_backend_event));
+    uint64_t * n = malloc(sizeof(uint64_t));
+    GGML_ASSERT(event != NULL && n != NULL);
+
+    *n = 0;
+    event->backend = backend;
+    event->context = n;
+
+    return event;
+}
+
+GGML_CALL static void ggml_backend_cpu_stage_event_free(ggml_backend_event_t event) {
+    free(event->context);
+    free(event);
+}
+
+GGML_CALL static void ggml_backend_cpu_stage_event_record(ggml_backend_event_t event) {
+    struct ggml_backend_cpu_context * cpu_ctx = (struct ggml_backend_cpu_context *)event->backend->context;
+    *(uint64_t *) event->context = cpu_ctx->stage->n_queued;
+}
+
+GGML_CALL static void ggml_backend_cpu_stage_event_wait(ggml_backend_t backend, ggml_backend_event_t event) {
+    struct ggml_cpu_stage * stage       = ((struct ggml_backend_cpu_context *)backend->context)->stage;
+    struct ggml_cpu_stage * stage_event = ((struct ggml_backend_cpu_context *)event->backend->context)->stage;
+
+    const uint64_t n = *(uint64_t *) event->context;
+
+    if (stage_event == stage) {
+        // the tasks of the stage already run in order, but the copies that other stages make into its buffers have to wait
+        stage->n_wait = MAX(stage->n_wait, n);
+    } else {
+        ggml_cpu_stage_push(stage, (struct ggml_cpu_stage_task) {
+            .op         = GGML_CPU_STAGE_OP_NONE,
+            .wait_stage = stage_event,
+            .wait_n     = n,
+        });
+    }
+}
+
+GGML_CALL static void ggml_backend_cpu_stage_event_synchronize(ggml_backend_event_t event) {
+    struct ggml_backend_cpu_context * cpu_ctx = (struct ggml_backend_cpu_context *)event->backend->context;
+    ggml_cpu_stage_wait(cpu_ctx->stage, *(uint64_t *) event->context);
+}
+
+static struct ggml_backend_i cpu_stage_backend_i = {
+    /* .get_name                = */ ggml_backend_cpu_stage_name,
+    /* .free                    = */ ggml_backend_cpu_stage_free,
+    /* .get_default_buffer_type = */ ggml_backend_cpu_stage_get_default_buffer_type,
+    /* .set_tensor_async        = */ ggml_backend_cpu_stage_set_tensor_async,
+    /* .get_tensor_async        = */ ggml_backend_cpu_stage_get_tensor_async,
+    /* .cpy_tensor_async        = */ ggml_backend_cpu_stage_cpy_tensor_async,
+    /* .synchronize             = */ ggml_backend_cpu_stage_synchronize,
+    /* .graph_plan_create       = */ NULL,
+    /* .graph_plan_free         = */ NULL,
+    /* .graph_plan_compute      = */ NULL,
+    /* .graph_compute           = */ ggml_backend_cpu_stage_graph_compute,
+    /* .supports_op             = */ ggml_backend_cpu_supports_op,
+    /* .offload_op              = */ NULL,
+    /* .event_new               = */ ggml_backend_cpu_stage_event_new,
+    /* .event_free              = */ ggml_backend_cpu_stage_event_free,
+    /* .event_record            = */ ggml_backend_cpu_stage_event_record,
+    /* .event_wait              = */ ggml_backend_cpu_stage_event_wait,
+    /* .event_synchronize       = */ ggml_backend_cpu_stage_event_synchronize,
+};
+
+ggml_backend_t ggml_backend_cpu_stage_init(int stage_id) {
+    GGML_ASSERT(stage_id >= 0 && stage_id < GGML_CPU_MAX_STAGES);
+
+    ggml_backend_t backend = ggml_backend_cpu_init();
+    if (backend == NULL) {
+        return NULL;
+    }
+
+    struct ggml_backend_cpu_context * ctx = (struct ggml_backend_cpu_context *)backend->context;
+
+    struct ggml_cpu_stage * stage = calloc(1, sizeof(struct ggml_cpu_stage));
+    if (stage == NULL) {
+        ggml_backend_free(backend);
+        return NULL;
+    }
+
+    stage->id     = stage_id;
+    stage->ctx    = ctx;
+    stage->status = GGML_STATUS_SUCCESS;
+
+    ggml_cpu_stage_mutex_init(&stage->mutex);
+    ggml_cpu_stage_cond_init(&stage->cond_task);
+    ggml_cpu_stage_cond_init(&stage->cond_done);
+
+#if defined(_WIN32)
+    stage->thread = CreateThread(NULL, 0, ggml_cpu_stage_main, stage, 0, NULL);
+    const bool ok = stage->thread != NULL;
+#else
+    const bool ok = pthread_create(&stage->thread, NULL, ggml_cpu_stage_main, stage) == 0;
+#endif
+    if (!ok) {
+        ggml_cpu_stage_cond_destroy(&stage->cond_done);
+        ggml_cpu_stage_cond_destroy(&stage->cond_task);
+        ggml_cpu_stage_mutex_destroy(&stage->mutex);
+        free(stage);
+        ggml_backend_free(backend);
+        return NULL;
+    }
+
+    ggml_backend_cpu_stage_buffer_type(stage_id); // initialize the names
+
+    ctx->stage     = stage;
+    backend->iface = cpu_stage_backend_i;
+
+    return backend;
+}
+
 // multi-buffer buffer
 
 struct ggml_backend_multi_buffer_context {
@@ -1104,11 +1907,23 @@ static int ggml_backend_sched_backend_from_buffer(ggml_backend_sched_t sched, co
     }
 
     // find highest prio backend that supports the buffer type
+    // the CPU buffer types are supported by all the CPU pipeline stages: a stage only gets the tensors of its own buffer
+    // type, the tensors of the other CPU buffers go to the plain CPU backend, or to the first stage if there is none
+    int stage_backend_id = -1;
     for (int i = 0; i < sched->n_backends; i++) {
         if (ggml_backend_buft_supports_backend(buffer->buft, sched->backends[i])) {
+            if (ggml_backend_is_cpu_stage(sched->backends[i]) && !ggml_backend_buft_is_cpu_stage(buffer->buft)) {
+                if (stage_backend_id == -1) {
+                    stage_backend_id = i;
+                }
+                continue;
+            }
             return i;
         }
     }
+    if (stage_backend_id != -1) {
+        return stage_backend_id;
+    }
 
     fprintf(stderr, "%s: error: no backend supports buffer type %s used in tensor %s\n",
         __func__, ggml_backend_buffer_name(buffer), tensor->name);
@@ -1887,16 +2702,16 @@ ggml_backend_t ggml_backend_sched_get_tensor_backend(ggml_backend_sched_t sched,
 
 // utils
 
-void ggml_backend_view_init(ggml_backend_buffer_t buffer, struct ggml_tensor * tensor) {
+void ggml_backend_view_init(struct ggml_tensor * tensor) {
     GGML_ASSERT(tensor->buffer == NULL);
     GGML_ASSERT(tensor->view_src != NULL);
     GGML_ASSERT(tensor->view_src->buffer != NULL);
     GGML_ASSERT(tensor->view_src->data != NULL);
 
-    tensor->buffer = buffer;
+    tensor->buffer = tensor->view_src->buffer;
     tensor->data = (char *)tensor->view_src->data + tensor->view_offs;
     tensor->backend = tensor->view_src->backend;
-    ggml_backend_buffer_init_tensor(buffer, tensor);
+    ggml_backend_buffer_init_tensor(tensor->buffer, tensor);
 }
 
 void ggml_backend_tensor_alloc(ggml_backend_buffer_t buffer, struct ggml_tensor * tensor, void * addr) {
@@ -1955,7 +2770,7 @@ static void graph_copy_init_tensor(struct ggml_hash_set hash_set, struct ggml_te
     struct ggml_tensor * dst = node_copies[id];
     if (dst->view_src != NULL) {
         graph_copy_init_tensor(hash_set, node_copies, node_init, src->view_src);
-        ggml_backend_view_init(dst->view_src->buffer, dst);
+        ggml_backend_view_init(dst);
     }
     else {
         ggml_backend_tensor_copy(src, dst);
@@ -100,6 +100,7 @@ extern "C" {
 
     GGML_API GGML_CALL bool ggml_backend_is_cpu                (ggml_backend_t backend);
     GGML_API           void ggml_backend_cpu_set_n_threads     (ggml_backend_t backend_cpu, int n_threads);
+    GGML_API           void ggml_backend_cpu_set_threadpool    (ggml_backend_t backend_cpu, struct ggml_threadpool * threadpool); // the pool is not owned by the backend
     GGML_API           void ggml_backend_cpu_set_abort_callback(ggml_backend_t backend_cpu, ggml_abort_callback abort_callback, void * abort_callback_data);
 
     // Create a backend buffer from an existing pointer
@@ -107,6 +108,22 @@ extern "C" {
 
     GGML_API GGML_CALL ggml_backend_buffer_type_t ggml_backend_cpu_buffer_type(void);
 
+    // CPU buffer type that stores the Q4_0/Q8_0 matrices in an interleaved layout for faster matrix multiplication
+    GGML_API GGML_CALL ggml_backend_buffer_type_t ggml_backend_cpu_repack_buffer_type(void);
+
+    // CPU buffer type that splits the rows of the matrices across the NUMA nodes
+    // returns NULL unless ggml_numa_init was called with GGML_NUMA_STRATEGY_DISTRIBUTE on a system with several nodes
+    GGML_API GGML_CALL ggml_backend_buffer_type_t ggml_backend_cpu_numa_buffer_type(void);
+
+    // CPU pipeline stages: CPU backends that compute their graphs asynchronously, in order, on a worker thread of their own
+    // the scheduler assigns to stage i the operations on the tensors of ggml_backend_cpu_stage_buffer_type(i), so with
+    // parallel = true the splits of consecutive graphs run on the stages at the same time
+    // with several NUMA nodes, the buffers of stage i are placed on node i % n_nodes
+#define GGML_CPU_MAX_STAGES 16
+
+    GGML_API           ggml_backend_t             ggml_backend_cpu_stage_init       (int stage);
+    GGML_API GGML_CALL ggml_backend_buffer_type_t ggml_backend_cpu_stage_buffer_type(int stage);
+
 #ifdef GGML_USE_CPU_HBM
     GGML_API ggml_backend_buffer_type_t ggml_backend_cpu_hbm_buffer_type(void);
 #endif
@@ -225,7 +242,7 @@ extern "C" {
 
     // Tensor initialization
     GGML_API void ggml_backend_tensor_alloc(ggml_backend_buffer_t buffer, struct ggml_tensor * tensor, void * addr);
-    GGML_API void ggml_backend_view_init(ggml_backend_buffer_t buffer, struct ggml_tensor * tensor);
+    GGML_API void ggml_backend_view_init(struct ggml_tensor * tensor);
 
 
 #ifdef  __cplusplus
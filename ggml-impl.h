@@ -595,6 +595,20 @@ size_t ggml_hash_insert        (      struct ggml_hash_set hash_set, struct ggml
 // return index, asserts if table is full
 size_t ggml_hash_find_or_insert(      struct ggml_hash_set hash_set, struct ggml_tensor * key);
 
+// NUMA row sharding of matrices (see ggml_backend_cpu_numa_buffer_type)
+// with GGML_NUMA_STRATEGY_DISTRIBUTE thread ith runs on node ith % n_nodes, so each node gets a contiguous
+// shard of the rows of a sharded matrix, placed in its local memory and computed by its own threads
+
+// marks the sharded tensors (tensor->extra)
+extern char ggml_numa_shard_tag;
+
+// number of shards, 0 if the matrices cannot be sharded
+int  ggml_numa_shard_count(void);
+// rows [*ir0, *ir1) of shard i out of n
+void ggml_numa_shard_rows(int64_t nrows, int n, int i, int64_t * ir0, int64_t * ir1);
+// place the pages of [data, data + size) on a node, the partial pages at the ends are left to the neighbouring ranges
+bool ggml_numa_bind(void * data, size_t size, int node);
+
 #ifdef __cplusplus
 }
 #endif
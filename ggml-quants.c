@@ -912,6 +912,23 @@ void dequantize_row_q4_0(const block_q4_0 * restrict x, float * restrict y, int6
 
     const int nb = k / qk;
 
+#if defined(__AVX2__)
+    const __m256i off = _mm256_set1_epi8(8);
+
+    for (int i = 0; i < nb; i++) {
+        const __m256 d = _mm256_set1_ps(GGML_FP16_TO_FP32(x[i].d));
+
+        // the low nibbles are the first 16 values, the high nibbles the last 16
+        const __m256i q  = _mm256_sub_epi8(bytes_from_nibbles_32(x[i].qs), off);
+        const __m128i q0 = _mm256_castsi256_si128(q);
+        const __m128i q1 = _mm256_extracti128_si256(q, 1);
+
+        _mm256_storeu_ps(y + i*qk +  0, _mm256_mul_ps(d, _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(q0))));
+        _mm256_storeu_ps(y + i*qk +  8, _mm256_mul_ps(d, _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(_mm_srli_si128(q0, 8)))));
+        _mm256_storeu_ps(y + i*qk + 16, _mm256_mul_ps(d, _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(q1))));
+        _mm256_storeu_ps(y + i*qk + 24, _mm256_mul_ps(d, _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(_mm_srli_si128(q1, 8)))));
+    }
+#else
     for (int i = 0; i < nb; i++) {
         const float d = GGML_FP16_TO_FP32(x[i].d);
 
@@ -923,6 +940,7 @@ void dequantize_row_q4_0(const block_q4_0 * restrict x, float * restrict y, int6
             y[i*qk + j + qk/2] = x1*d;
         }
     }
+#endif
 }
 
 void dequantize_row_q4_1(const block_q4_1 * restrict x, float * restrict y, int64_t k) {
@@ -3246,8 +3264,6 @@ void dequantize_row_iq1_m(const block_iq1_m * restrict x, float * restrict y, in
     }
 }
 
-static const int8_t kvalues_iq4nl[16] = {-127, -104, -83, -65, -49, -35, -22, -10, 1, 13, 25, 38, 53, 69, 89, 113};
-
 void dequantize_row_iq4_nl(const block_iq4_nl * restrict x, float * restrict y, int64_t k) {
     assert(k % QK4_NL == 0);
     const int64_t nb = k / QK4_NL;
@@ -12691,3 +12707,239 @@ bool ggml_validate_row_data(enum ggml_type type, const void * data, size_t nbyte
 
     return true;
 }
+
+//
+// interleaved layout of the CPU repack buffer type
+//
+
+typedef struct {
+    ggml_half d[GGML_REPACK_NROWS];                  // deltas
+    uint8_t   qs[GGML_REPACK_NROWS*QK4_0/2];         // nibbles, QK4_0/2 bytes per row
+} block_q4_0x4;
+static_assert(sizeof(block_q4_0x4) == GGML_REPACK_NROWS*sizeof(block_q4_0), "wrong q4_0x4 block size/padding");
+
+typedef struct {
+    ggml_half d[GGML_REPACK_NROWS];                  // deltas
+    int8_t    qs[GGML_REPACK_NROWS*QK8_0];           // quants, QK8_0 bytes per row
+} block_q8_0x4;
+static_assert(sizeof(block_q8_0x4) == GGML_REPACK_NROWS*sizeof(block_q8_0), "wrong q8_0x4 block size/padding");
+
+char ggml_repack_tag = 0;
+
+bool ggml_repack_supported(const struct ggml_tensor * tensor) {
+    return (tensor->type == GGML_TYPE_Q4_0 || tensor->type == GGML_TYPE_Q8_0) &&
+        tensor->ne[2] == 1 && tensor->ne[3] == 1 &&
+        tensor->ne[1] % GGML_REPACK_NROWS == 0 &&
+        tensor->view_src == NULL &&
+        ggml_is_contiguous(tensor);
+}
+
+static void repack_rows_q4_0(block_q4_0x4 * restrict y, const block_q4_0 * restrict x, int64_t nrows, int64_t nb) {
+    for (int64_t ir = 0; ir < nrows; ir += GGML_REPACK_NROWS) {
+        for (int64_t i = 0; i < nb; ++i) {
+            for (int r = 0; r < GGML_REPACK_NROWS; ++r) {
+                y[i].d[r] = x[r*nb + i].d;
+                memcpy(y[i].qs + r*QK4_0/2, x[r*nb + i].qs, QK4_0/2);
+            }
+        }
+        x += GGML_REPACK_NROWS*nb;
+        y += nb;
+    }
+}
+
+static void unpack_rows_q4_0(block_q4_0 * restrict y, const block_q4_0x4 * restrict x, int64_t nrows, int64_t nb) {
+    for (int64_t ir = 0; ir < nrows; ir += GGML_REPACK_NROWS) {
+        for (int64_t i = 0; i < nb; ++i) {
+            for (int r = 0; r < GGML_REPACK_NROWS; ++r) {
+                y[r*nb + i].d = x[i].d[r];
+                memcpy(y[r*nb + i].qs, x[i].qs + r*QK4_0/2, QK4_0/2);
+            }
+        }
+        x += nb;
+        y += GGML_REPACK_NROWS*nb;
+    }
+}
+
+static void repack_rows_q8_0(block_q8_0x4 * restrict y, const block_q8_0 * restrict x, int64_t nrows, int64_t nb) {
+    for (int64_t ir = 0; ir < nrows; ir += GGML_REPACK_NROWS) {
+        for (int64_t i = 0; i < nb; ++i) {
+            for (int r = 0; r < GGML_REPACK_NROWS; ++r) {
+                y[i].d[r] = x[r*nb + i].d;
+                memcpy(y[i].qs + r*QK8_0, x[r*nb + i].qs, QK8_0);
+            }
+        }
+        x += GGML_REPACK_NROWS*nb;
+        y += nb;
+    }
+}
+
+static void unpack_rows_q8_0(block_q8_0 * restrict y, const block_q8_0x4 * restrict x, int64_t nrows, int64_t nb) {
+    for (int64_t ir = 0; ir < nrows; ir += GGML_REPACK_NROWS) {
+        for (int64_t i = 0; i < nb; ++i) {
+            for (int r = 0; r < GGML_REPACK_NROWS; ++r) {
+                y[r*nb + i].d = x[i].d[r];
+                memcpy(y[r*nb + i].qs, x[i].qs + r*QK8_0, QK8_0);
+            }
+        }
+        x += nb;
+        y += GGML_REPACK_NROWS*nb;
+    }
+}
+
+void ggml_repack_rows(enum ggml_type type, void * restrict dst, const void * restrict src, int64_t nrows, int64_t n_per_row) {
+    GGML_ASSERT(nrows % GGML_REPACK_NROWS == 0);
+
+    switch (type) {
+        case GGML_TYPE_Q4_0: repack_rows_q4_0(dst, src, nrows, n_per_row/QK4_0); break;
+        case GGML_TYPE_Q8_0: repack_rows_q8_0(dst, src, nrows, n_per_row/QK8_0); break;
+        default: GGML_ASSERT(false && "unsupported type for repacking");
+    }
+}
+
+void ggml_unpack_rows(enum ggml_type type, void * restrict dst, const void * restrict src, int64_t nrows, int64_t n_per_row) {
+    GGML_ASSERT(nrows % GGML_REPACK_NROWS == 0);
+
+    switch (type) {
+        case GGML_TYPE_Q4_0: unpack_rows_q4_0(dst, src, nrows, n_per_row/QK4_0); break;
+        case GGML_TYPE_Q8_0: unpack_rows_q8_0(dst, src, nrows, n_per_row/QK8_0); break;
+        default: GGML_ASSERT(false && "unsupported type for unpacking");
+    }
+}
+
+void ggml_gemm_q4_0x4_q8_0(int n, float * restrict s, size_t bs, const void * restrict vx, const void * restrict vy, size_t by, int nc) {
+    const int qk = QK8_0;
+    const int nb = n / qk;
+
+    assert(n % qk == 0);
+    assert(nc >= 1 && nc <= 4);
+
+    const block_q4_0x4 * restrict x = vx;
+
+#if defined(__AVX2__)
+    const __m256i off = _mm256_set1_epi8(8);
+
+    // one accumulator per row and column: each super-block of x is unpacked once for all the columns
+    __m256 acc[4][GGML_REPACK_NROWS];
+    for (int c = 0; c < nc; ++c) {
+        for (int r = 0; r < GGML_REPACK_NROWS; ++r) {
+            acc[c][r] = _mm256_setzero_ps();
+        }
+    }
+
+    for (int i = 0; i < nb; ++i) {
+        __m256i qx[GGML_REPACK_NROWS];
+        float   dx[GGML_REPACK_NROWS];
+        for (int r = 0; r < GGML_REPACK_NROWS; ++r) {
+            qx[r] = _mm256_sub_epi8(bytes_from_nibbles_32(x[i].qs + r*qk/2), off);
+            dx[r] = GGML_FP16_TO_FP32(x[i].d[r]);
+        }
+
+        for (int c = 0; c < nc; ++c) {
+            const block_q8_0 * restrict y = (const block_q8_0 *) ((const char *) vy + c*by) + i;
+
+            const __m256i qy = _mm256_loadu_si256((const __m256i *) y->qs);
+            const float   dy = GGML_FP16_TO_FP32(y->d);
+
+            for (int r = 0; r < GGML_REPACK_NROWS; ++r) {
+                acc[c][r] = _mm256_fmadd_ps(_mm256_set1_ps(dx[r]*dy), mul_sum_i8_pairs_float(qx[r], qy), acc[c][r]);
+            }
+        }
+    }
+
+    for (int c = 0; c < nc; ++c) {
+        for (int r = 0; r < GGML_REPACK_NROWS; ++r) {
+            s[c*bs + r] = hsum_float_8(acc[c][r]);
+        }
+    }
+#else
+    for (int c = 0; c < nc; ++c) {
+        const block_q8_0 * restrict y = (const block_q8_0 *) ((const char *) vy + c*by);
+
+        for (int r = 0; r < GGML_REPACK_NROWS; ++r) {
+            float sumf = 0.0f;
+
+            for (int i = 0; i < nb; ++i) {
+                const uint8_t * qs = x[i].qs + r*qk/2;
+
+                int sumi = 0;
+                for (int j = 0; j < qk/2; ++j) {
+                    const int v0 = (qs[j] & 0x0F) - 8;
+                    const int v1 = (qs[j] >>   4) - 8;
+
+                    sumi += (v0 * y[i].qs[j]) + (v1 * y[i].qs[j + qk/2]);
+                }
+
+                sumf += sumi*GGML_FP16_TO_FP32(x[i].d[r])*GGML_FP16_TO_FP32(y[i].d);
+            }
+
+            s[c*bs + r] = sumf;
+        }
+    }
+#endif
+}
+
+void ggml_gemm_q8_0x4_q8_0(int n, float * restrict s, size_t bs, const void * restrict vx, const void * restrict vy, size_t by, int nc) {
+    const int qk = QK8_0;
+    const int nb = n / qk;
+
+    assert(n % qk == 0);
+    assert(nc >= 1 && nc <= 4);
+
+    const block_q8_0x4 * restrict x = vx;
+
+#if defined(__AVX2__)
+    __m256 acc[4][GGML_REPACK_NROWS];
+    for (int c = 0; c < nc; ++c) {
+        for (int r = 0; r < GGML_REPACK_NROWS; ++r) {
+            acc[c][r] = _mm256_setzero_ps();
+        }
+    }
+
+    for (int i = 0; i < nb; ++i) {
+        __m256i qx[GGML_REPACK_NROWS];
+        float   dx[GGML_REPACK_NROWS];
+        for (int r = 0; r < GGML_REPACK_NROWS; ++r) {
+            qx[r] = _mm256_loadu_si256((const __m256i *) (x[i].qs + r*qk));
+            dx[r] = GGML_FP16_TO_FP32(x[i].d[r]);
+        }
+
+        for (int c = 0; c < nc; ++c) {
+            const block_q8_0 * restrict y = (const block_q8_0 *) ((const char *) vy + c*by) + i;
+
+            const __m256i qy = _mm256_loadu_si256((const __m256i *) y->qs);
+            const float   dy = GGML_FP16_TO_FP32(y->d);
+
+            for (int r = 0; r < GGML_REPACK_NROWS; ++r) {
+                acc[c][r] = _mm256_fmadd_ps(_mm256_set1_ps(dx[r]*dy), mul_sum_i8_pairs_float(qx[r], qy), acc[c][r]);
+            }
+        }
+    }
+
+    for (int c = 0; c < nc; ++c) {
+        for (int r = 0; r < GGML_REPACK_NROWS; ++r) {
+            s[c*bs + r] = hsum_float_8(acc[c][r]);
+        }
+    }
+#else
+    for (int c = 0; c < nc; ++c) {
+        const block_q8_0 * restrict y = (const block_q8_0 *) ((const char *) vy + c*by);
+
+        for (int r = 0; r < GGML_REPACK_NROWS; ++r) {
+            float sumf = 0.0f;
+
+            for (int i = 0; i < nb; ++i) {
+                const int8_t * qs = x[i].qs + r*qk;
+
+                int sumi = 0;
+                for (int j = 0; j < qk; ++j) {
+                    sumi += qs[j]*y[i].qs[j];
+                }
+
+                sumf += sumi*GGML_FP16_TO_FP32(x[i].d[r])*GGML_FP16_TO_FP32(y[i].d);
+            }
+
+            s[c*bs + r] = sumf;
+        }
+    }
+#endif
+}
@@ -122,6 +122,24 @@ size_t quantize_q5_0(const float * GGML_RESTRICT src, void * GGML_RESTRICT dst,
 size_t quantize_q5_1(const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
 size_t quantize_q8_0(const float * GGML_RESTRICT src, void * GGML_RESTRICT dst, int64_t nrows, int64_t n_per_row, const float * imatrix);
 
+// Interleaved layout of the CPU repack buffer type (ggml_backend_cpu_repack_buffer_type)
+// each group of GGML_REPACK_NROWS rows of a Q4_0/Q8_0 matrix is stored as a sequence of super-blocks,
+// the i-th of which holds the scales and then the quants of the i-th block of every row of the group
+#define GGML_REPACK_NROWS 4
+
+// tensor->extra of the tensors stored in the interleaved layout
+extern char ggml_repack_tag;
+
+bool ggml_repack_supported(const struct ggml_tensor * tensor);
+
+void ggml_repack_rows(enum ggml_type type, void * GGML_RESTRICT dst, const void * GGML_RESTRICT src, int64_t nrows, int64_t n_per_row);
+void ggml_unpack_rows(enum ggml_type type, void * GGML_RESTRICT dst, const void * GGML_RESTRICT src, int64_t nrows, int64_t n_per_row);
+
+// s[c*bs + r] = dot(row r of the group vx, column c of vy) for the GGML_REPACK_NROWS rows and nc <= 4 columns
+// the columns are Q8_0 rows, by bytes apart
+void ggml_gemm_q4_0x4_q8_0(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, const void * GGML_RESTRICT vy, size_t by, int nc);
+void ggml_gemm_q8_0x4_q8_0(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, const void * GGML_RESTRICT vy, size_t by, int nc);
+
 void iq2xs_init_impl(enum ggml_type type);
 void iq2xs_free_impl(enum ggml_type type);
 void iq3xs_init_impl(int grid_size);
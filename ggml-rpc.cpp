@@ -0,0 +1,1372 @@
+#include "ggml-rpc.h"
+#include "ggml.h"
+#include "ggml-backend-impl.h"
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#ifdef _WIN32
+#  define WIN32_LEAN_AND_MEAN
+#  ifndef NOMINMAX
+#     define NOMINMAX
+#  endif
+#  include <winsock2.h>
+#  include <ws2tcpip.h>
+#  include <windows.h>
+#else
+#  include <arpa/inet.h>
+#  include <sys/socket.h>
+#  include <sys/types.h>
+#  include <netinet/in.h>
+#  include <netinet/tcp.h>
+#  include <netdb.h>
+#  include <unistd.h>
+#endif
+
+#define UNUSED GGML_UNUSED
+
+//
+// sockets
+//
+
+#ifdef _WIN32
+typedef SOCKET sockfd_t;
+#define INVALID_SOCKFD INVALID_SOCKET
+#else
+typedef int sockfd_t;
+#define INVALID_SOCKFD (-1)
+#endif
+
+#ifdef MSG_NOSIGNAL
+#define RPC_SEND_FLAGS MSG_NOSIGNAL // a closed connection is reported as an error instead of raising SIGPIPE
+#else
+#define RPC_SEND_FLAGS 0
+#endif
+
+struct socket_t {
+    sockfd_t   fd;
+    std::mutex mutex; // a connection is shared by the backends and buffers of an endpoint, which can be used from several threads
+
+    socket_t(sockfd_t fd) : fd(fd) {}
+    ~socket_t() {
+#ifdef _WIN32
+        closesocket(fd);
+#else
+        close(fd);
+#endif
+    }
+};
+
+static bool rpc_net_init() {
+#ifdef _WIN32
+    static bool initialized = [] {
+        WSADATA wsa_data;
+        return WSAStartup(MAKEWORD(2, 2), &wsa_data) == 0;
+    }();
+    return initialized;
+#else
+    return true;
+#endif
+}
+
+static bool set_no_delay(sockfd_t sockfd) {
+    // the requests are small and synchronous, do not wait to fill a packet
+    int flag = 1;
+    return setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, (const char *) &flag, sizeof(flag)) == 0;
+}
+
+static bool set_reuse_addr(sockfd_t sockfd) {
+    int flag = 1;
+    return setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, (const char *) &flag, sizeof(flag)) == 0;
+}
+
+static bool parse_endpoint(const std::string & endpoint, std::string & host, int & port) {
+    const size_t pos = endpoint.rfind(':');
+    if (pos == std::string::npos || pos == 0 || pos + 1 == endpoint.size()) {
+        return false;
+    }
+    host = endpoint.substr(0, pos);
+    port = atoi(endpoint.c_str() + pos + 1);
+    return port > 0 && port < 65536;
+}
+
+static std::shared_ptr<socket_t> socket_connect(const std::string & host, int port) {
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family   = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+
+    struct addrinfo * res = nullptr;
+    if (getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &res) != 0 || res == nullptr) {
+        fprintf(stderr, "%s: cannot resolve host '%s'\n", __func__, host.c_str());
+        return nullptr;
+    }
+
+    std::shared_ptr<socket_t> sock;
+
+    for (struct addrinfo * ai = res; ai != nullptr; ai = ai->ai_next) {
+        sockfd_t sockfd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (sockfd == INVALID_SOCKFD) {
+            continue;
+        }
+        auto cur = std::make_shared<socket_t>(sockfd);
+        if (!set_no_delay(sockfd)) {
+            continue;
+        }
+        if (connect(sockfd, ai->ai_addr, (int) ai->ai_addrlen) == 0) {
+            sock = cur;
+            break;
+        }
+    }
+
+    freeaddrinfo(res);
+
+    return sock;
+}
+
+static std::shared_ptr<socket_t> socket_accept(sockfd_t srv_sockfd) {
+    sockfd_t sockfd = accept(srv_sockfd, NULL, NULL);
+    if (sockfd == INVALID_SOCKFD) {
+        return nullptr;
+    }
+    auto sock = std::make_shared<socket_t>(sockfd);
+    if (!set_no_delay(sockfd)) {
+        fprintf(stderr, "%s: failed to set TCP_NODELAY\n", __func__);
+        return nullptr;
+    }
+    return sock;
+}
+
+static std::shared_ptr<socket_t> create_server_socket(const std::string & host, int port) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port   = htons((uint16_t) port);
+    if (inet_pton(AF_INET, host.c_str(), &addr.sin_addr) != 1) {
+        fprintf(stderr, "%s: invalid IPv4 address '%s'\n", __func__, host.c_str());
+        return nullptr;
+    }
+
+    sockfd_t sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sockfd == INVALID_SOCKFD) {
+        return nullptr;
+    }
+    auto sock = std::make_shared<socket_t>(sockfd);
+    if (!set_reuse_addr(sockfd)) {
+        fprintf(stderr, "%s: failed to set SO_REUSEADDR\n", __func__);
+        return nullptr;
+    }
+    if (bind(sockfd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        return nullptr;
+    }
+    if (listen(sockfd, 1) < 0) {
+        return nullptr;
+    }
+    return sock;
+}
+
+static bool send_data(sockfd_t sockfd, const void * data, size_t size) {
+    size_t bytes_sent = 0;
+    while (bytes_sent < size) {
+        const int chunk = (int) std::min<size_t>(size - bytes_sent, 1u << 30);
+        const auto n = send(sockfd, (const char *) data + bytes_sent, chunk, RPC_SEND_FLAGS);
+        if (n <= 0) {
+            return false;
+        }
+        bytes_sent += (size_t) n;
+    }
+    return true;
+}
+
+static bool recv_data(sockfd_t sockfd, void * data, size_t size) {
+    size_t bytes_recv = 0;
+    while (bytes_recv < size) {
+        const int chunk = (int) std::min<size_t>(size - bytes_recv, 1u << 30);
+        const auto n = recv(sockfd, (char *) data + bytes_recv, chunk, 0);
+        if (n <= 0) {
+            return false;
+        }
+        bytes_recv += (size_t) n;
+    }
+    return true;
+}
+
+//
+// protocol
+//
+
+// both ends are expected to have the same endianness and the same ggml version
+
+enum rpc_cmd {
+    RPC_CMD_ALLOC_BUFFER = 0,
+    RPC_CMD_GET_ALIGNMENT,
+    RPC_CMD_GET_MAX_SIZE,
+    RPC_CMD_BUFFER_GET_BASE,
+    RPC_CMD_FREE_BUFFER,
+    RPC_CMD_BUFFER_CLEAR,
+    RPC_CMD_SET_TENSOR,
+    RPC_CMD_GET_TENSOR,
+    RPC_CMD_COPY_TENSOR,
+    RPC_CMD_GRAPH_COMPUTE,
+    RPC_CMD_GET_DEVICE_MEMORY,
+    RPC_CMD_SUPPORTS_OP,
+};
+
+// a ggml_tensor of the client, pointers are sent as the addresses on the client (id, src, view_src)
+// or on the server (buffer, data)
+#pragma pack(push, 1)
+struct rpc_tensor {
+    uint64_t id;
+    uint32_t type;
+    uint64_t buffer;
+    int64_t  ne[GGML_MAX_DIMS];
+    uint64_t nb[GGML_MAX_DIMS];
+    uint32_t op;
+    int32_t  op_params[GGML_MAX_OP_PARAMS / sizeof(int32_t)];
+    int32_t  flags;
+    uint64_t src[GGML_MAX_SRC];
+    uint64_t view_src;
+    uint64_t view_offs;
+    uint64_t data;
+    char     name[GGML_MAX_NAME];
+};
+#pragma pack(pop)
+
+// request : | cmd (1 byte) | input size (8 bytes) | input |
+// response: | output size (8 bytes) | output |
+static bool send_rpc_cmd(const std::shared_ptr<socket_t> & sock, enum rpc_cmd cmd, const std::vector<uint8_t> & input, std::vector<uint8_t> & output) {
+    std::lock_guard<std::mutex> lock(sock->mutex);
+
+    const uint8_t  cmd_byte   = (uint8_t) cmd;
+    const uint64_t input_size = input.size();
+    if (!send_data(sock->fd, &cmd_byte, sizeof(cmd_byte)) ||
+        !send_data(sock->fd, &input_size, sizeof(input_size)) ||
+        !send_data(sock->fd, input.data(), input.size())) {
+        return false;
+    }
+    uint64_t output_size;
+    if (!recv_data(sock->fd, &output_size, sizeof(output_size))) {
+        return false;
+    }
+    output.resize(output_size);
+    return recv_data(sock->fd, output.data(), output_size);
+}
+
+template <typename T>
+static void rpc_write(std::vector<uint8_t> & buf, const T & value) {
+    const size_t pos = buf.size();
+    buf.resize(pos + sizeof(T));
+    memcpy(buf.data() + pos, &value, sizeof(T));
+}
+
+template <typename T>
+static bool rpc_read(const std::vector<uint8_t> & buf, size_t & pos, T & value) {
+    if (buf.size() < pos || buf.size() - pos < sizeof(T)) {
+        return false;
+    }
+    memcpy(&value, buf.data() + pos, sizeof(T));
+    pos += sizeof(T);
+    return true;
+}
+
+//
+// client
+//
+
+// the connections are shared by the buffer types, buffers and backends of an endpoint
+// and stay open as long as any of them holds a reference
+static std::shared_ptr<socket_t> get_socket(const std::string & endpoint) {
+    static std::mutex mutex;
+    static std::unordered_map<std::string, std::weak_ptr<socket_t>> sockets;
+
+    std::lock_guard<std::mutex> lock(mutex);
+
+    auto it = sockets.find(endpoint);
+    if (it != sockets.end()) {
+        if (auto sock = it->second.lock()) {
+            return sock;
+        }
+    }
+
+    std::string host;
+    int port;
+    if (!parse_endpoint(endpoint, host, port)) {
+        fprintf(stderr, "%s: invalid endpoint '%s', expected host:port\n", __func__, endpoint.c_str());
+        return nullptr;
+    }
+    if (!rpc_net_init()) {
+        return nullptr;
+    }
+
+    auto sock = socket_connect(host, port);
+    if (sock == nullptr) {
+        fprintf(stderr, "%s: failed to connect to %s\n", __func__, endpoint.c_str());
+        return nullptr;
+    }
+
+    sockets[endpoint] = sock;
+    return sock;
+}
+
+struct ggml_backend_rpc_buffer_type_context {
+    std::string endpoint;
+    std::string name;
+    size_t      alignment;
+    size_t      max_size;
+};
+
+struct ggml_backend_rpc_context {
+    std::string               endpoint;
+    std::string               name;
+    std::shared_ptr<socket_t> sock;
+};
+
+struct ggml_backend_rpc_buffer_context {
+    std::shared_ptr<socket_t> sock;
+    uint64_t                  remote_ptr;
+    void *                    base = nullptr; // address of the buffer on the server
+    std::string               name;
+};
+
+GGML_CALL static const char * ggml_backend_rpc_buffer_get_name(ggml_backend_buffer_t buffer);
+
+static bool ggml_backend_buffer_is_rpc(ggml_backend_buffer_t buffer) {
+    return buffer->iface.get_name == ggml_backend_rpc_buffer_get_name;
+}
+
+// the type, shape and operation of a tensor, without its data
+static rpc_tensor serialize_tensor_desc(const ggml_tensor * tensor) {
+    rpc_tensor result;
+    memset(&result, 0, sizeof(result));
+
+    result.id   = reinterpret_cast<uint64_t>(tensor);
+    result.type = tensor->type;
+
+    for (int i = 0; i < GGML_MAX_DIMS; i++) {
+        result.ne[i] = tensor->ne[i];
+        result.nb[i] = tensor->nb[i];
+    }
+
+    result.op = tensor->op;
+    memcpy(result.op_params, tensor->op_params, sizeof(result.op_params));
+    result.flags = tensor->flags;
+
+    snprintf(result.name, GGML_MAX_NAME, "%s", tensor->name);
+
+    return result;
+}
+
+static rpc_tensor serialize_tensor(const ggml_tensor * tensor) {
+    rpc_tensor result = serialize_tensor_desc(tensor);
+
+    if (tensor->buffer) {
+        GGML_ASSERT(ggml_backend_buffer_is_rpc(tensor->buffer) && "tensor is not allocated in an RPC buffer");
+        auto * ctx = (ggml_backend_rpc_buffer_context *) tensor->buffer->context;
+        result.buffer = ctx->remote_ptr;
+    }
+
+    for (int i = 0; i < GGML_MAX_SRC; i++) {
+        result.src[i] = reinterpret_cast<uint64_t>(tensor->src[i]);
+    }
+
+    result.view_src  = reinterpret_cast<uint64_t>(tensor->view_src);
+    result.view_offs = tensor->view_offs;
+    result.data      = reinterpret_cast<uint64_t>(tensor->data);
+
+    return result;
+}
+
+GGML_CALL static const char * ggml_backend_rpc_buffer_get_name(ggml_backend_buffer_t buffer) {
+    auto * ctx = (ggml_backend_rpc_buffer_context *) buffer->context;
+    return ctx->name.c_str();
+}
+
+GGML_CALL static void ggml_backend_rpc_buffer_free_buffer(ggml_backend_buffer_t buffer) {
+    auto * ctx = (ggml_backend_rpc_buffer_context *) buffer->context;
+
+    // input: | remote_ptr (8 bytes) |
+    std::vector<uint8_t> input;
+    rpc_write(input, ctx->remote_ptr);
+
+    std::vector<uint8_t> output;
+    bool status = send_rpc_cmd(ctx->sock, RPC_CMD_FREE_BUFFER, input, output);
+    GGML_ASSERT(status);
+
+    delete ctx;
+}
+
+GGML_CALL static void * ggml_backend_rpc_buffer_get_base(ggml_backend_buffer_t buffer) {
+    auto * ctx = (ggml_backend_rpc_buffer_context *) buffer->context;
+    if (ctx->base != nullptr) {
+        return ctx->base;
+    }
+
+    // input: | remote_ptr (8 bytes) |
+    std::vector<uint8_t> input;
+    rpc_write(input, ctx->remote_ptr);
+
+    // output: | base_ptr (8 bytes) |
+    std::vector<uint8_t> output;
+    bool status = send_rpc_cmd(ctx->sock, RPC_CMD_BUFFER_GET_BASE, input, output);
+    GGML_ASSERT(status);
+
+    uint64_t base_ptr = 0;
+    size_t pos = 0;
+    GGML_ASSERT(rpc_read(output, pos, base_ptr));
+
+    ctx->base = reinterpret_cast<void *>(base_ptr);
+    return ctx->base;
+}
+
+GGML_CALL static void ggml_backend_rpc_buffer_set_tensor(ggml_backend_buffer_t buffer, ggml_tensor * tensor, const void * data, size_t offset, size_t size) {
+    auto * ctx = (ggml_backend_rpc_buffer_context *) buffer->context;
+
+    // input: | rpc_tensor | offset (8 bytes) | data (size bytes) |
+    std::vector<uint8_t> input;
+    input.reserve(sizeof(rpc_tensor) + sizeof(uint64_t) + size);
+    rpc_write(input, serialize_tensor(tensor));
+    rpc_write(input, (uint64_t) offset);
+    input.insert(input.end(), (const uint8_t *) data, (const uint8_t *) data + size);
+
+    std::vector<uint8_t> output;
+    bool status = send_rpc_cmd(ctx->sock, RPC_CMD_SET_TENSOR, input, output);
+    GGML_ASSERT(status);
+}
+
+GGML_CALL static void ggml_backend_rpc_buffer_get_tensor(ggml_backend_buffer_t buffer, const ggml_tensor * tensor, void * data, size_t offset, size_t size) {
+    auto * ctx = (ggml_backend_rpc_buffer_context *) buffer->context;
+
+    // input: | rpc_tensor | offset (8 bytes) | size (8 bytes) |
+    std::vector<uint8_t> input;
+    rpc_write(input, serialize_tensor(tensor));
+    rpc_write(input, (uint64_t) offset);
+    rpc_write(input, (uint64_t) size);
+
+    // output: | data (size bytes) |
+    std::vector<uint8_t> output;
+    bool status = send_rpc_cmd(ctx->sock, RPC_CMD_GET_TENSOR, input, output);
+    GGML_ASSERT(status && output.size() == size);
+
+    memcpy(data, output.data(), size);
+}
+
+GGML_CALL static bool ggml_backend_rpc_buffer_cpy_tensor(ggml_backend_buffer_t buffer, const ggml_tensor * src, ggml_tensor * dst) {
+    auto * ctx = (ggml_backend_rpc_buffer_context *) buffer->context;
+
+    // only copies within the same server are done remotely
+    if (!ggml_backend_buffer_is_rpc(src->buffer) || ((ggml_backend_rpc_buffer_context *) src->buffer->context)->sock != ctx->sock) {
+        return false;
+    }
+
+    // input: | rpc_tensor src | rpc_tensor dst |
+    std::vector<uint8_t> input;
+    rpc_write(input, serialize_tensor(src));
+    rpc_write(input, serialize_tensor(dst));
+
+    // output: | result (1 byte) |
+    std::vector<uint8_t> output;
+    bool status = send_rpc_cmd(ctx->sock, RPC_CMD_COPY_TENSOR, input, output);
+    GGML_ASSERT(status);
+
+    uint8_t result = 0;
+    size_t pos = 0;
+    GGML_ASSERT(rpc_read(output, pos, result));
+    return result != 0;
+}
+
+GGML_CALL static void ggml_backend_rpc_buffer_clear(ggml_backend_buffer_t buffer, uint8_t value) {
+    auto * ctx = (ggml_backend_rpc_buffer_context *) buffer->context;
+
+    // input: | remote_ptr (8 bytes) | value (1 byte) |
+    std::vector<uint8_t> input;
+    rpc_write(input, ctx->remote_ptr);
+    rpc_write(input, value);
+
+    std::vector<uint8_t> output;
+    bool status = send_rpc_cmd(ctx->sock, RPC_CMD_BUFFER_CLEAR, input, output);
+    GGML_ASSERT(status);
+}
+
+static ggml_backend_buffer_i ggml_backend_rpc_buffer_interface = {
+    /* .get_name        = */ ggml_backend_rpc_buffer_get_name,
+    /* .free_buffer     = */ ggml_backend_rpc_buffer_free_buffer,
+    /* .get_base        = */ ggml_backend_rpc_buffer_get_base,
+    /* .init_tensor     = */ NULL,
+    /* .set_tensor      = */ ggml_backend_rpc_buffer_set_tensor,
+    /* .get_tensor      = */ ggml_backend_rpc_buffer_get_tensor,
+    /* .cpy_tensor      = */ ggml_backend_rpc_buffer_cpy_tensor,
+    /* .clear           = */ ggml_backend_rpc_buffer_clear,
+    /* .reset           = */ NULL,
+};
+
+GGML_CALL static const char * ggml_backend_rpc_buffer_type_name(ggml_backend_buffer_type_t buft) {
+    auto * buft_ctx = (ggml_backend_rpc_buffer_type_context *) buft->context;
+    return buft_ctx->name.c_str();
+}
+
+GGML_CALL static ggml_backend_buffer_t ggml_backend_rpc_buffer_type_alloc_buffer(ggml_backend_buffer_type_t buft, size_t size) {
+    auto * buft_ctx = (ggml_backend_rpc_buffer_type_context *) buft->context;
+
+    auto sock = get_socket(buft_ctx->endpoint);
+    if (sock == nullptr) {
+        return nullptr;
+    }
+
+    // input: | size (8 bytes) |
+    std::vector<uint8_t> input;
+    rpc_write(input, (uint64_t) size);
+
+    // output: | remote_ptr (8 bytes) | remote_size (8 bytes) |
+    std::vector<uint8_t> output;
+    bool status = send_rpc_cmd(sock, RPC_CMD_ALLOC_BUFFER, input, output);
+    GGML_ASSERT(status);
+
+    uint64_t remote_ptr  = 0;
+    uint64_t remote_size = 0;
+    size_t pos = 0;
+    GGML_ASSERT(rpc_read(output, pos, remote_ptr) && rpc_read(output, pos, remote_size));
+
+    if (remote_ptr == 0) {
+        fprintf(stderr, "%s: %s failed to allocate %zu bytes\n", __func__, buft_ctx->endpoint.c_str(), size);
+        return nullptr;
+    }
+
+    auto * ctx = new ggml_backend_rpc_buffer_context;
+    ctx->sock       = sock;
+    ctx->remote_ptr = remote_ptr;
+    ctx->name       = buft_ctx->name;
+
+    return ggml_backend_buffer_init(buft, ggml_backend_rpc_buffer_interface, ctx, remote_size);
+}
+
+GGML_CALL static size_t ggml_backend_rpc_buffer_type_get_alignment(ggml_backend_buffer_type_t buft) {
+    auto * buft_ctx = (ggml_backend_rpc_buffer_type_context *) buft->context;
+    return buft_ctx->alignment;
+}
+
+GGML_CALL static size_t ggml_backend_rpc_buffer_type_get_max_size(ggml_backend_buffer_type_t buft) {
+    auto * buft_ctx = (ggml_backend_rpc_buffer_type_context *) buft->context;
+    return buft_ctx->max_size;
+}
+
+GGML_CALL static bool ggml_backend_rpc_buffer_type_supports_backend(ggml_backend_buffer_type_t buft, ggml_backend_t backend) {
+    if (!ggml_backend_is_rpc(backend)) {
+        return false;
+    }
+    auto * buft_ctx = (ggml_backend_rpc_buffer_type_context *) buft->context;
+    auto * rpc_ctx  = (ggml_backend_rpc_context *) backend->context;
+    return buft_ctx->endpoint == rpc_ctx->endpoint;
+}
+
+static ggml_backend_buffer_type_i ggml_backend_rpc_buffer_type_interface = {
+    /* .get_name         = */ ggml_backend_rpc_buffer_type_name,
+    /* .alloc_buffer     = */ ggml_backend_rpc_buffer_type_alloc_buffer,
+    /* .get_alignment    = */ ggml_backend_rpc_buffer_type_get_alignment,
+    /* .get_max_size     = */ ggml_backend_rpc_buffer_type_get_max_size,
+    /* .get_alloc_size   = */ NULL, // defaults to ggml_nbytes
+    /* .supports_backend = */ ggml_backend_rpc_buffer_type_supports_backend,
+    /* .is_host          = */ NULL,
+};
+
+GGML_CALL static const char * ggml_backend_rpc_name(ggml_backend_t backend) {
+    auto * rpc_ctx = (ggml_backend_rpc_context *) backend->context;
+    return rpc_ctx->name.c_str();
+}
+
+GGML_CALL static void ggml_backend_rpc_free(ggml_backend_t backend) {
+    auto * rpc_ctx = (ggml_backend_rpc_context *) backend->context;
+    delete rpc_ctx;
+    delete backend;
+}
+
+GGML_CALL static ggml_backend_buffer_type_t ggml_backend_rpc_get_default_buffer_type(ggml_backend_t backend) {
+    auto * rpc_ctx = (ggml_backend_rpc_context *) backend->context;
+    return ggml_backend_rpc_buffer_type(rpc_ctx->endpoint.c_str());
+}
+
+static void add_tensor(ggml_tensor * tensor, std::vector<rpc_tensor> & tensors, std::unordered_set<ggml_tensor *> & visited) {
+    if (tensor == nullptr || visited.find(tensor) != visited.end()) {
+        return;
+    }
+    visited.insert(tensor);
+
+    for (int i = 0; i < GGML_MAX_SRC; i++) {
+        add_tensor(tensor->src[i], tensors, visited);
+    }
+    add_tensor(tensor->view_src, tensors, visited);
+
+    tensors.push_back(serialize_tensor(tensor));
+}
+
+// | n_nodes (4 bytes) | node ids (n_nodes * 8 bytes) | n_tensors (4 bytes) | tensors (n_tensors * sizeof(rpc_tensor)) |
+static void serialize_graph(const ggml_cgraph * cgraph, std::vector<uint8_t> & output) {
+    const uint32_t n_nodes = cgraph->n_nodes;
+
+    std::vector<rpc_tensor> tensors;
+    std::unordered_set<ggml_tensor *> visited;
+    for (uint32_t i = 0; i < n_nodes; i++) {
+        add_tensor(cgraph->nodes[i], tensors, visited);
+    }
+
+    const uint32_t n_tensors = tensors.size();
+
+    output.clear();
+    output.reserve(2*sizeof(uint32_t) + n_nodes*sizeof(uint64_t) + n_tensors*sizeof(rpc_tensor));
+
+    rpc_write(output, n_nodes);
+    for (uint32_t i = 0; i < n_nodes; i++) {
+        rpc_write(output, reinterpret_cast<uint64_t>(cgraph->nodes[i]));
+    }
+    rpc_write(output, n_tensors);
+    const uint8_t * p = (const uint8_t *) tensors.data();
+    output.insert(output.end(), p, p + n_tensors*sizeof(rpc_tensor));
+}
+
+GGML_CALL static enum ggml_status ggml_backend_rpc_graph_compute(ggml_backend_t backend, ggml_cgraph * cgraph) {
+    auto * rpc_ctx = (ggml_backend_rpc_context *) backend->context;
+
+    std::vector<uint8_t> input;
+    serialize_graph(cgraph, input);
+
+    // output: | status (1 byte) |
+    std::vector<uint8_t> output;
+    bool status = send_rpc_cmd(rpc_ctx->sock, RPC_CMD_GRAPH_COMPUTE, input, output);
+    GGML_ASSERT(status);
+
+    uint8_t result = GGML_STATUS_FAILED;
+    size_t pos = 0;
+    GGML_ASSERT(rpc_read(output, pos, result));
+    return (enum ggml_status) (int8_t) result;
+}
+
+GGML_CALL static bool ggml_backend_rpc_supports_op(ggml_backend_t backend, const ggml_tensor * op) {
+    auto * rpc_ctx = (ggml_backend_rpc_context *) backend->context;
+
+    // input: | rpc_tensor op | rpc_tensor src (GGML_MAX_SRC times, with id 0 when there is no source) |
+    std::vector<uint8_t> input;
+    rpc_write(input, serialize_tensor_desc(op));
+    for (int i = 0; i < GGML_MAX_SRC; i++) {
+        rpc_tensor src;
+        memset(&src, 0, sizeof(src));
+        if (op->src[i] != nullptr) {
+            src = serialize_tensor_desc(op->src[i]);
+        }
+        rpc_write(input, src);
+    }
+
+    // output: | supported (1 byte) |
+    std::vector<uint8_t> output;
+    uint8_t result = 0;
+    size_t pos = 0;
+    if (!send_rpc_cmd(rpc_ctx->sock, RPC_CMD_SUPPORTS_OP, input, output) || !rpc_read(output, pos, result)) {
+        return false;
+    }
+    return result != 0;
+}
+
+static ggml_backend_i ggml_backend_rpc_interface = {
+    /* .get_name                = */ ggml_backend_rpc_name,
+    /* .free                    = */ ggml_backend_rpc_free,
+    /* .get_default_buffer_type = */ ggml_backend_rpc_get_default_buffer_type,
+    /* .set_tensor_async        = */ NULL,
+    /* .get_tensor_async        = */ NULL,
+    /* .cpy_tensor_async        = */ NULL,
+    /* .synchronize             = */ NULL, // all the requests are synchronous
+    /* .graph_plan_create       = */ NULL,
+    /* .graph_plan_free         = */ NULL,
+    /* .graph_plan_compute      = */ NULL,
+    /* .graph_compute           = */ ggml_backend_rpc_graph_compute,
+    /* .supports_op             = */ ggml_backend_rpc_supports_op,
+    /* .offload_op              = */ NULL,
+    /* .event_new               = */ NULL,
+    /* .event_free              = */ NULL,
+    /* .event_record            = */ NULL,
+    /* .event_wait              = */ NULL,
+    /* .event_synchronize       = */ NULL,
+};
+
+static bool get_remote_size(const std::shared_ptr<socket_t> & sock, enum rpc_cmd cmd, size_t & value) {
+    std::vector<uint8_t> input;
+    std::vector<uint8_t> output;
+    if (!send_rpc_cmd(sock, cmd, input, output)) {
+        return false;
+    }
+    uint64_t v = 0;
+    size_t pos = 0;
+    if (!rpc_read(output, pos, v)) {
+        return false;
+    }
+    value = (size_t) v;
+    return true;
+}
+
+GGML_CALL ggml_backend_buffer_type_t ggml_backend_rpc_buffer_type(const char * endpoint) {
+    static std::mutex mutex;
+    static std::unordered_map<std::string, ggml_backend_buffer_type_t> buft_map;
+
+    std::lock_guard<std::mutex> lock(mutex);
+
+    // the buffer types are never freed, like the buffer types of the other backends
+    auto it = buft_map.find(endpoint);
+    if (it != buft_map.end()) {
+        return it->second;
+    }
+
+    auto sock = get_socket(endpoint);
+    if (sock == nullptr) {
+        return nullptr;
+    }
+
+    size_t alignment = 0;
+    size_t max_size  = 0;
+    if (!get_remote_size(sock, RPC_CMD_GET_ALIGNMENT, alignment) ||
+        !get_remote_size(sock, RPC_CMD_GET_MAX_SIZE,  max_size)) {
+        fprintf(stderr, "%s: failed to query %s\n", __func__, endpoint);
+        return nullptr;
+    }
+
+    auto * buft_ctx = new ggml_backend_rpc_buffer_type_context {
+        /* .endpoint  = */ endpoint,
+        /* .name      = */ "RPC[" + std::string(endpoint) + "]",
+        /* .alignment = */ alignment,
+        /* .max_size  = */ max_size,
+    };
+
+    ggml_backend_buffer_type_t buft = new ggml_backend_buffer_type {
+        /* .iface   = */ ggml_backend_rpc_buffer_type_interface,
+        /* .context = */ buft_ctx,
+    };
+
+    buft_map[endpoint] = buft;
+    return buft;
+}
+
+static ggml_guid_t ggml_backend_rpc_guid() {
+    static ggml_guid guid = { 0x99, 0x68, 0x5b, 0x6c, 0xd2, 0x83, 0x3d, 0x24, 0x25, 0x36, 0x72, 0xe1, 0x5b, 0x0e, 0x14, 0x03 };
+    return &guid;
+}
+
+GGML_CALL ggml_backend_t ggml_backend_rpc_init(const char * endpoint) {
+    auto sock = get_socket(endpoint);
+    if (sock == nullptr) {
+        return nullptr;
+    }
+
+    auto * ctx = new ggml_backend_rpc_context {
+        /* .endpoint = */ endpoint,
+        /* .name     = */ "RPC[" + std::string(endpoint) + "]",
+        /* .sock     = */ sock,
+    };
+
+    ggml_backend_t backend = new ggml_backend {
+        /* .guid      = */ ggml_backend_rpc_guid(),
+        /* .interface = */ ggml_backend_rpc_interface,
+        /* .context   = */ ctx,
+    };
+
+    return backend;
+}
+
+GGML_CALL bool ggml_backend_is_rpc(ggml_backend_t backend) {
+    return backend != NULL && ggml_guid_matches(backend->guid, ggml_backend_rpc_guid());
+}
+
+GGML_CALL void ggml_backend_rpc_get_device_memory(const char * endpoint, size_t * free, size_t * total) {
+    *free  = 0;
+    *total = 0;
+
+    auto sock = get_socket(endpoint);
+    if (sock == nullptr) {
+        return;
+    }
+
+    // output: | free (8 bytes) | total (8 bytes) |
+    std::vector<uint8_t> input;
+    std::vector<uint8_t> output;
+    if (!send_rpc_cmd(sock, RPC_CMD_GET_DEVICE_MEMORY, input, output)) {
+        return;
+    }
+
+    uint64_t free_mem  = 0;
+    uint64_t total_mem = 0;
+    size_t pos = 0;
+    if (rpc_read(output, pos, free_mem) && rpc_read(output, pos, total_mem)) {
+        *free  = (size_t) free_mem;
+        *total = (size_t) total_mem;
+    }
+}
+
+//
+// server
+//
+
+// all the requests of the client are validated, an invalid request closes the connection
+class rpc_server {
+public:
+    rpc_server(ggml_backend_t backend) : backend(backend) {}
+    ~rpc_server();
+
+    bool alloc_buffer(const std::vector<uint8_t> & input, std::vector<uint8_t> & output);
+    void get_alignment(std::vector<uint8_t> & output);
+    void get_max_size(std::vector<uint8_t> & output);
+    bool buffer_get_base(const std::vector<uint8_t> & input, std::vector<uint8_t> & output);
+    bool free_buffer(const std::vector<uint8_t> & input);
+    bool buffer_clear(const std::vector<uint8_t> & input);
+    bool set_tensor(const std::vector<uint8_t> & input);
+    bool get_tensor(const std::vector<uint8_t> & input, std::vector<uint8_t> & output);
+    bool copy_tensor(const std::vector<uint8_t> & input, std::vector<uint8_t> & output);
+    bool graph_compute(const std::vector<uint8_t> & input, std::vector<uint8_t> & output);
+    bool supports_op(const std::vector<uint8_t> & input, std::vector<uint8_t> & output);
+
+private:
+    ggml_backend_buffer_t find_buffer(uint64_t remote_ptr) const;
+    ggml_tensor * deserialize_tensor(struct ggml_context * ctx, const rpc_tensor * tensor);
+
+    ggml_backend_t backend;
+    std::unordered_set<ggml_backend_buffer_t> buffers;
+};
+
+rpc_server::~rpc_server() {
+    // the buffers of a client are released when it disconnects
+    for (ggml_backend_buffer_t buffer : buffers) {
+        ggml_backend_buffer_free(buffer);
+    }
+}
+
+ggml_backend_buffer_t rpc_server::find_buffer(uint64_t remote_ptr) const {
+    ggml_backend_buffer_t buffer = reinterpret_cast<ggml_backend_buffer_t>(remote_ptr);
+    return buffers.find(buffer) != buffers.end() ? buffer : nullptr;
+}
+
+bool rpc_server::alloc_buffer(const std::vector<uint8_t> & input, std::vector<uint8_t> & output) {
+    uint64_t size;
+    size_t pos = 0;
+    if (!rpc_read(input, pos, size)) {
+        return false;
+    }
+
+    ggml_backend_buffer_type_t buft = ggml_backend_get_default_buffer_type(backend);
+    ggml_backend_buffer_t buffer = ggml_backend_buft_alloc_buffer(buft, size);
+
+    uint64_t remote_ptr  = 0;
+    uint64_t remote_size = 0;
+    if (buffer != nullptr) {
+        remote_ptr  = reinterpret_cast<uint64_t>(buffer);
+        remote_size = ggml_backend_buffer_get_size(buffer);
+        buffers.insert(buffer);
+    }
+
+    rpc_write(output, remote_ptr);
+    rpc_write(output, remote_size);
+    return true;
+}
+
+void rpc_server::get_alignment(std::vector<uint8_t> & output) {
+    ggml_backend_buffer_type_t buft = ggml_backend_get_default_buffer_type(backend);
+    rpc_write(output, (uint64_t) ggml_backend_buft_get_alignment(buft));
+}
+
+void rpc_server::get_max_size(std::vector<uint8_t> & output) {
+    ggml_backend_buffer_type_t buft = ggml_backend_get_default_buffer_type(backend);
+    rpc_write(output, (uint64_t) ggml_backend_buft_get_max_size(buft));
+}
+
+bool rpc_server::buffer_get_base(const std::vector<uint8_t> & input, std::vector<uint8_t> & output) {
+    uint64_t remote_ptr;
+    size_t pos = 0;
+    if (!rpc_read(input, pos, remote_ptr)) {
+        return false;
+    }
+    ggml_backend_buffer_t buffer = find_buffer(remote_ptr);
+    if (buffer == nullptr) {
+        return false;
+    }
+    rpc_write(output, reinterpret_cast<uint64_t>(ggml_backend_buffer_get_base(buffer)));
+    return true;
+}
+
+bool rpc_server::free_buffer(const std::vector<uint8_t> & input) {
+    uint64_t remote_ptr;
+    size_t pos = 0;
+    if (!rpc_read(input, pos, remote_ptr)) {
+        return false;
+    }
+    ggml_backend_buffer_t buffer = find_buffer(remote_ptr);
+    if (buffer == nullptr) {
+        return false;
+    }
+    ggml_backend_buffer_free(buffer);
+    buffers.erase(buffer);
+    return true;
+}
+
+bool rpc_server::buffer_clear(const std::vector<uint8_t> & input) {
+    uint64_t remote_ptr;
+    uint8_t  value;
+    size_t pos = 0;
+    if (!rpc_read(input, pos, remote_ptr) || !rpc_read(input, pos, value)) {
+        return false;
+    }
+    ggml_backend_buffer_t buffer = find_buffer(remote_ptr);
+    if (buffer == nullptr) {
+        return false;
+    }
+    ggml_backend_buffer_clear(buffer, value);
+    return true;
+}
+
+ggml_tensor * rpc_server::deserialize_tensor(struct ggml_context * ctx, const rpc_tensor * tensor) {
+    // the removed types have no block size
+    if (tensor->type >= GGML_TYPE_COUNT || ggml_blck_size((ggml_type) tensor->type) == 0 || tensor->op >= GGML_OP_COUNT) {
+        return nullptr;
+    }
+    // the size of a quantized tensor is computed from the size of its blocks
+    const size_t type_size = ggml_type_size((ggml_type) tensor->type);
+    const size_t blck_size = ggml_blck_size((ggml_type) tensor->type);
+    if (blck_size > 1 && (tensor->nb[0] != type_size || tensor->ne[0] % blck_size != 0)) {
+        return nullptr;
+    }
+
+    // ne and nb come from the client: reject the tensors whose number of elements, data size or ggml_nbytes would
+    // overflow (ggml_nbytes is not defined for empty tensors, so every dimension has at least one element)
+    int64_t n_elements = 1;
+    for (int i = 0; i < GGML_MAX_DIMS; i++) {
+        if (tensor->ne[i] < 1 || tensor->nb[i] > SIZE_MAX || n_elements > INT64_MAX/tensor->ne[i]) {
+            return nullptr;
+        }
+        n_elements *= tensor->ne[i];
+    }
+    if ((uint64_t) n_elements/blck_size > SIZE_MAX/type_size) {
+        return nullptr;
+    }
+    uint64_t nbytes = blck_size > 1 ? tensor->ne[0]/blck_size*type_size : type_size;
+    for (int i = blck_size > 1 ? 1 : 0; i < GGML_MAX_DIMS; i++) {
+        const uint64_t ne = tensor->ne[i];
+        if (tensor->nb[i] != 0 && ne - 1 > (SIZE_MAX - nbytes)/tensor->nb[i]) {
+            return nullptr;
+        }
+        nbytes += (ne - 1)*tensor->nb[i];
+    }
+
+    ggml_tensor * result = ggml_new_tensor_4d(ctx, (ggml_type) tensor->type,
+        tensor->ne[0], tensor->ne[1], tensor->ne[2], tensor->ne[3]);
+    for (int i = 0; i < GGML_MAX_DIMS; i++) {
+        result->nb[i] = tensor->nb[i];
+    }
+
+    // the tensor data must be within a buffer of this client
+    if (tensor->buffer != 0) {
+        result->buffer = find_buffer(tensor->buffer);
+        if (result->buffer == nullptr) {
+            return nullptr;
+        }
+
+        const uint64_t tensor_size  = ggml_nbytes(result);
+        const uint64_t buffer_start = reinterpret_cast<uint64_t>(ggml_backend_buffer_get_base(result->buffer));
+        const uint64_t buffer_size  = ggml_backend_buffer_get_size(result->buffer);
+        if (tensor->data < buffer_start || tensor->data - buffer_start > buffer_size ||
+            tensor_size > buffer_size - (tensor->data - buffer_start)) {
+            return nullptr;
+        }
+    } else if (tensor->data != 0) {
+        return nullptr;
+    }
+
+    result->op = (ggml_op) tensor->op;
+    memcpy(result->op_params, tensor->op_params, sizeof(tensor->op_params));
+    result->flags = tensor->flags;
+    result->data  = reinterpret_cast<void *>(tensor->data);
+
+    char name[GGML_MAX_NAME];
+    memcpy(name, tensor->name, GGML_MAX_NAME);
+    name[GGML_MAX_NAME - 1] = 0;
+    ggml_set_name(result, name);
+
+    return result;
+}
+
+static struct ggml_context * rpc_tensor_context(size_t n_tensors) {
+    struct ggml_init_params params {
+        /*.mem_size   =*/ n_tensors*ggml_tensor_overhead(),
+        /*.mem_buffer =*/ NULL,
+        /*.no_alloc   =*/ true,
+    };
+    return ggml_init(params);
+}
+
+bool rpc_server::set_tensor(const std::vector<uint8_t> & input) {
+    // input: | rpc_tensor | offset (8 bytes) | data (size bytes) |
+    rpc_tensor in_tensor;
+    uint64_t   offset;
+    size_t pos = 0;
+    if (!rpc_read(input, pos, in_tensor) || !rpc_read(input, pos, offset)) {
+        return false;
+    }
+    const size_t size = input.size() - pos;
+
+    struct ggml_context * ctx = rpc_tensor_context(1);
+    ggml_tensor * tensor = deserialize_tensor(ctx, &in_tensor);
+
+    const bool ok = tensor != nullptr && tensor->buffer != nullptr &&
+        offset <= ggml_nbytes(tensor) && size <= ggml_nbytes(tensor) - offset;
+    if (ok) {
+        ggml_backend_tensor_set(tensor, input.data() + pos, offset, size);
+    }
+
+    ggml_free(ctx);
+    return ok;
+}
+
+bool rpc_server::get_tensor(const std::vector<uint8_t> & input, std::vector<uint8_t> & output) {
+    // input: | rpc_tensor | offset (8 bytes) | size (8 bytes) |
+    rpc_tensor in_tensor;
+    uint64_t   offset;
+    uint64_t   size;
+    size_t pos = 0;
+    if (!rpc_read(input, pos, in_tensor) || !rpc_read(input, pos, offset) || !rpc_read(input, pos, size)) {
+        return false;
+    }
+
+    struct ggml_context * ctx = rpc_tensor_context(1);
+    ggml_tensor * tensor = deserialize_tensor(ctx, &in_tensor);
+
+    const bool ok = tensor != nullptr && tensor->buffer != nullptr &&
+        offset <= ggml_nbytes(tensor) && size <= ggml_nbytes(tensor) - offset;
+    if (ok) {
+        output.resize(size);
+        ggml_backend_tensor_get(tensor, output.data(), offset, size);
+    }
+
+    ggml_free(ctx);
+    return ok;
+}
+
+bool rpc_server::copy_tensor(const std::vector<uint8_t> & input, std::vector<uint8_t> & output) {
+    // input: | rpc_tensor src | rpc_tensor dst |
+    rpc_tensor rpc_src;
+    rpc_tensor rpc_dst;
+    size_t pos = 0;
+    if (!rpc_read(input, pos, rpc_src) || !rpc_read(input, pos, rpc_dst)) {
+        return false;
+    }
+
+    struct ggml_context * ctx = rpc_tensor_context(2);
+    ggml_tensor * src = deserialize_tensor(ctx, &rpc_src);
+    ggml_tensor * dst = deserialize_tensor(ctx, &rpc_dst);
+
+    const bool ok = src != nullptr && dst != nullptr && src->buffer != nullptr && dst->buffer != nullptr &&
+        ggml_nbytes(src) <= ggml_nbytes(dst);
+    if (ok) {
+        const uint8_t result = ggml_backend_buffer_copy_tensor(src, dst);
+        rpc_write(output, result);
+    }
+
+    ggml_free(ctx);
+    return ok;
+}
+
+// the parameters of these operations are function pointers of the client
+static bool rpc_op_has_callback(enum ggml_op op) {
+    switch (op) {
+        case GGML_OP_MAP_UNARY:
+        case GGML_OP_MAP_BINARY:
+        case GGML_OP_MAP_CUSTOM1_F32:
+        case GGML_OP_MAP_CUSTOM2_F32:
+        case GGML_OP_MAP_CUSTOM3_F32:
+        case GGML_OP_MAP_CUSTOM1:
+        case GGML_OP_MAP_CUSTOM2:
+        case GGML_OP_MAP_CUSTOM3:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// the CPU kernels trust the shapes and the operation parameters set by ggml when the graph was built:
+// those that address memory are checked so that a node cannot access memory outside of its tensors
+static bool validate_tensor(const ggml_tensor * tensor) {
+    if (tensor->view_src != nullptr) {
+        const ggml_tensor * view_src = tensor->view_src;
+        if (tensor->view_offs > ggml_nbytes(view_src) || ggml_nbytes(tensor) > ggml_nbytes(view_src) - tensor->view_offs ||
+            (const char *) tensor->data != (const char *) view_src->data + tensor->view_offs) {
+            return false;
+        }
+    }
+
+    if (rpc_op_has_callback(tensor->op)) {
+        return false;
+    }
+
+    const ggml_tensor * src0 = tensor->src[0];
+    const ggml_tensor * src1 = tensor->src[1];
+
+    switch (tensor->op) {
+        case GGML_OP_VIEW:
+        case GGML_OP_RESHAPE:
+        case GGML_OP_PERMUTE:
+        case GGML_OP_TRANSPOSE:
+            return tensor->view_src != nullptr;
+        case GGML_OP_DUP:
+        case GGML_OP_CPY:
+        case GGML_OP_CONT:
+            return src0 != nullptr && ggml_nelements(src0) == ggml_nelements(tensor);
+        case GGML_OP_SET:
+        case GGML_OP_ACC:
+            {
+                // | nb1 | nb2 | nb3 | offset | inplace |: src1 is written in a view of dst with these strides and offset
+                if (src0 == nullptr || src1 == nullptr || src1->type != tensor->type ||
+                    !ggml_are_same_shape(src0, tensor) || src1->ne[0] == 0) {
+                    return false;
+                }
+                const int32_t * params = (const int32_t *) tensor->op_params;
+                for (int i = 0; i < 4; i++) {
+                    if (params[i] < 0) {
+                        return false;
+                    }
+                }
+                uint64_t end = (uint64_t) params[3] + src1->ne[0]*ggml_element_size(tensor);
+                for (int i = 1; i < GGML_MAX_DIMS; i++) {
+                    if (src1->ne[i] > 0) {
+                        end += (uint64_t) (src1->ne[i] - 1)*(uint64_t) params[i - 1];
+                    }
+                }
+                return end <= ggml_nbytes(tensor);
+            }
+        case GGML_OP_GET_ROWS:
+            // the row ids are read during the computation and checked by the kernels
+            return src0 != nullptr && src1 != nullptr && src1->type == GGML_TYPE_I32 && src1->ne[3] == 1 &&
+                tensor->ne[0] == src0->ne[0] && tensor->ne[1] == src1->ne[0] &&
+                tensor->ne[2] == src1->ne[1] && tensor->ne[3] == src1->ne[2] &&
+                src0->ne[2] == src1->ne[1] && src0->ne[3] >= src1->ne[2];
+        case GGML_OP_GET_ROWS_BACK:
+            return src0 != nullptr && src1 != nullptr && src1->type == GGML_TYPE_I32 &&
+                tensor->ne[0] == src0->ne[0] && src0->ne[1] >= ggml_nelements(src1);
+        case GGML_OP_ROPE:
+        case GGML_OP_ROPE_BACK:
+            {
+                // | n_past | n_dims | mode | ...: src1 holds the position of each row of src0
+                const int32_t n_dims = ((const int32_t *) tensor->op_params)[1];
+                const ggml_tensor * src2 = tensor->src[2];
+                return src0 != nullptr && src1 != nullptr && src1->type == GGML_TYPE_I32 &&
+                    ggml_are_same_shape(src0, tensor) && src1->ne[0] >= src0->ne[2] &&
+                    n_dims > 0 && n_dims <= src0->ne[0] &&
+                    (src2 == nullptr || (src2->type == GGML_TYPE_F32 && 2*src2->ne[0] >= n_dims));
+            }
+        default:
+            return true;
+    }
+}
+
+bool rpc_server::graph_compute(const std::vector<uint8_t> & input, std::vector<uint8_t> & output) {
+    // input: | n_nodes (4 bytes) | node ids (n_nodes * 8 bytes) | n_tensors (4 bytes) | tensors (n_tensors * sizeof(rpc_tensor)) |
+    uint32_t n_nodes;
+    size_t pos = 0;
+    if (!rpc_read(input, pos, n_nodes) || (input.size() - pos)/sizeof(uint64_t) < n_nodes) {
+        return false;
+    }
+    const size_t nodes_pos = pos;
+    pos += n_nodes*sizeof(uint64_t);
+
+    uint32_t n_tensors;
+    if (!rpc_read(input, pos, n_tensors) || (input.size() - pos)/sizeof(rpc_tensor) < n_tensors) {
+        return false;
+    }
+    const rpc_tensor * tensors = (const rpc_tensor *) (input.data() + pos);
+
+    struct ggml_init_params params {
+        /*.mem_size   =*/ ggml_tensor_overhead()*n_tensors + ggml_graph_overhead_custom(n_nodes, false),
+        /*.mem_buffer =*/ NULL,
+        /*.no_alloc   =*/ true,
+    };
+    struct ggml_context * ctx = ggml_init(params);
+    struct ggml_cgraph * graph = ggml_new_graph_custom(ctx, n_nodes, false);
+
+    // the tensors are created first and linked to their sources afterwards:
+    // the depth of the graph is chosen by the client, so it is not traversed recursively
+    std::unordered_map<uint64_t, struct ggml_tensor *> tensor_map;
+
+    bool ok = true;
+    for (uint32_t i = 0; i < n_tensors && ok; i++) {
+        ggml_tensor * tensor = deserialize_tensor(ctx, &tensors[i]);
+        // all the tensors of a graph are allocated
+        ok = tensor != nullptr && tensor->buffer != nullptr && tensors[i].id != 0 &&
+            tensor_map.emplace(tensors[i].id, tensor).second;
+    }
+
+    auto find_tensor = [&](uint64_t id) -> ggml_tensor * {
+        auto it = tensor_map.find(id);
+        return it != tensor_map.end() ? it->second : nullptr;
+    };
+
+    for (uint32_t i = 0; i < n_tensors && ok; i++) {
+        ggml_tensor * tensor = tensor_map[tensors[i].id];
+        for (int j = 0; j < GGML_MAX_SRC && ok; j++) {
+            if (tensors[i].src[j] != 0) {
+                tensor->src[j] = find_tensor(tensors[i].src[j]);
+                ok = tensor->src[j] != nullptr;
+            }
+        }
+        if (tensors[i].view_src != 0) {
+            tensor->view_src = find_tensor(tensors[i].view_src);
+            ok = ok && tensor->view_src != nullptr;
+        }
+        tensor->view_offs = tensors[i].view_offs;
+    }
+
+    for (uint32_t i = 0; i < n_tensors && ok; i++) {
+        ok = validate_tensor(tensor_map[tensors[i].id]);
+    }
+
+    for (uint32_t i = 0; i < n_nodes && ok; i++) {
+        uint64_t id;
+        memcpy(&id, input.data() + nodes_pos + i*sizeof(uint64_t), sizeof(id));
+
+        ggml_tensor * node = find_tensor(id);
+        ok = node != nullptr;
+        graph->nodes[graph->n_nodes++] = node;
+    }
+
+    if (ok) {
+        // output: | status (1 byte) |
+        const ggml_status status = ggml_backend_graph_compute(backend, graph);
+        rpc_write(output, (uint8_t) status);
+    }
+
+    ggml_free(ctx);
+    return ok;
+}
+
+bool rpc_server::supports_op(const std::vector<uint8_t> & input, std::vector<uint8_t> & output) {
+    // input: | rpc_tensor op | rpc_tensor src (GGML_MAX_SRC times, with id 0 when there is no source) |
+    rpc_tensor rpc_op;
+    rpc_tensor rpc_src[GGML_MAX_SRC];
+    size_t pos = 0;
+    bool ok = rpc_read(input, pos, rpc_op);
+    for (int i = 0; i < GGML_MAX_SRC && ok; i++) {
+        ok = rpc_read(input, pos, rpc_src[i]);
+    }
+    if (!ok) {
+        return false;
+    }
+
+    struct ggml_context * ctx = rpc_tensor_context(1 + GGML_MAX_SRC);
+
+    // the descriptions have no data: an operation on unknown types or shapes is not supported
+    ggml_tensor * op = deserialize_tensor(ctx, &rpc_op);
+    bool supported = op != nullptr;
+    for (int i = 0; i < GGML_MAX_SRC && supported; i++) {
+        if (rpc_src[i].id != 0) {
+            op->src[i] = deserialize_tensor(ctx, &rpc_src[i]);
+            supported = op->src[i] != nullptr;
+        }
+    }
+    supported = supported && !rpc_op_has_callback(op->op) && ggml_backend_supports_op(backend, op);
+
+    // output: | supported (1 byte) |
+    rpc_write(output, (uint8_t) supported);
+
+    ggml_free(ctx);
+    return true;
+}
+
+static void rpc_serve_client(ggml_backend_t backend, sockfd_t sockfd, size_t free_mem, size_t total_mem) {
+    rpc_server server(backend);
+
+    std::vector<uint8_t> input;
+    std::vector<uint8_t> output;
+
+    while (true) {
+        uint8_t  cmd;
+        uint64_t input_size;
+        if (!recv_data(sockfd, &cmd, sizeof(cmd)) || !recv_data(sockfd, &input_size, sizeof(input_size))) {
+            break;
+        }
+        try {
+            input.resize(input_size);
+        } catch (const std::bad_alloc &) {
+            fprintf(stderr, "%s: request of %" PRIu64 " bytes is too large\n", __func__, input_size);
+            break;
+        }
+        if (!recv_data(sockfd, input.data(), input_size)) {
+            break;
+        }
+
+        output.clear();
+
+        bool ok = true;
+        switch (cmd) {
+            case RPC_CMD_ALLOC_BUFFER:    ok = server.alloc_buffer(input, output);    break;
+            case RPC_CMD_GET_ALIGNMENT:        server.get_alignment(output);          break;
+            case RPC_CMD_GET_MAX_SIZE:         server.get_max_size(output);           break;
+            case RPC_CMD_BUFFER_GET_BASE: ok = server.buffer_get_base(input, output); break;
+            case RPC_CMD_FREE_BUFFER:     ok = server.free_buffer(input);             break;
+            case RPC_CMD_BUFFER_CLEAR:    ok = server.buffer_clear(input);            break;
+            case RPC_CMD_SET_TENSOR:      ok = server.set_tensor(input);              break;
+            case RPC_CMD_GET_TENSOR:      ok = server.get_tensor(input, output);      break;
+            case RPC_CMD_COPY_TENSOR:     ok = server.copy_tensor(input, output);     break;
+            case RPC_CMD_GRAPH_COMPUTE:   ok = server.graph_compute(input, output);   break;
+            case RPC_CMD_SUPPORTS_OP:     ok = server.supports_op(input, output);     break;
+            case RPC_CMD_GET_DEVICE_MEMORY:
+                {
+                    // output: | free (8 bytes) | total (8 bytes) |
+                    rpc_write(output, (uint64_t) free_mem);
+                    rpc_write(output, (uint64_t) total_mem);
+                } break;
+            default:
+                {
+                    fprintf(stderr, "%s: unknown command %d\n", __func__, cmd);
+                    ok = false;
+                } break;
+        }
+
+        if (!ok) {
+            fprintf(stderr, "%s: invalid request (command %d), closing the connection\n", __func__, cmd);
+            break;
+        }
+
+        const uint64_t output_size = output.size();
+        if (!send_data(sockfd, &output_size, sizeof(output_size)) || !send_data(sockfd, output.data(), output.size())) {
+            break;
+        }
+    }
+}
+
+GGML_CALL void ggml_backend_rpc_start_server(ggml_backend_t backend, const char * endpoint, size_t free_mem, size_t total_mem) {
+    std::string host;
+    int port;
+    if (!parse_endpoint(endpoint, host, port)) {
+        fprintf(stderr, "%s: invalid endpoint '%s', expected host:port\n", __func__, endpoint);
+        return;
+    }
+    if (!rpc_net_init()) {
+        fprintf(stderr, "%s: failed to initialize the network\n", __func__);
+        return;
+    }
+
+    auto server_socket = create_server_socket(host, port);
+    if (server_socket == nullptr) {
+        fprintf(stderr, "%s: failed to listen on %s\n", __func__, endpoint);
+        return;
+    }
+
+    while (true) {
+        auto client_socket = socket_accept(server_socket->fd);
+        if (client_socket == nullptr) {
+            fprintf(stderr, "%s: failed to accept a client connection\n", __func__);
+            return;
+        }
+        printf("accepted client connection, free_mem=%zu, total_mem=%zu\n", free_mem, total_mem);
+        fflush(stdout);
+        rpc_serve_client(backend, client_socket->fd, free_mem, total_mem);
+        printf("client connection closed\n");
+        fflush(stdout);
+    }
+}
@@ -100,6 +100,44 @@ static int sched_yield (void) {
     Sleep (0);
     return 0;
 }
+
+typedef SRWLOCK            pthread_mutex_t;
+typedef CONDITION_VARIABLE pthread_cond_t;
+
+static int pthread_mutex_init(pthread_mutex_t * mutex, void * unused) {
+    (void) unused;
+    InitializeSRWLock(mutex);
+    return 0;
+}
+static int pthread_mutex_destroy(pthread_mutex_t * mutex) {
+    (void) mutex;
+    return 0;
+}
+static int pthread_mutex_lock(pthread_mutex_t * mutex) {
+    AcquireSRWLockExclusive(mutex);
+    return 0;
+}
+static int pthread_mutex_unlock(pthread_mutex_t * mutex) {
+    ReleaseSRWLockExclusive(mutex);
+    return 0;
+}
+static int pthread_cond_init(pthread_cond_t * cond, void * unused) {
+    (void) unused;
+    InitializeConditionVariable(cond);
+    return 0;
+}
+static int pthread_cond_destroy(pthread_cond_t * cond) {
+    (void) cond;
+    return 0;
+}
+static int pthread_cond_wait(pthread_cond_t * cond, pthread_mutex_t * mutex) {
+    SleepConditionVariableSRW(cond, mutex, INFINITE, 0);
+    return 0;
+}
+static int pthread_cond_broadcast(pthread_cond_t * cond) {
+    WakeAllConditionVariable(cond);
+    return 0;
+}
 #else
 #include <pthread.h>
 #include <stdatomic.h>
@@ -2572,6 +2610,64 @@ bool ggml_is_numa(void) {
     return g_state.numa.n_nodes > 1;
 }
 
+int ggml_numa_n_nodes(void) {
+    return g_state.numa.n_nodes;
+}
+
+int ggml_numa_node_cpus(int node, bool * cpumask) {
+    if (node < 0 || node >= (int) g_state.numa.n_nodes) {
+        return 0;
+    }
+
+    int n = 0;
+    const struct ggml_numa_node * numa_node = &g_state.numa.nodes[node];
+    for (uint32_t i = 0; i < numa_node->n_cpus; ++i) {
+        if (numa_node->cpus[i] < GGML_MAX_N_THREADS) {
+            cpumask[numa_node->cpus[i]] = true;
+            n++;
+        }
+    }
+    return n;
+}
+
+char ggml_numa_shard_tag = 0;
+
+int ggml_numa_shard_count(void) {
+    if (!ggml_is_numa() || g_state.numa.numa_strategy != GGML_NUMA_STRATEGY_DISTRIBUTE) {
+        return 0;
+    }
+    return g_state.numa.n_nodes;
+}
+
+void ggml_numa_shard_rows(int64_t nrows, int n, int i, int64_t * ir0, int64_t * ir1) {
+    *ir0 = nrows*i/n;
+    *ir1 = nrows*(i + 1)/n;
+}
+
+bool ggml_numa_bind(void * data, size_t size, int node) {
+#if defined(__gnu_linux__) && defined(SYS_mbind)
+    GGML_ASSERT(node >= 0 && node < GGML_NUMA_MAX_NODES);
+
+    const uintptr_t page = (uintptr_t) sysconf(_SC_PAGESIZE);
+    const uintptr_t p0 = (uintptr_t) data & ~(page - 1);
+    const uintptr_t p1 = ((uintptr_t) data + size) & ~(page - 1);
+    if (p1 <= p0) {
+        return false;
+    }
+
+    unsigned long nodemask = 1UL << node;
+
+    // MPOL_BIND, MPOL_MF_MOVE: pages that are already touched are migrated
+    const long rv = syscall(SYS_mbind, (void *) p0, (unsigned long) (p1 - p0), 2, &nodemask, 8*sizeof(nodemask), 1 << 1);
+    return rv == 0;
+#else
+    GGML_UNUSED(data);
+    GGML_UNUSED(size);
+    GGML_UNUSED(node);
+    return false;
+#endif
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
 void ggml_print_object(const struct ggml_object * obj) {
@@ -7368,23 +7464,23 @@ static void ggml_compute_forward_dup_same_cont(
         return;
     }
 
-    const size_t nb00 = src0->nb[0];
-    const size_t nb0 = dst->nb[0];
+    // the rows of quantized types are made of blocks
+    const size_t nb0 = ggml_type_size(src0->type);
 
     const int ith = params->ith; // thread index
     const int nth = params->nth; // number of threads
 
-    // parallelize by elements
-    const int ne = ggml_nelements(dst);
-    const int dr = (ne + nth - 1) / nth;
-    const int ie0 = dr * ith;
-    const int ie1 = MIN(ie0 + dr, ne);
+    // parallelize by blocks
+    const int nk = ggml_nelements(src0)/ggml_blck_size(src0->type);
+    const int dr = (nk + nth - 1) / nth;
+    const int k0 = dr * ith;
+    const int k1 = MIN(k0 + dr, nk);
 
-    if (ie0 < ie1) {
+    if (k0 < k1) {
         memcpy(
-            ((char *)  dst->data + ie0*nb0),
-            ((char *) src0->data + ie0*nb00),
-            (ie1 - ie0) * ggml_type_size(src0->type));
+            ((char *)  dst->data + k0*nb0),
+            ((char *) src0->data + k0*nb0),
+            (k1 - k0) * nb0);
     }
 }
 
@@ -8380,7 +8476,7 @@ static void ggml_compute_forward_dup_bytes(
         ne00 == ne0 &&
         nb00 == type_size && nb0 == type_size) {
         // copy by rows
-        const size_t rs = ne00 * type_size;
+        const size_t rs = ggml_row_size(src0->type, ne00);
         for (int64_t i03 = 0; i03 < ne03; i03++) {
             for (int64_t i02 = 0; i02 < ne02; i02++) {
                 for (int64_t i01 = ir0; i01 < ir1; i01++) {
@@ -8397,7 +8493,7 @@ static void ggml_compute_forward_dup_bytes(
     if (ggml_is_contiguous(dst)) {
         size_t id = 0;
         char * dst_ptr = (char *) dst->data;
-        const size_t rs = ne00 * type_size;
+        const size_t rs = ggml_row_size(src0->type, ne00);
 
         if (nb00 == type_size) {
             // src0 is contigous on first dimension, copy by rows
@@ -11751,8 +11847,10 @@ static bool ggml_compute_forward_mul_mat_use_blas(struct ggml_tensor * dst) {
 
     // NOTE: with GGML_OP_MUL_MAT_ID we don't want to go through the BLAS branch because it will dequantize (to_float)
     //       all the experts for each batch element and the processing would become incredibly slow
+    //       the rows of the repacked src0 are interleaved and cannot be dequantized with to_float
     // TODO: find the optimal values for these
     if (dst->op != GGML_OP_MUL_MAT_ID &&
+        src0->extra != &ggml_repack_tag &&
         ggml_is_contiguous(src0) &&
         ggml_is_contiguous(src1) &&
       //src0->type == GGML_TYPE_F32 &&
@@ -11767,6 +11865,123 @@ static bool ggml_compute_forward_mul_mat_use_blas(struct ggml_tensor * dst) {
 }
 #endif
 
+// src0 is stored in the interleaved layout of the CPU repack buffer type:
+// the rows of src0 are computed in groups of GGML_REPACK_NROWS, for up to 4 columns of src1 at a time
+static void ggml_compute_forward_mul_mat_repacked(
+        const struct ggml_compute_params * params,
+              struct ggml_tensor * dst,
+        const void * wdata,
+        const size_t row_size) {
+
+    const struct ggml_tensor * src0 = dst->src[0];
+    const struct ggml_tensor * src1 = dst->src[1];
+
+    GGML_TENSOR_BINARY_OP_LOCALS
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    const enum ggml_type vec_dot_type = type_traits[src0->type].vec_dot_type;
+
+    GGML_ASSERT(ne02 == 1 && ne03 == 1);
+    GGML_ASSERT(ne01 % GGML_REPACK_NROWS == 0);
+
+    void (* const gemm)(int, float *, size_t, const void *, const void *, size_t, int) =
+        src0->type == GGML_TYPE_Q4_0 ? ggml_gemm_q4_0x4_q8_0 : ggml_gemm_q8_0x4_q8_0;
+
+    const int64_t nr0 = ne01/GGML_REPACK_NROWS; // groups of src0 rows
+    const int64_t nr1 = ne1*ne12*ne13;          // src1 rows
+
+    // distribute the thread work across the inner or outer loop based on which one is larger
+    const int64_t nth0 = nr0 > nr1 ? nth : 1; // parallelize by src0 row groups
+    const int64_t nth1 = nr0 > nr1 ? 1 : nth; // parallelize by src1 rows
+
+    const int64_t ith0 = ith % nth0;
+    const int64_t ith1 = ith / nth0;
+
+    const int64_t dr0 = (nr0 + nth0 - 1)/nth0;
+    const int64_t dr1 = (nr1 + nth1 - 1)/nth1;
+
+    const int64_t ir010 = dr0*ith0;
+    const int64_t ir011 = MIN(ir010 + dr0, nr0);
+
+    const int64_t ir110 = dr1*ith1;
+    const int64_t ir111 = MIN(ir110 + dr1, nr1);
+
+    if (ir010 >= ir011 || ir110 >= ir111) {
+        sched_yield();
+        return;
+    }
+
+    const bool   src1_packed = ggml_is_contiguous(src1) || src1->type != vec_dot_type;
+    const size_t src1_stride = src1_packed ? row_size : nb11;
+
+    const size_t nbg = GGML_REPACK_NROWS*nb01; // bytes per group of src0 rows
+
+    // block-tiling: a tile of src0 row groups is reused for all the columns of src1
+    const int64_t blck_0 = 16;
+
+    for (int64_t iir0 = ir010; iir0 < ir011; iir0 += blck_0) {
+        for (int64_t ir1 = ir110; ir1 < ir111; ) {
+            const int64_t i13 = (ir1/(ne12*ne1));
+            const int64_t i12 = (ir1 - i13*ne12*ne1)/ne1;
+            const int64_t i11 = (ir1 - i13*ne12*ne1 - i12*ne1);
+
+            // up to 4 consecutive columns of the same matrix of src1
+            const int nc = (int) MIN(4, MIN(ir111 - ir1, ne1 - i11));
+
+            const char * src1_col = (const char *) wdata +
+                (src1_packed
+                 ? (i11      + i12*ne11 + i13*ne12*ne11)*row_size
+                 : (i11*nb11 + i12*nb12 + i13*nb13));
+            float * dst_col = (float *) ((char *) dst->data + (i11*nb1 + i12*nb2 + i13*nb3));
+
+            for (int64_t ir0 = iir0; ir0 < iir0 + blck_0 && ir0 < ir011; ++ir0) {
+                gemm(ne00, dst_col + ir0*GGML_REPACK_NROWS, nb1/nb0, (const char *) src0->data + ir0*nbg, src1_col, src1_stride, nc);
+            }
+
+            ir1 += nc;
+        }
+    }
+}
+
+// the group of threads that computes the NUMA shard of the node of this thread:
+// the threads pinned to the CPUs of a node compute its shard, the threads that are not pinned to a single node
+// (such as the thread calling ggml_graph_compute with a threadpool) are spread over the groups
+// returns false if a node has no pinned thread, then all the threads compute all the rows
+static bool ggml_numa_shard_group(const struct ggml_compute_params * params, int n_nodes, int * node, int * ith_group, int * nth_group) {
+    const int * numa_nodes = params->numa_nodes;
+    if (numa_nodes == NULL || n_nodes > GGML_NUMA_MAX_NODES) {
+        return false;
+    }
+
+    int n_pinned[GGML_NUMA_MAX_NODES] = {0};
+    for (int j = 0; j < params->nth; ++j) {
+        if (numa_nodes[j] >= 0 && numa_nodes[j] < n_nodes) {
+            n_pinned[numa_nodes[j]]++;
+        }
+    }
+    for (int n = 0; n < n_nodes; ++n) {
+        if (n_pinned[n] == 0) {
+            return false;
+        }
+    }
+
+    int n_group[GGML_NUMA_MAX_NODES] = {0};
+    int n_unpinned = 0;
+    for (int j = 0; j < params->nth; ++j) {
+        const int group = numa_nodes[j] >= 0 && numa_nodes[j] < n_nodes ? numa_nodes[j] : n_unpinned++ % n_nodes;
+        if (j == params->ith) {
+            *node      = group;
+            *ith_group = n_group[group];
+        }
+        n_group[group]++;
+    }
+    *nth_group = n_group[*node];
+
+    return true;
+}
+
 static void ggml_compute_forward_mul_mat(
         const struct ggml_compute_params * params,
               struct ggml_tensor * dst) {
@@ -11786,6 +12001,24 @@ static void ggml_compute_forward_mul_mat(
 
     const bool src1_cont = ggml_is_contiguous(src1);
 
+    // src0 is in the interleaved layout of the CPU repack buffer type
+    const bool src0_repacked = src0->extra == &ggml_repack_tag;
+
+    // rows of src0 computed by the group of threads of this thread: with a NUMA sharded src0,
+    // each node computes the shard in its local memory, otherwise all the threads compute all the rows
+    int64_t ir0_start = 0;
+    int64_t ir0_end   = ne01;
+    int     ith_group = ith;
+    int     nth_group = nth;
+
+    if (src0->extra == &ggml_numa_shard_tag) {
+        const int n_nodes = ggml_numa_shard_count();
+        int node = 0;
+        if (n_nodes > 1 && ggml_numa_shard_group(params, n_nodes, &node, &ith_group, &nth_group)) {
+            ggml_numa_shard_rows(ne01, n_nodes, node, &ir0_start, &ir0_end);
+        }
+    }
+
     ggml_vec_dot_t    const vec_dot               = type_traits[type].vec_dot;
     enum ggml_type    const vec_dot_type          = type_traits[type].vec_dot_type;
     ggml_from_float_t const from_float_to_vec_dot = type_traits[vec_dot_type].from_float;
@@ -11890,17 +12123,17 @@ static void ggml_compute_forward_mul_mat(
 #endif
 
 #if GGML_USE_LLAMAFILE
-    if (src1_cont) {
+    if (src1_cont && !src0_repacked) {
         for (int64_t i13 = 0; i13 < ne13; i13++)
             for (int64_t i12 = 0; i12 < ne12; i12++)
-                if (!llamafile_sgemm(ne01, ne11, ne00/ggml_blck_size(src0->type),
-                                     (const char *)src0->data + i12/r2*nb02 + i13/r3*nb03,
+                if (!llamafile_sgemm(ir0_end - ir0_start, ne11, ne00/ggml_blck_size(src0->type),
+                                     (const char *)src0->data + i12/r2*nb02 + i13/r3*nb03 + ir0_start*nb01,
                                      nb01/ggml_type_size(src0->type),
                                      (const char *)src1->data + i12*nb12 + i13*nb13,
                                      nb11/ggml_type_size(src1->type),
-                                     (char *)dst->data + i12*nb2 + i13*nb3,
+                                     (char *)dst->data + i12*nb2 + i13*nb3 + ir0_start*nb0,
                                      nb1/ggml_type_size(dst->type),
-                                     ith, nth,
+                                     ith_group, nth_group,
                                      params->type,
                                      src0->type,
                                      src1->type,
@@ -11943,17 +12176,17 @@ UseGgmlGemm1:;
     const size_t row_size = ggml_row_size(vec_dot_type, ne10);
 
 #if GGML_USE_LLAMAFILE
-    if (src1->type != vec_dot_type) {
+    if (src1->type != vec_dot_type && !src0_repacked) {
         for (int64_t i13 = 0; i13 < ne13; i13++)
             for (int64_t i12 = 0; i12 < ne12; i12++)
-                if (!llamafile_sgemm(ne01, ne11, ne00/ggml_blck_size(src0->type),
-                                     (const char *)src0->data + i12/r2*nb02 + i13/r3*nb03,
+                if (!llamafile_sgemm(ir0_end - ir0_start, ne11, ne00/ggml_blck_size(src0->type),
+                                     (const char *)src0->data + i12/r2*nb02 + i13/r3*nb03 + ir0_start*nb01,
                                      nb01/ggml_type_size(src0->type),
                                      (const char *)wdata + (i12*ne11 + i13*ne12*ne11)*row_size,
                                      row_size/ggml_type_size(vec_dot_type),
-                                     (char *)dst->data + i12*nb2 + i13*nb3,
+                                     (char *)dst->data + i12*nb2 + i13*nb3 + ir0_start*nb0,
                                      nb1/ggml_type_size(dst->type),
-                                     ith, nth,
+                                     ith_group, nth_group,
                                      params->type,
                                      src0->type,
                                      vec_dot_type,
@@ -11964,24 +12197,29 @@ UseGgmlGemm1:;
 UseGgmlGemm2:;
 #endif
 
-    const int64_t nr0 = ne01;          // src0 rows
-    const int64_t nr1 = ne1*ne12*ne13; // src1 rows
+    if (src0_repacked) {
+        ggml_compute_forward_mul_mat_repacked(params, dst, wdata, row_size);
+        return;
+    }
+
+    const int64_t nr0 = ir0_end - ir0_start; // src0 rows of the thread group
+    const int64_t nr1 = ne1*ne12*ne13;       // src1 rows
 
     //printf("nr0 = %lld, nr1 = %lld\n", nr0, nr1);
 
     // distribute the thread work across the inner or outer loop based on which one is larger
 
-    const int64_t nth0 = nr0 > nr1 ? nth : 1; // parallelize by src0 rows
-    const int64_t nth1 = nr0 > nr1 ? 1 : nth; // parallelize by src1 rows
+    const int64_t nth0 = nr0 > nr1 ? nth_group : 1; // parallelize by src0 rows
+    const int64_t nth1 = nr0 > nr1 ? 1 : nth_group; // parallelize by src1 rows
 
-    const int64_t ith0 = ith % nth0;
-    const int64_t ith1 = ith / nth0;
+    const int64_t ith0 = ith_group % nth0;
+    const int64_t ith1 = ith_group / nth0;
 
     const int64_t dr0 = (nr0 + nth0 - 1)/nth0;
     const int64_t dr1 = (nr1 + nth1 - 1)/nth1;
 
-    const int64_t ir010 = dr0*ith0;
-    const int64_t ir011 = MIN(ir010 + dr0, nr0);
+    const int64_t ir010 = ir0_start + dr0*ith0;
+    const int64_t ir011 = MIN(ir010 + dr0, ir0_end);
 
     const int64_t ir110 = dr1*ith1;
     const int64_t ir111 = MIN(ir110 + dr1, nr1);
@@ -12005,7 +12243,7 @@ UseGgmlGemm2:;
     int64_t nrc = vec_dot_num_rows;
     // TODO: currently the mmla kernels support only even numbered rows/cols.
     // this check can be removed once they are extended to support odd numbered rows/cols too
-    if ((nr0 % 2 != 0) || (ne11 % 2 != 0)) {
+    if ((ne01 % 2 != 0) || (ne11 % 2 != 0)) {
         nrc = 1;
     }
 
@@ -12873,6 +13111,8 @@ static void ggml_compute_forward_get_rows_q(
         const int64_t i10 = (i - i12*ne11*ne10 - i11*ne10);
         const int64_t i01 = *(int32_t *) ((char *) src1->data + i10*nb10 + i11*nb11 + i12*nb12);
 
+        GGML_ASSERT(i01 >= 0 && i01 < ne01);
+
         dequantize_row_q(
                 (const void *) ((char *) src0->data + i01*nb01 + i11*nb02 + i12*nb03),
                      (float *) ((char *)  dst->data + i10*nb1  + i11*nb2  + i12*nb3), nc);
@@ -12916,6 +13156,8 @@ static void ggml_compute_forward_get_rows_f16(
         const int64_t i10 = (i - i12*ne11*ne10 - i11*ne10);
         const int64_t i01 = *(int32_t *) ((char *) src1->data + i10*nb10 + i11*nb11 + i12*nb12);
 
+        GGML_ASSERT(i01 >= 0 && i01 < ne01);
+
         ggml_fp16_to_fp32_row(
                 (const void *) ((char *) src0->data + i01*nb01 + i11*nb02 + i12*nb03),
                      (float *) ((char *)  dst->data + i10*nb1  + i11*nb2  + i12*nb3), nc);
@@ -12959,6 +13201,8 @@ static void ggml_compute_forward_get_rows_bf16(
         const int64_t i10 = (i - i12*ne11*ne10 - i11*ne10);
         const int64_t i01 = *(int32_t *) ((char *) src1->data + i10*nb10 + i11*nb11 + i12*nb12);
 
+        GGML_ASSERT(i01 >= 0 && i01 < ne01);
+
        ggml_bf16_to_fp32_row(
                 (const void *) ((char *) src0->data + i01*nb01 + i11*nb02 + i12*nb03),
                      (float *) ((char *)  dst->data + i10*nb1  + i11*nb2  + i12*nb3), nc);
@@ -13002,6 +13246,8 @@ static void ggml_compute_forward_get_rows_f32(
         const int64_t i10 = (i - i12*ne11*ne10 - i11*ne10);
         const int64_t i01 = *(int32_t *) ((char *) src1->data + i10*nb10 + i11*nb11 + i12*nb12);
 
+        GGML_ASSERT(i01 >= 0 && i01 < ne01);
+
         ggml_vec_cpy_f32(nc,
                 (float *) ((char *)  dst->data + i10*nb1  + i11*nb2  + i12*nb3),
                 (float *) ((char *) src0->data + i01*nb01 + i11*nb02 + i12*nb03));
@@ -13110,6 +13356,8 @@ static void ggml_compute_forward_get_rows_back_f32_f16(
     for (int i = 0; i < nr; ++i) {
         const int r = ((int32_t *) src1->data)[i];
 
+        GGML_ASSERT(r >= 0 && r < dst->ne[1]);
+
         for (int j = 0; j < nc; ++j) {
             ggml_fp16_t v = ((ggml_fp16_t *) ((char *) src0->data + i*src0->nb[1]))[j];
             ((float *) ((char *) dst->data + r*dst->nb[1]))[j] += GGML_FP16_TO_FP32(v);
@@ -13149,6 +13397,8 @@ static void ggml_compute_forward_get_rows_back_f32(
     for (int i = 0; i < nr; ++i) {
         const int r = ((int32_t *) src1->data)[i];
 
+        GGML_ASSERT(r >= 0 && r < dst->ne[1]);
+
         ggml_vec_add_f32(nc,
                 (float *) ((char *)  dst->data + r*dst->nb[1]),
                 (float *) ((char *)  dst->data + r*dst->nb[1]),
@@ -15555,9 +15805,20 @@ static void ggml_compute_forward_flash_attn_ext_f16(
     GGML_ASSERT(ne0 == D);
     GGML_ASSERT(ne2 == N);
 
+    // K can be F16 or quantized: the KQ dot products are computed with the vec_dot of its type,
+    // after converting each row of Q to its vec_dot_type
+    // V can be F16 or quantized: quantized rows are converted to F32 before being accumulated
+    const enum ggml_type        k_vec_dot_type = type_traits[k->type].vec_dot_type;
+    const ggml_from_float_t     q_to_vec_dot   = type_traits[k_vec_dot_type].from_float;
+    const ggml_vec_dot_t        kq_vec_dot     = type_traits[k->type].vec_dot;
+    const ggml_to_float_t       v_to_float     = type_traits[v->type].to_float;
+
+    GGML_ASSERT(q_to_vec_dot && kq_vec_dot && "unsupported K type for flash attention");
+    GGML_ASSERT(v_to_float && "unsupported V type for flash attention");
+
     GGML_ASSERT(nbq0 == sizeof(float));
-    GGML_ASSERT(nbk0 == sizeof(ggml_fp16_t));
-    GGML_ASSERT(nbv0 == sizeof(ggml_fp16_t));
+    GGML_ASSERT(nbk0 == ggml_type_size(k->type));
+    GGML_ASSERT(nbv0 == ggml_type_size(v->type));
 
     GGML_ASSERT(neq0 == D);
     GGML_ASSERT(nek0 == D);
@@ -15624,11 +15885,16 @@ static void ggml_compute_forward_flash_attn_ext_f16(
         float S = 0.0f;
         float M = -INFINITY;
 
-        float       * V32 = (float       *) params->wdata + ith*(2*D + CACHE_LINE_SIZE_F32);
-        ggml_fp16_t * Q16 = (ggml_fp16_t *) (V32); // reuse memory
-        ggml_fp16_t * V16 = (ggml_fp16_t *) (V32 + D);
+        float       * VKQ32 = (float       *) params->wdata + ith*(3*D + CACHE_LINE_SIZE_F32); // F32 VKQ accumulator
+        float       * V32   =                 (VKQ32 + 1*D); // F32 row of a quantized V
+        ggml_fp16_t * VKQ16 = (ggml_fp16_t *) (VKQ32 + 1*D); // F16 VKQ accumulator (F16 V)
+        void        * Q_q   =                 (VKQ32 + 2*D); // row of Q converted to the vec_dot_type of K
 
-        memset(V16, 0, D*sizeof(ggml_fp16_t));
+        if (v->type == GGML_TYPE_F16) {
+            memset(VKQ16, 0, D*sizeof(ggml_fp16_t));
+        } else {
+            memset(VKQ32, 0, D*sizeof(float));
+        }
 
         const ggml_fp16_t * mp = mask ? (ggml_fp16_t *)((char *) mask->data + iq1*mask->nb[1]) : NULL;
 
@@ -15640,6 +15906,9 @@ static void ggml_compute_forward_flash_attn_ext_f16(
         const int iv3 = iq3 / rv3;
         const int iv2 = iq2 / rv2;
 
+        const float * pq = (const float *) ((char *) q->data + (iq1*nbq1 + iq2*nbq2 + iq3*nbq3));
+        q_to_vec_dot(pq, Q_q, D);
+
         // online softmax / attention
         // loop over n_kv and n_head_kv
         // ref: https://arxiv.org/pdf/2112.05682.pdf
@@ -15651,19 +15920,8 @@ static void ggml_compute_forward_flash_attn_ext_f16(
 
             float s;
 
-            // convert Q to F16 in V32
-            {
-                const float * pq = (const float *) ((char *) q->data + (iq1*nbq1 + iq2*nbq2 + iq3*nbq3));
-
-                for (int64_t d = 0; d < D; ++d) {
-                    Q16[d] = GGML_FP32_TO_FP16(pq[d]);
-                }
-            }
-
-            ggml_vec_dot_f16(D,
-                    &s, 0,
-                    (ggml_fp16_t *) ((char *) k->data + ( ic*nbk1 + ik2*nbk2 + ik3*nbk3)), 0,
-                    Q16, 0, 1);
+            const char * k_data = (const char *) k->data + (ic*nbk1 + ik2*nbk2 + ik3*nbk3);
+            kq_vec_dot(D, &s, 0, k_data, 0, Q_q, 0, 1);
 
             s = s*scale + mv;
 
@@ -15672,29 +15930,50 @@ static void ggml_compute_forward_flash_attn_ext_f16(
             float ms = 1.0f;
             float vs = 1.0f;
 
-            if (s > M) {
-                M = s;
-                ms = expf(Mold - M);
+            const char * v_data = (const char *) v->data + (ic*nbv1 + iv2*nbv2 + iv3*nbv3);
+
+            if (v->type == GGML_TYPE_F16) {
+                if (s > M) {
+                    M = s;
+                    ms = expf(Mold - M);
 
-                // V = V*expf(Mold - M)
-                ggml_vec_scale_f16(D, V16, ms);
+                    // V = V*expf(Mold - M)
+                    ggml_vec_scale_f16(D, VKQ16, ms);
+                } else {
+                    vs = expf(s - M);
+                }
+
+                // V += v*expf(s - M)
+                ggml_vec_mad_f16(D, VKQ16, (const ggml_fp16_t *) v_data, vs);
             } else {
-                vs = expf(s - M);
-            }
+                if (s > M) {
+                    M = s;
+                    ms = expf(Mold - M);
+
+                    // V = V*expf(Mold - M)
+                    ggml_vec_scale_f32(D, VKQ32, ms);
+                } else {
+                    vs = expf(s - M);
+                }
 
-            const ggml_fp16_t * v16 = (const ggml_fp16_t *) ((char *) v->data + (ic*nbv1 + iv2*nbv2 + iv3*nbv3));
+                v_to_float(v_data, V32, D);
 
-            // V += v*expf(s - M)
-            ggml_vec_mad_f16(D, V16, v16, vs);
+                // V += v*expf(s - M)
+                ggml_vec_mad_f32(D, VKQ32, V32, vs);
+            }
 
             S = S*ms + vs;
         }
 
-        // V /= S
-        for (int64_t d = 0; d < D; ++d) {
-            V32[d] = GGML_FP16_TO_FP32(V16[d])/S;
+        if (v->type == GGML_TYPE_F16) {
+            for (int64_t d = 0; d < D; ++d) {
+                VKQ32[d] = GGML_FP16_TO_FP32(VKQ16[d]);
+            }
         }
 
+        // V /= S
+        ggml_vec_scale_f32(D, VKQ32, 1.0f/S);
+
         // dst indices
         const int i1 = iq1;
         const int i2 = iq2;
@@ -15704,7 +15983,7 @@ static void ggml_compute_forward_flash_attn_ext_f16(
         //memcpy((char *) dst->data + (i1*nb1 + i2*nb2 + i3*nb3), V, nev0*sizeof(float));
 
         // permute(0, 2, 1, 3)
-        memcpy((char *) dst->data + (i3*ne2*ne1 + i2 + i1*ne1)*nb1, V32, nb1);
+        memcpy((char *) dst->data + (i3*ne2*ne1 + i2 + i1*ne1)*nb1, VKQ32, nb1);
     }
 }
 
@@ -19121,17 +19400,105 @@ static void clear_numa_thread_affinity(void) {
 
     CPU_FREE(cpus);
 }
+
+// the node of the CPUs the calling thread may run on, -1 if they are on several nodes
+static int ggml_thread_numa_node(void) {
+    if (!ggml_is_numa()) {
+        return -1;
+    }
+
+    size_t setsize = CPU_ALLOC_SIZE(g_state.numa.total_cpus);
+
+    cpu_set_t * cpus = CPU_ALLOC(g_state.numa.total_cpus);
+    int node = -1;
+    if (pthread_getaffinity_np(pthread_self(), setsize, cpus) == 0) {
+        for (uint32_t n = 0; n < g_state.numa.n_nodes; ++n) {
+            const struct ggml_numa_node * numa_node = &g_state.numa.nodes[n];
+            bool found = false;
+            for (uint32_t i = 0; i < numa_node->n_cpus && !found; ++i) {
+                found = CPU_ISSET_S(numa_node->cpus[i], setsize, cpus);
+            }
+            if (found) {
+                if (node != -1) {
+                    node = -1;
+                    break;
+                }
+                node = (int) n;
+            }
+        }
+    }
+
+    CPU_FREE(cpus);
+    return node;
+}
+
+static void set_cpumask_thread_affinity(const bool * cpumask, int thread_n, bool strict) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+
+    int n_set = 0;
+    for (int i = 0; i < GGML_MAX_N_THREADS && i < CPU_SETSIZE; ++i) {
+        n_set += cpumask[i] ? 1 : 0;
+    }
+
+    if (strict) {
+        // pick the (thread_n % n_set)-th cpu of the mask
+        int k = thread_n % n_set;
+        for (int i = 0; i < GGML_MAX_N_THREADS && i < CPU_SETSIZE; ++i) {
+            if (cpumask[i] && k-- == 0) {
+                CPU_SET(i, &cpus);
+                break;
+            }
+        }
+    } else {
+        for (int i = 0; i < GGML_MAX_N_THREADS && i < CPU_SETSIZE; ++i) {
+            if (cpumask[i]) {
+                CPU_SET(i, &cpus);
+            }
+        }
+    }
+
+    int rv = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    if (rv) {
+        fprintf(stderr, "warning: pthread_setaffinity_np() failed: %s\n", strerror(rv));
+    }
+}
 #else
 // TODO: Windows etc.
 // (the linux implementation may also work on BSD, someone should test)
 static void set_numa_thread_affinity(int thread_n) { UNUSED(thread_n);  }
 static void clear_numa_thread_affinity(void) {}
+static int ggml_thread_numa_node(void) { return -1; }
+static void set_cpumask_thread_affinity(const bool * cpumask, int thread_n, bool strict) { UNUSED(cpumask); UNUSED(thread_n); UNUSED(strict); }
+#endif
+
+static inline void ggml_thread_cpu_relax(void) {
+#if defined(__x86_64__) || (defined(_MSC_VER) && defined(_M_AMD64))
+    _mm_pause();
 #endif
+}
+
+struct ggml_threadpool {
+    pthread_mutex_t mutex; // sleeping workers wait on cond with this mutex held
+    pthread_cond_t  cond;  // signaled when new work is available or the pool is stopped
+
+    atomic_int stop;
+
+    struct ggml_compute_state * workers; // workers[0] is the thread calling ggml_graph_compute()
+
+    int  n_threads;
+    int  poll;
+    bool strict_cpu;
+    bool has_cpumask;
+    bool cpumask[GGML_MAX_N_THREADS];
+};
 
 struct ggml_compute_state_shared {
     const struct ggml_cgraph * cgraph;
     const struct ggml_cplan  * cplan;
 
+    struct ggml_threadpool * threadpool; // NULL if the threads are created for this graph only
+
     int64_t perf_node_start_cycles;
     int64_t perf_node_start_time_us;
 
@@ -19144,6 +19511,8 @@ struct ggml_compute_state_shared {
 
     ggml_abort_callback abort_callback; // abort ggml_graph_compute when true
     void * abort_callback_data;
+
+    int numa_nodes[GGML_MAX_N_THREADS]; // numa_node of each thread, set by the thread when it starts on the graph
 };
 
 struct ggml_compute_state {
@@ -19151,6 +19520,11 @@ struct ggml_compute_state {
     int ith;
     struct ggml_compute_state_shared * shared;
     enum ggml_status ec;
+    int numa_node; // node of the CPUs the thread is pinned to, -1 if not pinned to a single node
+
+    // thread pool workers only
+    struct ggml_threadpool * threadpool;
+    atomic_int has_work; // set by the main thread when shared points to a new graph, cleared by the worker when done
 };
 
 static void ggml_graph_compute_perf_stats_node(struct ggml_tensor * node, const struct ggml_compute_state_shared * st) {
@@ -19450,7 +19824,15 @@ static thread_ret_t ggml_graph_compute_thread(void * data) {
 
     const int   n_threads   = state->shared->n_threads;
 
-    set_numa_thread_affinity(state->ith);
+    if (state->shared->threadpool == NULL) {
+        // thread pool workers set their affinity once when they are started
+        set_numa_thread_affinity(state->ith);
+        state->numa_node = ggml_thread_numa_node();
+    } else if (state->ith == 0) {
+        // the calling thread is not pinned by the pool
+        state->numa_node = ggml_thread_numa_node();
+    }
+    state->shared->numa_nodes[state->ith] = state->numa_node;
 
     int node_n     = -1;
     int task_phase = GGML_TASK_TYPE_FINALIZE;
@@ -19471,6 +19853,7 @@ static thread_ret_t ggml_graph_compute_thread(void * data) {
                 /*.nth   =*/ 0,
                 /*.wsize =*/ cplan->work_size,
                 /*.wdata =*/ cplan->work_data,
+                /*.numa_nodes =*/ state->shared->numa_nodes,
             };
 
             if (node_n != -1) {
@@ -19543,6 +19926,7 @@ static thread_ret_t ggml_graph_compute_thread(void * data) {
             /*.nth   =*/ n_tasks,
             /*.wsize =*/ cplan->work_size,
             /*.wdata =*/ cplan->work_data,
+            /*.numa_nodes =*/ state->shared->numa_nodes,
         };
 
         if (state->ith < n_tasks) {
@@ -19738,7 +20122,7 @@ struct ggml_cplan ggml_graph_plan(const struct ggml_cgraph * cgraph, int n_threa
                 {
                     const int64_t ne00 = node->src[0]->ne[0]; // D
 
-                    cur = 2*sizeof(float)*ne00*n_tasks; // 2x head size
+                    cur = 3*sizeof(float)*ne00*n_tasks; // 3x head size
                 } break;
             case GGML_OP_FLASH_FF:
                 {
@@ -19796,10 +20180,138 @@ struct ggml_cplan ggml_graph_plan(const struct ggml_cgraph * cgraph, int n_threa
     return cplan;
 }
 
+static void ggml_threadpool_set_affinity(const struct ggml_threadpool * threadpool, int ith) {
+    if (threadpool->has_cpumask) {
+        set_cpumask_thread_affinity(threadpool->cpumask, ith, threadpool->strict_cpu);
+    } else {
+        set_numa_thread_affinity(ith);
+    }
+}
+
+static thread_ret_t ggml_threadpool_worker(void * data) {
+    struct ggml_compute_state * state = (struct ggml_compute_state *) data;
+    struct ggml_threadpool * threadpool = state->threadpool;
+
+    ggml_threadpool_set_affinity(threadpool, state->ith);
+    state->numa_node = ggml_thread_numa_node();
+
+    // each poll level is worth 1024 spins
+    const int64_t n_spin = (int64_t) threadpool->poll * 1024;
+
+    while (true) {
+        // spin for a while first - decode steps are often only a few ms apart
+        for (int64_t i = 0; i < n_spin; ++i) {
+            if (atomic_load(&state->has_work) || atomic_load(&threadpool->stop)) {
+                break;
+            }
+            ggml_thread_cpu_relax();
+        }
+
+        if (!atomic_load(&state->has_work) && !atomic_load(&threadpool->stop)) {
+            pthread_mutex_lock(&threadpool->mutex);
+            while (!atomic_load(&state->has_work) && !atomic_load(&threadpool->stop)) {
+                pthread_cond_wait(&threadpool->cond, &threadpool->mutex);
+            }
+            pthread_mutex_unlock(&threadpool->mutex);
+        }
+
+        if (atomic_load(&threadpool->stop)) {
+            break;
+        }
+
+        ggml_graph_compute_thread(state);
+
+        atomic_store(&state->has_work, 0);
+    }
+
+    return 0;
+}
+
+struct ggml_threadpool_params ggml_threadpool_params_default(int n_threads) {
+    struct ggml_threadpool_params params;
+    memset(&params, 0, sizeof(params));
+
+    params.n_threads  = n_threads > 0 ? n_threads : GGML_DEFAULT_N_THREADS;
+    params.poll       = 50;
+    params.strict_cpu = false;
+
+    return params;
+}
+
+struct ggml_threadpool * ggml_threadpool_new(const struct ggml_threadpool_params * params) {
+    GGML_ASSERT(params->n_threads > 0 && params->n_threads <= GGML_MAX_N_THREADS);
+    GGML_ASSERT(params->poll >= 0);
+
+    struct ggml_threadpool * threadpool = GGML_MALLOC(sizeof(struct ggml_threadpool));
+
+    pthread_mutex_init(&threadpool->mutex, NULL);
+    pthread_cond_init(&threadpool->cond, NULL);
+
+    atomic_store(&threadpool->stop, 0);
+
+    threadpool->n_threads   = params->n_threads;
+    threadpool->poll        = params->poll;
+    threadpool->strict_cpu  = params->strict_cpu;
+    threadpool->has_cpumask = false;
+    for (int i = 0; i < GGML_MAX_N_THREADS; ++i) {
+        threadpool->cpumask[i]    = params->cpumask[i];
+        threadpool->has_cpumask  |= params->cpumask[i];
+    }
+
+    threadpool->workers = GGML_MALLOC(sizeof(struct ggml_compute_state)*params->n_threads);
+
+    for (int j = 0; j < params->n_threads; ++j) {
+        struct ggml_compute_state * worker = &threadpool->workers[j];
+
+        worker->thrd       = 0;
+        worker->ith        = j;
+        worker->shared     = NULL;
+        worker->ec         = GGML_STATUS_SUCCESS;
+        worker->threadpool = threadpool;
+        atomic_store(&worker->has_work, 0);
+    }
+
+    // workers[0] is the calling thread, only start the helpers
+    for (int j = 1; j < params->n_threads; ++j) {
+        const int rc = ggml_thread_create(&threadpool->workers[j].thrd, NULL, ggml_threadpool_worker, &threadpool->workers[j]);
+        GGML_ASSERT(rc == 0);
+        UNUSED(rc);
+    }
+
+    return threadpool;
+}
+
+void ggml_threadpool_free(struct ggml_threadpool * threadpool) {
+    if (threadpool == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&threadpool->mutex);
+    atomic_store(&threadpool->stop, 1);
+    pthread_cond_broadcast(&threadpool->cond);
+    pthread_mutex_unlock(&threadpool->mutex);
+
+    for (int j = 1; j < threadpool->n_threads; ++j) {
+        const int rc = ggml_thread_join(threadpool->workers[j].thrd, NULL);
+        GGML_ASSERT(rc == 0);
+        UNUSED(rc);
+    }
+
+    pthread_cond_destroy(&threadpool->cond);
+    pthread_mutex_destroy(&threadpool->mutex);
+
+    GGML_FREE(threadpool->workers);
+    GGML_FREE(threadpool);
+}
+
+int ggml_threadpool_get_n_threads(const struct ggml_threadpool * threadpool) {
+    return threadpool->n_threads;
+}
+
 enum ggml_status ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cplan * cplan) {
     {
         GGML_ASSERT(cplan);
-        GGML_ASSERT(cplan->n_threads > 0);
+        GGML_ASSERT(cplan->n_threads > 0 && cplan->n_threads <= GGML_MAX_N_THREADS);
 
         if (cplan->work_size > 0) {
             GGML_ASSERT(cplan->work_data);
@@ -19808,9 +20320,16 @@ enum ggml_status ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cpl
 
     const int n_threads = cplan->n_threads;
 
+    struct ggml_threadpool * threadpool = cplan->threadpool;
+    if (threadpool != NULL && n_threads > threadpool->n_threads) {
+        // the pool is too small for this plan - fall back to temporary threads
+        threadpool = NULL;
+    }
+
     struct ggml_compute_state_shared state_shared = {
         /*.cgraph                  =*/ cgraph,
         /*.cgraph_plan             =*/ cplan,
+        /*.threadpool              =*/ threadpool,
         /*.perf_node_start_cycles  =*/ 0,
         /*.perf_node_start_time_us =*/ 0,
         /*.n_threads               =*/ n_threads,
@@ -19819,11 +20338,26 @@ enum ggml_status ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cpl
         /*.node_task               =*/ GGML_TASK_TYPE_FINALIZE,
         /*.abort_callback          =*/ NULL,
         /*.abort_callback_data     =*/ NULL,
+        /*.numa_nodes              =*/ { 0 },
     };
-    struct ggml_compute_state * workers = alloca(sizeof(struct ggml_compute_state)*n_threads);
+    struct ggml_compute_state * workers = threadpool ? threadpool->workers : alloca(sizeof(struct ggml_compute_state)*n_threads);
+
+    if (threadpool) {
+        // hand the graph to the pool workers
+        for (int j = 1; j < n_threads; ++j) {
+            workers[j].shared = &state_shared;
+            workers[j].ec     = GGML_STATUS_SUCCESS;
+            atomic_store(&workers[j].has_work, 1);
+        }
 
-    // create thread pool
-    if (n_threads > 1) {
+        // wake up the workers that went to sleep
+        if (n_threads > 1) {
+            pthread_mutex_lock(&threadpool->mutex);
+            pthread_cond_broadcast(&threadpool->cond);
+            pthread_mutex_unlock(&threadpool->mutex);
+        }
+    } else if (n_threads > 1) {
+        // create thread pool
         for (int j = 1; j < n_threads; ++j) {
             workers[j] = (struct ggml_compute_state) {
                 .thrd   = 0,
@@ -19849,17 +20383,28 @@ enum ggml_status ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cpl
     ggml_graph_compute_thread(&workers[0]);
     enum ggml_status compute_status = workers[0].ec;
 
-    // don't leave affinity set on the main thread
-    clear_numa_thread_affinity();
-
-    // join or kill thread pool
-    if (n_threads > 1) {
+    if (threadpool) {
+        // wait for the pool workers to leave the graph
         for (int j = 1; j < n_threads; j++) {
-            const int rc = ggml_thread_join(workers[j].thrd, NULL);
-            GGML_ASSERT(rc == 0);
+            while (atomic_load(&workers[j].has_work)) {
+                sched_yield();
+            }
             if (workers[j].ec != GGML_STATUS_SUCCESS)
                 compute_status = workers[j].ec;
         }
+    } else {
+        // don't leave affinity set on the main thread
+        clear_numa_thread_affinity();
+
+        // join or kill thread pool
+        if (n_threads > 1) {
+            for (int j = 1; j < n_threads; j++) {
+                const int rc = ggml_thread_join(workers[j].thrd, NULL);
+                GGML_ASSERT(rc == 0);
+                if (workers[j].ec != GGML_STATUS_SUCCESS)
+                    compute_status = workers[j].ec;
+            }
+        }
     }
 
     // performance stats (graph)
@@ -234,6 +234,7 @@
 #endif
 #define GGML_MAX_OP_PARAMS      64
 #define GGML_DEFAULT_N_THREADS  4
+#define GGML_MAX_N_THREADS      512
 #define GGML_DEFAULT_GRAPH_SIZE 2048
 #if UINTPTR_MAX == 0xFFFFFFFF
     #define GGML_MEM_ALIGN 4
@@ -610,6 +611,16 @@ extern "C" {
     // If it returns true, the computation is aborted
     typedef bool (*ggml_abort_callback)(void * data);
 
+    // persistent pool of worker threads that can be reused across ggml_graph_compute() calls
+    struct ggml_threadpool;
+
+    struct ggml_threadpool_params {
+        bool cpumask[GGML_MAX_N_THREADS]; // CPUs the worker threads may run on (all false = no explicit affinity)
+        int  n_threads;                   // number of threads, including the thread calling ggml_graph_compute()
+        int  poll;                        // busy-wait level before an idle worker goes to sleep (0 = sleep immediately, 100 = spin aggressively)
+        bool strict_cpu;                  // pin each worker to a single CPU of the mask instead of the whole mask
+    };
+
     // the compute plan that needs to be prepared for ggml_graph_compute()
     // since https://github.com/ggerganov/ggml/issues/287
     struct ggml_cplan {
@@ -618,6 +629,9 @@ extern "C" {
 
         int n_threads;
 
+        // optional thread pool to run the graph on, if NULL threads are created and joined for every call
+        struct ggml_threadpool * threadpool;
+
         // abort ggml_graph_compute when true
         ggml_abort_callback abort_callback;
         void *              abort_callback_data;
@@ -688,6 +702,9 @@ extern "C" {
         // work buffer for all threads
         size_t wsize;
         void * wdata;
+
+        // NUMA node of the CPUs each thread is pinned to, -1 if not pinned to a single node (NULL if unknown)
+        const int * numa_nodes;
     };
 
     // numa strategies
@@ -725,6 +742,8 @@ extern "C" {
 
     GGML_API void    ggml_numa_init(enum ggml_numa_strategy numa); // call once for better performance on NUMA systems
     GGML_API bool    ggml_is_numa(void); // true if init detected that system has >1 NUMA node
+    GGML_API int     ggml_numa_n_nodes(void); // number of NUMA nodes found by init, 0 before init
+    GGML_API int     ggml_numa_node_cpus(int node, bool * cpumask); // set the flags of the CPUs of a node in cpumask[GGML_MAX_N_THREADS], returns their number
 
     GGML_API void    ggml_print_object (const struct ggml_object * obj);
     GGML_API void    ggml_print_objects(const struct ggml_context * ctx);
@@ -2008,6 +2027,14 @@ extern "C" {
     // note: the drawback of this API is that you must have ensured that the context has enough memory for the work data
     GGML_API enum ggml_status  ggml_graph_compute_with_ctx(struct ggml_context * ctx, struct ggml_cgraph * cgraph, int n_threads);
 
+    // thread pool
+    // the worker threads are started once and wait for new graphs by spinning for a while and then sleeping
+    // to use a pool, set cplan.threadpool before calling ggml_graph_compute() with cplan.n_threads <= pool size
+    GGML_API struct ggml_threadpool_params ggml_threadpool_params_default(int n_threads);
+    GGML_API struct ggml_threadpool *      ggml_threadpool_new          (const struct ggml_threadpool_params * params);
+    GGML_API void                          ggml_threadpool_free         (struct ggml_threadpool * threadpool);
+    GGML_API int                           ggml_threadpool_get_n_threads(const struct ggml_threadpool * threadpool);
+
     GGML_API struct ggml_tensor * ggml_graph_get_tensor(struct ggml_cgraph * cgraph, const char * name);
 
     GGML_API void                 ggml_graph_export(const struct ggml_cgraph * cgraph, const char * fname);
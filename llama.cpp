@@ -22,6 +22,9 @@
 #ifdef GGML_USE_METAL
 #  include "ggml-metal.h"
 #endif
+#ifdef GGML_USE_RPC
+#  include "ggml-rpc.h"
+#endif
 #ifdef GGML_USE_MPI
 #  include "ggml-mpi.h"
 #endif
@@ -60,18 +63,21 @@
 
 #include <algorithm>
 #include <array>
+#include <atomic>
 #include <cassert>
 #include <cctype>
 #include <cfloat>
 #include <cinttypes>
 #include <climits>
 #include <cmath>
+#include <condition_variable>
 #include <cstdarg>
 #include <cstddef>
 #include <cstdint>
 #include <cstdio>
 #include <cstring>
 #include <ctime>
+#include <deque>
 #include <forward_list>
 #include <fstream>
 #include <functional>
@@ -1685,91 +1691,6 @@ static ggml_backend_buffer_type_t llama_default_buffer_type_cpu(bool host_buffer
     GGML_UNUSED(host_buffer);
 }
 
-static ggml_backend_buffer_type_t llama_default_buffer_type_offload(int gpu) {
-    ggml_backend_buffer_type_t buft = nullptr;
-
-#ifdef GGML_USE_METAL
-    buft = ggml_backend_metal_buffer_type();
-#elif defined(GGML_USE_CUDA)
-    buft = ggml_backend_cuda_buffer_type(gpu);
-#elif defined(GGML_USE_VULKAN)
-    buft = ggml_backend_vk_buffer_type(gpu);
-#elif defined(GGML_USE_SYCL)
-    buft = ggml_backend_sycl_buffer_type(gpu);
-#elif defined(GGML_USE_CLBLAST)
-    buft = ggml_backend_opencl_buffer_type();
-#elif defined(GGML_USE_KOMPUTE)
-    buft = ggml_backend_kompute_buffer_type(gpu);
-    if (buft == nullptr) {
-        LLAMA_LOG_WARN("%s: cannot use GPU %d, check `vulkaninfo --summary`\n", __func__, gpu);
-    }
-#endif
-
-    if (buft == nullptr) {
-        buft = llama_default_buffer_type_cpu(true);
-    }
-    return buft;
-
-    GGML_UNUSED(gpu);
-}
-
-static ggml_backend_buffer_type_t llama_default_buffer_type_split(int fallback_gpu, const float * tensor_split) {
-    ggml_backend_buffer_type_t buft = nullptr;
-
-#ifdef GGML_USE_CUDA
-    if (ggml_backend_cuda_get_device_count() > 1) {
-        buft = ggml_backend_cuda_split_buffer_type(tensor_split);
-    }
-#endif
-
-#ifdef GGML_USE_SYCL
-    if (ggml_backend_sycl_get_device_count() > 1) {
-        buft = ggml_backend_sycl_split_buffer_type(tensor_split);
-    }
-#endif
-
-    if (buft == nullptr) {
-        buft = llama_default_buffer_type_offload(fallback_gpu);
-    }
-    return buft;
-
-    GGML_UNUSED(tensor_split);
-}
-
-static size_t llama_get_device_count() {
-#if defined(GGML_USE_CUDA)
-    return ggml_backend_cuda_get_device_count();
-#elif defined(GGML_USE_SYCL)
-    return ggml_backend_sycl_get_device_count();
-#elif defined(GGML_USE_VULKAN)
-    return ggml_backend_vk_get_device_count();
-#else
-    return 1;
-#endif
-}
-
-static size_t llama_get_device_memory(int device) {
-#if defined(GGML_USE_CUDA)
-    size_t total;
-    size_t free;
-    ggml_backend_cuda_get_device_memory(device, &free, &total);
-    return free;
-#elif defined(GGML_USE_SYCL)
-    size_t total;
-    size_t free;
-    ggml_backend_sycl_get_device_memory(device, &free, &total);
-    return free;
-#elif defined(GGML_USE_VULKAN)
-    size_t total;
-    size_t free;
-    ggml_backend_vk_get_device_memory(device, &free, &total);
-    return free;
-#else
-    return 1;
-    GGML_UNUSED(device);
-#endif
-}
-
 //
 // globals
 //
@@ -1938,6 +1859,7 @@ struct llama_cparams {
     uint32_t n_batch;
     uint32_t n_ubatch;
     uint32_t n_seq_max;
+    uint32_t n_kv_block;      // cells per block of the paged KV cache (0 = not paged)
     uint32_t n_threads;       // number of threads to use for generation
     uint32_t n_threads_batch; // number of threads to use for batch processing
 
@@ -2055,6 +1977,13 @@ struct llama_kv_cell {
     }
 };
 
+// range of consecutive batch tokens stored in consecutive KV cells
+struct llama_kv_run {
+    uint32_t i_token;
+    uint32_t i_cell;
+    uint32_t n;
+};
+
 // ring-buffer of cached KV data
 struct llama_kv_cache {
     bool has_shift = false;
@@ -2078,6 +2007,27 @@ struct llama_kv_cache {
 
     std::vector<llama_kv_cell> cells;
 
+    // paged mode: the cells are grouped in blocks of block_size cells
+    // a block is owned by the sequence that allocated it, and new tokens of a sequence are only stored in its own
+    // blocks, so sequences can grow independently without defragmentation
+    // blocks filled by one sequence can still be shared by other sequences via llama_kv_cache_seq_cp (no copy)
+    uint32_t block_size = 0; // 0 = not paged
+
+    std::vector<llama_seq_id> block_owner; // per block, -1 = free
+
+    // set by llama_kv_cache_find_slot in paged mode - where the tokens of the batch are stored
+    std::vector<llama_kv_run> runs;
+
+    // set before each graph build in paged mode - the cells that the attention gathers (-1 = padding)
+    // when empty, the attention uses the first n cells like the non-paged cache
+    std::vector<int32_t> gather;
+
+    struct ggml_tensor * inp_gather = nullptr; // I32 [n], graph input
+
+    bool paged() const {
+        return block_size > 0;
+    }
+
     std::vector<struct ggml_tensor *> k_l; // per layer
     std::vector<struct ggml_tensor *> v_l;
 
@@ -2127,6 +2077,28 @@ struct llama_control_vector {
     }
 };
 
+// the vocab decoded into a trie of code points, used to apply a grammar to all the tokens at once:
+// the tokens that share a prefix share the matching of that prefix
+struct llama_token_trie {
+    struct node {
+        uint32_t child_begin; // the children of a node are contiguous, sorted by code point
+        uint32_t child_end;
+        uint32_t token_begin; // the tokens that end at this node
+        uint32_t token_end;
+    };
+
+    struct token {
+        llama_token        id;
+        llama_partial_utf8 partial_utf8; // incomplete UTF-8 sequence at the end of the token, if any
+    };
+
+    std::vector<node>     nodes; // nodes[0] is the root
+    std::vector<uint32_t> cpts;  // the code point that leads to each node
+    std::vector<token>    tokens;
+
+    std::vector<llama_token> eog; // only allowed when the grammar can end
+};
+
 struct llama_vocab {
     using id    = int32_t;
     using token = std::string;
@@ -2168,6 +2140,9 @@ struct llama_vocab {
 
     bool add_space_prefix = true;
 
+    // built on the first use of a grammar, see llama_vocab_get_trie
+    mutable std::shared_ptr<const llama_token_trie> trie;
+
     int find_bpe_rank(const std::string & token_left, const std::string & token_right) const {
         GGML_ASSERT(token_left.find(' ') == std::string::npos);
         GGML_ASSERT(token_left.find('\n') == std::string::npos);
@@ -2209,6 +2184,9 @@ struct llama_model {
     llama_split_mode split_mode;
     int main_gpu;
     int n_gpu_layers;
+    int n_cpu_stages;
+
+    std::vector<std::string> rpc_servers;
 
     // gguf metadata
     std::unordered_map<std::string, std::string> gguf_kv;
@@ -2261,6 +2239,140 @@ struct llama_model {
     }
 };
 
+static ggml_backend_buffer_type_t llama_default_buffer_type_offload(const llama_model & model, int gpu) {
+    ggml_backend_buffer_type_t buft = nullptr;
+
+#if defined(GGML_USE_RPC)
+    if (gpu < (int) model.rpc_servers.size()) {
+        buft = ggml_backend_rpc_buffer_type(model.rpc_servers[gpu].c_str());
+    }
+#elif defined(GGML_USE_METAL)
+    buft = ggml_backend_metal_buffer_type();
+#elif defined(GGML_USE_CUDA)
+    buft = ggml_backend_cuda_buffer_type(gpu);
+#elif defined(GGML_USE_VULKAN)
+    buft = ggml_backend_vk_buffer_type(gpu);
+#elif defined(GGML_USE_SYCL)
+    buft = ggml_backend_sycl_buffer_type(gpu);
+#elif defined(GGML_USE_CLBLAST)
+    buft = ggml_backend_opencl_buffer_type();
+#elif defined(GGML_USE_KOMPUTE)
+    buft = ggml_backend_kompute_buffer_type(gpu);
+    if (buft == nullptr) {
+        LLAMA_LOG_WARN("%s: cannot use GPU %d, check `vulkaninfo --summary`\n", __func__, gpu);
+    }
+#endif
+
+    if (buft == nullptr) {
+        buft = llama_default_buffer_type_cpu(true);
+    }
+    return buft;
+
+    GGML_UNUSED(model);
+    GGML_UNUSED(gpu);
+}
+
+static ggml_backend_buffer_type_t llama_default_buffer_type_split(const llama_model & model, int fallback_gpu, const float * tensor_split) {
+    ggml_backend_buffer_type_t buft = nullptr;
+
+#ifdef GGML_USE_CUDA
+    if (ggml_backend_cuda_get_device_count() > 1) {
+        buft = ggml_backend_cuda_split_buffer_type(tensor_split);
+    }
+#endif
+
+#ifdef GGML_USE_SYCL
+    if (ggml_backend_sycl_get_device_count() > 1) {
+        buft = ggml_backend_sycl_split_buffer_type(tensor_split);
+    }
+#endif
+
+    if (buft == nullptr) {
+        buft = llama_default_buffer_type_offload(model, fallback_gpu);
+    }
+    return buft;
+
+    GGML_UNUSED(tensor_split);
+}
+
+static size_t llama_get_device_count(const llama_model & model) {
+#if defined(GGML_USE_RPC)
+    return model.rpc_servers.size();
+#elif defined(GGML_USE_CUDA)
+    return ggml_backend_cuda_get_device_count();
+#elif defined(GGML_USE_SYCL)
+    return ggml_backend_sycl_get_device_count();
+#elif defined(GGML_USE_VULKAN)
+    return ggml_backend_vk_get_device_count();
+#else
+    return 1;
+#endif
+    GGML_UNUSED(model);
+}
+
+static size_t llama_get_device_memory(const llama_model & model, int device) {
+#if defined(GGML_USE_RPC)
+    size_t total;
+    size_t free;
+    ggml_backend_rpc_get_device_memory(model.rpc_servers[device].c_str(), &free, &total);
+    return free;
+#elif defined(GGML_USE_CUDA)
+    size_t total;
+    size_t free;
+    ggml_backend_cuda_get_device_memory(device, &free, &total);
+    return free;
+#elif defined(GGML_USE_SYCL)
+    size_t total;
+    size_t free;
+    ggml_backend_sycl_get_device_memory(device, &free, &total);
+    return free;
+#elif defined(GGML_USE_VULKAN)
+    size_t total;
+    size_t free;
+    ggml_backend_vk_get_device_memory(device, &free, &total);
+    return free;
+#else
+    return 1;
+    GGML_UNUSED(device);
+#endif
+    GGML_UNUSED(model);
+}
+
+// the topology of a decode graph only depends on these values
+// the position of the ubatch in the KV cache is patched into the KV store views of a reused graph
+struct llama_graph_key {
+    uint32_t n_tokens    = 0;
+    uint32_t n_outputs   = 0;
+    uint32_t n_kv        = 0; // padded to 32 cells (256 with flash_attn), so it changes every 32 (256) tokens
+    bool     embd_inp    = false;
+    bool     causal_attn = false;
+    bool     embeddings  = false;
+
+    bool operator==(const llama_graph_key & other) const {
+        return n_tokens    == other.n_tokens    &&
+               n_outputs   == other.n_outputs   &&
+               n_kv        == other.n_kv        &&
+               embd_inp    == other.embd_inp    &&
+               causal_attn == other.causal_attn &&
+               embeddings  == other.embeddings;
+    }
+};
+
+// the last decode graph, kept allocated in the scheduler so that the next ubatch with the same key
+// only has to update the input tensors instead of building, splitting and allocating a new graph
+struct llama_graph_cache {
+    bool valid = false; // cleared by any other graph built in buf_compute_meta
+
+    llama_graph_key key;
+
+    struct ggml_cgraph * gf   = nullptr;
+    struct ggml_tensor * res  = nullptr;
+    struct ggml_tensor * embd = nullptr;
+
+    // views of the KV cache written by the graph and their offset per cell of kv_head
+    std::vector<std::pair<struct ggml_tensor *, size_t>> kv_views;
+};
+
 struct llama_context {
     llama_context(const llama_model & model) : model(model), t_start_us(model.t_start_us), t_load_us(model.t_load_us) {}
     ~llama_context() {
@@ -2270,6 +2382,11 @@ struct llama_context {
             ggml_backend_free(backend);
         }
 
+        ggml_threadpool_free(threadpool);
+        for (ggml_threadpool * tp : threadpool_stages) {
+            ggml_threadpool_free(tp);
+        }
+
         ggml_backend_buffer_free(buf_output);
     }
 
@@ -2281,6 +2398,15 @@ struct llama_context {
 #endif
     ggml_backend_t backend_cpu = nullptr;
 
+    // persistent worker threads of the CPU backend
+    ggml_threadpool_params threadpool_params;
+    ggml_threadpool * threadpool = nullptr;
+
+    // CPU pipeline stages, each with its own worker threads
+    std::vector<ggml_backend_t>         backend_cpu_stages;
+    std::vector<ggml_threadpool_params> threadpool_stage_params;
+    std::vector<ggml_threadpool *>      threadpool_stages;
+
     const llama_model & model;
 
     // key + value cache for the self attention
@@ -2292,14 +2418,16 @@ struct llama_context {
 
     int64_t t_start_us;
     int64_t t_load_us;
-    int64_t t_sample_us = 0;
     int64_t t_p_eval_us = 0;
     int64_t t_eval_us   = 0;
 
     int64_t t_compute_start_us = 0;
     int64_t n_queued_tokens = 0;
 
-    int32_t n_sample = 0; // number of tokens sampled
+    // the sampling functions can be called from several threads at once, each with its own candidates
+    std::atomic<int64_t> t_sample_us{0};
+    std::atomic<int32_t> n_sample{0}; // number of tokens sampled
+
     int32_t n_p_eval = 0; // number of tokens in eval calls for the prompt (with batch size > 1)
     int32_t n_eval   = 0; // number of eval calls
 
@@ -2329,6 +2457,8 @@ struct llama_context {
     std::vector<uint8_t> buf_compute_meta;
     ggml_backend_sched_t sched = nullptr;
 
+    struct llama_graph_cache graph_cache;
+
     ggml_abort_callback abort_callback      = nullptr;
     void *              abort_callback_data = nullptr;
 
@@ -2375,8 +2505,13 @@ static bool llama_kv_cache_init(
 
     cache.has_shift = false;
 
-    // TODO: find a nicer way to add other recurrent model architectures
-    cache.recurrent = model.arch == LLM_ARCH_MAMBA;
+    cache.recurrent = llama_model_is_recurrent(&model);
+
+    cache.block_size = cache.recurrent ? 0 : cparams.n_kv_block;
+    cache.block_owner.clear();
+    cache.block_owner.resize(cache.paged() ? (kv_size + cache.block_size - 1)/cache.block_size : 0, -1);
+
+    // the paged cache gathers whole rows of V and requires flash_attn, so it is never transposed
     cache.v_trans   = !cparams.flash_attn;
 
     // TODO: support mixed recurrent Transformer architectures
@@ -2407,14 +2542,27 @@ static bool llama_kv_cache_init(
     offload = false;
 #endif
 
+    // without offload the KV of the layers is kept on the CPU, by the pipeline stage of the layer if there are several
+    // (the last stage for the layers that are not on the CPU)
+    auto buft_kv = [&](int64_t il) -> ggml_backend_buffer_type_t {
+        if (offload) {
+            return model.buft_layer[il].buft;
+        }
+        if (model.n_cpu_stages > 1) {
+            for (int stage = 0; stage < model.n_cpu_stages; ++stage) {
+                if (model.buft_layer[il].buft == ggml_backend_cpu_stage_buffer_type(stage)) {
+                    return model.buft_layer[il].buft;
+                }
+            }
+            return ggml_backend_cpu_stage_buffer_type(model.n_cpu_stages - 1);
+        }
+        return llama_default_buffer_type_cpu(true);
+    };
+
     // count used buffer types
     std::map<ggml_backend_buffer_type_t, int> buft_layer_count;
-    if (offload) {
-        for (int64_t i = 0; i < n_layer; ++i) {
-            buft_layer_count[model.buft_layer[i].buft]++;
-        }
-    } else {
-        buft_layer_count[llama_default_buffer_type_cpu(true)] = n_layer;
+    for (int64_t i = 0; i < n_layer; ++i) {
+        buft_layer_count[buft_kv(i)]++;
     }
 
     // create a context for each buffer type
@@ -2439,7 +2587,7 @@ static bool llama_kv_cache_init(
     cache.v_l.reserve(n_layer);
 
     for (int i = 0; i < (int) n_layer; i++) {
-        struct ggml_context * ctx = offload ? ctx_map.at(model.buft_layer[i].buft) : cache.ctxs.front();
+        struct ggml_context * ctx = ctx_map.at(buft_kv(i));
         ggml_tensor * k = ggml_new_tensor_1d(ctx, type_k, n_embd_k_gqa*kv_size);
         ggml_tensor * v = ggml_new_tensor_1d(ctx, type_v, n_embd_v_gqa*kv_size);
         ggml_format_name(k, "cache_k_l%d", i);
@@ -2465,6 +2613,152 @@ static bool llama_kv_cache_init(
     return true;
 }
 
+// paged mode: release the blocks that have become empty and adopt the non-empty blocks without an owner
+// (e.g. after loading a state or falling back to a contiguous slot)
+static void llama_kv_cache_sync_blocks(struct llama_kv_cache & cache) {
+    const uint32_t n_blocks = cache.block_owner.size();
+
+    for (uint32_t b = 0; b < n_blocks; ++b) {
+        const uint32_t i0 = b*cache.block_size;
+        const uint32_t i1 = std::min(cache.size, i0 + cache.block_size);
+
+        llama_seq_id owner = -1;
+        for (uint32_t i = i0; i < i1; ++i) {
+            const llama_kv_cell & cell = cache.cells[i];
+            if (cell.pos >= 0 && !cell.is_empty()) {
+                owner = *cell.seq_id.begin();
+                break;
+            }
+        }
+
+        if (owner < 0) {
+            cache.block_owner[b] = -1;
+        } else if (cache.block_owner[b] < 0) {
+            cache.block_owner[b] = owner;
+        }
+    }
+}
+
+// store each token in a block owned by its sequence, allocating new blocks as needed
+// the tokens are not required to be contiguous in the cache - the resulting ranges are recorded in cache.runs
+static bool llama_kv_cache_find_slot_paged(
+           struct llama_kv_cache & cache,
+        const struct llama_batch & batch) {
+    // each run is a separate copy per layer in the graph, keep their number bounded
+    static const size_t LLAMA_KV_MAX_RUNS = 32;
+
+    const uint32_t n_tokens = batch.n_tokens;
+    const uint32_t n_blocks = cache.block_owner.size();
+    const uint32_t bs       = cache.block_size;
+
+    llama_kv_cache_sync_blocks(cache);
+
+    // blocks with free cells, per owner
+    std::map<llama_seq_id, std::vector<uint32_t>> seq_blocks;
+    for (uint32_t b = 0; b < n_blocks; ++b) {
+        if (cache.block_owner[b] < 0) {
+            continue;
+        }
+        const uint32_t i1 = std::min(cache.size, (b + 1)*bs);
+        for (uint32_t i = b*bs; i < i1; ++i) {
+            if (cache.cells[i].pos < 0) {
+                seq_blocks[cache.block_owner[b]].push_back(b);
+                break;
+            }
+        }
+    }
+
+    std::map<llama_seq_id, uint32_t> seq_last; // last cell allocated for each sequence in this batch
+    std::vector<uint32_t> new_blocks;
+    std::vector<uint32_t> ids(n_tokens);
+
+    uint32_t b_free = 0; // search position for free blocks
+
+    cache.runs.clear();
+
+    uint32_t i = 0;
+    for (; i < n_tokens; ++i) {
+        const llama_seq_id seq_id = batch.seq_id[i][0];
+
+        int64_t id = -1;
+
+        // continue after the previous token of the sequence, if it is in the same block
+        auto it_last = seq_last.find(seq_id);
+        if (it_last != seq_last.end()) {
+            const uint32_t next = it_last->second + 1;
+            if (next < cache.size && next % bs != 0 && cache.cells[next].pos < 0) {
+                id = next;
+            }
+        }
+
+        // otherwise, the first free cell in one of the blocks of the sequence
+        if (id < 0) {
+            auto & blocks = seq_blocks[seq_id];
+            while (id < 0 && !blocks.empty()) {
+                const uint32_t b  = blocks.front();
+                const uint32_t i1 = std::min(cache.size, (b + 1)*bs);
+                for (uint32_t k = b*bs; k < i1; ++k) {
+                    if (cache.cells[k].pos < 0) {
+                        id = k;
+                        break;
+                    }
+                }
+                if (id < 0) {
+                    blocks.erase(blocks.begin());
+                }
+            }
+        }
+
+        // otherwise, a new block
+        if (id < 0) {
+            while (b_free < n_blocks && cache.block_owner[b_free] >= 0) {
+                b_free++;
+            }
+            if (b_free == n_blocks) {
+                break;
+            }
+            cache.block_owner[b_free] = seq_id;
+            seq_blocks[seq_id].push_back(b_free);
+            new_blocks.push_back(b_free);
+            id = b_free*bs;
+        }
+
+        ids[i] = id;
+        seq_last[seq_id] = id;
+
+        // reserve the cell, the seq ids are inserted once the search succeeded
+        cache.cells[id].pos = batch.pos[i];
+
+        if (!cache.runs.empty() && cache.runs.back().i_cell + cache.runs.back().n == id) {
+            cache.runs.back().n++;
+        } else {
+            cache.runs.push_back({ i, (uint32_t) id, 1 });
+        }
+    }
+
+    if (i < n_tokens || cache.runs.size() > LLAMA_KV_MAX_RUNS) {
+        // undo
+        for (uint32_t j = 0; j < i; ++j) {
+            cache.cells[ids[j]].pos = -1;
+        }
+        for (uint32_t b : new_blocks) {
+            cache.block_owner[b] = -1;
+        }
+        cache.runs.clear();
+        return false;
+    }
+
+    for (uint32_t j = 0; j < n_tokens; ++j) {
+        for (int32_t s = 0; s < batch.n_seq_id[j]; s++) {
+            cache.cells[ids[j]].seq_id.insert(batch.seq_id[j][s]);
+        }
+    }
+
+    cache.used += n_tokens;
+
+    return true;
+}
+
 // find an empty slot of size "n_tokens" in the cache
 // updates the cache head
 // Note: On success, it's important that cache.head points
@@ -2528,6 +2822,13 @@ static bool llama_kv_cache_find_slot(
         return false;
     }
 
+    if (cache.paged()) {
+        if (llama_kv_cache_find_slot_paged(cache, batch)) {
+            return true;
+        }
+        // too scattered - fall back to a contiguous range of free cells
+    }
+
     uint32_t n_tested = 0;
 
     while (true) {
@@ -2567,6 +2868,11 @@ static bool llama_kv_cache_find_slot(
 
     cache.used += n_tokens;
 
+    if (cache.paged()) {
+        // the blocks touched here are adopted by llama_kv_cache_sync_blocks
+        cache.runs = { { 0, cache.head, n_tokens } };
+    }
+
     return true;
 }
 
@@ -2591,6 +2897,8 @@ static void llama_kv_cache_clear(struct llama_kv_cache & cache) {
     cache.head = 0;
     cache.used = 0;
 
+    std::fill(cache.block_owner.begin(), cache.block_owner.end(), -1);
+
     for (auto & buf : cache.bufs) {
         ggml_backend_buffer_clear(buf, 0);
     }
@@ -2802,7 +3110,8 @@ static llama_pos llama_kv_cache_seq_pos_max(struct llama_kv_cache & cache, llama
 }
 
 static void llama_kv_cache_defrag(struct llama_kv_cache & cache) {
-    cache.do_defrag = true;
+    // the paged cache does not need contiguous free cells
+    cache.do_defrag = !cache.paged();
 }
 
 static uint32_t llama_kv_cache_get_padding(const struct llama_cparams & cparams) {
@@ -2810,6 +3119,75 @@ static uint32_t llama_kv_cache_get_padding(const struct llama_cparams & cparams)
     return cparams.flash_attn ? 256u : 32u;
 }
 
+// paged mode: select the KV cells that the attention of the batch has to see
+// these are the blocks holding cells of the sequences in the batch - if they are not a prefix of the cache and
+// gathering them is cheaper than attending to the first n cells, their cells are listed in cache.gather
+static void llama_kv_cache_prepare_gather(
+           struct llama_kv_cache & cache,
+        const struct llama_batch & batch,
+                        uint32_t   pad) {
+    const uint32_t n_tokens = batch.n_tokens;
+    const uint32_t n_blocks = cache.block_owner.size();
+    const uint32_t bs       = cache.block_size;
+
+    cache.gather.clear();
+
+    std::set<llama_seq_id> seq_ids;
+    for (uint32_t i = 0; i < n_tokens; ++i) {
+        for (int32_t s = 0; s < batch.n_seq_id[i]; ++s) {
+            seq_ids.insert(batch.seq_id[i][s]);
+        }
+    }
+
+    uint32_t n_cells = 0;
+    bool is_prefix = true;
+    bool prev_used = true;
+
+    std::vector<uint32_t> blocks;
+    for (uint32_t b = 0; b < n_blocks; ++b) {
+        const uint32_t i1 = std::min(cache.size, (b + 1)*bs);
+
+        bool used = false;
+        for (uint32_t i = b*bs; i < i1 && !used; ++i) {
+            for (const llama_seq_id seq_id : cache.cells[i].seq_id) {
+                if (seq_ids.count(seq_id)) {
+                    used = true;
+                    break;
+                }
+            }
+        }
+
+        if (used) {
+            blocks.push_back(b);
+            n_cells += i1 - b*bs;
+            is_prefix = is_prefix && prev_used;
+        }
+        prev_used = used;
+    }
+
+    if (is_prefix) {
+        return;
+    }
+
+    const uint32_t n_gather = GGML_PAD(n_cells, pad);
+
+    // the gather copies the cells once and is then shared by all tokens of the batch
+    if ((uint64_t) n_gather*(n_tokens + 2) >= (uint64_t) cache.n*n_tokens) {
+        return;
+    }
+
+    cache.gather.reserve(n_gather);
+    for (const uint32_t b : blocks) {
+        const uint32_t i1 = std::min(cache.size, (b + 1)*bs);
+        for (uint32_t i = b*bs; i < i1; ++i) {
+            cache.gather.push_back(i);
+        }
+    }
+    cache.gather.resize(n_gather, -1);
+
+    cache.n = n_gather;
+}
+
 //
 // model loading and saving
 //
@@ -4756,7 +5134,9 @@ static bool llm_load_tensors(
         enum llama_split_mode split_mode,
         int main_gpu,
         const float * tensor_split,
+        int n_cpu_stages,
         bool use_mlock,
+        bool repack_tensors,
         llama_progress_callback progress_callback,
         void * progress_callback_user_data) {
     model.t_start_us = ggml_time_us();
@@ -4778,26 +5158,50 @@ static bool llm_load_tensors(
     const int64_t i_gpu_start = std::max((int64_t) hparams.n_layer - n_gpu_layers, (int64_t) 0);
     bool use_mmap_buffer = true;
 
+    // every CPU pipeline stage needs at least one layer
+    model.n_cpu_stages = (int) std::max<int64_t>(std::min<int64_t>({ (int64_t) n_cpu_stages, (int64_t) GGML_CPU_MAX_STAGES, i_gpu_start }), 1);
+
     // there is very little benefit to offloading the input layer, so always keep it on the CPU
     model.buft_input = llama_default_buffer_type_cpu(true);
-    //model.buft_input = llama_default_buffer_type_offload(main_gpu);
+    //model.buft_input = llama_default_buffer_type_offload(model, main_gpu);
 
     model.buft_layer.resize(n_layer);
 
-    // assign cpu layers
+    // the matrices of the layers kept on the CPU can be repacked for the CPU matmul,
+    // or split across the NUMA nodes with GGML_NUMA_STRATEGY_DISTRIBUTE (NULL buffer type otherwise)
+    // these tensors cannot be memory mapped, they are copied when loading the model
+    ggml_backend_buffer_type_t buft_matrix_cpu = repack_tensors
+        ? ggml_backend_cpu_repack_buffer_type()
+        : ggml_backend_cpu_numa_buffer_type();
+
+    const llama_model::layer_buft buft_cpu = buft_matrix_cpu
+        ? llama_model::layer_buft(buft_matrix_cpu, llama_default_buffer_type_cpu(true))
+        : llama_model::layer_buft(llama_default_buffer_type_cpu(true));
+
+    // assign cpu layers, split evenly across the CPU pipeline stages if there are several
+    // the stages own the memory of their layers, so these are not memory mapped either
     for (int64_t i = 0; i < i_gpu_start; ++i) {
-        model.buft_layer[i] = llama_default_buffer_type_cpu(true);
+        if (model.n_cpu_stages > 1) {
+            model.buft_layer[i] = llama_model::layer_buft(ggml_backend_cpu_stage_buffer_type(i*model.n_cpu_stages/i_gpu_start));
+        } else {
+            model.buft_layer[i] = buft_cpu;
+        }
     }
 
+    // the output layer follows the last CPU layer
+    const llama_model::layer_buft buft_cpu_output = model.n_cpu_stages > 1
+        ? llama_model::layer_buft(ggml_backend_cpu_stage_buffer_type(model.n_cpu_stages - 1))
+        : buft_cpu;
+
     if (split_mode == LLAMA_SPLIT_MODE_LAYER) {
         // calculate the split points
-        int device_count = llama_get_device_count();
+        int device_count = llama_get_device_count(model);
         bool all_zero = tensor_split == nullptr || std::all_of(tensor_split, tensor_split + device_count, [](float x) { return x == 0.0f; });
         std::vector<float> splits(device_count);
         if (all_zero) {
             // default split, by free memory
             for (int i = 0; i < device_count; ++i) {
-                splits[i] = llama_get_device_memory(i);
+                splits[i] = llama_get_device_memory(model, i);
             }
         } else {
             std::copy(tensor_split, tensor_split + device_count, splits.begin());
@@ -4817,38 +5221,38 @@ static bool llm_load_tensors(
         int act_gpu_layers = std::min(n_gpu_layers, (int)n_layer + 1);
         for (int64_t i = i_gpu_start; i < n_layer; ++i) {
             int layer_gpu = std::upper_bound(splits.begin(), splits.begin() + device_count, float(i - i_gpu_start)/act_gpu_layers) - splits.begin();
-            model.buft_layer[i] = llama_default_buffer_type_offload(layer_gpu);
+            model.buft_layer[i] = llama_default_buffer_type_offload(model, layer_gpu);
         }
         // assign the output layer
         if (n_gpu_layers > n_layer) {
             int layer_gpu = std::upper_bound(splits.begin(), splits.begin() + device_count, float(act_gpu_layers - 1)/act_gpu_layers) - splits.begin();
-            model.buft_output = llama_default_buffer_type_offload(layer_gpu);
+            model.buft_output = llama_default_buffer_type_offload(model, layer_gpu);
         } else {
-            model.buft_output = llama_default_buffer_type_cpu(true);
+            model.buft_output = buft_cpu_output;
         }
     } else {
         ggml_backend_buffer_type_t split_buft;
         if (split_mode == LLAMA_SPLIT_MODE_ROW) {
-            split_buft = llama_default_buffer_type_split(main_gpu, tensor_split);
+            split_buft = llama_default_buffer_type_split(model, main_gpu, tensor_split);
         } else {
             // LLAMA_SPLIT_MODE_NONE or LLAMA_SPLIT_MODE_LAYER in backends where it is not supported
-            split_buft = llama_default_buffer_type_offload(main_gpu);
+            split_buft = llama_default_buffer_type_offload(model, main_gpu);
         }
         // assign the repeating layers
         for (int64_t i = i_gpu_start; i < n_layer; ++i) {
             model.buft_layer[i] = {
                 split_buft,
-                llama_default_buffer_type_offload(main_gpu)
+                llama_default_buffer_type_offload(model, main_gpu)
             };
         }
         // assign the output layer
         if (n_gpu_layers > n_layer) {
             model.buft_output = {
                 split_buft,
-                llama_default_buffer_type_offload(main_gpu)
+                llama_default_buffer_type_offload(model, main_gpu)
             };
         } else {
-            model.buft_output = llama_default_buffer_type_cpu(true);
+            model.buft_output = buft_cpu_output;
         }
     }
 
@@ -6117,7 +6521,8 @@ static bool llm_load_tensors(
                 throw std::runtime_error("unable to allocate backend buffer");
             }
             model.bufs.push_back(buf);
-            if (use_mlock && ggml_backend_buffer_is_host(buf)) {
+            // the repacked weights are in CPU memory too, they are only not in the layout of a host buffer
+            if (use_mlock && (ggml_backend_buffer_is_host(buf) || buft == ggml_backend_cpu_repack_buffer_type())) {
                 model.mlock_bufs.emplace_back(new llama_mlock);
                 auto & mlock_buf = model.mlock_bufs.back();
                 mlock_buf->init   (ggml_backend_buffer_get_base(buf));
@@ -6251,8 +6656,8 @@ static int llama_model_load(const std::string & fname, llama_model & model, llam
 #endif
 
         if (!llm_load_tensors(
-            ml, model, params.n_gpu_layers, params.split_mode,  params.main_gpu, params.tensor_split, params.use_mlock,
-            params.progress_callback, params.progress_callback_user_data
+            ml, model, params.n_gpu_layers, params.split_mode,  params.main_gpu, params.tensor_split, params.n_cpu_stages,
+            params.use_mlock, params.repack_tensors, params.progress_callback, params.progress_callback_user_data
         )) {
             return -2;
         }
@@ -6337,6 +6742,41 @@ static void llm_build_kv_store(
 
     GGML_ASSERT(kv.size == n_ctx);
 
+    if (!kv.runs.empty()) {
+        // paged KV cache: the tokens are stored in several ranges of cells
+        GGML_ASSERT(!kv.v_trans);
+
+        if (!ggml_is_contiguous(k_cur)) {
+            k_cur = ggml_cont(ctx, k_cur);
+        }
+        if (!ggml_is_contiguous(v_cur)) {
+            v_cur = ggml_cont(ctx, v_cur);
+        }
+
+        const size_t k_cur_row = ggml_row_size(k_cur->type, n_embd_k_gqa);
+        const size_t v_cur_row = ggml_row_size(v_cur->type, n_embd_v_gqa);
+
+        for (const llama_kv_run & run : kv.runs) {
+            struct ggml_tensor * k_run = ggml_view_2d(ctx, k_cur, n_embd_k_gqa, run.n, k_cur_row, k_cur_row*run.i_token);
+            struct ggml_tensor * v_run = ggml_view_2d(ctx, v_cur, n_embd_v_gqa, run.n, v_cur_row, v_cur_row*run.i_token);
+
+            struct ggml_tensor * k_cache_view = ggml_view_2d(ctx, kv.k_l[il], n_embd_k_gqa, run.n,
+                    ggml_row_size(kv.k_l[il]->type, n_embd_k_gqa),
+                    ggml_row_size(kv.k_l[il]->type, n_embd_k_gqa)*run.i_cell);
+            cb(k_cache_view, "k_cache_view", il);
+
+            struct ggml_tensor * v_cache_view = ggml_view_2d(ctx, kv.v_l[il], n_embd_v_gqa, run.n,
+                    ggml_row_size(kv.v_l[il]->type, n_embd_v_gqa),
+                    ggml_row_size(kv.v_l[il]->type, n_embd_v_gqa)*run.i_cell);
+            cb(v_cache_view, "v_cache_view", il);
+
+            ggml_build_forward_expand(graph, ggml_cpy(ctx, k_run, k_cache_view));
+            ggml_build_forward_expand(graph, ggml_cpy(ctx, v_run, v_cache_view));
+        }
+
+        return;
+    }
+
     struct ggml_tensor * k_cache_view = ggml_view_1d(ctx, kv.k_l[il], n_tokens*n_embd_k_gqa,
             (ggml_row_size(kv.k_l[il]->type, n_embd_k_gqa))*kv_head);
     cb(k_cache_view, "k_cache_view", il);
@@ -6348,7 +6788,7 @@ static void llm_build_kv_store(
 
     struct ggml_tensor * v_cache_view = nullptr;
 
-    if (cparams.flash_attn) {
+    if (!kv.v_trans) {
         v_cache_view = ggml_view_1d(ctx, kv.v_l[il], n_tokens*n_embd_v_gqa,
                 (kv_head)*ggml_row_size(kv.v_l[il]->type, n_embd_v_gqa));
     } else {
@@ -6604,14 +7044,33 @@ static struct ggml_tensor * llm_build_kqv(
     const int64_t n_embd_k_gqa  = hparams.n_embd_k_gqa();
     const int64_t n_embd_head_v = hparams.n_embd_head_v;
 
+    const int64_t n_embd_v_gqa  = hparams.n_embd_v_gqa();
+
     struct ggml_tensor * q = ggml_permute(ctx, q_cur, 0, 2, 1, 3);
     cb(q, "q", il);
 
+    struct ggml_tensor * k_src = kv.k_l[il];
+    struct ggml_tensor * v_src = kv.v_l[il];
+
+    if (kv.inp_gather) {
+        // paged KV cache: gather the cells of the blocks used by the batch
+        GGML_ASSERT(cparams.flash_attn && !kv.v_trans);
+
+        k_src = ggml_get_rows(ctx, ggml_reshape_2d(ctx, kv.k_l[il], n_embd_k_gqa, kv.size), kv.inp_gather);
+        v_src = ggml_get_rows(ctx, ggml_reshape_2d(ctx, kv.v_l[il], n_embd_v_gqa, kv.size), kv.inp_gather);
+
+        // the FA kernels need F16 K and V
+        k_src = ggml_cast(ctx, k_src, GGML_TYPE_F16);
+        v_src = ggml_cast(ctx, v_src, GGML_TYPE_F16);
+        cb(k_src, "k_gather", il);
+        cb(v_src, "v_gather", il);
+    }
+
     struct ggml_tensor * k =
-        ggml_view_3d(ctx, kv.k_l[il],
+        ggml_view_3d(ctx, k_src,
                 n_embd_head_k, n_kv, n_head_kv,
-                ggml_row_size(kv.k_l[il]->type, n_embd_k_gqa),
-                ggml_row_size(kv.k_l[il]->type, n_embd_head_k),
+                ggml_row_size(k_src->type, n_embd_k_gqa),
+                ggml_row_size(k_src->type, n_embd_head_k),
                 0);
     cb(k, "k", il);
 
@@ -6623,10 +7082,10 @@ static struct ggml_tensor * llm_build_kqv(
 
         // split cached v into n_head heads (not transposed)
         struct ggml_tensor * v =
-            ggml_view_3d(ctx, kv.v_l[il],
+            ggml_view_3d(ctx, v_src,
                     n_embd_head_v, n_kv, n_head_kv,
-                    ggml_row_size(kv.v_l[il]->type, n_embd_k_gqa),
-                    ggml_row_size(kv.v_l[il]->type, n_embd_head_k),
+                    ggml_row_size(v_src->type, n_embd_v_gqa),
+                    ggml_row_size(v_src->type, n_embd_head_v),
                     0);
         cb(v, "v", il);
 
@@ -6768,6 +7227,7 @@ struct llm_build_context {
 
     const int32_t n_tokens;
     const int32_t n_kv;     // size of KV cache to consider (n_kv <= kv_self.size)
+    const bool    kv_gather; // the attention gathers the n_kv cells of kv_self.gather (paged KV cache)
     const int32_t n_outputs;
     const int32_t kv_head;  // index of where we store new KV data in the cache
     const int32_t n_orig_ctx;
@@ -6817,6 +7277,7 @@ struct llm_build_context {
         norm_rms_eps     (hparams.f_norm_rms_eps),
         n_tokens         (batch.n_tokens),
         n_kv             (worst_case ? kv_self.size : kv_self.n),
+        kv_gather        (kv_self.paged() && (worst_case || !kv_self.gather.empty())),
         n_outputs        (worst_case ? n_tokens : lctx.n_outputs),
         kv_head          (worst_case ? (kv_self.recurrent ? 0 : kv_self.size - n_tokens) : kv_self.head),
         n_orig_ctx       (cparams.n_yarn_orig_ctx),
@@ -6848,6 +7309,11 @@ struct llm_build_context {
         lctx.inp_s_copy  = nullptr;
         lctx.inp_s_mask  = nullptr;
         lctx.inp_s_seq   = nullptr;
+
+        lctx.kv_self.inp_gather = nullptr;
+
+        // the metadata of the cached graph is overwritten
+        lctx.graph_cache.valid = false;
     }
 
     void free() {
@@ -6937,7 +7403,7 @@ struct llm_build_context {
                 ggml_tensor * view_v_src;
                 ggml_tensor * view_v_dst;
 
-                if (flash_attn) {
+                if (!kv_self.v_trans) {
                     // NOTE: the V cache is not transposed when using flash attention
                     view_v_src = ggml_view_2d(ctx0, kv_self.v_l[il],
                             n_embd_v_gqa, nm,
@@ -6989,6 +7455,12 @@ struct llm_build_context {
     struct ggml_tensor * build_inp_KQ_mask(bool causal = true) {
         if (causal) {
             lctx.inp_KQ_mask = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_kv,     GGML_PAD(n_tokens, GGML_KQ_MASK_PAD));
+
+            if (kv_gather) {
+                lctx.kv_self.inp_gather = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_kv);
+                cb(lctx.kv_self.inp_gather, "KV_gather", -1);
+                ggml_set_input(lctx.kv_self.inp_gather);
+            }
         } else {
             lctx.inp_KQ_mask = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_tokens, GGML_PAD(n_tokens, GGML_KQ_MASK_PAD));
         }
@@ -10829,8 +11301,16 @@ static struct ggml_cgraph * llama_build_graph(
 
         if (!lctx.cparams.offload_kqv) {
             if (strcmp(name, "kqv_merged_cont") == 0) {
-                // all nodes between the KV store and the attention output are run on the CPU
-                ggml_backend_sched_set_tensor_backend(lctx.sched, cur, lctx.backend_cpu);
+                // all nodes between the KV store and the attention output are run on the CPU,
+                // by the pipeline stage that holds the KV of the layer if there are several
+                ggml_backend_t backend_kv = lctx.backend_cpu;
+                for (auto * backend : lctx.backend_cpu_stages) {
+                    if (il >= 0 && ggml_backend_buft_supports_backend(ggml_backend_buffer_get_type(lctx.kv_self.k_l[il]->buffer), backend)) {
+                        backend_kv = backend;
+                        break;
+                    }
+                }
+                ggml_backend_sched_set_tensor_backend(lctx.sched, cur, backend_kv);
             }
         }
 
@@ -11080,6 +11560,19 @@ static void llama_set_inputs(llama_context & lctx, const llama_batch & batch) {
 
             float * data = (float *) lctx.inp_KQ_mask->data;
 
+            // paged KV cache: the i-th KV row of the attention is the cell kv_self.gather[i]
+            const bool gather = lctx.kv_self.inp_gather != nullptr;
+
+            if (gather) {
+                GGML_ASSERT((int64_t) kv_self.gather.size() == n_kv);
+
+                std::vector<int32_t> ids(n_kv);
+                for (int i = 0; i < n_kv; ++i) {
+                    ids[i] = std::max(kv_self.gather[i], 0);
+                }
+                ggml_backend_tensor_set(lctx.kv_self.inp_gather, ids.data(), 0, n_kv*ggml_element_size(lctx.kv_self.inp_gather));
+            }
+
             // For causal attention, use only the previous KV cells
             // of the correct sequence for each token of the batch.
             // It's assumed that if a token in the batch has multiple sequences, they are equivalent.
@@ -11089,12 +11582,14 @@ static void llama_set_inputs(llama_context & lctx, const llama_batch & batch) {
                     const llama_seq_id seq_id = batch.seq_id[j][0];
 
                     for (int i = 0; i < n_kv; ++i) {
+                        const int32_t id = gather ? kv_self.gather[i] : i;
+
                         float f;
-                        if (!lctx.kv_self.cells[i].has_seq_id(seq_id) || lctx.kv_self.cells[i].pos > pos) {
+                        if (id < 0 || !lctx.kv_self.cells[id].has_seq_id(seq_id) || lctx.kv_self.cells[id].pos > pos) {
                             f = -INFINITY;
                         } else {
                             if (hparams.use_alibi) {
-                                f = -fabs(lctx.kv_self.cells[i].pos - pos);
+                                f = -fabs(lctx.kv_self.cells[id].pos - pos);
                             } else {
                                 f = 0.0f;
                             }
@@ -11282,6 +11777,8 @@ static size_t llama_output_reserve(llama_context & lctx, size_t n_outputs) {
             // This doesn't happen often, but may be annoying in some cases (like the HellaSwag benchmark)
             LLAMA_LOG_INFO("%s: reallocating output buffer from size %.02f MiB to %.02f MiB\n", __func__, prev_size / 1024.0 / 1024.0, new_size / 1024.0 / 1024.0);
 #endif
+            // the outputs of the previous batch may still be copied asynchronously to the buffer
+            ggml_backend_sched_synchronize(lctx.sched);
             ggml_backend_buffer_free(lctx.buf_output);
             lctx.buf_output = nullptr;
             lctx.logits = nullptr;
@@ -11335,6 +11832,12 @@ static void llama_graph_compute(
         ggml_backend_cpu_set_abort_callback(lctx.backend_cpu, lctx.abort_callback, lctx.abort_callback_data);
     }
 
+    // the threads are shared by the CPU pipeline stages
+    for (ggml_backend_t backend : lctx.backend_cpu_stages) {
+        ggml_backend_cpu_set_n_threads(backend, std::max(1, n_threads/(int) lctx.backend_cpu_stages.size()));
+        ggml_backend_cpu_set_abort_callback(backend, lctx.abort_callback, lctx.abort_callback_data);
+    }
+
     ggml_backend_sched_graph_compute_async(lctx.sched, gf);
 
     // fprintf(stderr, "splits: %d\n", ggml_backend_sched_get_n_splits(lctx.sched));
@@ -11344,6 +11847,75 @@ static void llama_graph_compute(
 #endif
 }
 
+// collect the views of the KV cache that the KV store of a decode graph writes to
+// returns false if the graph cannot be reused for later ubatches
+static bool llama_graph_cache_init(llama_context & lctx, ggml_cgraph * gf) {
+    const auto & hparams = lctx.model.hparams;
+    const auto & kv_self = lctx.kv_self;
+
+    auto & cache = lctx.graph_cache;
+
+    cache.kv_views.clear();
+
+    // the recurrent state views and the placement of a paged batch change with every ubatch
+    if (kv_self.recurrent || kv_self.paged()) {
+        return false;
+    }
+
+    // with pipeline parallelism the splits read a different copy of their inputs in every graph
+    if (ggml_backend_sched_get_n_copies(lctx.sched) > 1) {
+        return false;
+    }
+
+    // offset of one cell in each KV cache tensor, as used by llm_build_kv_store
+    std::unordered_map<const ggml_tensor *, size_t> cell_size;
+    for (size_t il = 0; il < kv_self.k_l.size(); ++il) {
+        const ggml_tensor * k = kv_self.k_l[il];
+        const ggml_tensor * v = kv_self.v_l[il];
+
+        cell_size[k] = ggml_row_size(k->type, hparams.n_embd_k_gqa());
+        cell_size[v] = kv_self.v_trans ? ggml_element_size(v) : ggml_row_size(v->type, hparams.n_embd_v_gqa());
+    }
+
+    for (int i = 0; i < gf->n_nodes; ++i) {
+        ggml_tensor * node = gf->nodes[i];
+        if (node->op != GGML_OP_CPY || node->view_src == nullptr) {
+            continue;
+        }
+
+        const auto it = cell_size.find(node->view_src);
+        if (it == cell_size.end()) {
+            continue;
+        }
+
+        // both the copy and the view that it writes to hold the offset
+        for (ggml_tensor * t : { node, node->src[1] }) {
+            GGML_ASSERT(t->view_src == node->view_src && t->view_offs == kv_self.head*it->second);
+            cache.kv_views.emplace_back(t, it->second);
+        }
+    }
+
+    return true;
+}
+
+// move the KV store of the cached graph to the current head of the KV cache
+static void llama_graph_cache_set_kv_head(llama_context & lctx) {
+    const uint32_t kv_head = lctx.kv_self.head;
+
+    for (const auto & kv_view : lctx.graph_cache.kv_views) {
+        ggml_tensor * t = kv_view.first;
+
+        const size_t offset = kv_head*kv_view.second;
+
+        t->view_offs = offset;
+        t->data      = (char *) t->view_src->data + offset;
+
+        if (t->op == GGML_OP_VIEW) {
+            memcpy(t->op_params, &offset, sizeof(offset));
+        }
+    }
+}
+
 // decode a batch of tokens by evaluating the transformer
 //
 //   - lctx:      llama context
@@ -11518,51 +12090,89 @@ static int llama_decode_internal(
                 const uint32_t pad = llama_kv_cache_get_padding(cparams);
                 kv_self.n = std::min(kv_self.size, std::max(pad, GGML_PAD(llama_kv_cache_cell_max(kv_self), pad)));
                 //kv_self.n = llama_kv_cache_cell_max(kv_self);
+
+                if (kv_self.paged()) {
+                    llama_kv_cache_prepare_gather(kv_self, u_batch, pad);
+                }
             }
         }
 
         //printf("kv_self.n = %5d, kv_self.used = %5d, kv_self.head = %5d\n", kv_self.n, kv_self.used, kv_self.head);
 
-        ggml_backend_sched_reset(lctx.sched);
         ggml_backend_sched_set_eval_callback(lctx.sched, lctx.cparams.cb_eval, lctx.cparams.cb_eval_user_data);
 
-        ggml_cgraph * gf = llama_build_graph(lctx, u_batch, false);
+        llama_graph_key graph_key;
+        graph_key.n_tokens    = n_tokens;
+        graph_key.n_outputs   = lctx.n_outputs;
+        graph_key.n_kv        = kv_self.n;
+        graph_key.embd_inp    = u_batch.embd != nullptr;
+        graph_key.causal_attn = cparams.causal_attn;
+        graph_key.embeddings  = cparams.embeddings;
+
+        auto & graph_cache = lctx.graph_cache;
 
-        // the output is always the last tensor in the graph
-        struct ggml_tensor * res  = gf->nodes[gf->n_nodes - 1];
-        struct ggml_tensor * embd = gf->nodes[gf->n_nodes - 2];
+        ggml_cgraph * gf   = nullptr;
+        ggml_tensor * res  = nullptr;
+        ggml_tensor * embd = nullptr;
 
-        if (lctx.n_outputs == 0) {
-            // no output
-            res  = nullptr;
-            embd = nullptr;
-        } else if (!hparams.causal_attn) {
-            res = nullptr; // do not extract logits for embedding models such as BERT
+        if (graph_cache.valid && graph_cache.key == graph_key) {
+            // the graph of the previous ubatch is still split and allocated, only the inputs have to be set
+            gf   = graph_cache.gf;
+            res  = graph_cache.res;
+            embd = graph_cache.embd;
 
-            // token or sequence embeddings
-            embd = gf->nodes[gf->n_nodes - 1];
+            llama_graph_cache_set_kv_head(lctx);
+        } else {
+            ggml_backend_sched_reset(lctx.sched);
 
-            GGML_ASSERT(strcmp(embd->name, "result_embd") == 0 || strcmp(embd->name, "result_embd_pooled") == 0);
-        } else if (cparams.embeddings) {
-            // the embeddings could be in the second to last tensor, or any of the previous tensors
-            int i_embd = gf->n_nodes - 2;
-            for (int i = 3; strcmp(embd->name, "result_norm") != 0; ++i) {
-                i_embd = gf->n_nodes - i;
-                if (i_embd < 0) { break; }
-                embd = gf->nodes[i_embd];
+            gf = llama_build_graph(lctx, u_batch, false);
+
+            // the output is always the last tensor in the graph
+            res  = gf->nodes[gf->n_nodes - 1];
+            embd = gf->nodes[gf->n_nodes - 2];
+
+            if (lctx.n_outputs == 0) {
+                // no output
+                res  = nullptr;
+                embd = nullptr;
+            } else if (!hparams.causal_attn) {
+                res = nullptr; // do not extract logits for embedding models such as BERT
+
+                // token or sequence embeddings
+                embd = gf->nodes[gf->n_nodes - 1];
+
+                GGML_ASSERT(strcmp(embd->name, "result_embd") == 0 || strcmp(embd->name, "result_embd_pooled") == 0);
+            } else if (cparams.embeddings) {
+                // the embeddings could be in the second to last tensor, or any of the previous tensors
+                int i_embd = gf->n_nodes - 2;
+                for (int i = 3; strcmp(embd->name, "result_norm") != 0; ++i) {
+                    i_embd = gf->n_nodes - i;
+                    if (i_embd < 0) { break; }
+                    embd = gf->nodes[i_embd];
+                }
+                GGML_ASSERT(i_embd >= 0 && "missing result_norm tensor");
+
+                // TODO: use a per-batch flag to know when to skip logits while keeping embeddings
+                if (!cparams.causal_attn) {
+                    res = nullptr; // do not extract logits when not needed
+                    // skip computing logits
+                    // TODO: is this safe?
+                    gf->n_nodes = i_embd + 1;
+                }
+            } else {
+                embd = nullptr; // do not extract embeddings when not needed
+                GGML_ASSERT(strcmp(res->name, "result_output") == 0 && "missing result_output tensor");
             }
-            GGML_ASSERT(i_embd >= 0 && "missing result_norm tensor");
 
-            // TODO: use a per-batch flag to know when to skip logits while keeping embeddings
-            if (!cparams.causal_attn) {
-                res = nullptr; // do not extract logits when not needed
-                // skip computing logits
-                // TODO: is this safe?
-                gf->n_nodes = i_embd + 1;
+            ggml_backend_sched_alloc_graph(lctx.sched, gf);
+
+            if (llama_graph_cache_init(lctx, gf)) {
+                graph_cache.valid = true;
+                graph_cache.key   = graph_key;
+                graph_cache.gf    = gf;
+                graph_cache.res   = res;
+                graph_cache.embd  = embd;
             }
-        } else {
-            embd = nullptr; // do not extract embeddings when not needed
-            GGML_ASSERT(strcmp(res->name, "result_output") == 0 && "missing result_output tensor");
         }
         // LLAMA_LOG_INFO("graph build time: %.3f ms (%d nodes, %d leafs)\n", (ggml_time_us() - t_start_us)/1000.0, gf->n_nodes, gf->n_leafs);
 
@@ -11577,8 +12187,6 @@ static int llama_decode_internal(
             n_threads = std::min(4, n_threads);
         }
 
-        ggml_backend_sched_alloc_graph(lctx.sched, gf);
-
         llama_set_inputs(lctx, u_batch);
 
         llama_graph_compute(lctx, gf, n_threads);
@@ -11587,6 +12195,10 @@ static int llama_decode_internal(
         {
             kv_self.head += n_tokens;
 
+            // the placement of the batch is only valid for this graph
+            kv_self.runs.clear();
+            kv_self.gather.clear();
+
             // Ensure kv cache head points to a valid index.
             if (kv_self.head >= kv_self.size) {
                 kv_self.head = 0;
@@ -11686,7 +12298,10 @@ static int llama_decode_internal(
 
     // Reset state for the next token before backend sync, to allow the CPU activities in the reset to
     // overlap with device computation.
-    ggml_backend_sched_reset(lctx.sched);
+    // A cached graph stays allocated, so that the next ubatch of the same shape can reuse it.
+    if (!lctx.graph_cache.valid) {
+        ggml_backend_sched_reset(lctx.sched);
+    }
 
     return 0;
 }
@@ -13182,6 +13797,314 @@ static std::vector<llama_grammar_candidate> llama_grammar_reject_candidates(
     return rejects;
 }
 
+static void llama_token_trie_insert(
+        llama_token_trie                                                             & trie,
+        const std::vector<std::pair<std::vector<uint32_t>, llama_token_trie::token>> & seqs,
+        size_t                                                                         begin,
+        size_t                                                                         end,
+        size_t                                                                         depth,
+        uint32_t                                                                       inode) {
+    // the sequences are sorted, so the ones that end at this node come first
+    trie.nodes[inode].token_begin = trie.tokens.size();
+    while (begin < end && seqs[begin].first.size() == depth) {
+        trie.tokens.push_back(seqs[begin].second);
+        begin++;
+    }
+    trie.nodes[inode].token_end = trie.tokens.size();
+
+    std::vector<size_t> bounds;
+    for (size_t i = begin; i < end; ) {
+        bounds.push_back(i);
+        const uint32_t cpt = seqs[i].first[depth];
+        while (i < end && seqs[i].first[depth] == cpt) {
+            i++;
+        }
+    }
+    bounds.push_back(end);
+
+    // allocate all the children before recursing, so that they are contiguous
+    const uint32_t child_begin = trie.nodes.size();
+    trie.nodes[inode].child_begin = child_begin;
+    trie.nodes[inode].child_end   = child_begin + bounds.size() - 1;
+    for (size_t c = 0; c + 1 < bounds.size(); ++c) {
+        trie.nodes.push_back({ 0, 0, 0, 0 });
+        trie.cpts.push_back(seqs[bounds[c]].first[depth]);
+    }
+
+    for (size_t c = 0; c + 1 < bounds.size(); ++c) {
+        llama_token_trie_insert(trie, seqs, bounds[c], bounds[c + 1], depth + 1, child_begin + c);
+    }
+}
+
+static std::shared_ptr<const llama_token_trie> llama_vocab_get_trie(const llama_model & model) {
+    static std::mutex mutex;
+    std::lock_guard<std::mutex> lock(mutex);
+
+    if (model.vocab.trie) {
+        return model.vocab.trie;
+    }
+
+    const int64_t t_start_us = ggml_time_us();
+
+    auto trie = std::make_shared<llama_token_trie>();
+
+    std::vector<std::pair<std::vector<uint32_t>, llama_token_trie::token>> seqs;
+    std::vector<char> buf(64);
+
+    const int n_vocab = (int) model.vocab.id_to_token.size();
+    for (llama_token id = 0; id < n_vocab; ++id) {
+        if (llama_token_is_eog(&model, id)) {
+            trie->eog.push_back(id);
+            continue;
+        }
+
+        int n = llama_token_to_piece(&model, id, buf.data(), buf.size(), false);
+        if (n < 0) {
+            buf.resize(-n);
+            n = llama_token_to_piece(&model, id, buf.data(), buf.size(), false);
+        }
+        const std::string piece(buf.data(), n);
+
+        // the same tokens as llama_sample_grammar rejects in any state
+        if (piece.empty() || piece[0] == 0) {
+            continue;
+        }
+
+        auto decoded = decode_utf8(piece, { 0, 0 });
+        if (decoded.second.n_remain < 0) {
+            continue;
+        }
+        decoded.first.pop_back(); // terminating 0
+
+        seqs.emplace_back(std::move(decoded.first), llama_token_trie::token{ id, decoded.second });
+    }
+
+    std::sort(seqs.begin(), seqs.end(), [](const std::pair<std::vector<uint32_t>, llama_token_trie::token> & a,
+                                           const std::pair<std::vector<uint32_t>, llama_token_trie::token> & b) {
+        return a.first < b.first;
+    });
+
+    trie->nodes.push_back({ 0, 0, 0, 0 });
+    trie->cpts.push_back(0);
+    llama_token_trie_insert(*trie, seqs, 0, seqs.size(), 0, 0);
+
+    LLAMA_LOG_INFO("%s: built a trie of %zu nodes for %zu tokens in %.2f ms\n", __func__,
+            trie->nodes.size(), trie->tokens.size(), (ggml_time_us() - t_start_us) / 1000.0);
+
+    model.vocab.trie = trie;
+
+    return model.vocab.trie;
+}
+
+// walks the vocab trie along the grammar, pruning the subtrees that the grammar rejects
+// the sets of stacks reached along the way are deduplicated and their transitions memoized, so that the prefixes
+// that leave the grammar in the same state, e.g. the characters of a string, are matched only once
+struct llama_grammar_trie_walk {
+    using stack_t  = std::vector<const llama_grammar_element *>;
+    using stacks_t = std::vector<stack_t>;
+
+    // the stacks are identified by a bit of a uint64_t
+    static constexpr size_t max_stacks = 64;
+
+    struct state {
+        stacks_t stacks;
+
+        // after[i]: the stacks after matching a char at stacks[i]
+        std::vector<stacks_t> after;
+
+        // the states reached by the code points matched by the subsets of stacks seen so far
+        std::vector<std::pair<uint64_t, int>> next;
+    };
+
+    const std::vector<std::vector<llama_grammar_element>> & rules;
+    const llama_token_trie                                & trie;
+
+    std::vector<uint32_t> & mask;
+
+    std::vector<state>   states;
+    std::map<stacks_t, int> state_ids;
+
+    bool ok = true;
+
+    llama_grammar_trie_walk(
+            const std::vector<std::vector<llama_grammar_element>> & rules,
+            const llama_token_trie                                & trie,
+            std::vector<uint32_t>                                 & mask)
+        : rules(rules), trie(trie), mask(mask) {}
+
+    int get_state(const stacks_t & stacks) {
+        const auto it = state_ids.find(stacks);
+        if (it != state_ids.end()) {
+            return it->second;
+        }
+
+        if (stacks.size() > max_stacks) {
+            ok = false;
+        }
+
+        const int id = states.size();
+        states.push_back({ stacks, {}, {} });
+        state_ids.emplace(stacks, id);
+
+        auto & after = states[id].after;
+        after.resize(stacks.size());
+        for (size_t i = 0; i < stacks.size(); ++i) {
+            const auto & stack = stacks[i];
+            if (stack.empty()) {
+                continue;
+            }
+
+            const auto * pos = llama_grammar_match_char(stack.back(), 0).second;
+
+            stack_t stack_after(stack.begin(), stack.end() - 1);
+            if (!llama_grammar_is_end_of_sequence(pos)) {
+                stack_after.push_back(pos);
+            }
+            llama_grammar_advance_stack(rules, stack_after, after[i]);
+        }
+
+        return id;
+    }
+
+    int get_next(int istate, uint64_t matched) {
+        for (const auto & next : states[istate].next) {
+            if (next.first == matched) {
+                return next.second;
+            }
+        }
+
+        // same as llama_grammar_accept
+        stacks_t stacks;
+        for (size_t i = 0; i < states[istate].after.size(); ++i) {
+            if (!(matched & (uint64_t(1) << i))) {
+                continue;
+            }
+            for (const auto & stack : states[istate].after[i]) {
+                if (std::find(stacks.begin(), stacks.end(), stack) == stacks.end()) {
+                    stacks.push_back(stack);
+                }
+            }
+        }
+
+        const int inext = get_state(stacks);
+        states[istate].next.emplace_back(matched, inext);
+
+        return inext;
+    }
+
+    void walk(uint32_t inode, int istate) {
+        const llama_token_trie::node & node = trie.nodes[inode];
+
+        for (uint32_t i = node.token_begin; i < node.token_end; ++i) {
+            const llama_token_trie::token & tok = trie.tokens[i];
+
+            bool allowed = tok.partial_utf8.n_remain == 0;
+            for (size_t j = 0; j < states[istate].stacks.size() && !allowed; ++j) {
+                const auto & stack = states[istate].stacks[j];
+                allowed = !stack.empty() && llama_grammar_match_partial_char(stack.back(), tok.partial_utf8);
+            }
+
+            if (allowed) {
+                mask[tok.id / 32] |= 1u << (tok.id % 32);
+            }
+        }
+
+        for (uint32_t c = node.child_begin; c < node.child_end && ok; ++c) {
+            const uint32_t cpt = trie.cpts[c];
+
+            uint64_t matched = 0;
+            for (size_t j = 0; j < states[istate].stacks.size(); ++j) {
+                const auto & stack = states[istate].stacks[j];
+                if (!stack.empty() && llama_grammar_match_char(stack.back(), cpt).first) {
+                    matched |= uint64_t(1) << j;
+                }
+            }
+
+            if (matched) {
+                const int inext = get_next(istate, matched);
+                if (ok) {
+                    walk(c, inext);
+                }
+            }
+        }
+    }
+};
+
+// computes the tokens allowed by the grammar in its current state, one bit per token
+// returns false if the state is not supported by the trie walk
+static bool llama_grammar_compute_mask(const llama_model & model, const llama_grammar & grammar, std::vector<uint32_t> & mask) {
+    if (grammar.partial_utf8.n_remain != 0 || grammar.stacks.size() > llama_grammar_trie_walk::max_stacks) {
+        return false;
+    }
+
+    const auto trie = llama_vocab_get_trie(model);
+
+    mask.assign((model.vocab.id_to_token.size() + 31) / 32, 0);
+
+    llama_grammar_trie_walk walk(grammar.rules, *trie, mask);
+    walk.walk(0, walk.get_state(grammar.stacks));
+    if (!walk.ok) {
+        return false;
+    }
+
+    for (const auto & stack : grammar.stacks) {
+        if (stack.empty()) {
+            for (const llama_token id : trie->eog) {
+                mask[id / 32] |= 1u << (id % 32);
+            }
+            break;
+        }
+    }
+
+    return true;
+}
+
+// returns the mask of the tokens allowed in the current state of the grammar, or nullptr if the candidates should be
+// checked one by one
+static const std::vector<uint32_t> * llama_grammar_get_mask(const llama_model & model, const llama_grammar & grammar, size_t n_candidates) {
+    // there is no need to keep many masks, the states of a grammar repeat quickly
+    const size_t max_masks = 256;
+
+    // for a few candidates of a new state, it is cheaper to check them than to walk the trie
+    const size_t min_candidates = 256;
+
+    // the trie is decoded from the start of a code point
+    if (grammar.partial_utf8.n_remain != 0) {
+        return nullptr;
+    }
+
+    if (grammar.masks_model != &model) {
+        grammar.masks.clear();
+        grammar.masks_model = &model;
+    }
+
+    std::vector<const llama_grammar_element *> key;
+    for (const auto & stack : grammar.stacks) {
+        key.insert(key.end(), stack.begin(), stack.end());
+        key.push_back(nullptr);
+    }
+
+    const auto it = grammar.masks.find(key);
+    if (it != grammar.masks.end()) {
+        return &it->second;
+    }
+
+    if (n_candidates < min_candidates) {
+        return nullptr;
+    }
+
+    std::vector<uint32_t> mask;
+    if (!llama_grammar_compute_mask(model, grammar, mask)) {
+        return nullptr;
+    }
+
+    if (grammar.masks.size() >= max_masks) {
+        grammar.masks.clear();
+    }
+
+    return &grammar.masks.emplace(std::move(key), std::move(mask)).first->second;
+}
+
 static bool llama_grammar_detect_left_recursion(
         const std::vector<std::vector<llama_grammar_element>> & rules,
         size_t                                                  rule_index,
@@ -13291,7 +14214,7 @@ struct llama_grammar * llama_grammar_init(
     // Important: vec_rules has to be moved here, not copied, because stacks contains
     // pointers to elements of vec_rules. If vec_rules were copied into llama_grammar
     // then the pointers would be invalidated when the local vec_rules goes out of scope.
-    return new llama_grammar{ std::move(vec_rules), std::move(stacks), {} };
+    return new llama_grammar{ std::move(vec_rules), std::move(stacks), {}, nullptr, {} };
 }
 
 void llama_grammar_free(struct llama_grammar * grammar) {
@@ -13299,7 +14222,7 @@ void llama_grammar_free(struct llama_grammar * grammar) {
 }
 
 struct llama_grammar * llama_grammar_copy(const struct llama_grammar * grammar) {
-    llama_grammar * result = new llama_grammar{ grammar->rules, grammar->stacks, grammar->partial_utf8 };
+    llama_grammar * result = new llama_grammar{ grammar->rules, grammar->stacks, grammar->partial_utf8, nullptr, {} };
 
     // redirect elements in stacks to point to new rules
     for (size_t is = 0; is < result->stacks.size(); is++) {
@@ -13784,6 +14707,19 @@ void llama_sample_grammar(struct llama_context * ctx, llama_token_data_array * c
     GGML_ASSERT(ctx);
     const int64_t t_start_sample_us = ggml_time_us();
 
+    const std::vector<uint32_t> * mask = llama_grammar_get_mask(ctx->model, *grammar, candidates->size);
+    if (mask) {
+        for (size_t i = 0; i < candidates->size; ++i) {
+            const llama_token id = candidates->data[i].id;
+            if (!((*mask)[id / 32] & (1u << (id % 32)))) {
+                candidates->data[i].logit = -INFINITY;
+            }
+        }
+
+        ctx->t_sample_us += ggml_time_us() - t_start_sample_us;
+        return;
+    }
+
     bool allow_eog = false;
     for (const auto & stack : grammar->stacks) {
         if (stack.empty()) {
@@ -14701,17 +15637,66 @@ static size_t llama_tensor_quantize_internal(enum ggml_type new_type, const floa
                 break;
             }
         }
-    };
-    for (int it = 0; it < nthread - 1; ++it) {
-        workers.emplace_back(compute);
-    }
-    compute();
-    for (auto & w : workers) { w.join(); }
-    workers.clear();
-    if (!valid) {
-        throw std::runtime_error("quantized data validation failed");
+    };
+    for (int it = 0; it < nthread - 1; ++it) {
+        workers.emplace_back(compute);
+    }
+    compute();
+    for (auto & w : workers) { w.join(); }
+    workers.clear();
+    if (!valid) {
+        throw std::runtime_error("quantized data validation failed");
+    }
+    return new_size;
+}
+
+// blocking FIFO handing the slots of the quantization pipeline from one stage to the next
+struct llama_quantize_queue {
+    std::mutex              mutex;
+    std::condition_variable cv;
+    std::deque<int>         items;
+    bool                    closed = false;
+
+    void push(int item) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            items.push_back(item);
+        }
+        cv.notify_one();
+    }
+
+    // waits for an item, returns false once the queue is closed and empty
+    bool pop(int & item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [this] { return !items.empty() || closed; });
+        if (items.empty()) {
+            return false;
+        }
+        item = items.front();
+        items.pop_front();
+        return true;
+    }
+
+    // no more items, with discard the pending ones are dropped as well
+    void close(bool discard) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            closed = true;
+            if (discard) {
+                items.clear();
+            }
+        }
+        cv.notify_all();
     }
-    return new_size;
+};
+
+// replace dst with src, atomically where the platform allows it
+static bool llama_replace_file(const char * src, const char * dst) {
+#if defined(_WIN32)
+    return MoveFileExA(src, dst, MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+    return std::rename(src, dst) == 0;
+#endif
 }
 
 static void llama_model_quantize_internal(const std::string & fname_inp, const std::string & fname_out, const llama_model_quantize_params * params) {
@@ -14851,100 +15836,23 @@ static void llama_model_quantize_internal(const std::string & fname_inp, const s
     size_t total_size_org = 0;
     size_t total_size_new = 0;
 
-    std::vector<std::thread> workers;
-    workers.reserve(nthread);
-
-    int idx = 0;
-
-    std::vector<no_init<uint8_t>> read_data;
-    std::vector<no_init<uint8_t>> work;
-    std::vector<no_init<float>> f32_conv_buf;
-
-    uint16_t n_split = 1;
-    // Assume split index is continuous
-    if (params->keep_split) {
-        for (int i = 0; i < ml.n_tensors; ++i) {
-            n_split = std::max(uint16_t(ml.get_weight(i)->idx+1), n_split);
-        }
-    }
-    std::vector<gguf_context*> ctx_outs(n_split, NULL);
-    ctx_outs[0] = ctx_out;
-
-    // populate the original tensors so we get an initial meta data
-    for (int i = 0; i < ml.n_tensors; ++i) {
-        auto weight = ml.get_weight(i);
-        uint16_t i_split = params->keep_split ? weight->idx : 0;
-        struct ggml_tensor * tensor = weight->tensor;
-        if (ctx_outs[i_split] == NULL) {
-            ctx_outs[i_split] = gguf_init_empty();
-        }
-        gguf_add_tensor(ctx_outs[i_split], tensor);
-    }
-
-    // Set split info if needed
-    if (n_split > 1) {
-        for (size_t i = 0; i < ctx_outs.size(); ++i) {
-            gguf_set_val_u16(ctx_outs[i], ml.llm_kv(LLM_KV_SPLIT_NO).c_str(), i);
-            gguf_set_val_u16(ctx_outs[i], ml.llm_kv(LLM_KV_SPLIT_COUNT).c_str(), n_split);
-            gguf_set_val_i32(ctx_outs[i], ml.llm_kv(LLM_KV_SPLIT_TENSORS_COUNT).c_str(), ml.n_tensors);
-        }
-    }
-
-    int cur_split = -1;
-    std::ofstream fout;
-    auto close_ofstream = [&]() {
-        // Write metadata and close file handler
-        if (fout.is_open()) {
-            fout.seekp(0);
-            std::vector<uint8_t> data(gguf_get_meta_size(ctx_outs[cur_split]));
-            gguf_get_meta_data(ctx_outs[cur_split], data.data());
-            fout.write((const char *) data.data(), data.size());
-            fout.close();
-        }
-    };
-    auto new_ofstream = [&](int index) {
-        cur_split = index;
-        GGML_ASSERT(ctx_outs[cur_split] && "Find uninitialized gguf_context");
-        std::string fname = fname_out;
-        if (params->keep_split) {
-            char split_path[PATH_MAX] = {0};
-            llama_split_path(split_path, sizeof(split_path), fname_out.c_str(), cur_split, n_split);
-            fname = std::string(split_path);
-        }
-
-        fout = std::ofstream(fname, std::ios::binary);
-        fout.exceptions(std::ofstream::failbit); // fail fast on write errors
-        const size_t meta_size = gguf_get_meta_size(ctx_outs[cur_split]);
-        // placeholder for the meta data
-        ::zeros(fout, meta_size);
+    // plan the output before converting any data: with the types and sizes of all the tensors known, the meta data
+    // of every shard is final, the shards are written in one pass and an interrupted run can be resumed
+    struct quantize_tensor_plan {
+        bool          quantize;
+        ggml_type     new_type;
+        size_t        new_size;
+        const float * imatrix;
+        uint16_t      i_split;
     };
+    std::vector<quantize_tensor_plan> plan(ml.n_tensors);
 
     const auto tn = LLM_TN(model.arch);
-    new_ofstream(0);
     for (int i = 0; i < ml.n_tensors; ++i) {
-        auto weight = ml.get_weight(i);
-        struct ggml_tensor * tensor = weight->tensor;
-        if (weight->idx != cur_split && params->keep_split) {
-            close_ofstream();
-            new_ofstream(weight->idx);
-        }
+        struct ggml_tensor * tensor = ml.get_weight(i)->tensor;
 
         const std::string name = ggml_get_name(tensor);
 
-        if (!ml.use_mmap) {
-            if (read_data.size() < ggml_nbytes(tensor)) {
-                read_data.resize(ggml_nbytes(tensor));
-            }
-            tensor->data = read_data.data();
-        }
-        ml.load_data_for(tensor);
-
-        LLAMA_LOG_INFO("[%4d/%4d] %36s - [%s], type = %6s, ",
-               ++idx, ml.n_tensors,
-               ggml_get_name(tensor),
-               llama_format_tensor_shape(tensor).c_str(),
-               ggml_type_name(tensor->type));
-
         // This used to be a regex, but <regex> has an extreme cost to compile times.
         bool quantize = name.rfind("weight") == name.size() - 6; // ends with 'weight'?
 
@@ -14971,9 +15879,8 @@ static void llama_model_quantize_internal(const std::string & fname_inp, const s
         quantize &= name.find("ssm_x.weight")      == std::string::npos;
         quantize &= name.find("ssm_dt.weight")     == std::string::npos;
 
-        enum ggml_type new_type;
-        void * new_data;
-        size_t new_size;
+        enum ggml_type new_type = tensor->type;
+        const float * imatrix = nullptr;
 
         if (quantize) {
             new_type = default_type;
@@ -14996,13 +15903,7 @@ static void llama_model_quantize_internal(const std::string & fname_inp, const s
 
         if (!quantize) {
             new_type = tensor->type;
-            new_data = tensor->data;
-            new_size = ggml_nbytes(tensor);
-            LLAMA_LOG_INFO("size = %8.3f MB\n", ggml_nbytes(tensor)/1024.0/1024.0);
         } else {
-            const int64_t nelements = ggml_nelements(tensor);
-
-            const float * imatrix = nullptr;
             if (imatrix_data) {
                 auto it = imatrix_data->find(tensor->name);
                 if (it == imatrix_data->end()) {
@@ -15037,62 +15938,416 @@ static void llama_model_quantize_internal(const std::string & fname_inp, const s
                 LLAMA_LOG_ERROR("============================================================\n\n");
                 throw std::runtime_error(format("Missing importance matrix for tensor %s in a very low-bit quantization", tensor->name));
             }
+            if (tensor->type != GGML_TYPE_F32 && ggml_is_quantized(tensor->type) && !params->allow_requantize) {
+                throw std::runtime_error(format("requantizing from type %s is disabled", ggml_type_name(tensor->type)));
+            }
+        }
 
-            float * f32_data;
+        plan[i].quantize = quantize;
+        plan[i].new_type = new_type;
+        plan[i].new_size = quantize ? ggml_row_size(new_type, tensor->ne[0])*(ggml_nelements(tensor)/tensor->ne[0]) : ggml_nbytes(tensor);
+        plan[i].imatrix  = imatrix;
+        plan[i].i_split  = 0;
 
-            if (tensor->type == GGML_TYPE_F32) {
-                f32_data = (float *) tensor->data;
-            } else if (ggml_is_quantized(tensor->type) && !params->allow_requantize) {
-                throw std::runtime_error(format("requantizing from type %s is disabled", ggml_type_name(tensor->type)));
-            } else {
-                llama_tensor_dequantize_internal(tensor, f32_conv_buf, workers, nelements, nthread);
-                f32_data = (float *) f32_conv_buf.data();
+        total_size_org += ggml_nbytes(tensor);
+        total_size_new += plan[i].new_size;
+    }
+
+    uint16_t n_split = 1;
+    if (params->keep_split) {
+        // Assume split index is continuous
+        for (int i = 0; i < ml.n_tensors; ++i) {
+            plan[i].i_split = ml.get_weight(i)->idx;
+            n_split = std::max(uint16_t(plan[i].i_split + 1), n_split);
+        }
+    } else if (params->split_max_size > 0) {
+        size_t split_size = 0;
+        for (int i = 0; i < ml.n_tensors; ++i) {
+            const size_t padded_size = GGML_PAD(plan[i].new_size, align);
+            if (split_size > 0 && split_size + padded_size > params->split_max_size) {
+                ++n_split;
+                split_size = 0;
             }
+            plan[i].i_split = n_split - 1;
+            split_size += padded_size;
+        }
+    }
+    const bool split_output = params->keep_split || params->split_max_size > 0;
+
+    std::vector<gguf_context*> ctx_outs(n_split, NULL);
+    ctx_outs[0] = ctx_out;
+
+    // populate the tensors with their final types and sizes
+    for (int i = 0; i < ml.n_tensors; ++i) {
+        struct ggml_tensor * tensor = ml.get_weight(i)->tensor;
+        const uint16_t i_split = plan[i].i_split;
+        if (ctx_outs[i_split] == NULL) {
+            ctx_outs[i_split] = gguf_init_empty();
+        }
+        gguf_add_tensor(ctx_outs[i_split], tensor);
+        gguf_set_tensor_type(ctx_outs[i_split], tensor->name, plan[i].new_type);
+        gguf_set_tensor_data(ctx_outs[i_split], tensor->name, nullptr, plan[i].new_size);
+    }
+
+    // Set split info if needed
+    if (n_split > 1) {
+        for (size_t i = 0; i < ctx_outs.size(); ++i) {
+            gguf_set_val_u16(ctx_outs[i], ml.llm_kv(LLM_KV_SPLIT_NO).c_str(), i);
+            gguf_set_val_u16(ctx_outs[i], ml.llm_kv(LLM_KV_SPLIT_COUNT).c_str(), n_split);
+            gguf_set_val_i32(ctx_outs[i], ml.llm_kv(LLM_KV_SPLIT_TENSORS_COUNT).c_str(), ml.n_tensors);
+        }
+    }
 
-            LLAMA_LOG_INFO("converting to %s .. ", ggml_type_name(new_type));
-            fflush(stdout);
+    // the run is identified in the checkpoint by the hash of the meta data of the shards, of the importance matrix
+    // and of the quantization params
+    std::vector<std::vector<uint8_t>> metas(n_split);
+    uint64_t plan_hash = 14695981039346656037ULL; // FNV-1a
+    auto hash_bytes = [&plan_hash](const void * data, size_t size) {
+        for (size_t i = 0; i < size; ++i) {
+            plan_hash = (plan_hash ^ ((const uint8_t *) data)[i]) * 1099511628211ULL;
+        }
+    };
+    for (uint16_t i_split = 0; i_split < n_split; ++i_split) {
+        metas[i_split].resize(gguf_get_meta_size(ctx_outs[i_split]));
+        gguf_get_meta_data(ctx_outs[i_split], metas[i_split].data());
+        hash_bytes(metas[i_split].data(), metas[i_split].size());
+    }
+    for (int i = 0; i < ml.n_tensors; ++i) {
+        // the included and excluded weights only change which tensors have an importance matrix
+        if (plan[i].imatrix) {
+            const struct ggml_tensor * tensor = ml.get_weight(i)->tensor;
+            hash_bytes(&i, sizeof(i));
+            hash_bytes(plan[i].imatrix, tensor->ne[0]*tensor->ne[2]*sizeof(float));
+        }
+    }
+    const int32_t quantize_params[] = {
+        params->ftype, params->output_tensor_type, params->token_embedding_type, params->allow_requantize,
+        params->quantize_output_tensor, params->only_copy, params->pure, params->keep_split,
+    };
+    hash_bytes(quantize_params, sizeof(quantize_params));
+    hash_bytes(&params->split_max_size, sizeof(params->split_max_size));
+    plan_hash ^= ml.n_bytes;
+
+    // the checkpoint holds the number of tensors written so far, it is removed once the output is complete
+    const std::string fname_ckpt = fname_out + ".ckpt";
+
+    int i_start = 0;
+    if (params->resume) {
+        std::ifstream fckpt(fname_ckpt);
+        uint64_t ckpt_hash = 0;
+        int n_done = 0;
+        if (fckpt >> std::hex >> ckpt_hash >> std::dec >> n_done) {
+            if (ckpt_hash != plan_hash || n_done < 0 || n_done > ml.n_tensors) {
+                throw std::runtime_error(format("checkpoint %s was written by a different quantization, remove it to start over", fname_ckpt.c_str()));
+            }
+            i_start = n_done;
+            LLAMA_LOG_INFO("%s: resuming from %s, %d of %d tensors already written\n", __func__, fname_ckpt.c_str(), i_start, ml.n_tensors);
+        } else {
+            LLAMA_LOG_INFO("%s: no checkpoint in %s, starting from the beginning\n", __func__, fname_ckpt.c_str());
+        }
+    }
 
-            if (work.size() < (size_t)nelements * 4) {
-                work.resize(nelements * 4); // upper bound on size
+    auto save_checkpoint = [&](int n_done) {
+        const std::string fname_tmp = fname_ckpt + ".tmp";
+        {
+            std::ofstream fckpt(fname_tmp, std::ios::trunc);
+            fckpt << std::hex << plan_hash << std::dec << " " << n_done << "\n";
+            if (!fckpt.flush()) {
+                throw std::runtime_error(format("failed to write %s", fname_tmp.c_str()));
             }
-            new_data = work.data();
+        }
+        if (!llama_replace_file(fname_tmp.c_str(), fname_ckpt.c_str())) {
+            throw std::runtime_error(format("failed to write %s", fname_ckpt.c_str()));
+        }
+    };
+
+    int cur_split = -1;
+    std::ofstream fout;
+    // open the shard of tensor i at the offset of its data
+    auto open_split = [&](int i) {
+        cur_split = plan[i].i_split;
+        std::string fname = fname_out;
+        if (split_output) {
+            char split_path[PATH_MAX] = {0};
+            llama_split_path(split_path, sizeof(split_path), fname_out.c_str(), cur_split, n_split);
+            fname = std::string(split_path);
+        }
+
+        // when resuming in the middle of a shard, keep the tensors written before
+        const bool resume_split = i == i_start && i > 0 && plan[i - 1].i_split == cur_split;
+
+        fout = std::ofstream(fname, resume_split ? std::ios::binary | std::ios::in : std::ios::binary | std::ios::trunc);
+        if (!fout.is_open()) {
+            throw std::runtime_error(format("failed to open %s", fname.c_str()));
+        }
+        fout.exceptions(std::ofstream::failbit); // fail fast on write errors
+        fout.write((const char *) metas[cur_split].data(), metas[cur_split].size());
 
-            const int64_t n_per_row = tensor->ne[0];
-            const int64_t nrows = tensor->ne[1];
+        const char * name = ggml_get_name(ml.get_weight(i)->tensor);
+        fout.seekp(metas[cur_split].size() + gguf_get_tensor_offset(ctx_outs[cur_split], gguf_find_tensor(ctx_outs[cur_split], name)));
+    };
 
-            static const int64_t min_chunk_size = 32 * 512;
-            const int64_t chunk_size = n_per_row >= min_chunk_size ? n_per_row : n_per_row * ((min_chunk_size + n_per_row - 1)/n_per_row);
+    // the conversion is pipelined over three slots: the loader thread reads (and dequantizes) tensor i+1 while
+    // this thread quantizes tensor i and the writer thread writes tensor i-1
+    struct quantize_slot {
+        int i;
+        std::vector<no_init<uint8_t>> read_data;
+        std::vector<no_init<float>>   f32_conv_buf;
+        std::vector<no_init<uint8_t>> work;
+        const float * f32_data;
+        const void  * new_data;
+        size_t        new_size;
 
-            const int64_t nelements_matrix = tensor->ne[0] * tensor->ne[1];
-            const int64_t nchunk = (nelements_matrix + chunk_size - 1)/chunk_size;
-            const int64_t nthread_use = nthread > 1 ? std::max((int64_t)1, std::min((int64_t)nthread, nchunk)) : 1;
+        size_t buf_size() const {
+            return read_data.capacity()*sizeof(uint8_t) + f32_conv_buf.capacity()*sizeof(float) + work.capacity()*sizeof(uint8_t);
+        }
 
-            // quantize each expert separately since they have different importance matrices
-            new_size = 0;
-            for (int64_t i03 = 0; i03 < tensor->ne[2]; ++i03) {
-                const float * f32_data_03 = f32_data + i03 * nelements_matrix;
-                void * new_data_03 = (char *)new_data + ggml_row_size(new_type, n_per_row) * i03 * nrows;
-                const float * imatrix_03 = imatrix ? imatrix + i03 * n_per_row : nullptr;
+        void release() {
+            std::vector<no_init<uint8_t>>().swap(read_data);
+            std::vector<no_init<float>>  ().swap(f32_conv_buf);
+            std::vector<no_init<uint8_t>>().swap(work);
+        }
+    };
 
-                new_size += llama_tensor_quantize_internal(new_type, f32_data_03, new_data_03, chunk_size, nrows, n_per_row, imatrix_03, workers, nthread_use);
+    const int n_slots = 3;
+    std::vector<quantize_slot> slots(n_slots);
+
+    // the buffers of a slot are grown for each tensor: its data when it is not mapped, its f32 conversion and its
+    // quantized data - a tensor is only loaded while the buffers of all the slots fit in max_pipeline_size, freeing
+    // the buffers of the idle slots first, and a tensor that does not fit alone is converted alone
+    static const size_t max_pipeline_size = 4ull*1024*1024*1024;
+    std::mutex              pipeline_mutex;
+    std::condition_variable pipeline_cv;
+    std::vector<bool>       slot_busy(n_slots, false);
+    size_t                  pipeline_size    = 0; // sum of the buffers of all the slots
+    bool                    pipeline_aborted = false;
+
+    // the dequantization of the loader and the quantization of this thread run at the same time, split the threads
+    // between them - the dequantization is the cheaper of the two
+    const int nthread_load  = std::max(1, nthread/4);
+    const int nthread_quant = std::max(1, nthread - nthread_load);
+    LLAMA_LOG_INFO("%s: %d threads to quantize, %d to load\n", __func__, nthread_quant, nthread_load);
+
+    llama_quantize_queue q_free;      // slots ready to load a tensor
+    llama_quantize_queue q_loaded;    // slots with a tensor to convert
+    llama_quantize_queue q_converted; // slots with a tensor to write
+    for (int s = 0; s < n_slots; ++s) {
+        q_free.push(s);
+    }
+
+    std::mutex error_mutex;
+    std::exception_ptr error;
+    auto abort_pipeline = [&](std::exception_ptr e) {
+        {
+            std::lock_guard<std::mutex> lock(error_mutex);
+            if (!error) {
+                error = e;
             }
-            LLAMA_LOG_INFO("size = %8.2f MiB -> %8.2f MiB\n", ggml_nbytes(tensor)/1024.0/1024.0, new_size/1024.0/1024.0);
         }
-        total_size_org += ggml_nbytes(tensor);
-        total_size_new += new_size;
+        {
+            std::lock_guard<std::mutex> lock(pipeline_mutex);
+            pipeline_aborted = true;
+        }
+        pipeline_cv.notify_all();
+        q_free.close(true);
+        q_loaded.close(true);
+        q_converted.close(true);
+    };
+
+    // wait until the buffers for tensor i fit in max_pipeline_size, then grow the buffers of the slot for it
+    auto acquire_slot = [&](int s, int i) {
+        quantize_slot & slot = slots[s];
+        const struct ggml_tensor * tensor = ml.get_weight(i)->tensor;
+
+        const size_t n_read = ml.use_mmap ? 0 : ggml_nbytes(tensor);
+        const size_t n_conv = plan[i].quantize && tensor->type != GGML_TYPE_F32 ? ggml_nelements(tensor) : 0;
+        const size_t n_work = plan[i].quantize ? plan[i].new_size : 0;
+
+        const size_t growth =
+            (n_read > slot.read_data.capacity()    ? (n_read - slot.read_data.capacity())*sizeof(uint8_t)  : 0) +
+            (n_conv > slot.f32_conv_buf.capacity() ? (n_conv - slot.f32_conv_buf.capacity())*sizeof(float) : 0) +
+            (n_work > slot.work.capacity()         ? (n_work - slot.work.capacity())*sizeof(uint8_t)       : 0);
+
+        {
+            std::unique_lock<std::mutex> lock(pipeline_mutex);
+            while (pipeline_size + growth > max_pipeline_size) {
+                int n_busy = 0;
+                for (int t = 0; t < n_slots; ++t) {
+                    if (t != s && !slot_busy[t] && slots[t].buf_size() > 0) {
+                        pipeline_size -= slots[t].buf_size();
+                        slots[t].release();
+                    }
+                    n_busy += slot_busy[t];
+                }
+                if (pipeline_size + growth <= max_pipeline_size || n_busy == 0) {
+                    break;
+                }
+                pipeline_cv.wait(lock);
+                if (pipeline_aborted) {
+                    return false;
+                }
+            }
+            slot_busy[s] = true;
+            pipeline_size += growth;
+        }
+
+        // reserve first so that the capacity is exactly what has been accounted for
+        if (slot.read_data.size() < n_read) {
+            slot.read_data.reserve(n_read);
+            slot.read_data.resize(n_read);
+        }
+        if (slot.f32_conv_buf.size() < n_conv) {
+            slot.f32_conv_buf.reserve(n_conv);
+            slot.f32_conv_buf.resize(n_conv);
+        }
+        if (slot.work.size() < n_work) {
+            slot.work.reserve(n_work);
+            slot.work.resize(n_work);
+        }
+        return true;
+    };
+
+    auto release_slot = [&](int s) {
+        {
+            std::lock_guard<std::mutex> lock(pipeline_mutex);
+            slot_busy[s] = false;
+        }
+        pipeline_cv.notify_all();
+        q_free.push(s);
+    };
+
+    std::thread loader([&]() {
+        std::vector<std::thread> workers;
+        workers.reserve(nthread_load);
+        try {
+            int s;
+            for (int i = i_start; i < ml.n_tensors && q_free.pop(s); ++i) {
+                if (!acquire_slot(s, i)) {
+                    break;
+                }
+
+                quantize_slot & slot = slots[s];
+                struct ggml_tensor * tensor = ml.get_weight(i)->tensor;
+
+                if (!ml.use_mmap) {
+                    tensor->data = slot.read_data.data();
+                }
+                ml.load_data_for(tensor);
 
-        // update the gguf meta data as we go
-        gguf_set_tensor_type(ctx_outs[cur_split], name.c_str(), new_type);
-        gguf_set_tensor_data(ctx_outs[cur_split], name.c_str(), new_data, new_size);
+                slot.i        = i;
+                slot.f32_data = nullptr;
+                if (plan[i].quantize) {
+                    if (tensor->type == GGML_TYPE_F32) {
+                        slot.f32_data = (const float *) tensor->data;
+                    } else {
+                        llama_tensor_dequantize_internal(tensor, slot.f32_conv_buf, workers, ggml_nelements(tensor), nthread_load);
+                        slot.f32_data = (const float *) slot.f32_conv_buf.data();
+                    }
+                }
+                q_loaded.push(s);
+            }
+            q_loaded.close(false);
+        } catch (...) {
+            abort_pipeline(std::current_exception());
+        }
+    });
+
+    std::thread writer([&]() {
+        try {
+            int s;
+            while (q_converted.pop(s)) {
+                const quantize_slot & slot = slots[s];
+                if (plan[slot.i].i_split != cur_split) {
+                    if (fout.is_open()) {
+                        fout.close();
+                    }
+                    open_split(slot.i);
+                }
+
+                // write tensor data + padding
+                fout.write((const char *) slot.new_data, slot.new_size);
+                zeros(fout, GGML_PAD(slot.new_size, align) - slot.new_size);
+                fout.flush();
+
+                save_checkpoint(slot.i + 1);
+                release_slot(s);
+            }
+        } catch (...) {
+            abort_pipeline(std::current_exception());
+        }
+    });
+
+    try {
+        std::vector<std::thread> workers;
+        workers.reserve(nthread_quant);
+
+        int s;
+        while (q_loaded.pop(s)) {
+            quantize_slot & slot = slots[s];
+            const quantize_tensor_plan & tp = plan[slot.i];
+            struct ggml_tensor * tensor = ml.get_weight(slot.i)->tensor;
+
+            LLAMA_LOG_INFO("[%4d/%4d] %36s - [%s], type = %6s, ",
+                   slot.i + 1, ml.n_tensors,
+                   ggml_get_name(tensor),
+                   llama_format_tensor_shape(tensor).c_str(),
+                   ggml_type_name(tensor->type));
+
+            if (!tp.quantize) {
+                slot.new_data = tensor->data;
+                slot.new_size = ggml_nbytes(tensor);
+                LLAMA_LOG_INFO("size = %8.3f MB\n", ggml_nbytes(tensor)/1024.0/1024.0);
+            } else {
+                LLAMA_LOG_INFO("converting to %s .. ", ggml_type_name(tp.new_type));
+                fflush(stdout);
+
+                void * new_data = slot.work.data();
+
+                const int64_t n_per_row = tensor->ne[0];
+                const int64_t nrows = tensor->ne[1];
+
+                static const int64_t min_chunk_size = 32 * 512;
+                const int64_t chunk_size = n_per_row >= min_chunk_size ? n_per_row : n_per_row * ((min_chunk_size + n_per_row - 1)/n_per_row);
+
+                const int64_t nelements_matrix = tensor->ne[0] * tensor->ne[1];
+                const int64_t nchunk = (nelements_matrix + chunk_size - 1)/chunk_size;
+                const int64_t nthread_use = nthread_quant > 1 ? std::max((int64_t)1, std::min((int64_t)nthread_quant, nchunk)) : 1;
+
+                // quantize each expert separately since they have different importance matrices
+                size_t new_size = 0;
+                for (int64_t i03 = 0; i03 < tensor->ne[2]; ++i03) {
+                    const float * f32_data_03 = slot.f32_data + i03 * nelements_matrix;
+                    void * new_data_03 = (char *)new_data + ggml_row_size(tp.new_type, n_per_row) * i03 * nrows;
+                    const float * imatrix_03 = tp.imatrix ? tp.imatrix + i03 * n_per_row : nullptr;
+
+                    new_size += llama_tensor_quantize_internal(tp.new_type, f32_data_03, new_data_03, chunk_size, nrows, n_per_row, imatrix_03, workers, nthread_use);
+                }
+                GGML_ASSERT(new_size == tp.new_size);
+
+                slot.new_data = new_data;
+                slot.new_size = new_size;
+                LLAMA_LOG_INFO("size = %8.2f MiB -> %8.2f MiB\n", ggml_nbytes(tensor)/1024.0/1024.0, new_size/1024.0/1024.0);
+            }
+            q_converted.push(s);
+        }
+        q_converted.close(false);
+    } catch (...) {
+        abort_pipeline(std::current_exception());
+    }
+
+    loader.join();
+    writer.join();
 
-        // write tensor data + padding
-        fout.write((const char *) new_data, new_size);
-        zeros(fout, GGML_PAD(new_size, align) - new_size);
+    if (fout.is_open()) {
+        fout.close();
     }
-    close_ofstream();
     for (auto & c:ctx_outs) {
         gguf_free(c);
     }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+    std::remove(fname_ckpt.c_str());
 
     LLAMA_LOG_INFO("%s: model size  = %8.2f MB\n", __func__, total_size_org/1024.0/1024.0);
     LLAMA_LOG_INFO("%s: quant size  = %8.2f MB\n", __func__, total_size_new/1024.0/1024.0);
@@ -15390,6 +16645,8 @@ struct llama_model_params llama_model_default_params() {
         /*.split_mode                  =*/ LLAMA_SPLIT_MODE_LAYER,
         /*.main_gpu                    =*/ 0,
         /*.tensor_split                =*/ nullptr,
+        /*.rpc_servers                 =*/ nullptr,
+        /*.n_cpu_stages                =*/ 1,
         /*.progress_callback           =*/ nullptr,
         /*.progress_callback_user_data =*/ nullptr,
         /*.kv_overrides                =*/ nullptr,
@@ -15397,6 +16654,7 @@ struct llama_model_params llama_model_default_params() {
         /*.use_mmap                    =*/ true,
         /*.use_mlock                   =*/ false,
         /*.check_tensors               =*/ false,
+        /*.repack_tensors              =*/ false,
     };
 
 #ifdef GGML_USE_METAL
@@ -15414,8 +16672,11 @@ struct llama_context_params llama_context_default_params() {
         /*.n_batch                     =*/ 2048,
         /*.n_ubatch                    =*/ 512,
         /*.n_seq_max                   =*/ 1,
+        /*.n_kv_block                  =*/ 0,
         /*.n_threads                   =*/ GGML_DEFAULT_N_THREADS, // TODO: better default
         /*.n_threads_batch             =*/ GGML_DEFAULT_N_THREADS,
+        /*.poll                        =*/ 50,
+        /*.cpumask                     =*/ nullptr,
         /*.rope_scaling_type           =*/ LLAMA_ROPE_SCALING_TYPE_UNSPECIFIED,
         /*.pooling_type                =*/ LLAMA_POOLING_TYPE_UNSPECIFIED,
         /*.rope_freq_base              =*/ 0.0f,
@@ -15434,6 +16695,7 @@ struct llama_context_params llama_context_default_params() {
         /*.embeddings                  =*/ false,
         /*.offload_kqv                 =*/ true,
         /*.flash_attn                  =*/ false,
+        /*.cpu_strict                  =*/ false,
         /*.abort_callback              =*/ nullptr,
         /*.abort_callback_data         =*/ nullptr,
     };
@@ -15452,6 +16714,8 @@ struct llama_model_quantize_params llama_model_quantize_default_params() {
         /*.only_copy                   =*/ false,
         /*.pure                        =*/ false,
         /*.keep_split                  =*/ false,
+        /*.resume                      =*/ false,
+        /*.split_max_size              =*/ 0,
         /*.imatrix                     =*/ nullptr,
         /*.kv_overrides                =*/ nullptr,
     };
@@ -15460,7 +16724,9 @@ struct llama_model_quantize_params llama_model_quantize_default_params() {
 }
 
 size_t llama_max_devices(void) {
-#if defined(GGML_USE_METAL)
+#if defined(GGML_USE_RPC)
+    return GGML_RPC_MAX_SERVERS;
+#elif defined(GGML_USE_METAL)
     return 1;
 #elif defined(GGML_USE_CUDA)
     return GGML_CUDA_MAX_DEVICES;
@@ -15483,7 +16749,7 @@ bool llama_supports_mlock(void) {
 
 bool llama_supports_gpu_offload(void) {
 #if defined(GGML_USE_CUDA) || defined(GGML_USE_CLBLAST) || defined(GGML_USE_METAL) || defined(GGML_USE_VULKAN) || \
-    defined(GGML_USE_SYCL) || defined(GGML_USE_KOMPUTE)
+    defined(GGML_USE_SYCL) || defined(GGML_USE_KOMPUTE) || defined(GGML_USE_RPC)
     // Defined when llama.cpp is compiled with support for offloading model layers to GPU.
     return true;
 #else
@@ -15547,6 +16813,17 @@ struct llama_model * llama_load_model_from_file(
         };
     }
 
+    if (params.rpc_servers != nullptr && params.rpc_servers[0] != '\0') {
+        // split the comma separated list of servers into model->rpc_servers
+        std::string servers(params.rpc_servers);
+        size_t pos = 0;
+        while ((pos = servers.find(',')) != std::string::npos) {
+            std::string server = servers.substr(0, pos);
+            model->rpc_servers.push_back(server);
+            servers.erase(0, pos + 1);
+        }
+        model->rpc_servers.push_back(servers);
+    }
     int status = llama_model_load(path_model, *model, params);
     GGML_ASSERT(status <= 0);
     if (status < 0) {
@@ -15566,6 +16843,40 @@ void llama_free_model(struct llama_model * model) {
     delete model;
 }
 
+// the CPUs of a CPU pipeline stage: the CPUs of cpumask, or else of the NUMA nodes in order, or else all of them,
+// split in n_stages contiguous groups
+static void llama_cpu_stage_cpumask(const bool * cpumask, int stage, int n_stages, bool * stage_cpumask) {
+    std::vector<int> cpus;
+    if (cpumask != nullptr && std::any_of(cpumask, cpumask + GGML_MAX_N_THREADS, [](bool b) { return b; })) {
+        for (int i = 0; i < GGML_MAX_N_THREADS; ++i) {
+            if (cpumask[i]) {
+                cpus.push_back(i);
+            }
+        }
+    } else if (ggml_is_numa()) {
+        for (int node = 0; node < ggml_numa_n_nodes(); ++node) {
+            bool node_cpumask[GGML_MAX_N_THREADS] = { false };
+            ggml_numa_node_cpus(node, node_cpumask);
+            for (int i = 0; i < GGML_MAX_N_THREADS; ++i) {
+                if (node_cpumask[i]) {
+                    cpus.push_back(i);
+                }
+            }
+        }
+    } else {
+        const int n_cpus = std::min<int>(std::thread::hardware_concurrency(), GGML_MAX_N_THREADS);
+        for (int i = 0; i < n_cpus; ++i) {
+            cpus.push_back(i);
+        }
+    }
+
+    // no affinity if there are fewer CPUs than stages
+    std::fill(stage_cpumask, stage_cpumask + GGML_MAX_N_THREADS, false);
+    for (size_t i = cpus.size()*stage/n_stages; i < cpus.size()*(stage + 1)/n_stages; ++i) {
+        stage_cpumask[cpus[i]] = true;
+    }
+}
+
 struct llama_context * llama_new_context_with_model(
                  struct llama_model * model,
         struct llama_context_params   params) {
@@ -15596,6 +16907,7 @@ struct llama_context * llama_new_context_with_model(
     auto       & cparams = ctx->cparams;
 
     cparams.n_seq_max        = std::max(1u, params.n_seq_max);
+    cparams.n_kv_block       = model->arch == LLM_ARCH_MAMBA ? 0 : params.n_kv_block;
     cparams.n_threads        = params.n_threads;
     cparams.n_threads_batch  = params.n_threads_batch;
     cparams.yarn_ext_factor  = params.yarn_ext_factor;
@@ -15666,6 +16978,7 @@ struct llama_context * llama_new_context_with_model(
     LLAMA_LOG_INFO("%s: n_batch    = %u\n",     __func__, cparams.n_batch);
     LLAMA_LOG_INFO("%s: n_ubatch   = %u\n",     __func__, cparams.n_ubatch);
     LLAMA_LOG_INFO("%s: flash_attn = %d\n",     __func__, cparams.flash_attn);
+    LLAMA_LOG_INFO("%s: n_kv_block = %u\n",     __func__, cparams.n_kv_block);
     LLAMA_LOG_INFO("%s: freq_base  = %.1f\n",   __func__, cparams.rope_freq_base);
     LLAMA_LOG_INFO("%s: freq_scale = %g\n",     __func__, cparams.rope_freq_scale);
 
@@ -15691,9 +17004,36 @@ struct llama_context * llama_new_context_with_model(
     GGML_ASSERT(hparams.n_embd_head_k % ggml_blck_size(type_k) == 0);
     GGML_ASSERT(hparams.n_embd_head_v % ggml_blck_size(type_v) == 0);
 
+    // without Flash Attention, V is stored transposed, which is not possible for quantized types
+    if (ggml_is_quantized(type_v) && !cparams.flash_attn) {
+        LLAMA_LOG_ERROR("%s: V cache quantization requires flash_attn\n", __func__);
+        llama_free(ctx);
+        return nullptr;
+    }
+
+    // the paged KV cache stores and gathers V per cell, the attention without Flash Attention would need a
+    // transposed copy of all of V in every layer
+    if (cparams.n_kv_block > 0 && !cparams.flash_attn) {
+        LLAMA_LOG_ERROR("%s: the paged KV cache requires flash_attn\n", __func__);
+        llama_free(ctx);
+        return nullptr;
+    }
+
     if (!hparams.vocab_only) {
         // initialize backends
-#ifdef GGML_USE_METAL
+#if defined(GGML_USE_RPC)
+        if (model->n_gpu_layers > 0) {
+            for (const auto & endpoint : model->rpc_servers) {
+                ggml_backend_t backend = ggml_backend_rpc_init(endpoint.c_str());
+                if (backend == nullptr) {
+                    LLAMA_LOG_ERROR("%s: failed to connect RPC backend to %s\n", __func__, endpoint.c_str());
+                    llama_free(ctx);
+                    return nullptr;
+                }
+                ctx->backends.push_back(backend);
+            }
+        }
+#elif defined(GGML_USE_METAL)
         if (model->n_gpu_layers > 0) {
             ctx->backend_metal = ggml_backend_metal_init();
             if (ctx->backend_metal == nullptr) {
@@ -15786,6 +17126,21 @@ struct llama_context * llama_new_context_with_model(
             ctx->backends.push_back(backend);
         }
 #endif
+        if (model->n_cpu_stages > 1) {
+            for (int stage = 0; stage < model->n_cpu_stages; ++stage) {
+                ggml_backend_t backend = ggml_backend_cpu_stage_init(stage);
+                if (backend == nullptr) {
+                    LLAMA_LOG_ERROR("%s: failed to initialize CPU pipeline stage %d\n", __func__, stage);
+                    llama_free(ctx);
+                    return nullptr;
+                }
+                ctx->backends.push_back(backend);
+                ctx->backend_cpu_stages.push_back(backend);
+            }
+            LLAMA_LOG_INFO("%s: CPU layers pipelined across %d CPU stages\n", __func__, model->n_cpu_stages);
+        }
+
+        // the scheduler requires the CPU backend to be the last one
         ctx->backend_cpu = ggml_backend_cpu_init();
         if (ctx->backend_cpu == nullptr) {
             LLAMA_LOG_ERROR("%s: failed to initialize CPU backend\n", __func__);
@@ -15794,6 +17149,30 @@ struct llama_context * llama_new_context_with_model(
         }
         ctx->backends.push_back(ctx->backend_cpu);
 
+        if (params.poll >= 0) {
+            ctx->threadpool_params = ggml_threadpool_params_default(std::min<int>(std::max(cparams.n_threads, cparams.n_threads_batch), GGML_MAX_N_THREADS));
+            ctx->threadpool_params.poll       = params.poll;
+            ctx->threadpool_params.strict_cpu = params.cpu_strict;
+            if (params.cpumask) {
+                std::copy(params.cpumask, params.cpumask + GGML_MAX_N_THREADS, ctx->threadpool_params.cpumask);
+            }
+
+            ctx->threadpool = ggml_threadpool_new(&ctx->threadpool_params);
+            ggml_backend_cpu_set_threadpool(ctx->backend_cpu, ctx->threadpool);
+
+            // each stage runs its share of the threads on its own group of CPUs
+            const int n_stages = (int) ctx->backend_cpu_stages.size();
+            for (int stage = 0; stage < n_stages; ++stage) {
+                ggml_threadpool_params tp_params = ctx->threadpool_params;
+                tp_params.n_threads = std::max(1, tp_params.n_threads/n_stages);
+                llama_cpu_stage_cpumask(params.cpumask, stage, n_stages, tp_params.cpumask);
+
+                ctx->threadpool_stage_params.push_back(tp_params);
+                ctx->threadpool_stages.push_back(ggml_threadpool_new(&tp_params));
+                ggml_backend_cpu_set_threadpool(ctx->backend_cpu_stages[stage], ctx->threadpool_stages.back());
+            }
+        }
+
         if (!llama_kv_cache_init(ctx->kv_self, ctx, type_k, type_v, kv_size, cparams.offload_kqv)) {
             LLAMA_LOG_ERROR("%s: llama_kv_cache_init() failed for self-attention cache\n", __func__);
             llama_free(ctx);
@@ -15837,7 +17216,7 @@ struct llama_context * llama_new_context_with_model(
             // buffer types used for the compute buffer of each backend
             std::vector<ggml_backend_buffer_type_t> backend_buft;
             for (auto * backend : ctx->backends) {
-                if (ggml_backend_is_cpu(backend)) {
+                if (backend == ctx->backend_cpu) {
                     // use host buffers for the CPU backend compute buffer
                     backend_buft.push_back(llama_default_buffer_type_cpu(true));
                 } else {
@@ -15849,12 +17228,16 @@ struct llama_context * llama_new_context_with_model(
             ctx->buf_compute_meta.resize(ggml_tensor_overhead()*LLAMA_MAX_NODES + ggml_graph_overhead_custom(LLAMA_MAX_NODES, false));
 
             // enabling pipeline parallelism in the scheduler increases memory usage, so it is only done when necessary
-            bool pipeline_parallel = llama_get_device_count() > 1 && model->n_gpu_layers > (int)model->hparams.n_layer && model->split_mode == LLAMA_SPLIT_MODE_LAYER;
+            bool pipeline_parallel = llama_get_device_count(*model) > 1 && model->n_gpu_layers > (int)model->hparams.n_layer && model->split_mode == LLAMA_SPLIT_MODE_LAYER;
 #ifndef GGML_USE_CUDA
             // pipeline parallelism requires support for async compute and events
             // currently this is only implemented in the CUDA backend
             pipeline_parallel = false;
 #endif
+            // the CPU pipeline stages compute asynchronously, the inputs of their splits need one copy per graph in flight
+            if (!ctx->backend_cpu_stages.empty()) {
+                pipeline_parallel = true;
+            }
             ctx->sched = ggml_backend_sched_new(ctx->backends.data(), backend_buft.data(), ctx->backends.size(), LLAMA_MAX_NODES, pipeline_parallel);
 
             if (pipeline_parallel) {
@@ -16076,6 +17459,11 @@ uint64_t llama_model_n_params(const struct llama_model * model) {
     return nparams;
 }
 
+bool llama_model_is_recurrent(const struct llama_model * model) {
+    // TODO: find a nicer way to add other recurrent model architectures
+    return model->arch == LLM_ARCH_MAMBA;
+}
+
 struct ggml_tensor * llama_get_model_tensor(struct llama_model * model, const char * name) {
     auto it = std::find_if(model->tensors_by_name.begin(), model->tensors_by_name.end(),
             [name](const std::pair<std::string, struct ggml_tensor *> & it) {
@@ -16166,6 +17554,9 @@ int32_t llama_control_vector_apply(struct llama_context * lctx, const float * da
     const llama_model & model = lctx->model;
     llama_control_vector & cvec = lctx->cvec;
 
+    // the layer range is part of the graph
+    lctx->graph_cache.valid = false;
+
     if (data == nullptr) {
         // disable the current control vector (but leave allocated for later)
         cvec.layer_start = -1;
@@ -17150,13 +18541,20 @@ size_t llama_state_seq_set_data(struct llama_context * ctx, const uint8_t * src,
             return 0;
         }
 
+        if (kv_self.runs.empty()) {
+            kv_self.runs = { { 0, kv_self.head, cell_count } };
+        }
+
         // DEBUG CHECK: kv_self.head should be our first cell, kv_self.head + cell_count - 1 should be our last cell (verify seq_id and pos values)
         // Assume that this is one contiguous block of cells
-        GGML_ASSERT(kv_self.head + cell_count <= kv_self.size);
-        GGML_ASSERT(kv_self.cells[kv_self.head].pos == batch.pos[0]);
-        GGML_ASSERT(kv_self.cells[kv_self.head + cell_count - 1].pos == batch.pos[cell_count - 1]);
-        GGML_ASSERT(kv_self.cells[kv_self.head].has_seq_id(dest_seq_id));
-        GGML_ASSERT(kv_self.cells[kv_self.head + cell_count - 1].has_seq_id(dest_seq_id));
+        // (except for the paged KV cache, which can split the sequence in several ranges of cells)
+        GGML_ASSERT(kv_self.paged() || kv_self.head + cell_count <= kv_self.size);
+        if (!kv_self.paged()) {
+            GGML_ASSERT(kv_self.cells[kv_self.head].pos == batch.pos[0]);
+            GGML_ASSERT(kv_self.cells[kv_self.head + cell_count - 1].pos == batch.pos[cell_count - 1]);
+            GGML_ASSERT(kv_self.cells[kv_self.head].has_seq_id(dest_seq_id));
+            GGML_ASSERT(kv_self.cells[kv_self.head + cell_count - 1].has_seq_id(dest_seq_id));
+        }
 
         // Cleanup
         llama_batch_free(batch);
@@ -17165,6 +18563,10 @@ size_t llama_state_seq_set_data(struct llama_context * ctx, const uint8_t * src,
     const uint32_t kv_size = kv_self.size;
     const uint32_t kv_head = kv_self.head;
 
+    // ranges of cells to write, consumed in order from the input
+    const std::vector<llama_kv_run> runs = std::move(kv_self.runs);
+    kv_self.runs.clear();
+
     // For each layer, read the keys for each cell, one row is one cell, read as one contiguous blo
     for (int il = 0; il < (int)n_layer; ++il) {
         // Read type of key
@@ -17191,7 +18593,9 @@ size_t llama_state_seq_set_data(struct llama_context * ctx, const uint8_t * src,
 
         if (cell_count) {
             // Read and set the keys for the whole cell range
-            ggml_backend_tensor_set(kv_self.k_l[il], inp, kv_head * k_size_row, cell_count * k_size_row);
+            for (const llama_kv_run & run : runs) {
+                ggml_backend_tensor_set(kv_self.k_l[il], inp + run.i_token * k_size_row, run.i_cell * k_size_row, run.n * k_size_row);
+            }
             inp += cell_count * k_size_row;
         }
     }
@@ -17223,7 +18627,9 @@ size_t llama_state_seq_set_data(struct llama_context * ctx, const uint8_t * src,
 
             if (cell_count) {
                 // Read and set the values for the whole cell range
-                ggml_backend_tensor_set(kv_self.v_l[il], inp, kv_head * v_size_row, cell_count * v_size_row);
+                for (const llama_kv_run & run : runs) {
+                    ggml_backend_tensor_set(kv_self.v_l[il], inp + run.i_token * v_size_row, run.i_cell * v_size_row, run.n * v_size_row);
+                }
                 inp += cell_count * v_size_row;
             }
         }
@@ -17352,6 +18758,30 @@ size_t llama_state_seq_load_file(struct llama_context * ctx, const char * filepa
 void llama_set_n_threads(struct llama_context * ctx, uint32_t n_threads, uint32_t n_threads_batch) {
     ctx->cparams.n_threads       = n_threads;
     ctx->cparams.n_threads_batch = n_threads_batch;
+
+    // grow the thread pool if needed, a smaller thread count just leaves some workers idle
+    const int n_threads_max = std::min<int>(std::max(n_threads, n_threads_batch), GGML_MAX_N_THREADS);
+    if (ctx->threadpool != nullptr && n_threads_max > ggml_threadpool_get_n_threads(ctx->threadpool)) {
+        ggml_threadpool_free(ctx->threadpool);
+
+        ctx->threadpool_params.n_threads = n_threads_max;
+        ctx->threadpool = ggml_threadpool_new(&ctx->threadpool_params);
+        ggml_backend_cpu_set_threadpool(ctx->backend_cpu, ctx->threadpool);
+    }
+
+    const int n_stages = (int) ctx->threadpool_stages.size();
+    if (n_stages > 0 && std::max(1, n_threads_max/n_stages) > ggml_threadpool_get_n_threads(ctx->threadpool_stages[0])) {
+        // the stages may still be computing with their pools
+        llama_synchronize(ctx);
+
+        for (int stage = 0; stage < n_stages; ++stage) {
+            ggml_threadpool_free(ctx->threadpool_stages[stage]);
+
+            ctx->threadpool_stage_params[stage].n_threads = std::max(1, n_threads_max/n_stages);
+            ctx->threadpool_stages[stage] = ggml_threadpool_new(&ctx->threadpool_stage_params[stage]);
+            ggml_backend_cpu_set_threadpool(ctx->backend_cpu_stages[stage], ctx->threadpool_stages[stage]);
+        }
+    }
 }
 
 void llama_set_abort_callback(struct llama_context * ctx, bool (*abort_callback)(void * data), void * abort_callback_data) {
@@ -17432,6 +18862,12 @@ int32_t llama_decode(
 void llama_synchronize(struct llama_context * ctx) {
     ggml_backend_sched_synchronize(ctx->sched);
 
+    // nothing was evaluated since the last synchronization
+    // the context is not modified then, so that the outputs can be read from several threads
+    if (ctx->n_queued_tokens == 0) {
+        return;
+    }
+
     // FIXME: if multiple single tokens are evaluated without a synchronization,
     // the stats will be added to the prompt evaluation stats
     // this should only happen when using batch size 1 to evaluate a batch
@@ -17440,13 +18876,13 @@ void llama_synchronize(struct llama_context * ctx) {
     if (ctx->n_queued_tokens == 1) {
         ctx->t_eval_us += ggml_time_us() - ctx->t_compute_start_us;
         ctx->n_eval++;
-    } else if (ctx->n_queued_tokens > 1) {
+    } else {
         ctx->t_p_eval_us += ggml_time_us() - ctx->t_compute_start_us;
         ctx->n_p_eval += ctx->n_queued_tokens;
     }
 
     // get a more accurate load time, upon first eval
-    if (ctx->n_queued_tokens > 0 && !ctx->has_evaluated_once) {
+    if (!ctx->has_evaluated_once) {
         ctx->t_load_us = ggml_time_us() - ctx->t_start_us;
         ctx->has_evaluated_once = true;
     }
@@ -18011,7 +19447,7 @@ struct llama_timings llama_get_timings(struct llama_context * ctx) {
         /*.t_p_eval_ms =*/ 1e-3 * ctx->t_p_eval_us,
         /*.t_eval_ms   =*/ 1e-3 * ctx->t_eval_us,
 
-        /*.n_sample =*/ std::max(1, ctx->n_sample),
+        /*.n_sample =*/ std::max(1, ctx->n_sample.load()),
         /*.n_p_eval =*/ std::max(0, ctx->n_p_eval),
         /*.n_eval   =*/ std::max(1, ctx->n_eval),
     };
@@ -18085,11 +19521,11 @@ void llama_dump_timing_info_yaml(FILE * stream, const llama_context * ctx) {
             1.0e-3 * ctx->t_sample_us / ctx->n_sample);
     fprintf(stream, "n_eval: %d  # number of tokens generated (excluding the first one)\n", ctx->n_eval);
     fprintf(stream, "n_p_eval: %d  # number of tokens processed in batches at the beginning\n", ctx->n_p_eval);
-    fprintf(stream, "n_sample: %d  # number of sampled tokens\n", ctx->n_sample);
+    fprintf(stream, "n_sample: %d  # number of sampled tokens\n", ctx->n_sample.load());
     fprintf(stream, "t_eval_us: %" PRId64 "  # total microseconds spent generating tokens\n", ctx->t_eval_us);
     fprintf(stream, "t_load_us: %" PRId64 "  # total microseconds spent loading the model\n", ctx->t_load_us);
     fprintf(stream, "t_p_eval_us: %" PRId64 "  # total microseconds spent prompt processing\n", ctx->t_p_eval_us);
-    fprintf(stream, "t_sample_us: %" PRId64 "  # total microseconds spent sampling\n", ctx->t_sample_us);
+    fprintf(stream, "t_sample_us: %" PRId64 "  # total microseconds spent sampling\n", ctx->t_sample_us.load());
     fprintf(stream, "ts_eval: %.2f  # tokens / second during generation\n",
             1.0e6 * ctx->n_eval / ctx->t_eval_us);
     fprintf(stream, "ts_p_eval: %.2f  # tokens / second during prompt processing\n",
@@ -242,6 +242,13 @@ extern "C" {
         // proportion of the model (layers or rows) to offload to each GPU, size: llama_max_devices()
         const float * tensor_split;
 
+        // comma separated list of RPC servers (host:port) to offload to, used instead of the local GPUs
+        const char * rpc_servers;
+
+        // number of CPU backends the layers kept on the CPU are split across (e.g. one per NUMA node), each with its own threads
+        // the ubatches of a batch flow through them as a pipeline, <= 1 = a single CPU backend
+        int32_t n_cpu_stages;
+
         // Called with a progress value between 0.0 and 1.0. Pass NULL to disable.
         // If the provided progress_callback returns true, model loading continues.
         // If it returns false, model loading is immediately aborted.
@@ -258,6 +265,7 @@ extern "C" {
         bool use_mmap;      // use mmap if possible
         bool use_mlock;     // force system to keep model in RAM
         bool check_tensors; // validate model tensor data
+        bool repack_tensors; // store the Q4_0/Q8_0 matrices of the CPU layers in an interleaved layout for faster matmul
     };
 
     struct llama_context_params {
@@ -266,8 +274,11 @@ extern "C" {
         uint32_t n_batch;           // logical maximum batch size that can be submitted to llama_decode
         uint32_t n_ubatch;          // physical maximum batch size
         uint32_t n_seq_max;         // max number of sequences (i.e. distinct states for recurrent models)
+        uint32_t n_kv_block;        // KV cells per block of the paged KV cache, 0 = contiguous KV cache (default), requires flash_attn
         uint32_t n_threads;         // number of threads to use for generation
         uint32_t n_threads_batch;   // number of threads to use for batch processing
+        int32_t  poll;              // CPU thread pool busy-wait level before sleeping (0 = sleep immediately, 100 = spin aggressively), < 0 = no thread pool
+        const bool * cpumask;       // optional array of GGML_MAX_N_THREADS flags selecting the CPUs for the worker threads, NULL = default affinity
 
         enum llama_rope_scaling_type rope_scaling_type; // RoPE scaling type, from `enum llama_rope_scaling_type`
         enum llama_pooling_type      pooling_type;      // whether to pool (sum) embedding results by sequence id
@@ -294,6 +305,7 @@ extern "C" {
         bool embeddings;  // if true, extract embeddings (together with logits)
         bool offload_kqv; // whether to offload the KQV ops (including the KV cache) to GPU
         bool flash_attn;  // whether to use flash attention
+        bool cpu_strict;  // pin each worker thread to a single CPU of cpumask
 
         // Abort callback
         // if it returns true, execution of llama_decode() will be aborted
@@ -313,6 +325,8 @@ extern "C" {
         bool only_copy;                      // only copy tensors - ftype, allow_requantize and quantize_output_tensor are ignored
         bool pure;                           // quantize all tensors to the default type
         bool keep_split;                     // quantize to the same number of shards
+        bool resume;                         // continue an interrupted run from the checkpoint next to the output
+        size_t split_max_size;               // max size in bytes of the tensor data of an output shard, 0 = no limit (ignored with keep_split)
         void * imatrix;                      // pointer to importance matrix data
         void * kv_overrides;                 // pointer to vector containing overrides
     } llama_model_quantize_params;
@@ -454,9 +468,15 @@ extern "C" {
     // Returns the total number of parameters in the model
     LLAMA_API uint64_t llama_model_n_params(const struct llama_model * model);
 
+    // Returns true if the model is recurrent (like Mamba): each sequence has a single state instead of a cell per token
+    LLAMA_API bool llama_model_is_recurrent(const struct llama_model * model);
+
     // Get a llama model tensor
     LLAMA_API struct ggml_tensor * llama_get_model_tensor(struct llama_model * model, const char * name);
 
+    // The tensors are loaded, quantized and written in a pipeline: besides the model data,
+    // up to three tensors are in memory at a time (with their f32 conversion and quantized data),
+    // as long as they fit in 4 GiB in total. A tensor that needs more is converted alone.
     // Returns 0 on success
     LLAMA_API uint32_t llama_model_quantize(
             const char * fname_inp,
@@ -1101,6 +1121,7 @@ extern "C" {
 // Internal API to be implemented by llama.cpp and used by tests/benchmarks only
 #ifdef LLAMA_API_INTERNAL
 
+#include <map>
 #include <random>
 #include <string>
 #include <vector>
@@ -1118,6 +1139,10 @@ struct llama_grammar {
 
     // buffer for partially generated UTF-8 sequence from accepted tokens
     llama_partial_utf8                                      partial_utf8;
+
+    // the tokens allowed in the states seen so far, one bit per token, keyed by the stacks
+    mutable const struct llama_model *                                                  masks_model;
+    mutable std::map<std::vector<const llama_grammar_element *>, std::vector<uint32_t>> masks;
 };
 
 struct llama_grammar_candidate {
@@ -50,6 +50,11 @@
 #include "ggml-impl.h"
 #include "ggml-quants.h"
 
+#define GGML_COMMON_IMPL_CPP
+#include "ggml-common.h"
+
+#include <type_traits>
+
 #ifdef _MSC_VER
 #define NOINLINE __declspec(noinline)
 #else
@@ -127,6 +132,12 @@ inline __m512 madd(__m512 a, __m512 b, __m512 c) {
     return _mm512_fmadd_ps(a, b, c);
 }
 #endif
+#if defined(__AVX512BF16__)
+template <>
+inline __m512 madd(__m512bh a, __m512bh b, __m512 c) {
+    return _mm512_dpbf16_ps(c, a, b);
+}
+#endif
 #endif
 
 #if defined(__ARM_FEATURE_FMA)
@@ -204,6 +215,9 @@ template <> inline float32x4_t load(const ggml_fp16_t *p) {
     return vcvt_f32_f16(vld1_f16((const float16_t *)p));
 }
 #endif // _MSC_VER
+template <> inline float32x4_t load(const ggml_bf16_t *p) {
+    return vreinterpretq_f32_u32(vshll_n_u16(vld1_u16((const uint16_t *)p), 16));
+}
 #endif // __ARM_NEON
 
 #if defined(__SSE__) || defined(__AVX__) || defined(__AVX2__) || defined(__AVX512F__)
@@ -218,6 +232,13 @@ template <> inline __m256 load(const float *p) {
 }
 #endif // __AVX__
 
+#if defined(__AVX2__)
+template <> inline __m256 load(const ggml_bf16_t *p) {
+    return _mm256_castsi256_ps(
+        _mm256_slli_epi32(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)p)), 16));
+}
+#endif // __AVX2__
+
 #if defined(__F16C__)
 template <> inline __m256 load(const ggml_fp16_t *p) {
     return _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)p));
@@ -231,8 +252,18 @@ template <> inline __m512 load(const float *p) {
 template <> inline __m512 load(const ggml_fp16_t *p) {
     return _mm512_cvtph_ps(_mm256_loadu_si256((const __m256i *)p));
 }
+template <> inline __m512 load(const ggml_bf16_t *p) {
+    return _mm512_castsi512_ps(
+        _mm512_slli_epi32(_mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i *)p)), 16));
+}
 #endif // __AVX512F__
 
+#if defined(__AVX512BF16__)
+template <> inline __m512bh load(const ggml_bf16_t *p) {
+    return (__m512bh)_mm512_loadu_ps((const float *)p);
+}
+#endif // __AVX512BF16__
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 // FLOATING POINT MATRIX MULTIPLICATION
 
@@ -814,6 +845,241 @@ class tinyBLAS_Q0_AVX {
 };
 #endif // __AVX__
 
+#if defined(__AVX2__) && QK_K == 256
+/**
+ * tinyBLAS for the K-quants and IQ4_XS against Q8_K activations.
+ *
+ * Each super-block of `A` is unpacked once per tile into 8-bit quants
+ * and 16-bit group scales, which are then reused for all the columns
+ * of the tile. The offsets of Q4_K/Q5_K (mins) and Q6_K (-32) are
+ * applied through the group sums of `B` (the bsums of Q8_K) instead
+ * of being subtracted from every quant.
+ */
+template <typename TA>
+class tinyBLAS_KQ_AVX2 {
+  public:
+    tinyBLAS_KQ_AVX2(int64_t k,
+                     const TA *A, int64_t lda,
+                     const block_q8_K *B, int64_t ldb,
+                     float *C, int64_t ldc,
+                     int ith, int nth)
+        : A(A), B(B), C(C), k(k), lda(lda), ldb(ldb), ldc(ldc), ith(ith), nth(nth) {
+    }
+
+    void matmul(int64_t m, int64_t n, int task) {
+        if (task == GGML_TASK_TYPE_COMPUTE)
+            mnpack(0, m, 0, n);
+    }
+
+  private:
+    // IQ4_XS has signed quants and no offset, the K-quants are stored unsigned
+    static constexpr bool is_signed = std::is_same<TA, block_iq4_xs>::value;
+
+    struct unpacked {
+        __m256i q[QK_K/32]; // quants
+        __m256i s[QK_K/32]; // scales of the two groups of 16 quants in q, as 16-bit lanes
+        __m256i m;          // offsets of the 16 groups of quants, multiplied with the bsums of B
+        float d;            // scale of the quants
+        float dm;           // scale of the offsets
+    };
+
+    // the unpacking of A is amortized over the columns of a tile, so the tiles are wide rather than tall
+    void mnpack(int64_t m0, int64_t m, int64_t n0, int64_t n) {
+        int64_t mc, nc, mp, np;
+        switch ((MIN(m - m0, 2) << 4) | MIN(n - n0, 4)) {
+        case 0x24:
+            mc = 2;
+            nc = 4;
+            gemm<2, 4>(m0, m, n0, n);
+            break;
+        case 0x23:
+            mc = 2;
+            nc = 3;
+            gemm<2, 3>(m0, m, n0, n);
+            break;
+        case 0x14:
+            mc = 1;
+            nc = 4;
+            gemm<1, 4>(m0, m, n0, n);
+            break;
+        case 0x22:
+            mc = 2;
+            nc = 2;
+            gemm<2, 2>(m0, m, n0, n);
+            break;
+        case 0x13:
+            mc = 1;
+            nc = 3;
+            gemm<1, 3>(m0, m, n0, n);
+            break;
+        case 0x21:
+            mc = 2;
+            nc = 1;
+            gemm<2, 1>(m0, m, n0, n);
+            break;
+        case 0x12:
+            mc = 1;
+            nc = 2;
+            gemm<1, 2>(m0, m, n0, n);
+            break;
+        case 0x11:
+            mc = 1;
+            nc = 1;
+            gemm<1, 1>(m0, m, n0, n);
+            break;
+        default:
+            return;
+        }
+        mp = m0 + (m - m0) / mc * mc;
+        np = n0 + (n - n0) / nc * nc;
+        mnpack(mp, m, n0, np);
+        mnpack(m0, m, np, n);
+    }
+
+    template <int RM, int RN>
+    NOINLINE void gemm(int64_t m0, int64_t m, int64_t n0, int64_t n) {
+        int64_t ytiles = (m - m0) / RM;
+        int64_t xtiles = (n - n0) / RN;
+        int64_t tiles = xtiles * ytiles;
+        int64_t duty = (tiles + nth - 1) / nth;
+        int64_t start = duty * ith;
+        int64_t end = start + duty;
+        if (end > tiles)
+            end = tiles;
+        for (int64_t job = start; job < end; ++job) {
+            int64_t ii = m0 + job / xtiles * RM;
+            int64_t jj = n0 + job % xtiles * RN;
+            __m256 Cv[RN][RM] = {};
+            unpacked Au[RM];
+            for (int64_t l = 0; l < k; ++l) {
+                for (int64_t i = 0; i < RM; ++i)
+                    unpack(A + lda * (ii + i) + l, Au[i]);
+                for (int64_t j = 0; j < RN; ++j) {
+                    const block_q8_K *b = B + ldb * (jj + j) + l;
+                    const __m256i bsums = _mm256_loadu_si256((const __m256i *)b->bsums);
+                    for (int64_t i = 0; i < RM; ++i) {
+                        __m256i sumi = _mm256_setzero_si256();
+                        for (int c = 0; c < QK_K/32; ++c) {
+                            const __m256i bq = _mm256_loadu_si256((const __m256i *)b->qs + c);
+                            sumi = _mm256_add_epi32(sumi, _mm256_madd_epi16(dot(Au[i].q[c], bq), Au[i].s[c]));
+                        }
+                        Cv[j][i] = madd(_mm256_set1_ps(Au[i].d * b->d), _mm256_cvtepi32_ps(sumi), Cv[j][i]);
+                        if (!is_signed)
+                            Cv[j][i] = madd(_mm256_set1_ps(Au[i].dm * b->d),
+                                            _mm256_cvtepi32_ps(_mm256_madd_epi16(Au[i].m, bsums)),
+                                            Cv[j][i]);
+                    }
+                }
+            }
+            for (int64_t j = 0; j < RN; ++j)
+                for (int64_t i = 0; i < RM; ++i)
+                    C[ldc * (jj + j) + (ii + i)] = hsum(Cv[j][i]);
+        }
+    }
+
+    // pairwise products of the quants, as 16-bit sums
+    static inline __m256i dot(__m256i a, __m256i b) {
+        if (is_signed)
+            return _mm256_maddubs_epi16(_mm256_sign_epi8(a, a), _mm256_sign_epi8(b, a));
+        return _mm256_maddubs_epi16(a, b);
+    }
+
+    static inline __m256i scales(int s0, int s1) {
+        return MM256_SET_M128I(_mm_set1_epi16(s1), _mm_set1_epi16(s0));
+    }
+
+    static inline void unpack(const block_q4_K *x, unpacked &u) {
+        const __m256i m4 = _mm256_set1_epi8(15);
+        for (int j = 0; j < QK_K/64; ++j) {
+            const __m256i bits = _mm256_loadu_si256((const __m256i *)x->qs + j);
+            u.q[2*j + 0] = _mm256_and_si256(bits, m4);
+            u.q[2*j + 1] = _mm256_and_si256(_mm256_srli_epi16(bits, 4), m4);
+        }
+        unpack_scales_k4(x->scales, unhalf(x->dmin), u);
+        u.d = unhalf(x->d);
+    }
+
+    static inline void unpack(const block_q5_K *x, unpacked &u) {
+        const __m256i m4 = _mm256_set1_epi8(15);
+        const __m256i m1 = _mm256_set1_epi8(1);
+        const __m256i hbits = _mm256_loadu_si256((const __m256i *)x->qh);
+        for (int j = 0; j < QK_K/64; ++j) {
+            const __m256i bits = _mm256_loadu_si256((const __m256i *)x->qs + j);
+            const __m256i h0 = _mm256_and_si256(_mm256_srli_epi16(hbits, 2*j + 0), m1);
+            const __m256i h1 = _mm256_and_si256(_mm256_srli_epi16(hbits, 2*j + 1), m1);
+            u.q[2*j + 0] = _mm256_or_si256(_mm256_and_si256(bits, m4), _mm256_slli_epi16(h0, 4));
+            u.q[2*j + 1] = _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi16(bits, 4), m4), _mm256_slli_epi16(h1, 4));
+        }
+        unpack_scales_k4(x->scales, unhalf(x->dmin), u);
+        u.d = unhalf(x->d);
+    }
+
+    // 6-bit scales and mins of Q4_K/Q5_K, see ggml_vec_dot_q4_K_q8_K
+    static inline void unpack_scales_k4(const uint8_t *q, float dmin, unpacked &u) {
+        const uint32_t kmask1 = 0x3f3f3f3f;
+        const uint32_t kmask2 = 0x0f0f0f0f;
+        const uint32_t kmask3 = 0x03030303;
+        uint32_t utmp[4];
+        memcpy(utmp, q, 12);
+        utmp[3] = ((utmp[2] >> 4) & kmask2) | (((utmp[1] >> 6) & kmask3) << 4);
+        const uint32_t uaux = utmp[1] & kmask1;
+        utmp[1] = (utmp[2] & kmask2) | (((utmp[0] >> 6) & kmask3) << 4);
+        utmp[2] = uaux;
+        utmp[0] &= kmask1;
+        const uint8_t *sc = (const uint8_t *)utmp;
+        for (int j = 0; j < QK_K/32; ++j)
+            u.s[j] = _mm256_set1_epi16(sc[j]);
+        // each min covers two groups of 16
+        const __m128i mins = _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i *)(sc + 8)));
+        u.m = MM256_SET_M128I(_mm_unpackhi_epi16(mins, mins), _mm_unpacklo_epi16(mins, mins));
+        u.dm = -dmin;
+    }
+
+    static inline void unpack(const block_q6_K *x, unpacked &u) {
+        const __m256i m4 = _mm256_set1_epi8(15);
+        const __m256i m2 = _mm256_set1_epi8(3);
+        for (int j = 0; j < QK_K/128; ++j) {
+            const __m256i l0 = _mm256_loadu_si256((const __m256i *)(x->ql + 64*j));
+            const __m256i l1 = _mm256_loadu_si256((const __m256i *)(x->ql + 64*j + 32));
+            const __m256i h = _mm256_loadu_si256((const __m256i *)(x->qh + 32*j));
+            u.q[4*j + 0] = _mm256_or_si256(_mm256_and_si256(l0, m4), _mm256_slli_epi16(_mm256_and_si256(h, m2), 4));
+            u.q[4*j + 1] = _mm256_or_si256(_mm256_and_si256(l1, m4), _mm256_slli_epi16(_mm256_and_si256(_mm256_srli_epi16(h, 2), m2), 4));
+            u.q[4*j + 2] = _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi16(l0, 4), m4), _mm256_slli_epi16(_mm256_and_si256(_mm256_srli_epi16(h, 4), m2), 4));
+            u.q[4*j + 3] = _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi16(l1, 4), m4), _mm256_slli_epi16(_mm256_and_si256(_mm256_srli_epi16(h, 6), m2), 4));
+        }
+        for (int j = 0; j < QK_K/32; ++j)
+            u.s[j] = scales(x->scales[2*j + 0], x->scales[2*j + 1]);
+        // the quants are stored with an offset of 32
+        u.m = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i *)x->scales));
+        u.d = unhalf(x->d);
+        u.dm = -32 * u.d;
+    }
+
+    static inline void unpack(const block_iq4_xs *x, unpacked &u) {
+        const __m256i m4 = _mm256_set1_epi8(15);
+        const __m256i values = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)kvalues_iq4nl));
+        for (int j = 0; j < QK_K/32; ++j) {
+            const __m128i bits = _mm_loadu_si128((const __m128i *)x->qs + j);
+            const __m256i idx = _mm256_and_si256(MM256_SET_M128I(_mm_srli_epi16(bits, 4), bits), m4);
+            u.q[j] = _mm256_shuffle_epi8(values, idx);
+            const int ls = ((x->scales_l[j/2] >> 4*(j%2)) & 0xf) | (((x->scales_h >> 2*j) & 3) << 4);
+            u.s[j] = scales(ls - 32, ls - 32);
+        }
+        u.d = unhalf(x->d);
+    }
+
+    const TA *const A;
+    const block_q8_K *const B;
+    float *const C;
+    const int64_t k;
+    const int64_t lda;
+    const int64_t ldb;
+    const int64_t ldc;
+    const int ith;
+    const int nth;
+};
+#endif // __AVX2__
+
 } // namespace
 
 /**
@@ -960,6 +1226,54 @@ bool llamafile_sgemm(int64_t m, int64_t n, int64_t k, const void *A, int64_t lda
 #endif
     }
 
+    case GGML_TYPE_BF16: {
+        if (Btype != GGML_TYPE_BF16)
+            return false;
+#if defined(__AVX512BF16__)
+        if (k % 32)
+            return false;
+        tinyBLAS<32, __m512, __m512bh, ggml_bf16_t, ggml_bf16_t, float> tb{
+            k, (const ggml_bf16_t *)A, lda,
+            (const ggml_bf16_t *)B, ldb,
+            (float *)C, ldc,
+            ith, nth};
+        tb.matmul(m, n, task);
+        return true;
+#elif defined(__AVX512F__)
+        if (k % 16)
+            return false;
+        tinyBLAS<16, __m512, __m512, ggml_bf16_t, ggml_bf16_t, float> tb{
+            k, (const ggml_bf16_t *)A, lda,
+            (const ggml_bf16_t *)B, ldb,
+            (float *)C, ldc,
+            ith, nth};
+        tb.matmul(m, n, task);
+        return true;
+#elif defined(__AVX2__)
+        if (k % 8)
+            return false;
+        tinyBLAS<8, __m256, __m256, ggml_bf16_t, ggml_bf16_t, float> tb{
+            k, (const ggml_bf16_t *)A, lda,
+            (const ggml_bf16_t *)B, ldb,
+            (float *)C, ldc,
+            ith, nth};
+        tb.matmul(m, n, task);
+        return true;
+#elif defined(__ARM_NEON) && !defined(_MSC_VER)
+        if (k % 4)
+            return false;
+        tinyBLAS<4, float32x4_t, float32x4_t, ggml_bf16_t, ggml_bf16_t, float> tb{
+            k, (const ggml_bf16_t *)A, lda,
+            (const ggml_bf16_t *)B, ldb,
+            (float *)C, ldc,
+            ith, nth};
+        tb.matmul(m, n, task);
+        return true;
+#else
+        return false;
+#endif
+    }
+
     case GGML_TYPE_Q8_0: {
         if (Btype != GGML_TYPE_Q8_0)
            return false;
@@ -1008,6 +1322,58 @@ bool llamafile_sgemm(int64_t m, int64_t n, int64_t k, const void *A, int64_t lda
 #endif
     }
 
+    case GGML_TYPE_Q4_K:
+    case GGML_TYPE_Q5_K:
+    case GGML_TYPE_Q6_K:
+    case GGML_TYPE_IQ4_XS: {
+        if (Btype != GGML_TYPE_Q8_K)
+            return false;
+#if defined(__AVX2__) && QK_K == 256
+        if (n < 4) // unpacking A does not pay off, vec_dot is faster
+            return false;
+        switch (Atype) {
+        case GGML_TYPE_Q4_K: {
+            tinyBLAS_KQ_AVX2<block_q4_K> tb{
+                k, (const block_q4_K *)A, lda,
+                (const block_q8_K *)B, ldb,
+                (float *)C, ldc,
+                ith, nth};
+            tb.matmul(m, n, task);
+            return true;
+        }
+        case GGML_TYPE_Q5_K: {
+            tinyBLAS_KQ_AVX2<block_q5_K> tb{
+                k, (const block_q5_K *)A, lda,
+                (const block_q8_K *)B, ldb,
+                (float *)C, ldc,
+                ith, nth};
+            tb.matmul(m, n, task);
+            return true;
+        }
+        case GGML_TYPE_Q6_K: {
+            tinyBLAS_KQ_AVX2<block_q6_K> tb{
+                k, (const block_q6_K *)A, lda,
+                (const block_q8_K *)B, ldb,
+                (float *)C, ldc,
+                ith, nth};
+            tb.matmul(m, n, task);
+            return true;
+        }
+        default: {
+            tinyBLAS_KQ_AVX2<block_iq4_xs> tb{
+                k, (const block_iq4_xs *)A, lda,
+                (const block_q8_K *)B, ldb,
+                (float *)C, ldc,
+                ith, nth};
+            tb.matmul(m, n, task);
+            return true;
+        }
+        }
+#else
+        return false;
+#endif
+    }
+
     default:
         return false;
     }
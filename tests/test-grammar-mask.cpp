@@ -0,0 +1,170 @@
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+#include "llama.cpp" // TODO: not great
+#include "grammar-parser.h"
+
+#include <cassert>
+#include <fstream>
+
+// checks that llama_sample_grammar, which applies the grammar through the vocab trie and caches the masks of
+// the states it has seen, rejects the same tokens as checking the tokens one by one
+//
+// usage: test-grammar-mask vocab-file
+
+// the tokens allowed by the grammar, checked one by one
+static std::vector<bool> allowed_tokens_ref(llama_context * ctx, const llama_grammar * grammar) {
+    const llama_model * model = llama_get_model(ctx);
+    const int n_vocab = llama_n_vocab(model);
+
+    bool allow_eog = false;
+    for (const auto & stack : grammar->stacks) {
+        if (stack.empty()) {
+            allow_eog = true;
+            break;
+        }
+    }
+
+    std::vector<bool> allowed(n_vocab, true);
+
+    std::vector<std::pair<std::vector<uint32_t>, llama_partial_utf8>> decoded;
+    decoded.reserve(n_vocab);
+    std::vector<llama_grammar_candidate> candidates;
+    candidates.reserve(n_vocab);
+
+    for (llama_token id = 0; id < n_vocab; ++id) {
+        const std::string piece = llama_token_to_piece(ctx, id, false);
+
+        if (llama_token_is_eog(model, id)) {
+            allowed[id] = allow_eog;
+        } else if (piece.empty() || piece[0] == 0) {
+            allowed[id] = false;
+        } else {
+            decoded.push_back(decode_utf8(piece, grammar->partial_utf8));
+            candidates.push_back({ (size_t) id, decoded.back().first.data(), decoded.back().second });
+        }
+    }
+
+    for (const auto & reject : llama_grammar_reject_candidates(grammar->rules, grammar->stacks, candidates)) {
+        allowed[reject.index] = false;
+    }
+
+    return allowed;
+}
+
+static bool test_grammar(llama_context * ctx, const std::string & name, const std::string & grammar_str, int n_steps, uint32_t seed) {
+    fprintf(stderr, "%s: testing grammar '%s'\n", __func__, name.c_str());
+
+    grammar_parser::parse_state parsed_grammar = grammar_parser::parse(grammar_str.c_str());
+    assert(!parsed_grammar.rules.empty());
+
+    std::vector<const llama_grammar_element *> grammar_rules(parsed_grammar.c_rules());
+    llama_grammar * grammar = llama_grammar_init(grammar_rules.data(), grammar_rules.size(), parsed_grammar.symbol_ids.at("root"));
+
+    const int n_vocab = llama_n_vocab(llama_get_model(ctx));
+
+    std::mt19937 rng(seed);
+
+    std::vector<llama_token_data> cur(n_vocab);
+
+    std::string text;
+    bool success = true;
+
+    for (int step = 0; step < n_steps; ++step) {
+        const std::vector<bool> allowed = allowed_tokens_ref(ctx, grammar);
+
+        for (llama_token id = 0; id < n_vocab; ++id) {
+            cur[id] = llama_token_data{ id, 0.0f, 0.0f };
+        }
+        llama_token_data_array cur_p = { cur.data(), cur.size(), false };
+        llama_sample_grammar(ctx, &cur_p, grammar);
+
+        std::vector<llama_token> allowed_ids;
+        for (llama_token id = 0; id < n_vocab; ++id) {
+            if (allowed[id] != (cur[id].logit != -INFINITY)) {
+                fprintf(stderr, "%s: step %d, after '%s': token %d '%s' is %s, expected %s\n", __func__, step, text.c_str(),
+                        id, llama_token_to_piece(ctx, id, false).c_str(),
+                        allowed[id] ? "rejected" : "allowed", allowed[id] ? "allowed" : "rejected");
+                success = false;
+            }
+            if (allowed[id]) {
+                allowed_ids.push_back(id);
+            }
+        }
+
+        if (!success || allowed_ids.empty()) {
+            break;
+        }
+
+        const llama_token id = allowed_ids[rng() % allowed_ids.size()];
+        if (llama_token_is_eog(llama_get_model(ctx), id)) {
+            break;
+        }
+
+        llama_grammar_accept_token(ctx, grammar, id);
+        text += llama_token_to_piece(ctx, id, false);
+    }
+
+    fprintf(stderr, "%s: generated '%s', %zu masks cached\n", __func__, text.c_str(), grammar->masks.size());
+
+    llama_grammar_free(grammar);
+
+    return success;
+}
+
+static std::string read_file(const std::string & fname) {
+    std::ifstream ifs(fname);
+    return std::string(std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>());
+}
+
+int main(int argc, char ** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s vocab-file\n", argv[0]);
+        return 1;
+    }
+
+    const std::string fname = argv[1];
+
+    llama_backend_init();
+
+    auto mparams = llama_model_default_params();
+    mparams.vocab_only = true;
+
+    llama_model * model = llama_load_model_from_file(fname.c_str(), mparams);
+    if (model == NULL) {
+        fprintf(stderr, "%s: error: failed to load vocab '%s'\n", __func__, fname.c_str());
+        return 1;
+    }
+
+    llama_context * ctx = llama_new_context_with_model(model, llama_context_default_params());
+    if (ctx == NULL) {
+        fprintf(stderr, "%s: error: failed to load vocab '%s'\n", __func__, fname.c_str());
+        llama_free_model(model);
+        return 1;
+    }
+
+    bool success = true;
+
+    const char * files[] = { "json.gbnf", "json_arr.gbnf", "c.gbnf", "chess.gbnf", "japanese.gbnf", "arithmetic.gbnf", "list.gbnf" };
+    for (const char * file : files) {
+        const std::string grammar_str = read_file(std::string("grammars/") + file);
+        assert(!grammar_str.empty());
+        for (uint32_t seed = 1; seed <= 2; ++seed) {
+            success = test_grammar(ctx, file, grammar_str, 12, seed) && success;
+        }
+    }
+
+    // multi-byte characters, character ranges, negated ranges and the end of the grammar
+    success = test_grammar(ctx, "unicode", R"""(root ::= [αβγ]+ ("é" | [^a-z\n])* "🦙" [ぁ-ゟ]*)""", 12, 1) && success;
+    success = test_grammar(ctx, "end",     R"""(root ::= "yes" | "no" | "maybe" [0-9]?)""",          12, 1) && success;
+
+    llama_free(ctx);
+    llama_free_model(model);
+
+    llama_backend_free();
+
+    fprintf(stderr, "%s: %s\n", __func__, success ? "passed" : "failed");
+
+    return success ? 0 : 1;
+}
@@ -0,0 +1,255 @@
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+#include "llama.cpp" // TODO: not great
+
+#include <cassert>
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+// checks the reuse of the decode graph across ubatches of the same shape (llama_graph_cache): the same batches are
+// decoded by a context that reuses its graph and by a context that builds a new graph for every ubatch, and the
+// logits must be the same
+//
+// the model is a tiny llama with random weights, generated next to the test from the vocab of the given file
+//
+// usage: test-graph-reuse vocab-file
+
+static const char * fname_model = "test-graph-reuse.gguf";
+
+static bool write_model(const char * fname_vocab, const char * fname) {
+    gguf_init_params params = { /*.no_alloc =*/ true, /*.ctx =*/ nullptr };
+    gguf_context * vocab = gguf_init_from_file(fname_vocab, params);
+    if (vocab == nullptr) {
+        fprintf(stderr, "%s: failed to load %s\n", __func__, fname_vocab);
+        return false;
+    }
+
+    const int n_vocab   = gguf_get_arr_n(vocab, gguf_find_key(vocab, "tokenizer.ggml.tokens"));
+    const int n_embd    = 64;
+    const int n_ff      = 128;
+    const int n_layer   = 2;
+    const int n_head    = 2;
+    const int n_head_kv = 1;
+    const int n_embd_kv = n_embd/n_head*n_head_kv;
+
+    gguf_context * gguf = gguf_init_empty();
+    gguf_set_kv(gguf, vocab);
+    gguf_set_val_str(gguf, "general.architecture", "llama");
+    gguf_set_val_u32(gguf, "llama.context_length",                  4096);
+    gguf_set_val_u32(gguf, "llama.embedding_length",                n_embd);
+    gguf_set_val_u32(gguf, "llama.feed_forward_length",             n_ff);
+    gguf_set_val_u32(gguf, "llama.block_count",                     n_layer);
+    gguf_set_val_u32(gguf, "llama.attention.head_count",            n_head);
+    gguf_set_val_u32(gguf, "llama.attention.head_count_kv",         n_head_kv);
+    gguf_set_val_u32(gguf, "llama.rope.dimension_count",            n_embd/n_head);
+    gguf_set_val_f32(gguf, "llama.attention.layer_norm_rms_epsilon", 1e-5f);
+
+    ggml_init_params ip = {
+        /*.mem_size   =*/ (size_t) (2*n_vocab*n_embd + n_layer*(4*n_embd*n_embd + 3*n_embd*n_ff) + 16*n_embd)*sizeof(float) + 64*ggml_tensor_overhead(),
+        /*.mem_buffer =*/ nullptr,
+        /*.no_alloc   =*/ false,
+    };
+    ggml_context * ctx = ggml_init(ip);
+
+    std::mt19937 rng(1234);
+    std::normal_distribution<float> dist(0.0f, 0.2f);
+
+    auto add_tensor = [&](const std::string & name, int64_t ne0, int64_t ne1) {
+        ggml_tensor * t = ne1 > 0 ? ggml_new_tensor_2d(ctx, GGML_TYPE_F32, ne0, ne1) : ggml_new_tensor_1d(ctx, GGML_TYPE_F32, ne0);
+        ggml_set_name(t, name.c_str());
+        float * data = (float *) t->data;
+        for (int64_t i = 0; i < ggml_nelements(t); ++i) {
+            data[i] = ne1 > 0 ? dist(rng) : 1.0f; // norms are 1
+        }
+        gguf_add_tensor(gguf, t);
+    };
+
+    add_tensor("token_embd.weight",  n_embd, n_vocab);
+    add_tensor("output_norm.weight", n_embd, 0);
+    add_tensor("output.weight",      n_embd, n_vocab);
+
+    for (int il = 0; il < n_layer; ++il) {
+        const std::string prefix = "blk." + std::to_string(il) + ".";
+        add_tensor(prefix + "attn_norm.weight",   n_embd, 0);
+        add_tensor(prefix + "attn_q.weight",      n_embd, n_embd);
+        add_tensor(prefix + "attn_k.weight",      n_embd, n_embd_kv);
+        add_tensor(prefix + "attn_v.weight",      n_embd, n_embd_kv);
+        add_tensor(prefix + "attn_output.weight", n_embd, n_embd);
+        add_tensor(prefix + "ffn_norm.weight",    n_embd, 0);
+        add_tensor(prefix + "ffn_gate.weight",    n_embd, n_ff);
+        add_tensor(prefix + "ffn_down.weight",    n_ff,   n_embd);
+        add_tensor(prefix + "ffn_up.weight",      n_embd, n_ff);
+    }
+
+    gguf_write_to_file(gguf, fname, false);
+
+    ggml_free(ctx);
+    gguf_free(gguf);
+    gguf_free(vocab);
+
+    return true;
+}
+
+// normalized mean squared error
+static double nmse(const float * a, const float * b, int n) {
+    double mse   = 0.0;
+    double ref_2 = 0.0;
+    for (int i = 0; i < n; ++i) {
+        mse   += (a[i] - b[i])*(a[i] - b[i]);
+        ref_2 += b[i]*b[i];
+    }
+    return mse/ref_2;
+}
+
+static void batch_add(llama_batch & batch, llama_token id, llama_pos pos, llama_seq_id seq_id, bool logits) {
+    batch.token   [batch.n_tokens]    = id;
+    batch.pos     [batch.n_tokens]    = pos;
+    batch.n_seq_id[batch.n_tokens]    = 1;
+    batch.seq_id  [batch.n_tokens][0] = seq_id;
+    batch.logits  [batch.n_tokens]    = logits;
+
+    batch.n_tokens++;
+}
+
+struct test_context {
+    const char    * name;
+    llama_model   * model;
+    llama_context * ctx;     // reuses the graph of the previous ubatch
+    llama_context * ctx_ref; // builds a new graph for every ubatch
+    std::mt19937    rng;
+    std::vector<llama_pos> n_past;
+    int             n_reused;
+
+    // decode n_new[s] random tokens of each sequence s in one batch, with the logits of all tokens if all_logits
+    void decode(const std::vector<int> & n_new, bool all_logits) {
+        int n_tokens = 0;
+        for (int n : n_new) {
+            n_tokens += n;
+        }
+
+        llama_batch batch = llama_batch_init(n_tokens, 0, 1);
+        for (size_t s = 0; s < n_new.size(); ++s) {
+            for (int j = 0; j < n_new[s]; ++j) {
+                const llama_token id = std::uniform_int_distribution<llama_token>(100, llama_n_vocab(model) - 1)(rng);
+                batch_add(batch, id, n_past[s]++, s, all_logits || j == n_new[s] - 1);
+            }
+        }
+
+        // the graph is reused if it is still valid and has the key of this ubatch
+        const bool            valid = ctx->graph_cache.valid;
+        const llama_graph_key key   = ctx->graph_cache.key;
+
+        assert(llama_decode(ctx, batch) == 0);
+
+        if (valid && ctx->graph_cache.valid && ctx->graph_cache.key == key) {
+            n_reused++;
+        }
+
+        ctx_ref->graph_cache.valid = false;
+        assert(llama_decode(ctx_ref, batch) == 0);
+
+        const int n_vocab = llama_n_vocab(model);
+        for (int i = 0; i < batch.n_tokens; ++i) {
+            if (!batch.logits[i]) {
+                continue;
+            }
+            const double err = nmse(llama_get_logits_ith(ctx, i), llama_get_logits_ith(ctx_ref, i), n_vocab);
+            if (err > 1e-12) {
+                fprintf(stderr, "%s: %s: token %d, n_past %d: NMSE = %.3e\n", __func__, name, i, n_past[0], err);
+                assert(false);
+            }
+        }
+
+        llama_batch_free(batch);
+    }
+
+    void seq_rm(llama_seq_id seq_id, llama_pos p0) {
+        assert(llama_kv_cache_seq_rm(ctx,     seq_id, p0, -1));
+        assert(llama_kv_cache_seq_rm(ctx_ref, seq_id, p0, -1));
+        n_past[seq_id] = p0;
+    }
+};
+
+static void run_test(llama_model * model, const char * name, bool flash_attn) {
+    llama_context_params cparams = llama_context_default_params();
+    cparams.n_ctx           = 512;
+    cparams.n_batch         = 512;
+    cparams.n_seq_max       = 2;
+    cparams.n_threads       = 1;
+    cparams.n_threads_batch = 1;
+    cparams.flash_attn      = flash_attn;
+
+    test_context t = {
+        name, model, llama_new_context_with_model(model, cparams), llama_new_context_with_model(model, cparams),
+        std::mt19937(42), { 0, 0 }, 0,
+    };
+    assert(t.ctx != nullptr && t.ctx_ref != nullptr);
+
+    // the same ubatch shape twice, in the middle of the cache
+    t.decode({ 20, 0 }, true);
+    t.decode({ 20, 0 }, true);
+
+    // single tokens: the KV store moves with the head and n_kv grows with the padding
+    for (int i = 0; i < 40; ++i) {
+        t.decode({ 1, 0 }, false);
+    }
+
+    // two sequences, only the last logits of each
+    for (int i = 0; i < 8; ++i) {
+        t.decode({ 3, 2 }, false);
+    }
+
+    // the head jumps back into a hole left by a removed part of a sequence
+    t.seq_rm(0, 30);
+    for (int i = 0; i < 8; ++i) {
+        t.decode({ 1, 1 }, false);
+    }
+
+    // a graph built for another purpose in between must not be reused
+    llama_kv_cache_seq_add(t.ctx,     1, 0, -1, 3);
+    llama_kv_cache_seq_add(t.ctx_ref, 1, 0, -1, 3);
+    t.n_past[1] += 3;
+    for (int i = 0; i < 4; ++i) {
+        t.decode({ 1, 1 }, false);
+    }
+
+    assert(t.n_reused > 0);
+
+    printf("%s: %-8s OK (%d ubatches with a reused graph)\n", __func__, name, t.n_reused);
+    fflush(stdout);
+
+    llama_free(t.ctx_ref);
+    llama_free(t.ctx);
+}
+
+int main(int argc, char ** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s vocab-file\n", argv[0]);
+        return 1;
+    }
+
+    if (!write_model(argv[1], fname_model)) {
+        return 1;
+    }
+
+    llama_backend_init();
+
+    llama_model_params mparams = llama_model_default_params();
+    llama_model * model = llama_load_model_from_file(fname_model, mparams);
+    assert(model != nullptr);
+
+    run_test(model, "default", false);
+    run_test(model, "FA",      true);
+
+    llama_free_model(model);
+    llama_backend_free();
+
+    std::remove(fname_model);
+
+    return 0;
+}
@@ -0,0 +1,413 @@
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+#include "llama.cpp" // TODO: not great
+
+#include <cassert>
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+// checks the paged KV cache (llama_context_params.n_kv_block > 0): several sequences are decoded in interleaved
+// batches, copied, truncated and defragmented, and the logits of each sequence must match those of the same tokens
+// decoded alone with the contiguous F16 KV cache
+//
+// the model is a tiny llama with random weights, generated next to the test from the vocab of the given file
+//
+// usage: test-kv-cache-paged vocab-file
+
+static const char * fname_model = "test-kv-cache-paged.gguf";
+
+static bool write_model(const char * fname_vocab, const char * fname) {
+    gguf_init_params params = { /*.no_alloc =*/ true, /*.ctx =*/ nullptr };
+    gguf_context * vocab = gguf_init_from_file(fname_vocab, params);
+    if (vocab == nullptr) {
+        fprintf(stderr, "%s: failed to load %s\n", __func__, fname_vocab);
+        return false;
+    }
+
+    const int n_vocab   = gguf_get_arr_n(vocab, gguf_find_key(vocab, "tokenizer.ggml.tokens"));
+    const int n_embd    = 64;
+    const int n_ff      = 128;
+    const int n_layer   = 2;
+    const int n_head    = 2;
+    const int n_head_kv = 1;
+    const int n_embd_kv = n_embd/n_head*n_head_kv;
+
+    gguf_context * gguf = gguf_init_empty();
+    gguf_set_kv(gguf, vocab);
+    gguf_set_val_str(gguf, "general.architecture", "llama");
+    gguf_set_val_u32(gguf, "llama.context_length",                  4096);
+    gguf_set_val_u32(gguf, "llama.embedding_length",                n_embd);
+    gguf_set_val_u32(gguf, "llama.feed_forward_length",             n_ff);
+    gguf_set_val_u32(gguf, "llama.block_count",                     n_layer);
+    gguf_set_val_u32(gguf, "llama.attention.head_count",            n_head);
+    gguf_set_val_u32(gguf, "llama.attention.head_count_kv",         n_head_kv);
+    gguf_set_val_u32(gguf, "llama.rope.dimension_count",            n_embd/n_head);
+    gguf_set_val_f32(gguf, "llama.attention.layer_norm_rms_epsilon", 1e-5f);
+
+    ggml_init_params ip = {
+        /*.mem_size   =*/ (size_t) (2*n_vocab*n_embd + n_layer*(4*n_embd*n_embd + 3*n_embd*n_ff) + 16*n_embd)*sizeof(float) + 64*ggml_tensor_overhead(),
+        /*.mem_buffer =*/ nullptr,
+        /*.no_alloc   =*/ false,
+    };
+    ggml_context * ctx = ggml_init(ip);
+
+    std::mt19937 rng(1234);
+    std::normal_distribution<float> dist(0.0f, 0.2f);
+
+    auto add_tensor = [&](const std::string & name, int64_t ne0, int64_t ne1) {
+        ggml_tensor * t = ne1 > 0 ? ggml_new_tensor_2d(ctx, GGML_TYPE_F32, ne0, ne1) : ggml_new_tensor_1d(ctx, GGML_TYPE_F32, ne0);
+        ggml_set_name(t, name.c_str());
+        float * data = (float *) t->data;
+        for (int64_t i = 0; i < ggml_nelements(t); ++i) {
+            data[i] = ne1 > 0 ? dist(rng) : 1.0f; // norms are 1
+        }
+        gguf_add_tensor(gguf, t);
+    };
+
+    add_tensor("token_embd.weight",  n_embd, n_vocab);
+    add_tensor("output_norm.weight", n_embd, 0);
+    add_tensor("output.weight",      n_embd, n_vocab);
+
+    for (int il = 0; il < n_layer; ++il) {
+        const std::string prefix = "blk." + std::to_string(il) + ".";
+        add_tensor(prefix + "attn_norm.weight",   n_embd, 0);
+        add_tensor(prefix + "attn_q.weight",      n_embd, n_embd);
+        add_tensor(prefix + "attn_k.weight",      n_embd, n_embd_kv);
+        add_tensor(prefix + "attn_v.weight",      n_embd, n_embd_kv);
+        add_tensor(prefix + "attn_output.weight", n_embd, n_embd);
+        add_tensor(prefix + "ffn_norm.weight",    n_embd, 0);
+        add_tensor(prefix + "ffn_gate.weight",    n_embd, n_ff);
+        add_tensor(prefix + "ffn_down.weight",    n_ff,   n_embd);
+        add_tensor(prefix + "ffn_up.weight",      n_embd, n_ff);
+    }
+
+    gguf_write_to_file(gguf, fname, false);
+
+    ggml_free(ctx);
+    gguf_free(gguf);
+    gguf_free(vocab);
+
+    return true;
+}
+
+// normalized mean squared error
+static double nmse(const float * a, const float * b, int n) {
+    double mse   = 0.0;
+    double ref_2 = 0.0;
+    for (int i = 0; i < n; ++i) {
+        mse   += (a[i] - b[i])*(a[i] - b[i]);
+        ref_2 += b[i]*b[i];
+    }
+    return mse/ref_2;
+}
+
+static void batch_add(llama_batch & batch, llama_token id, llama_pos pos, llama_seq_id seq_id, bool logits) {
+    batch.token   [batch.n_tokens]    = id;
+    batch.pos     [batch.n_tokens]    = pos;
+    batch.n_seq_id[batch.n_tokens]    = 1;
+    batch.seq_id  [batch.n_tokens][0] = seq_id;
+    batch.logits  [batch.n_tokens]    = logits;
+
+    batch.n_tokens++;
+}
+
+struct test_seq {
+    llama_seq_id id;
+    std::vector<llama_token> tokens;
+};
+
+struct test_case {
+    const char * name;
+    ggml_type    type_k;
+    ggml_type    type_v;
+    bool         flash_attn;
+    uint32_t     n_kv_block;
+    double       max_nmse;
+};
+
+struct test_context {
+    test_case      tc;
+    llama_model  * model;
+    llama_context * ctx;
+    llama_context * ctx_ref;
+    std::mt19937   rng;
+    double         max_err;
+
+    llama_token random_token() {
+        return std::uniform_int_distribution<llama_token>(100, llama_n_vocab(model) - 1)(rng);
+    }
+
+    // the logits of the last token of the sequence, decoded alone with the contiguous KV cache
+    std::vector<float> logits_ref(const std::vector<llama_token> & tokens) {
+        llama_kv_cache_clear(ctx_ref);
+
+        llama_batch batch = llama_batch_init(tokens.size(), 0, 1);
+        for (size_t i = 0; i < tokens.size(); ++i) {
+            batch_add(batch, tokens[i], i, 0, i == tokens.size() - 1);
+        }
+        assert(llama_decode(ctx_ref, batch) == 0);
+        llama_batch_free(batch);
+
+        const float * logits = llama_get_logits_ith(ctx_ref, -1);
+        return std::vector<float>(logits, logits + llama_n_vocab(model));
+    }
+
+    // append n_new[i] random tokens to each sequence in one batch and check the logits of the last token of each
+    void decode(std::vector<test_seq *> seqs, std::vector<int> n_new) {
+        int n_tokens = 0;
+        for (int n : n_new) {
+            n_tokens += n;
+        }
+
+        llama_batch batch = llama_batch_init(n_tokens, 0, 1);
+        std::vector<int> i_logits;
+        for (size_t s = 0; s < seqs.size(); ++s) {
+            for (int j = 0; j < n_new[s]; ++j) {
+                const llama_pos pos = seqs[s]->tokens.size();
+                seqs[s]->tokens.push_back(random_token());
+                batch_add(batch, seqs[s]->tokens.back(), pos, seqs[s]->id, j == n_new[s] - 1);
+            }
+            i_logits.push_back(batch.n_tokens - 1);
+        }
+        assert(llama_decode(ctx, batch) == 0);
+        llama_batch_free(batch);
+
+        const int n_vocab = llama_n_vocab(model);
+        for (size_t s = 0; s < seqs.size(); ++s) {
+            const std::vector<float> ref = logits_ref(seqs[s]->tokens);
+            const double err = nmse(llama_get_logits_ith(ctx, i_logits[s]), ref.data(), n_vocab);
+            if (err > tc.max_nmse) {
+                fprintf(stderr, "%s: %s: seq %d, n_past %zu: NMSE = %.3e > %.3e\n",
+                        __func__, tc.name, seqs[s]->id, seqs[s]->tokens.size(), err, tc.max_nmse);
+                assert(false);
+            }
+            max_err = std::max(max_err, err);
+        }
+    }
+
+    // the cells that the attention of the next token of the sequence gathers, selected like in llama_decode
+    // (the selection is only kept during the decode)
+    std::vector<int32_t> gather_of(const test_seq & seq) {
+        llama_kv_cache & kv = ctx->kv_self;
+
+        llama_batch batch = llama_batch_init(1, 0, 1);
+        batch_add(batch, 0, seq.tokens.size(), seq.id, true);
+
+        const uint32_t pad = llama_kv_cache_get_padding(ctx->cparams);
+        kv.n = std::min(kv.size, std::max(pad, GGML_PAD(llama_kv_cache_cell_max(kv), pad)));
+        llama_kv_cache_prepare_gather(kv, batch, pad);
+
+        std::vector<int32_t> gather;
+        std::swap(gather, kv.gather);
+
+        llama_batch_free(batch);
+
+        return gather;
+    }
+
+    // the block that holds the cell of the given sequence and position
+    int32_t block_of(llama_seq_id seq_id, llama_pos pos) const {
+        const llama_kv_cache & kv = ctx->kv_self;
+        for (uint32_t i = 0; i < kv.size; ++i) {
+            if (kv.cells[i].pos == pos && kv.cells[i].has_seq_id(seq_id)) {
+                return i/kv.block_size;
+            }
+        }
+        return -1;
+    }
+};
+
+static void run_test(llama_model * model, llama_context * ctx_ref, const test_case & tc) {
+    llama_context_params cparams = llama_context_default_params();
+    cparams.n_ctx           = 1024;
+    cparams.n_batch         = 1024;
+    cparams.n_seq_max       = 4;
+    cparams.n_threads       = 1;
+    cparams.n_threads_batch = 1;
+    cparams.type_k          = tc.type_k;
+    cparams.type_v          = tc.type_v;
+    cparams.flash_attn      = tc.flash_attn;
+    cparams.n_kv_block      = tc.n_kv_block;
+
+    test_context t = { tc, model, llama_new_context_with_model(model, cparams), ctx_ref, std::mt19937(42), 0.0 };
+    assert(t.ctx != nullptr);
+
+    const llama_kv_cache & kv = t.ctx->kv_self;
+    const bool paged = tc.n_kv_block > 0;
+    assert(kv.paged() == paged);
+    const uint32_t bs = kv.block_size;
+
+    test_seq s0 = { 0, {} };
+    test_seq s1 = { 1, {} };
+    test_seq s2 = { 2, {} };
+    test_seq s3 = { 3, {} };
+
+    // block allocation: each sequence starts in its own blocks, in the order of the batch
+    t.decode({ &s0, &s1, &s2 }, { 20, 10, 40 });
+    if (paged) {
+        assert(bs == 16);
+        const std::vector<llama_seq_id> owners = { 0, 0, 1, 2, 2, 2 };
+        for (size_t b = 0; b < owners.size(); ++b) {
+            assert(kv.block_owner[b] == owners[b]);
+        }
+        assert(kv.block_owner[owners.size()] == -1);
+    }
+
+    // the sequences grow in their own blocks
+    for (int i = 0; i < 4; ++i) {
+        t.decode({ &s0, &s1, &s2 }, { 1, 1, 1 });
+    }
+
+    // the tail of the last block of s0 and a new block
+    t.decode({ &s0 }, { 20 });
+    if (paged) {
+        assert(t.block_of(0, 24) == 1);
+        assert(kv.block_owner[6] == 0);
+        assert(t.block_of(0, s0.tokens.size() - 1) == 6);
+    }
+
+    // the blocks of s1 are not a prefix of the cache, but the FA padding of 256 cells already covers the whole
+    // used part of the cache
+    if (paged) {
+        assert(t.gather_of(s1).empty());
+    }
+    t.decode({ &s1 }, { 1 });
+    if (paged) {
+        assert(t.block_of(1, s1.tokens.size() - 1) == 2);
+    }
+
+    // s3 shares the blocks of s0 without a copy, the new tokens of both go to their own blocks
+    llama_kv_cache_seq_cp(t.ctx, 0, 3, -1, -1);
+    s3.tokens = s0.tokens;
+    for (int i = 0; i < 3; ++i) {
+        t.decode({ &s0, &s3 }, { 1, 2 });
+    }
+    if (paged) {
+        assert(t.block_of(3, s0.tokens.size() - 4) == 6);
+        assert(kv.block_owner[t.block_of(3, s3.tokens.size() - 1)] == 3);
+        assert(kv.block_owner[t.block_of(0, s0.tokens.size() - 1)] == 0);
+    }
+
+    // truncate s2 in the middle of a block and regrow it
+    assert(llama_kv_cache_seq_rm(t.ctx, 2, 25, -1));
+    s2.tokens.resize(25);
+    t.decode({ &s2 }, { 10 });
+    t.decode({ &s1, &s2 }, { 3, 12 });
+    if (paged) {
+        assert(t.block_of(2, 25) == 25/(int32_t) bs + 3);
+    }
+
+    // remove s0: the blocks still used by s3 are kept
+    assert(llama_kv_cache_seq_rm(t.ctx, 0, -1, -1));
+    for (int i = 0; i < 2; ++i) {
+        t.decode({ &s1, &s3 }, { 1, 1 });
+    }
+    if (paged) {
+        assert(kv.block_owner[0] == 0);
+        assert(t.block_of(3, 0) == 0);
+    }
+
+    // defragment, then continue all the sequences
+    llama_kv_cache_defrag(t.ctx);
+    llama_kv_cache_update(t.ctx);
+    for (int i = 0; i < 2; ++i) {
+        t.decode({ &s1, &s2, &s3 }, { 1, 2, 1 });
+    }
+
+    // reuse the cells of a sequence that has been removed
+    assert(llama_kv_cache_seq_rm(t.ctx, 1, -1, -1));
+    s1.tokens.clear();
+    t.decode({ &s1 }, { 30 });
+    t.decode({ &s1, &s2, &s3 }, { 1, 1, 1 });
+
+    // a long sequence fills the cache beyond 768 cells: the attention of the other sequences gathers their blocks
+    s0.tokens.clear();
+    t.decode({ &s0 }, { 720 });
+    if (paged) {
+        assert(llama_kv_cache_cell_max(kv) > 768);
+        const std::vector<int32_t> gather = t.gather_of(s1);
+        assert(gather.size() == 256);
+        // whole blocks holding all the cells of s1, then padding
+        uint32_t n_cells = 0;
+        uint32_t n_seq   = 0;
+        for (const int32_t i : gather) {
+            if (i >= 0) {
+                n_cells++;
+                n_seq += kv.cells[i].has_seq_id(1);
+            }
+        }
+        assert(n_cells % bs == 0 && n_cells < gather.size());
+        assert(n_seq == s1.tokens.size());
+    }
+    t.decode({ &s1 }, { 1 });
+    t.decode({ &s1, &s2, &s3 }, { 1, 2, 1 });
+
+    printf("%s: %-20s OK (max NMSE = %.3e)\n", __func__, tc.name, t.max_err);
+    fflush(stdout);
+
+    llama_free(t.ctx);
+}
+
+int main(int argc, char ** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s vocab-file\n", argv[0]);
+        return 1;
+    }
+
+    if (!write_model(argv[1], fname_model)) {
+        return 1;
+    }
+
+    llama_backend_init();
+
+    llama_model_params mparams = llama_model_default_params();
+    llama_model * model = llama_load_model_from_file(fname_model, mparams);
+    assert(model != nullptr);
+
+    llama_context_params cparams = llama_context_default_params();
+    cparams.n_ctx           = 1024;
+    cparams.n_batch         = 1024;
+    cparams.n_threads       = 1;
+    cparams.n_threads_batch = 1;
+    llama_context * ctx_ref = llama_new_context_with_model(model, cparams);
+    assert(ctx_ref != nullptr);
+
+    // the tolerances allow for the F16 rounding of the FA kernels and for the quantization of the cache
+    const std::vector<test_case> test_cases = {
+        { "contiguous",     GGML_TYPE_F16,  GGML_TYPE_F16, false,  0, 1e-7 },
+        { "contiguous, FA", GGML_TYPE_F16,  GGML_TYPE_F16, true,   0, 1e-4 },
+        { "paged, FA",      GGML_TYPE_F16,  GGML_TYPE_F16, true,  16, 1e-4 },
+        // the quantized V cache needs FA, this runs the quantized CPU kernel against the reference
+        { "contiguous, FA, q8_0", GGML_TYPE_Q8_0, GGML_TYPE_Q8_0, true,  0, 2e-2 },
+        { "paged, FA, q8_0",      GGML_TYPE_Q8_0, GGML_TYPE_Q8_0, true, 16, 2e-2 },
+        { "paged, FA, V q8_0",    GGML_TYPE_F16,  GGML_TYPE_Q8_0, true, 16, 2e-2 },
+    };
+
+    for (const test_case & tc : test_cases) {
+        run_test(model, ctx_ref, tc);
+    }
+
+    // without FA, V is stored transposed, which is not possible for a quantized V cache
+    cparams.type_v = GGML_TYPE_Q8_0;
+    assert(llama_new_context_with_model(model, cparams) == nullptr);
+    printf("%s: quantized V without FA is rejected\n", __func__);
+
+    // the paged KV cache stores V per cell and needs FA
+    cparams.type_v     = GGML_TYPE_F16;
+    cparams.n_kv_block = 16;
+    assert(llama_new_context_with_model(model, cparams) == nullptr);
+    printf("%s: paged KV cache without FA is rejected\n", __func__);
+
+    llama_free(ctx_ref);
+    llama_free_model(model);
+    llama_backend_free();
+
+    std::remove(fname_model);
+
+    return 0;
+}
@@ -1,11 +1,17 @@
 // Unit tests for quantization specific functions - quantize, dequantize and dot product
 
 #include "ggml.h"
+#include "ggml-alloc.h"
+#include "ggml-backend.h"
+#ifdef GGML_USE_LLAMAFILE
+#include "sgemm.h"
+#endif
 
 #undef NDEBUG
 #include <assert.h>
 #include <math.h>
 #include <stdio.h>
+#include <string.h>
 #include <string>
 #include <vector>
 
@@ -94,6 +100,143 @@ static float dot_product_error(
     return fabsf(result - dot_ref) / test_size;
 }
 
+// Round trip of a weight matrix through the CPU repack buffer type and error of the interleaved matmul against vec_dot
+static bool repack_error(ggml_type type, size_t test_size, const float * test_data1, const float * test_data2, float * error) {
+    const int64_t n_per_row = 256;
+    const int64_t nrows     = test_size/n_per_row;
+    const int64_t ncols     = 5; // one full group of columns and a remainder
+
+    ggml_type_traits_t qfns = ggml_internal_get_type_traits(type);
+    ggml_type_traits_t vdot = ggml_internal_get_type_traits(qfns.vec_dot_type);
+
+    struct ggml_init_params params = {
+        /* .mem_size   = */ 4*ggml_tensor_overhead() + ggml_graph_overhead(),
+        /* .mem_buffer = */ NULL,
+        /* .no_alloc   = */ true,
+    };
+    struct ggml_context * ctx = ggml_init(params);
+
+    struct ggml_tensor * a = ggml_new_tensor_2d(ctx, type, n_per_row, nrows);
+    struct ggml_tensor * b = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n_per_row, ncols);
+    struct ggml_tensor * c = ggml_mul_mat(ctx, a, b);
+
+    // the weight goes to the repack buffer, the remaining tensors to a regular CPU buffer
+    ggml_backend_buffer_t buf_a = ggml_backend_buft_alloc_buffer(ggml_backend_cpu_repack_buffer_type(), ggml_nbytes(a));
+    ggml_tallocr alloc = ggml_tallocr_new(buf_a);
+    ggml_tallocr_alloc(&alloc, a);
+
+    ggml_backend_buffer_t buf_c = ggml_backend_alloc_ctx_tensors_from_buft(ctx, ggml_backend_cpu_buffer_type());
+
+    std::vector<uint8_t> tmp_a(ggml_nbytes(a));
+    std::vector<uint8_t> tmp_a_out(ggml_nbytes(a));
+    std::vector<uint8_t> tmp_b(ggml_row_size(qfns.vec_dot_type, n_per_row)*ncols);
+
+    qfns.from_float(test_data1, tmp_a.data(), test_size);
+    ggml_backend_tensor_set(a, tmp_a.data(), 0, ggml_nbytes(a));
+    ggml_backend_tensor_get(a, tmp_a_out.data(), 0, ggml_nbytes(a));
+
+    bool ok = memcmp(tmp_a.data(), tmp_a_out.data(), tmp_a.size()) == 0;
+
+    ggml_backend_tensor_set(b, test_data2, 0, ggml_nbytes(b));
+    vdot.from_float(test_data2, tmp_b.data(), n_per_row*ncols);
+
+    ggml_backend_t backend = ggml_backend_cpu_init();
+    struct ggml_cgraph * gf = ggml_new_graph(ctx);
+    ggml_build_forward_expand(gf, c);
+    ggml_backend_graph_compute(backend, gf);
+
+    std::vector<float> out(nrows*ncols);
+    ggml_backend_tensor_get(c, out.data(), 0, ggml_nbytes(c));
+
+    *error = 0.0f;
+    for (int64_t j = 0; j < ncols; j++) {
+        for (int64_t i = 0; i < nrows; i++) {
+            float ref = INFINITY;
+            qfns.vec_dot(n_per_row, &ref, 0, tmp_a.data() + i*ggml_row_size(type, n_per_row), 0,
+                    tmp_b.data() + j*ggml_row_size(qfns.vec_dot_type, n_per_row), 0, 1);
+            *error = fmaxf(*error, fabsf(out[j*nrows + i] - ref) / n_per_row);
+        }
+    }
+
+    ggml_backend_free(backend);
+    ggml_backend_buffer_free(buf_a);
+    ggml_backend_buffer_free(buf_c);
+    ggml_free(ctx);
+
+    return ok;
+}
+
+#ifdef GGML_USE_LLAMAFILE
+// Max error of llamafile_sgemm against vec_dot for the quantized types and against a double precision dot product of
+// the rounded values for the float types, on shapes with remainders in the tiles of m and n and with k of one and of
+// several blocks (of 32 values for the float types, the widest step of their kernels)
+// returns false if sgemm does not handle the type on this CPU
+static bool sgemm_error(ggml_type type, float * error) {
+    ggml_type_traits_t qfns = ggml_internal_get_type_traits(type);
+    ggml_type_traits_t vdot = ggml_internal_get_type_traits(qfns.vec_dot_type);
+
+    const bool    quantized = ggml_is_quantized(type);
+    const int64_t blck      = quantized ? qfns.blck_size : 32;
+    const int64_t shapes[][3] = { // m, n, k
+        {  7,  5,   blck },
+        {  5, 11, 3*blck },
+        { 13,  4, 3*blck },
+    };
+
+    *error = 0.0f;
+    for (const auto & shape : shapes) {
+        const int64_t m = shape[0];
+        const int64_t n = shape[1];
+        const int64_t k = shape[2];
+
+        std::vector<float> data_a(m*k);
+        std::vector<float> data_b(n*k);
+        generate_data(0.0, data_a.size(), data_a.data());
+        generate_data(1.0, data_b.size(), data_b.data());
+
+        const size_t row_size_a = ggml_row_size(type, k);
+        const size_t row_size_b = ggml_row_size(qfns.vec_dot_type, k);
+
+        std::vector<uint8_t> tmp_a(row_size_a*m);
+        std::vector<uint8_t> tmp_b(row_size_b*n);
+        qfns.from_float(data_a.data(), tmp_a.data(), m*k);
+        vdot.from_float(data_b.data(), tmp_b.data(), n*k);
+
+        // the rows of C are split between two threads
+        std::vector<float> out(m*n, INFINITY);
+        for (int ith = 0; ith < 2; ith++) {
+            if (!llamafile_sgemm(m, n, k/qfns.blck_size, tmp_a.data(), k/qfns.blck_size, tmp_b.data(), k/vdot.blck_size,
+                        out.data(), m, ith, 2, GGML_TASK_TYPE_COMPUTE, type, qfns.vec_dot_type, GGML_TYPE_F32)) {
+                return false;
+            }
+        }
+
+        if (!quantized) {
+            qfns.to_float(tmp_a.data(), data_a.data(), m*k);
+            vdot.to_float(tmp_b.data(), data_b.data(), n*k);
+        }
+
+        for (int64_t j = 0; j < n; j++) {
+            for (int64_t i = 0; i < m; i++) {
+                float ref = INFINITY;
+                if (quantized) {
+                    qfns.vec_dot(k, &ref, 0, tmp_a.data() + i*row_size_a, 0, tmp_b.data() + j*row_size_b, 0, 1);
+                } else {
+                    double sum = 0.0;
+                    for (int64_t l = 0; l < k; l++) {
+                        sum += (double) data_a[i*k + l] * data_b[j*k + l];
+                    }
+                    ref = sum;
+                }
+                *error = fmaxf(*error, fabsf(out[j*m + i] - ref) / k);
+            }
+        }
+    }
+
+    return true;
+}
+#endif
+
 int main(int argc, char * argv[]) {
     bool verbose = false;
     const size_t test_size = 32 * 128;
@@ -172,6 +315,32 @@ int main(int argc, char * argv[]) {
             if (failed || verbose) {
                 printf("%5s dot product error:              %s (%f)\n", ggml_type_name(type), RESULT_STR[failed], vec_dot_error);
             }
+
+            if (type == GGML_TYPE_Q4_0 || type == GGML_TYPE_Q8_0) {
+                float repack_matmul_error = 0.0f;
+                const bool repack_ok = repack_error(type, test_size, test_data.data(), test_data2.data(), &repack_matmul_error);
+                failed = !repack_ok;
+                num_failed += failed;
+                if (failed || verbose) {
+                    printf("%5s repack round trip:              %s\n", ggml_type_name(type), RESULT_STR[failed]);
+                }
+                failed = !(repack_matmul_error < MAX_QUANTIZATION_REFERENCE_ERROR);
+                num_failed += failed;
+                if (failed || verbose) {
+                    printf("%5s repacked matmul error:          %s (%f)\n", ggml_type_name(type), RESULT_STR[failed], repack_matmul_error);
+                }
+            }
+
+#ifdef GGML_USE_LLAMAFILE
+            float sgemm_matmul_error = 0.0f;
+            if (sgemm_error(type, &sgemm_matmul_error)) {
+                failed = !(sgemm_matmul_error < MAX_QUANTIZATION_REFERENCE_ERROR);
+                num_failed += failed;
+                if (failed || verbose) {
+                    printf("%5s sgemm matmul error:             %s (%f)\n", ggml_type_name(type), RESULT_STR[failed], sgemm_matmul_error);
+                }
+            }
+#endif
         }
     }
 
@@ -0,0 +1,147 @@
+// measures the tokenization throughput of a vocab on a large synthetic document
+// and checks that the tokens of a byte-level BPE vocab detokenize to the original text
+//
+// usage: test-tokenizer-throughput vocab-file [size-in-KiB]
+
+#include "llama.h"
+#include "common.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+// a mix of prose, code, numbers, whitespace runs and non-ASCII scripts, so that every branch
+// of the pre-tokenizer regexes is exercised
+static std::string make_text(size_t n_bytes) {
+    static const char * fragments[] = {
+        "the", "quick", "brown", "fox", "jumps", "over", "lazy", "dog", "retrieval", "augmented", "generation",
+        "I'm", "you're", "we've", "they'll", "it's", "don't", "He'd", "OK", "HTTP", "JSON",
+        "0", "7", "42", "1234", "2024", "3.14159", "1,000,000", "0x7fff", "v1.2.3",
+        ".", ",", "!", "?", ";", ":", "...", "--", "(", ")", "[", "]", "{", "}", "\"", "'", "->", "==", "!=", "&&", "||",
+        "if (x) {", "return 0;", "for (int i = 0; i < n; ++i)", "std::vector<int>", "#include <cstdio>", "def f(x):", "  ",
+        "нещо", "на", "Български", "Führer", "café", "naïve", "我想在", "工作", "天～", "こんにちは", "세계",
+        "🦙", "🚀", "😁", "✅", "ááá", "ﬁ", "…",
+    };
+    static const char * spaces[] = {
+        " ", " ", " ", " ", " ", " ", " ", " ", "  ", "   ", "\n", "\n\n", "\t", " \n", "\n    ", "\r\n",
+    };
+
+    const size_t n_fragments = sizeof(fragments) / sizeof(fragments[0]);
+    const size_t n_spaces    = sizeof(spaces)    / sizeof(spaces[0]);
+
+    std::mt19937 rng(1234);
+
+    std::string text;
+    text.reserve(n_bytes + 64);
+    while (text.size() < n_bytes) {
+        text += fragments[rng() % n_fragments];
+        text += spaces[rng() % n_spaces];
+    }
+
+    return text;
+}
+
+int main(int argc, char ** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s vocab-file [size-in-KiB]\n", argv[0]);
+        return 1;
+    }
+
+    const std::string fname = argv[1];
+
+    size_t n_kib = 256;
+    if (argc > 2) {
+        n_kib = std::strtoul(argv[2], nullptr, 10);
+    }
+
+    fprintf(stderr, "%s : reading vocab from: '%s'\n", __func__, fname.c_str());
+
+    llama_model * model;
+    llama_context * ctx;
+
+    llama_backend_init();
+
+    // load the vocab
+    {
+        auto mparams = llama_model_default_params();
+
+        mparams.vocab_only = true;
+
+        model = llama_load_model_from_file(fname.c_str(), mparams);
+
+        if (model == NULL) {
+            fprintf(stderr, "%s: error: failed to load vocab '%s'\n", __func__, fname.c_str());
+            return 1;
+        }
+
+        auto cparams = llama_context_default_params();
+
+        ctx = llama_new_context_with_model(model, cparams);
+
+        if (ctx == NULL) {
+            fprintf(stderr, "%s: error: failed to load vocab '%s'\n", __func__, fname.c_str());
+            llama_free_model(model);
+            return 1;
+        }
+    }
+
+    const std::string text = make_text(n_kib * 1024);
+
+    bool success = true;
+
+    // warm up, so that the one-time initialization of the tokenizer is not measured
+    llama_tokenize(ctx, text.substr(0, 1024), false);
+
+    // report the fastest of a few runs, the others are mostly noise from the rest of the system
+    const int n_rep = 3;
+
+    std::vector<llama_token> res;
+
+    int64_t t_best = INT64_MAX;
+    for (int i = 0; i < n_rep; ++i) {
+        const int64_t t_start = ggml_time_us();
+
+        res = llama_tokenize(ctx, text, false);
+
+        t_best = std::min(t_best, ggml_time_us() - t_start);
+    }
+
+    const double t_s = t_best / 1e6;
+
+    printf("%s : text size: %zu bytes, tokens: %zu\n", __func__, text.size(), res.size());
+    printf("%s : tokenized in %.3f ms (best of %d), %.2f MiB/s, %.0f tokens/s\n", __func__,
+            1e3*t_s, n_rep, text.size() / (1024.0*1024.0) / t_s, res.size() / t_s);
+
+    if (llama_vocab_type(model) == LLAMA_VOCAB_TYPE_BPE) {
+        std::string detok;
+        detok.reserve(text.size());
+        for (const auto & tok : res) {
+            detok += llama_token_to_piece(ctx, tok);
+        }
+
+        if (detok != text) {
+            size_t pos = 0;
+            while (pos < detok.size() && pos < text.size() && detok[pos] == text[pos]) {
+                pos++;
+            }
+            fprintf(stderr, "%s : error: the tokens do not detokenize to the text, first difference at byte %zu\n", __func__, pos);
+            fprintf(stderr, "%s : expected: '%s'\n", __func__, text.substr(pos, 32).c_str());
+            fprintf(stderr, "%s : got:      '%s'\n", __func__, detok.substr(pos, 32).c_str());
+            success = false;
+        }
+    }
+
+    llama_free_model(model);
+    llama_free(ctx);
+
+    llama_backend_free();
+
+    printf("\n");
+    printf("Tests %s\n", success ? "passed" : "failed");
+
+    return success ? 0 : 3;
+}
@@ -1,10 +1,12 @@
 ﻿#include "unicode.h"
 #include "unicode-data.h"
 
+#include <algorithm>
 #include <cassert>
 #include <cstddef>
 #include <cstdint>
 #include <map>
+#include <memory>
 #include <regex>
 #include <stdexcept>
 #include <string>
@@ -540,6 +542,742 @@ static std::vector<size_t> unicode_regex_split_stl(const std::string & text, con
     return bpe_offsets;
 }
 
+//
+// regex engine
+//
+
+// a small regex engine for the pre-tokenizer regexes, much faster than std::regex on long texts
+// the regex is compiled to a Thompson NFA with prioritized alternatives, which is run as a lazily built DFA over the
+// classes of codepoints that the regex distinguishes. the matches are the same as with std::regex (ECMAScript, leftmost-first)
+// supported syntax: literals, [...] and [^...] with ranges, \s \S \d \D \w \W \p{L} \p{N} \p{P}, ., (...), (?:...), (?i:...),
+// (?!x) with a single character or class x, $, |, ?, *, +, {n}, {n,} and {n,m}
+// the text is either the codepoints, or the collapsed representation used for the unicode categories (see unicode_regex_split)
+
+enum unicode_regex_cat {
+    UNICODE_REGEX_CAT_SPACE     = 1 << 0,
+    UNICODE_REGEX_CAT_NOT_SPACE = 1 << 1,
+    UNICODE_REGEX_CAT_DIGIT     = 1 << 2,
+    UNICODE_REGEX_CAT_NOT_DIGIT = 1 << 3,
+    UNICODE_REGEX_CAT_WORD      = 1 << 4,
+    UNICODE_REGEX_CAT_NOT_WORD  = 1 << 5,
+    UNICODE_REGEX_CAT_LETTER    = 1 << 6,
+    UNICODE_REGEX_CAT_NUMBER    = 1 << 7,
+    UNICODE_REGEX_CAT_PUNCT     = 1 << 8,
+};
+
+struct unicode_regex_class {
+    std::vector<std::pair<uint32_t, uint32_t>> ranges;
+    uint32_t cats   = 0; // unicode_regex_cat
+    bool     negate = false;
+};
+
+struct unicode_regex_node {
+    enum type_t {
+        EMPTY,
+        CLASS,
+        CONCAT,
+        ALTERNATE,
+        REPEAT,
+        ASSERT_END,
+        NOT_AHEAD,
+    };
+
+    type_t type = EMPTY;
+    int cls = -1;
+    int min = 0;
+    int max = -1; // -1 = unbounded
+    std::vector<unicode_regex_node> children;
+};
+
+struct unicode_regex_inst {
+    enum op_t {
+        CHAR,       // consume a codepoint of class x
+        SPLIT,      // continue at x, then at y with a lower priority
+        JMP,        // continue at x
+        ASSERT_END, // the end of the text
+        NOT_AHEAD,  // the next codepoint is not of class x
+        MATCH,
+    };
+
+    op_t op;
+    int  x;
+    int  y;
+};
+
+// the ASCII part of \p{P}, the same as in unicode_regex_split
+static bool unicode_regex_is_ascii_punct(uint32_t c) {
+    return (0x21 <= c && c <= 0x23) || (0x25 <= c && c <= 0x2A) || (0x2C <= c && c <= 0x2F) || (0x3A <= c && c <= 0x3B) ||
+           (0x3F <= c && c <= 0x40) || (0x5B <= c && c <= 0x5D) || c == 0x5F || c == 0x7B || c == 0x7D;
+}
+
+struct unicode_regex {
+    bool collapsed;
+    std::vector<unicode_regex_class> classes;
+    std::vector<unicode_regex_inst>  prog;
+
+    // the DFA, built lazily: each state is the ordered list of the NFA threads, transitions are indexed by symbol + 1 (0 = end of text)
+    // a transition is (next state << 1) | (1 if a match ends before the symbol)
+    std::vector<std::vector<int>> states;
+    std::map<std::vector<int>, int> state_ids;
+    std::vector<std::vector<int>> transitions;
+
+    // the symbols: the sets of classes that the codepoints belong to
+    std::vector<uint64_t> sym_classes;
+    std::unordered_map<uint64_t, int> sym_ids;
+    int sym_ascii[256];
+    std::unordered_map<uint32_t, int> sym_other;
+
+    explicit unicode_regex(bool collapsed) : collapsed(collapsed) {
+        std::fill(sym_ascii, sym_ascii + 256, -1);
+    }
+
+    //
+    // parser
+    //
+
+    std::vector<uint32_t> pat;
+    size_t pos = 0;
+    bool   icase = false;
+
+    bool compile(const std::string & regex_expr) {
+        try {
+            pat = unicode_cpts_from_utf8(regex_expr);
+        } catch (const std::exception &) {
+            return false;
+        }
+        pos = 0;
+
+        unicode_regex_node root;
+        if (!parse_alternate(root) || pos != pat.size() || classes.size() > 64) {
+            return false;
+        }
+        emit(root);
+        prog.push_back({ unicode_regex_inst::MATCH, 0, 0 });
+
+        // dead state and start state
+        states.emplace_back();
+        state_ids[states.back()] = 0;
+        transitions.emplace_back();
+        std::vector<int> start;
+        std::vector<bool> seen(prog.size(), false);
+        closure(start, seen, 0);
+        add_state(start);
+        return true;
+    }
+
+    bool parse_alternate(unicode_regex_node & node) {
+        node.type = unicode_regex_node::ALTERNATE;
+        while (true) {
+            node.children.emplace_back();
+            if (!parse_concat(node.children.back())) {
+                return false;
+            }
+            if (pos < pat.size() && pat[pos] == '|') {
+                ++pos;
+                continue;
+            }
+            return true;
+        }
+    }
+
+    bool parse_concat(unicode_regex_node & node) {
+        node.type = unicode_regex_node::CONCAT;
+        while (pos < pat.size() && pat[pos] != '|' && pat[pos] != ')') {
+            unicode_regex_node atom;
+            if (!parse_atom(atom) || !parse_quantifier(atom)) {
+                return false;
+            }
+            node.children.push_back(std::move(atom));
+        }
+        return true;
+    }
+
+    bool parse_number(int & n) {
+        if (pos >= pat.size() || pat[pos] < '0' || pat[pos] > '9') {
+            return false;
+        }
+        n = 0;
+        while (pos < pat.size() && pat[pos] >= '0' && pat[pos] <= '9' && n < 1000) {
+            n = 10*n + (pat[pos++] - '0');
+        }
+        return true;
+    }
+
+    bool parse_quantifier(unicode_regex_node & atom) {
+        if (pos >= pat.size()) {
+            return true;
+        }
+        int min = 0;
+        int max = -1;
+        switch (pat[pos]) {
+            case '?': min = 0; max =  1; ++pos; break;
+            case '*': min = 0; max = -1; ++pos; break;
+            case '+': min = 1; max = -1; ++pos; break;
+            case '{':
+                {
+                    ++pos;
+                    if (!parse_number(min)) {
+                        return false;
+                    }
+                    max = min;
+                    if (pos < pat.size() && pat[pos] == ',') {
+                        ++pos;
+                        max = -1;
+                        if (pos < pat.size() && pat[pos] != '}' && !parse_number(max)) {
+                            return false;
+                        }
+                    }
+                    if (pos >= pat.size() || pat[pos] != '}' || (max >= 0 && max < min)) {
+                        return false;
+                    }
+                    ++pos;
+                } break;
+            default:
+                return true;
+        }
+        if (pos < pat.size() && (pat[pos] == '?' || pat[pos] == '+' || pat[pos] == '*' || pat[pos] == '{')) {
+            return false; // lazy and possessive quantifiers are not supported
+        }
+        if (atom.type == unicode_regex_node::ASSERT_END || atom.type == unicode_regex_node::NOT_AHEAD) {
+            return false;
+        }
+        unicode_regex_node rep;
+        rep.type = unicode_regex_node::REPEAT;
+        rep.min  = min;
+        rep.max  = max;
+        rep.children.push_back(std::move(atom));
+        atom = std::move(rep);
+        return true;
+    }
+
+    int add_class(unicode_regex_class cls) {
+        if (icase) {
+            // ASCII case folding
+            const size_t n = cls.ranges.size();
+            for (size_t i = 0; i < n; ++i) {
+                const auto r = cls.ranges[i];
+                const uint32_t lo_a = std::max<uint32_t>(r.first, 'a'), hi_a = std::min<uint32_t>(r.second, 'z');
+                const uint32_t lo_A = std::max<uint32_t>(r.first, 'A'), hi_A = std::min<uint32_t>(r.second, 'Z');
+                if (lo_a <= hi_a) {
+                    cls.ranges.emplace_back(lo_a - 32, hi_a - 32);
+                }
+                if (lo_A <= hi_A) {
+                    cls.ranges.emplace_back(lo_A + 32, hi_A + 32);
+                }
+            }
+        }
+        classes.push_back(std::move(cls));
+        return classes.size() - 1;
+    }
+
+    // an escape sequence, either a single codepoint (returns true with cats == 0) or a category
+    bool parse_escape(uint32_t & c, uint32_t & cats) {
+        cats = 0;
+        if (pos >= pat.size()) {
+            return false;
+        }
+        c = pat[pos++];
+        switch (c) {
+            case 's': cats = UNICODE_REGEX_CAT_SPACE;     return true;
+            case 'S': cats = UNICODE_REGEX_CAT_NOT_SPACE; return true;
+            case 'd': cats = UNICODE_REGEX_CAT_DIGIT;     return true;
+            case 'D': cats = UNICODE_REGEX_CAT_NOT_DIGIT; return true;
+            case 'w': cats = UNICODE_REGEX_CAT_WORD;      return true;
+            case 'W': cats = UNICODE_REGEX_CAT_NOT_WORD;  return true;
+            case 'p':
+                {
+                    if (!collapsed || pos + 2 >= pat.size() || pat[pos] != '{' || pat[pos + 2] != '}') {
+                        return false;
+                    }
+                    switch (pat[pos + 1]) {
+                        case 'L': cats = UNICODE_REGEX_CAT_LETTER; break;
+                        case 'N': cats = UNICODE_REGEX_CAT_NUMBER; break;
+                        case 'P': cats = UNICODE_REGEX_CAT_PUNCT;  break;
+                        default: return false;
+                    }
+                    pos += 3;
+                    return true;
+                }
+            case 'r': c = '\r'; return true;
+            case 'n': c = '\n'; return true;
+            case 't': c = '\t'; return true;
+            case 'v': c = '\v'; return true;
+            case 'f': c = '\f'; return true;
+            case '0': c = 0;    return true;
+            case 'x':
+            case 'u':
+                {
+                    const size_t n = c == 'x' ? 2 : 4;
+                    if (pos + n > pat.size()) {
+                        return false;
+                    }
+                    c = 0;
+                    for (size_t i = 0; i < n; ++i) {
+                        const uint32_t h = pat[pos++];
+                        if      (h >= '0' && h <= '9') c = 16*c + (h - '0');
+                        else if (h >= 'a' && h <= 'f') c = 16*c + (h - 'a' + 10);
+                        else if (h >= 'A' && h <= 'F') c = 16*c + (h - 'A' + 10);
+                        else return false;
+                    }
+                    return true;
+                }
+            default:
+                // an escaped punctuation character, letters and digits have special meanings that are not supported
+                return c < 128 && !((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9'));
+        }
+    }
+
+    bool check_literal(uint32_t c) const {
+        // the collapsed text has no codepoints above 0xFF, std::regex would not match them either
+        return !collapsed || c < 128;
+    }
+
+    bool parse_class(unicode_regex_class & cls) {
+        if (pos < pat.size() && pat[pos] == '^') {
+            cls.negate = true;
+            ++pos;
+        }
+        bool first = true;
+        while (pos < pat.size() && (pat[pos] != ']' || first)) {
+            first = false;
+            uint32_t lo = pat[pos++];
+            if (lo == '[') {
+                return false; // nested classes, [:alpha:] and the like
+            }
+            if (lo == '\\') {
+                uint32_t cats;
+                if (!parse_escape(lo, cats)) {
+                    return false;
+                }
+                if (cats) {
+                    cls.cats |= cats;
+                    continue;
+                }
+            }
+            if (!check_literal(lo)) {
+                return false;
+            }
+            uint32_t hi = lo;
+            if (pos + 1 < pat.size() && pat[pos] == '-' && pat[pos + 1] != ']') {
+                ++pos;
+                hi = pat[pos++];
+                if (hi == '\\') {
+                    uint32_t cats;
+                    if (!parse_escape(hi, cats) || cats) {
+                        return false;
+                    }
+                }
+                if (hi < lo || !check_literal(hi)) {
+                    return false;
+                }
+            }
+            cls.ranges.emplace_back(lo, hi);
+        }
+        if (pos >= pat.size()) {
+            return false;
+        }
+        ++pos; // ]
+        return true;
+    }
+
+    bool parse_atom(unicode_regex_node & node) {
+        const uint32_t c = pat[pos++];
+        unicode_regex_class cls;
+        switch (c) {
+            case '(':
+                {
+                    const bool icase_prev = icase;
+                    bool not_ahead = false;
+                    if (pos + 1 < pat.size() && pat[pos] == '?') {
+                        if (pat[pos + 1] == ':') {
+                            pos += 2;
+                        } else if (pat[pos + 1] == '!') {
+                            pos += 2;
+                            not_ahead = true;
+                        } else if (pos + 2 < pat.size() && pat[pos + 1] == 'i' && pat[pos + 2] == ':') {
+                            pos += 3;
+                            icase = true;
+                        } else {
+                            return false;
+                        }
+                    }
+                    if (not_ahead) {
+                        // only a single character or class
+                        unicode_regex_node atom;
+                        if (pos >= pat.size() || !parse_atom(atom) || atom.type != unicode_regex_node::CLASS) {
+                            return false;
+                        }
+                        node.type = unicode_regex_node::NOT_AHEAD;
+                        node.cls  = atom.cls;
+                    } else if (!parse_alternate(node)) {
+                        return false;
+                    }
+                    icase = icase_prev;
+                    if (pos >= pat.size() || pat[pos] != ')') {
+                        return false;
+                    }
+                    ++pos;
+                    return true;
+                }
+            case '[':
+                if (!parse_class(cls)) {
+                    return false;
+                }
+                break;
+            case '.':
+                cls.negate = true;
+                cls.ranges.emplace_back('\n', '\n');
+                cls.ranges.emplace_back('\r', '\r');
+                if (!collapsed) {
+                    cls.ranges.emplace_back(0x2028, 0x2029);
+                }
+                break;
+            case '$':
+                node.type = unicode_regex_node::ASSERT_END;
+                return true;
+            case '\\':
+                {
+                    uint32_t e;
+                    if (!parse_escape(e, cls.cats)) {
+                        return false;
+                    }
+                    if (!cls.cats) {
+                        if (!check_literal(e)) {
+                            return false;
+                        }
+                        cls.ranges.emplace_back(e, e);
+                    }
+                } break;
+            case '^':
+            case ')':
+            case '|':
+            case '?':
+            case '*':
+            case '+':
+            case '{':
+            case ']':
+            case '}':
+                return false;
+            default:
+                if (!check_literal(c)) {
+                    return false;
+                }
+                cls.ranges.emplace_back(c, c);
+                break;
+        }
+        node.type = unicode_regex_node::CLASS;
+        node.cls  = add_class(std::move(cls));
+        return true;
+    }
+
+    //
+    // compiler
+    //
+
+    int emit_inst(unicode_regex_inst::op_t op, int x = 0, int y = 0) {
+        prog.push_back({ op, x, y });
+        return prog.size() - 1;
+    }
+
+    void emit(const unicode_regex_node & node) {
+        switch (node.type) {
+            case unicode_regex_node::EMPTY:
+                break;
+            case unicode_regex_node::CLASS:
+                emit_inst(unicode_regex_inst::CHAR, node.cls);
+                break;
+            case unicode_regex_node::ASSERT_END:
+                emit_inst(unicode_regex_inst::ASSERT_END);
+                break;
+            case unicode_regex_node::NOT_AHEAD:
+                emit_inst(unicode_regex_inst::NOT_AHEAD, node.cls);
+                break;
+            case unicode_regex_node::CONCAT:
+                for (const auto & child : node.children) {
+                    emit(child);
+                }
+                break;
+            case unicode_regex_node::ALTERNATE:
+                {
+                    std::vector<int> jmps;
+                    for (size_t i = 0; i < node.children.size(); ++i) {
+                        int split = -1;
+                        if (i + 1 < node.children.size()) {
+                            split = emit_inst(unicode_regex_inst::SPLIT);
+                            prog[split].x = prog.size();
+                        }
+                        emit(node.children[i]);
+                        if (split >= 0) {
+                            jmps.push_back(emit_inst(unicode_regex_inst::JMP));
+                            prog[split].y = prog.size();
+                        }
+                    }
+                    for (int j : jmps) {
+                        prog[j].x = prog.size();
+                    }
+                } break;
+            case unicode_regex_node::REPEAT:
+                {
+                    const auto & child = node.children[0];
+                    for (int i = 0; i < node.min - (node.max < 0 && node.min > 0 ? 1 : 0); ++i) {
+                        emit(child);
+                    }
+                    if (node.max < 0) {
+                        if (node.min > 0) {
+                            // x+ : x, then loop back with a higher priority than leaving
+                            const int start = prog.size();
+                            emit(child);
+                            emit_inst(unicode_regex_inst::SPLIT, start, prog.size() + 1);
+                        } else {
+                            // x* : split to x or out, x loops back to the split
+                            const int split = emit_inst(unicode_regex_inst::SPLIT, prog.size() + 1);
+                            emit(child);
+                            emit_inst(unicode_regex_inst::JMP, split);
+                            prog[split].y = prog.size();
+                        }
+                    } else {
+                        // x{0,n} : nested optional copies, all leaving to the end
+                        std::vector<int> splits;
+                        for (int i = node.min; i < node.max; ++i) {
+                            splits.push_back(emit_inst(unicode_regex_inst::SPLIT, prog.size() + 1));
+                            emit(child);
+                        }
+                        for (int split : splits) {
+                            prog[split].y = prog.size();
+                        }
+                    }
+                } break;
+        }
+    }
+
+    //
+    // matcher
+    //
+
+    bool cat_match(uint32_t cats, uint32_t v) const {
+        const bool space = v == ' ' || (v >= '\t' && v <= '\r');
+        const bool digit = v >= '0' && v <= '9';
+        const bool alpha = (v >= 'a' && v <= 'z') || (v >= 'A' && v <= 'Z');
+        const bool word  = alpha || digit || v == '_';
+        return ((cats & UNICODE_REGEX_CAT_SPACE)     &&  space) ||
+               ((cats & UNICODE_REGEX_CAT_NOT_SPACE) && !space) ||
+               ((cats & UNICODE_REGEX_CAT_DIGIT)     &&  digit) ||
+               ((cats & UNICODE_REGEX_CAT_NOT_DIGIT) && !digit) ||
+               ((cats & UNICODE_REGEX_CAT_WORD)      &&  word)  ||
+               ((cats & UNICODE_REGEX_CAT_NOT_WORD)  && !word)  ||
+               ((cats & UNICODE_REGEX_CAT_LETTER)    && (alpha || v == 0xD2)) ||
+               ((cats & UNICODE_REGEX_CAT_NUMBER)    && (digit || v == 0xD1)) ||
+               ((cats & UNICODE_REGEX_CAT_PUNCT)     && (unicode_regex_is_ascii_punct(v) || v == 0xD3));
+    }
+
+    bool class_match(const unicode_regex_class & cls, uint32_t v) const {
+        bool match = cat_match(cls.cats, v);
+        for (size_t i = 0; i < cls.ranges.size() && !match; ++i) {
+            match = cls.ranges[i].first <= v && v <= cls.ranges[i].second;
+        }
+        return match != cls.negate;
+    }
+
+    int symbol(uint32_t v) {
+        int * cached = nullptr;
+        if (v < 256) {
+            cached = &sym_ascii[v];
+            if (*cached >= 0) {
+                return *cached;
+            }
+        } else {
+            auto it = sym_other.find(v);
+            if (it != sym_other.end()) {
+                return it->second;
+            }
+        }
+        uint64_t mask = 0;
+        for (size_t i = 0; i < classes.size(); ++i) {
+            if (class_match(classes[i], v)) {
+                mask |= uint64_t(1) << i;
+            }
+        }
+        auto it = sym_ids.find(mask);
+        int sym;
+        if (it == sym_ids.end()) {
+            sym = sym_classes.size();
+            sym_classes.push_back(mask);
+            sym_ids[mask] = sym;
+        } else {
+            sym = it->second;
+        }
+        if (cached) {
+            *cached = sym;
+        } else {
+            sym_other[v] = sym;
+        }
+        return sym;
+    }
+
+    // add the threads reachable from pc without consuming a codepoint, in priority order
+    // the assertions are kept, they are resolved with the next codepoint
+    void closure(std::vector<int> & threads, std::vector<bool> & seen, int pc) const {
+        if (seen[pc]) {
+            return;
+        }
+        seen[pc] = true;
+        switch (prog[pc].op) {
+            case unicode_regex_inst::JMP:
+                closure(threads, seen, prog[pc].x);
+                break;
+            case unicode_regex_inst::SPLIT:
+                closure(threads, seen, prog[pc].x);
+                closure(threads, seen, prog[pc].y);
+                break;
+            default:
+                threads.push_back(pc);
+                break;
+        }
+    }
+
+    int add_state(const std::vector<int> & threads) {
+        auto it = state_ids.find(threads);
+        if (it != state_ids.end()) {
+            return it->second;
+        }
+        states.push_back(threads);
+        transitions.emplace_back();
+        return state_ids[threads] = states.size() - 1;
+    }
+
+    // sym = -1 for the end of the text
+    // returns false when a match ends before sym, the lower priority threads are dropped then
+    bool step(int pc, int sym, std::vector<int> & next, std::vector<bool> & seen_next, std::vector<bool> & seen_cur) const {
+        if (seen_cur[pc]) {
+            return true;
+        }
+        seen_cur[pc] = true;
+        const auto & inst = prog[pc];
+        switch (inst.op) {
+            case unicode_regex_inst::CHAR:
+                if (sym >= 0 && (sym_classes[sym] >> inst.x & 1)) {
+                    closure(next, seen_next, pc + 1);
+                }
+                return true;
+            case unicode_regex_inst::MATCH:
+                return false;
+            case unicode_regex_inst::ASSERT_END:
+            case unicode_regex_inst::NOT_AHEAD:
+                {
+                    const bool holds = sym < 0 || (inst.op == unicode_regex_inst::NOT_AHEAD && !(sym_classes[sym] >> inst.x & 1));
+                    if (holds) {
+                        std::vector<int> threads;
+                        std::vector<bool> seen(prog.size(), false);
+                        closure(threads, seen, pc + 1);
+                        for (int t : threads) {
+                            if (!step(t, sym, next, seen_next, seen_cur)) {
+                                return false;
+                            }
+                        }
+                    }
+                    return true;
+                }
+            default:
+                return true;
+        }
+    }
+
+    int transition(int state, int sym) {
+        auto & trans = transitions[state];
+        if ((int) trans.size() <= sym + 1) {
+            trans.resize(sym_classes.size() + 1, -1);
+        }
+        if (trans[sym + 1] >= 0) {
+            return trans[sym + 1];
+        }
+        std::vector<int> next;
+        std::vector<bool> seen_next(prog.size(), false);
+        std::vector<bool> seen_cur(prog.size(), false);
+        bool matched = false;
+        const std::vector<int> threads = states[state];
+        for (int pc : threads) {
+            if (!step(pc, sym, next, seen_next, seen_cur)) {
+                matched = true;
+                break;
+            }
+        }
+        const int result = (add_state(next) << 1) | (matched ? 1 : 0);
+        transitions[state][sym + 1] = result;
+        return result;
+    }
+
+    // the end of the leftmost-first match at start, or -1
+    int64_t match_at(const std::vector<int> & syms, size_t start, size_t end) {
+        int64_t best = -1;
+        int state = 1;
+        for (size_t i = start; ; ++i) {
+            const int t = transition(state, i < end ? syms[i] : -1);
+            if (t & 1) {
+                best = i;
+            }
+            state = t >> 1;
+            if (i == end || state == 0) {
+                break;
+            }
+        }
+        return best;
+    }
+};
+
+// split the text like unicode_regex_split_stl, using the regex engine above
+// returns false if the regex is not supported by the engine
+static bool unicode_regex_split_engine(const std::vector<uint32_t> & text, const std::string & regex_expr, bool collapsed,
+        const std::vector<size_t> & offsets, std::vector<size_t> & bpe_offsets) {
+    // the compiled regexes and their DFAs are cached per thread
+    thread_local std::unordered_map<std::string, std::unique_ptr<unicode_regex>> cache;
+
+    const std::string key = (collapsed ? "c:" : "u:") + regex_expr;
+    auto it = cache.find(key);
+    if (it == cache.end()) {
+        std::unique_ptr<unicode_regex> regex(new unicode_regex(collapsed));
+        if (!regex->compile(regex_expr)) {
+            regex.reset();
+        }
+        it = cache.emplace(key, std::move(regex)).first;
+    }
+    if (!it->second) {
+        return false;
+    }
+    unicode_regex & regex = *it->second;
+
+    std::vector<int> syms(text.size());
+    for (size_t i = 0; i < text.size(); ++i) {
+        syms[i] = regex.symbol(text[i]);
+    }
+
+    bpe_offsets.clear();
+    bpe_offsets.reserve(offsets.size()); // Reserve memory for the approximate size
+    size_t start = 0;
+    for (auto offset : offsets) {
+        const size_t end = start + offset;
+        size_t prev = start;
+        for (size_t pos = start; pos < end; ) {
+            const int64_t match_end = regex.match_at(syms, pos, end);
+            if (match_end <= (int64_t) pos) {
+                ++pos;
+                continue;
+            }
+            if (pos > prev) {
+                bpe_offsets.emplace_back(pos - prev);
+            }
+            bpe_offsets.emplace_back(match_end - pos);
+            pos  = match_end;
+            prev = match_end;
+        }
+        if (prev < end) {
+            bpe_offsets.emplace_back(end - prev);
+        }
+        start = end;
+    }
+
+    return true;
+}
+
 static std::vector<size_t> unicode_regex_split_custom(const std::string & text, const std::string & regex_expr, const std::vector<size_t> & offsets) {
     std::vector<size_t> bpe_offsets;
 
@@ -722,18 +1460,33 @@ std::vector<std::string> unicode_regex_split(const std::string & text, const std
             continue;
         }
 
-        // fallback to general-purpose std::regex / std::wregex
-        try {
-            // if a unicode category is used in the regex, we use the collapsed text and replace the unicode category
-            // with the corresponding collapsed representation
-            bool use_collapsed = false;
-            for (auto & ucat : k_ucat_enum) {
-                if (std::string::npos != regex_expr.find(ucat.first)) {
-                    use_collapsed = true;
-                    break;
+        // if a unicode category is used in the regex, we use the collapsed text and replace the unicode category
+        // with the corresponding collapsed representation
+        bool use_collapsed = false;
+        for (auto & ucat : k_ucat_enum) {
+            if (std::string::npos != regex_expr.find(ucat.first)) {
+                use_collapsed = true;
+                break;
+            }
+        }
+
+        // then, our own regex engine, which supports all the pre-tokenizer regexes of llama.cpp
+        {
+            std::vector<uint32_t> text_values;
+            if (use_collapsed) {
+                text_values.assign(text_collapsed.begin(), text_collapsed.end());
+                for (auto & v : text_values) {
+                    v &= 0xFF;
                 }
             }
+            if (unicode_regex_split_engine(use_collapsed ? text_values : cpts, regex_expr, use_collapsed, bpe_offsets, tmp)) {
+                bpe_offsets = std::move(tmp);
+                continue;
+            }
+        }
 
+        // fallback to general-purpose std::regex / std::wregex
+        try {
             if (use_collapsed) {
                 // sanity-check that the original regex does not contain any non-ASCII characters
                 const auto cpts_regex = unicode_cpts_from_utf8(regex_expr);